@@ -84,6 +84,17 @@ void handleAPIKillKVS(const Request &request, Response &response);
  */
 void handleAPIStartKVS(const Request &request, Response &response);
 
+/**
+ * Handles API requests to move rows to the clusters configured in initKVS().
+ * Publishes a ring of the clusters with rows migrating, waits for the clients
+ * to load it, moves the rows, then publishes the ring with migration done.
+ * Rows written by clients not following the controllers may be missed.
+ *
+ * @param request The request object.
+ * @param response The response object.
+ */
+void handleAPIMigrateKVS(const Request &request, Response &response);
+
 /**
  * Escapes special characters in a JSON string.
  *
@@ -43,6 +43,8 @@ int main(int argc, char *argv[])
 
   post("/api/kvs/start", handleAPIStartKVS);
 
+  post("/api/kvs/migrate", handleAPIMigrateKVS);
+
   get("/api/kvs/viewRows", handleAPIAllRows);
 
   checkForInactiveWorkers();
@@ -6,9 +6,16 @@
 
 KVSClient kvsClient;
 KVSCTRLClient kvsCtrlClient;
+std::vector<std::vector<std::string>> kvsClusters;
 
 const bool localKVS = false;
 
+// Passes of the migration before giving up for a later call, a cluster may be down
+const int migrateMaxPasses = 100;
+
+// Browsing views may be a second behind, so that they spread over all replicas
+const ReadOptions browseReadOptions = {BOUNDED_STALENESS, 0, 1000};
+
 void handleIndexPage(const Request &request, Response &response)
 {
   // Open the file
@@ -379,6 +386,86 @@ void handleAPIStartKVS(const Request &request, Response &response)
   }
 }
 
+void handleAPIMigrateKVS(const Request &request, Response &response)
+{
+  try
+  {
+    Ring ring;
+    if (!kvsCtrlClient.GetRing(ring))
+    {
+      response.body("Error: No controller answered");
+      response.type("text/html");
+      response.status(503, "Service Unavailable");
+      response.flush();
+      return;
+    }
+
+    bool same = ring.clusters_size() == static_cast<int>(kvsClusters.size());
+    for (int i = 0; same && i < ring.clusters_size(); i++)
+      same = std::vector<std::string>(ring.clusters(i).ips().begin(), ring.clusters(i).ips().end()) == kvsClusters[i];
+
+    if (same && !ring.migrating())
+    {
+      response.body("Rows are already on their clusters, ring " + std::to_string(ring.epoch()));
+      response.type("text/html");
+      response.status(200, "OK");
+      response.flush();
+      return;
+    }
+
+    // Publish the configured clusters with rows migrating, unless a call left off migrating to them,
+    // and let every client following the controllers load the ring before rows move
+    if (!same)
+    {
+      ring.set_epoch(ring.epoch() + 1);
+      ring.clear_clusters();
+      for (const std::vector<std::string> &ips : kvsClusters)
+      {
+        Cluster *cluster = ring.add_clusters();
+        for (const std::string &ip : ips)
+          cluster->add_ips(ip);
+      }
+      ring.set_virtualnodes(RING_VIRTUAL_NODES);
+      ring.set_migrating(true);
+      if (kvsCtrlClient.SetRing(ring) != grpc::StatusCode::OK)
+        throw std::runtime_error("the ring could not be published on every controller");
+    }
+    kvsClient.SetRing(ring);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2 * RING_REFRESH_MS));
+
+    size_t moved = 0, total = 0;
+    bool done = false;
+    for (int pass = 0; pass < migrateMaxPasses && !done; pass++)
+    {
+      done = kvsClient.Migrate(moved);
+      total += moved;
+      if (!done)
+        std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_INTERVAL_MS * 10));
+    }
+    if (!done)
+      throw std::runtime_error(std::to_string(total) + " rows moved, the others are left for another call");
+
+    ring.set_epoch(ring.epoch() + 1);
+    ring.set_migrating(false);
+    if (kvsCtrlClient.SetRing(ring) != grpc::StatusCode::OK)
+      throw std::runtime_error("rows are moved, but the ring could not be published on every controller");
+    kvsClient.SetRing(ring);
+
+    response.body(std::to_string(total) + " rows moved, ring " + std::to_string(ring.epoch()));
+    response.type("text/html");
+    response.status(200, "OK");
+    response.flush();
+  }
+  catch (const std::exception &e)
+  {
+    // Handle exceptions
+    response.body("Error: " + std::string(e.what()));
+    response.type("text/html");
+    response.status(500, "Internal Server Error");
+    response.flush();
+  }
+}
+
 std::string escapeJSON(const std::string &s)
 {
   std::string escaped;
@@ -454,7 +541,7 @@ void handleAPIAllRows(const Request &request, Response &response)
     std::vector<std::string> rows;
     if (kvsIP.empty())
     {
-      kvsClient.GetAllRows(rows);
+      kvsClient.GetAllRows(rows, "", browseReadOptions);
     }
     else
     {
@@ -480,7 +567,7 @@ void handleAPIAllRows(const Request &request, Response &response)
       std::vector<std::string> cols;
       if (kvsIP.empty())
       {
-        kvsClient.GetColsInRow(rows[i], cols);
+        kvsClient.GetColsInRow(rows[i], cols, "-", "", browseReadOptions);
       }
       else
       {
@@ -493,7 +580,7 @@ void handleAPIAllRows(const Request &request, Response &response)
           jsonStream << ", ";
         }
         std::string col_value;
-        bool success = kvsClient.Get(rows[i], cols[j], col_value);
+        bool success = kvsClient.Get(rows[i], cols[j], col_value, "-", browseReadOptions);
         // assert(success);
         if (col_value.length() > 100)
         {
@@ -561,6 +648,8 @@ void initKVS()
 
   kvsCtrlClient = KVSCTRLClient(controllers);
   kvsClient = KVSClient(clusters);
+  kvsClient.FollowRing(controllers);
+  kvsClusters = clusters;
 
   std::cout << "Controller starting servers..." << std::endl;
 
@@ -199,17 +199,29 @@ void getMailbox(std::vector<std::pair<std::string, std::string>>& mailbox, const
     return;
   }
   
-  for (const auto& colKey: colKeys)
+  // fetch all messages in parallel, then wait for every one of them
+  std::vector<std::string> values(colKeys.size());
+  std::vector<std::future<bool>> gets;
+  for (size_t i = 0; i < colKeys.size(); i++)
   {
-    // std::cout << "colKey: " << colKey << std::endl;
-    std::string value;
-    if (!kvsClient.Get(rowKey, colKey, value, mutexId))
-    {
-      std::cerr << "Get failed in getMailbox" << std::endl;
-      releaseLock(rowKey, mutexId);
-      return;
-    }
-    mailbox.emplace_back(colKey, value);
+    gets.push_back(kvsClient.GetAsync(rowKey, colKeys[i], values[i], mutexId));
+  }
+
+  bool success = true;
+  for (auto& get: gets)
+  {
+    success = get.get() && success;
+  }
+  if (!success)
+  {
+    std::cerr << "Get failed in getMailbox" << std::endl;
+    releaseLock(rowKey, mutexId);
+    return;
+  }
+
+  for (size_t i = 0; i < colKeys.size(); i++)
+  {
+    mailbox.emplace_back(colKeys[i], values[i]);
   }
   releaseLock(rowKey, mutexId);
 }
@@ -440,9 +440,9 @@ void handleUploadFile(const Request &request, Response &response)
             std::cout << "Update file index" << std::endl;
         }
 
-        // Save the file content in KVS and append the new file info to the file index 
-        std::string newFileIdx = fileIdx + fileName + " " + fileSize + " " + fileType + " " + fileDate + "\n";
-        if (kvsClient.CPut(userR, "fileIndex.txt", fileIdx, newFileIdx))
+        // Append the new file info to the file index, unless another upload added the file meanwhile
+        std::string fileInfo = fileName + " " + fileSize + " " + fileType + " " + fileDate;
+        if (kvsClient.AppendLine(userR, "fileIndex.txt", fileInfo, fileName))
         {
             // create a json response containing the uploaded files info
             std::string jsonResponse = "{\"name\": \"" + fileName + "\", \"size\": \"" + fileSize + "\", \"type\": \"" + fileType + "\", \"date\": \"" + fileDate + "\"}";
@@ -508,19 +508,8 @@ void handleDeleteFile(const Request &request, Response &response)
             return;
         }
 
-        // open file index and create temp file for writing new index
-        std::istringstream fileIdxStream(fileIdx);
-        std::string newFileIdx, line;
-        while (std::getline(fileIdxStream, line))
-        {
-            if (line.find(fileName) == std::string::npos)
-            {
-                newFileIdx += line + "\n";
-            }
-        }
-
-        // update file index
-        if (!kvsClient.CPut(userR, "fileIndex.txt", fileIdx, newFileIdx))
+        // remove the file info from the file index
+        if (!kvsClient.RemoveLine(userR, "fileIndex.txt", fileName))
         {
             response.status(500, "Internal Server Error");
             response.body("500 Internal Server Error: File index could not be updated");
@@ -607,9 +596,10 @@ void handleMoveFile(const Request &request, Response &response)
             return;
         }
 
-        // Move the file to the destination folder
+        // Get the file content to move
         std::string fileContent;
-        if (!kvsClient.Get(oldFileR, fileName, fileContent))
+        uint64_t fileVersion = 0;
+        if (!kvsClient.Get(oldFileR, fileName, fileContent, fileVersion))
         {
             response.status(500, "Internal Server Error");
             response.body("500 Internal Server Error: File could not be opened");
@@ -617,52 +607,30 @@ void handleMoveFile(const Request &request, Response &response)
             return;
         }
 
-        if (!kvsClient.Put(newFileR, fileName, fileContent))
-        {
-            response.status(500, "Internal Server Error");
-            response.body("500 Internal Server Error: File could not be saved");
-            response.flush();
-            return;
-        }
-
-        // Remove the old file from old file R
-        if (!kvsClient.Delete(oldFileR, fileName))
-        {
-            response.status(500, "Internal Server Error");
-            response.body("500 Internal Server Error: File could not be removed");
-            response.flush();
-            return;
-        }
-
-        // Update old file R file index
+        // Find the file info in old file R file index
         std::istringstream oldFileRfileIdxStream(oldFileRfileIdx);
-        std::string newOldFileRfileIdx, line, fileInfo;
+        std::string line, fileInfo;
         while (std::getline(oldFileRfileIdxStream, line))
         {
-            if (line.find(fileName) == std::string::npos)
-            {
-                newOldFileRfileIdx += line + "\n";
-            }
-            else
+            if (line.substr(0, line.find(' ')) == fileName)
             {
                 fileInfo = line;
+                break;
             }
         }
 
-        if (!kvsClient.CPut(oldFileR, "fileIndex.txt", oldFileRfileIdx, newOldFileRfileIdx))
-        {
-            response.status(500, "Internal Server Error");
-            response.body("500 Internal Server Error: File index could not be updated");
-            response.flush();
-            return;
-        }
-
-        // Update new file R file index
-        std::string newFileRfileIdxUpdate = newFileRFileIdx + fileInfo + "\n";
-        if (!kvsClient.CPut(newFileR, "fileIndex.txt", newFileRFileIdx, newFileRfileIdxUpdate))
+        // Move the file and its file info at once, unless the file changed since it was read
+        Transaction move;
+        move.Check(oldFileR, fileName, fileVersion)
+            .Delete(oldFileR, fileName)
+            .RemoveLine(oldFileR, "fileIndex.txt", fileName)
+            .PutIfVersion(newFileR, fileName, 0, fileContent)
+            .AppendLine(newFileR, "fileIndex.txt", fileInfo, fileName);
+        std::vector<std::string> values;
+        if (!kvsClient.Commit(move, values))
         {
             response.status(500, "Internal Server Error");
-            response.body("500 Internal Server Error: File index could not be updated");
+            response.body("500 Internal Server Error: File could not be moved");
             response.flush();
             return;
         }
@@ -732,7 +700,8 @@ void handleRenameFile(const Request &request, Response &response)
 
         // Get the file contents
         std::string fileContent;
-        if (!kvsClient.Get(userR, fileName, fileContent))
+        uint64_t fileVersion = 0;
+        if (!kvsClient.Get(userR, fileName, fileContent, fileVersion))
         {
             response.status(500, "Internal Server Error");
             response.body("500 Internal Server Error: File could not be opened");
@@ -740,45 +709,29 @@ void handleRenameFile(const Request &request, Response &response)
             return;
         }
 
-        // Save the file content in KVS with new file name
-        if (!kvsClient.Put(userR, newFileName, fileContent))
-        {
-            response.status(500, "Internal Server Error");
-            response.body("500 Internal Server Error: File could not be saved");
-            response.flush();
-            return;
-        }    
-
-        // Remove the old file from KVS
-        if (!kvsClient.Delete(userR, fileName))
-        {
-            response.status(500, "Internal Server Error");
-            response.body("500 Internal Server Error: File could not be removed");
-            response.flush();
-            return;
-        }
-
-        // Open the file index and create a temp file for writing the new index
+        // Find the file info in the file index
         std::istringstream fileIdxStream(fileIdx);
-        std::string newFileIdx, line;
+        std::string line, fileInfo;
         while (std::getline(fileIdxStream, line))
         {
-            if (line.find(fileName) == std::string::npos)
-            {
-                newFileIdx += line + "\n";
-            }
-            else
+            if (line.substr(0, line.find(' ')) == fileName)
             {
-                std::string fileInfo = line.substr(line.find(" ") + 1);
-                newFileIdx += newFileName + " " + fileInfo + "\n";
+                fileInfo = line.substr(line.find(" ") + 1);
+                break;
             }
         }
 
-        // Update the file index
-        if (!kvsClient.CPut(userR, "fileIndex.txt", fileIdx, newFileIdx))
+        // Save the file content with the new file name, remove the old file and update the file index at once
+        Transaction rename;
+        rename.Check(userR, fileName, fileVersion)
+            .PutIfVersion(userR, newFileName, 0, fileContent)
+            .Delete(userR, fileName)
+            .ReplaceLine(userR, "fileIndex.txt", fileName, newFileName + " " + fileInfo);
+        std::vector<std::string> values;
+        if (!kvsClient.Commit(rename, values))
         {
             response.status(500, "Internal Server Error");
-            response.body("500 Internal Server Error: File index could not be updated");
+            response.body("500 Internal Server Error: File could not be renamed");
             response.flush();
             return;
         }
@@ -905,9 +858,8 @@ void handleCreateFolder(const Request &request, Response &response)
             return;
         }
 
-        // Save the folder name in KVS and append the new folder info to the folder index 
-        std::string newFolderIdx = folderIdx + folderName + "\n";
-        if (kvsClient.CPut(userR, "folderIndex.txt", folderIdx, newFolderIdx))
+        // Append the new folder to the folder index, unless another request added it meanwhile
+        if (kvsClient.AppendLine(userR, "folderIndex.txt", folderName, folderName + "\n"))
         {
             // create a json response containing the new folder info
             std::string jsonResponse = "{\"name\": \"" + folderName + "\"}";
@@ -982,19 +934,8 @@ void handleDeleteFolder(const Request &request, Response &response)
         std::string  deleteFolderR = userR + "/" + folderName; // the row key of the folder to delete
         deleteFolder(deleteFolderR);
 
-        // Open the folder index and create a temp file for writing the new index
-        std::istringstream folderIdxStream(folderIdx);
-        std::string newFolderIdx, line;
-        while (std::getline(folderIdxStream, line))
-        {
-            if (line != folderName)
-            {
-                newFolderIdx += line + "\n";
-            }
-        }
-
         // Update the folder index
-        if (!kvsClient.CPut(userR, "folderIndex.txt", folderIdx, newFolderIdx))
+        if (!kvsClient.RemoveLine(userR, "folderIndex.txt", folderName + "\n"))
         {
             response.status(500, "Internal Server Error");
             response.body("500 Internal Server Error: Folder index could not be updated");
@@ -1080,19 +1021,8 @@ void handleMoveFolder(const Request &request, Response &response)
         // Move the folder to the destination folder
         moveFolder(oldFolderR, newFolderR, newFolderPath);
         
-        // Open the folder index of the old folder parent and create a temp file for writing the new index
-        std::istringstream oldFolderIdxStream(oldFolderIdx);
-        std::string folderIdx, line;
-        while (std::getline(oldFolderIdxStream, line))
-        {
-            if (line != folderName)
-            {
-                folderIdx += line + "\n";
-            }
-        }
-
         // Update the folder index of the old folder parent
-        if (!kvsClient.CPut(oldUserR, "folderIndex.txt", oldFolderIdx, folderIdx))
+        if (!kvsClient.RemoveLine(oldUserR, "folderIndex.txt", folderName + "\n"))
         {
             response.status(500, "Internal Server Error");
             response.body("500 Internal Server Error: Folder index could not be updated");
@@ -1101,8 +1031,7 @@ void handleMoveFolder(const Request &request, Response &response)
         }
         
         // Update the folder index of the new folder parent
-        std::string newFolderIdxUpdate = newFolderIdx + folderName + "\n";
-        if (!kvsClient.CPut(newUserR, "folderIndex.txt", newFolderIdx, newFolderIdxUpdate))
+        if (!kvsClient.AppendLine(newUserR, "folderIndex.txt", folderName, folderName + "\n"))
         {
             response.status(500, "Internal Server Error");
             response.body("500 Internal Server Error: Folder index could not be updated");
@@ -1184,23 +1113,8 @@ void handleRenameFolder(const Request &request, Response &response)
         // Move all the subfolders and files to the new renamed folder
         moveFolder(oldFolderR, newFolderR, newFolderPath);
 
-        // Open the folder index of the old folder parent and create a temp file for writing the new index
-        std::istringstream folderIdxStream(folderIdx);
-        std::string newFolderIdx, line;
-        while (std::getline(folderIdxStream, line))
-        {
-            if (line != folderName)
-            {
-                newFolderIdx += line + "\n";
-            }
-            else
-            {
-                newFolderIdx += newFolderName + "\n";
-            }
-        }
-
         // Update the folder index
-        if (!kvsClient.CPut(userR, "folderIndex.txt", folderIdx, newFolderIdx))
+        if (!kvsClient.ReplaceLine(userR, "folderIndex.txt", folderName + "\n", newFolderName))
         {
             response.status(500, "Internal Server Error");
             response.body("500 Internal Server Error: Folder index could not be updated");
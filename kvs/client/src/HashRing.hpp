@@ -0,0 +1,110 @@
+#ifndef HASH_RING_HPP
+#define HASH_RING_HPP
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+
+#include <openssl/evp.h>
+
+#define RING_VIRTUAL_NODES 128  // default number of points of each cluster on the ring
+#define RING_MODULO 0           // number of points placing rows by their hash modulo the number of clusters, as before the ring
+
+/**
+ * @brief A consistent-hash ring mapping rows to clusters.
+ * @author Lang Qin
+ *
+ * Each cluster owns virtualNodes points on a ring of 64-bit hashes, placed by hashing
+ * its index and the number of the point. A row belongs to the cluster of the first
+ * point at or after the hash of the row, wrapping around. Clusters are identified by
+ * the order in which they joined, so adding a cluster only takes over the rows just
+ * before its points, about 1/n of all rows, and moves no row between old clusters.
+ *
+ * A ring built with RING_MODULO points places rows the way clients did before rings were
+ * published, by the two halves of the MD5 digest of the row xored, modulo the number of
+ * clusters, so that rows written by older clients are found where they are.
+ *
+ * The ring is immutable and may be read by any number of threads.
+ *
+ * APIs:
+ * 1. size_t Locate(const std::string& row):
+ *     Get the index of the cluster the row belongs to.
+ * 2. size_t Size():
+ *     Get the number of clusters on the ring.
+ * 3. static uint64_t Hash(const std::string& key):
+ *     Get the position of a key on the ring.
+*/
+
+class HashRing {
+public:
+    HashRing(size_t clusters = 0, int virtualNodes = RING_VIRTUAL_NODES) : clusters_(clusters), modulo_(virtualNodes <= RING_MODULO) {
+        if (modulo_)
+            return;
+
+        points_.reserve(clusters * virtualNodes);
+        for (size_t cluster = 0; cluster < clusters; cluster++) {
+            for (int point = 0; point < virtualNodes; point++)
+                points_.emplace_back(Hash(std::to_string(cluster) + "#" + std::to_string(point)), cluster);
+        }
+        std::sort(points_.begin(), points_.end());
+    }
+
+    /**
+     * @brief Get the index of the cluster the row belongs to.
+     *
+     * @param row the row
+     * @return size_t index of the cluster, 0 if the ring is empty
+     */
+    size_t Locate(const std::string& row) const {
+        if (clusters_ < 2)
+            return 0;
+        if (modulo_)
+            return legacyHash(row) % clusters_;
+
+        uint64_t hash = Hash(row);
+        auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(hash, (size_t)0));
+        return it == points_.end() ? points_.front().second : it->second;
+    }
+
+    /**
+     * @brief Get the number of clusters on the ring.
+     */
+    size_t Size() const {
+        return clusters_;
+    }
+
+    /**
+     * @brief Get the position of a key on the ring, from the first 8 bytes of its MD5 digest.
+     */
+    static uint64_t Hash(const std::string& key) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        EVP_Digest(key.data(), key.size(), digest, nullptr, EVP_md5(), nullptr);
+
+        uint64_t hash = 0;
+        for (int i = 0; i < 8; i++)
+            hash = (hash << 8) | digest[i];
+        return hash;
+    }
+
+private:
+    size_t clusters_;                                  // number of clusters
+    bool modulo_;                                      // whether rows are placed modulo the number of clusters, without points
+    std::vector<std::pair<uint64_t, size_t>> points_;  // points of the clusters, sorted by hash
+
+    // Get the hash older clients placed a row by, the two halves of its MD5 digest xored
+    static uint64_t legacyHash(const std::string& row) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        EVP_Digest(row.data(), row.size(), digest, nullptr, EVP_md5(), nullptr);
+
+        uint64_t high = 0, low = 0;
+        for (int i = 0; i < 8; i++) {
+            high = (high << 8) | digest[i];
+            low = (low << 8) | digest[8 + i];
+        }
+        return high ^ low;
+    }
+};
+
+#endif
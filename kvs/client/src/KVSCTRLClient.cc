@@ -100,6 +100,49 @@ int KVSCTRLClient::KillAll()
     return grpc::StatusCode::OK;
 }
 
+int KVSCTRLClient::SetRing(const Ring &ring)
+{
+    // Publish on every controller even if one fails, so that a retry reaches the others
+    int result = grpc::StatusCode::OK;
+    for (auto &pair : stubs_)
+    {
+        std::shared_ptr<Controller::Stub> stub = pair.second;
+
+        grpc::ClientContext context;
+        StopReply reply;
+        grpc::Status status = stub->SetRing(&context, ring, &reply);
+        if (!status.ok())
+        {
+            std::cout << "Error: " << status.error_message() << std::endl;
+            result = status.error_code();
+        }
+    }
+    return result;
+}
+
+bool KVSCTRLClient::GetRing(Ring &ring)
+{
+    bool answered = false;
+    ring.Clear();
+    for (auto &pair : stubs_)
+    {
+        std::shared_ptr<Controller::Stub> stub = pair.second;
+
+        grpc::ClientContext context;
+        context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(CTRL_RING_TIMEOUT_MS));
+        ServersArgs args;
+        Ring reply;
+        grpc::Status status = stub->GetRing(&context, args, &reply);
+        if (!status.ok())
+            continue;
+
+        answered = true;
+        if (reply.epoch() > ring.epoch())
+            ring = reply;
+    }
+    return answered;
+}
+
 bool KVSCTRLClient::getNValidateIp(const std::string &addr, std::string &ip) {
     ip = addr.substr(0, addr.find(":"));
     
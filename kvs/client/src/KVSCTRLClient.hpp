@@ -8,6 +8,8 @@
 #include "proto/controller.pb.h"
 #include "proto/controller.grpc.pb.h"
 
+#define CTRL_RING_TIMEOUT_MS 2000  // deadline of a call to a controller for the ring, so that a dead one does not block clients following the ring
+
 /**
  * @brief A client for the controller.
  * The client can perform the following operations:
@@ -19,6 +21,10 @@
  *    Get the list of servers' ips.
  * 4. client.KillAll():
  *    Kill all servers.
+ * 5. client.SetRing(ring):
+ *    Publish a new ring of clusters on every controller.
+ * 6. client.GetRing(ring):
+ *    Get the newest ring of clusters published on the controllers.
  */
 class KVSCTRLClient
 {
@@ -63,6 +69,23 @@ public:
      */
     int KillAll();
 
+    /**
+     * @brief Publish a new ring of clusters on every controller.
+     * The epoch of the ring must be higher than the one of the published ring.
+     *
+     * @return grpc::StatusCode::FAILED_PRECONDITION if a newer ring is published.
+     * @return grpc::StatusCode::OK if the ring is published on all controllers.
+     */
+    int SetRing(const Ring &ring);
+
+    /**
+     * @brief Get the newest ring of clusters published on the controllers.
+     *
+     * @param ring the ring to store the result, epoch 0 if none is published
+     * @return bool whether any controller answered within CTRL_RING_TIMEOUT_MS
+     */
+    bool GetRing(Ring &ring);
+
 private:
 
     // The stubs for the controller
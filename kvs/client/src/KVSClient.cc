@@ -1,133 +1,526 @@
 #include "KVSClient.hpp"
+#include "KVSCTRLClient.hpp"
 
-KVSClient::KVSClient()
+KVSClient::KVSClient() : shared_(std::make_shared<SharedState>()), queue_(std::make_shared<AsyncQueue>())
 {
-    transactionID_ = 1;
     clientID_ = nrand();
+    setTopology(*shared_, 0, {}, RING_MODULO, false);
 }
 
-KVSClient::KVSClient(std::vector<std::string> serversIP)
+KVSClient::KVSClient(std::vector<std::string> serversIP) : shared_(std::make_shared<SharedState>()), queue_(std::make_shared<AsyncQueue>())
 {
-    transactionID_ = 1;
     clientID_ = nrand();
-
-    std::vector<std::shared_ptr<KVS::Stub>> servers;
-    initCluster(serversIP, servers);
-    clusters_.emplace_back(servers);
-    assert(clusters_[0].size() == serversIP.size());
+    setTopology(*shared_, 0, {serversIP}, RING_MODULO, false);
 }
 
-KVSClient::KVSClient(std::vector<std::vector<std::string>> clusters)
+KVSClient::KVSClient(std::vector<std::vector<std::string>> clusters) : shared_(std::make_shared<SharedState>()), queue_(std::make_shared<AsyncQueue>())
 {
-    transactionID_ = 1;
     clientID_ = nrand();
+    setTopology(*shared_, 0, clusters, RING_MODULO, false);
+}
+
+std::shared_ptr<KVSClient::ServerState> KVSClient::connect(const std::string &ip)
+{
+    grpc::ChannelArguments channelArgs;
+    channelArgs.SetMaxReceiveMessageSize(1024 * 1024 * 1024);
+
+    auto server = std::make_shared<ServerState>();
+    server->ip = ip;
+    std::shared_ptr<grpc::Channel> channel = grpc::CreateCustomChannel(ip, grpc::InsecureChannelCredentials(), channelArgs);
+    server->stub = std::move(KVS::NewStub(channel));
+    return server;
+}
+
+bool KVSClient::setTopology(SharedState &shared, uint64_t epoch, const std::vector<std::vector<std::string>> &clusters, int virtualNodes, bool migrating)
+{
+    std::lock_guard<std::mutex> lock(shared.mu);
+    std::shared_ptr<const Topology> old = std::atomic_load(&shared.topology);
+    if (old && epoch <= old->epoch)
+        return false;
+
+    auto topology = std::make_shared<Topology>();
+    topology->epoch = epoch;
+    topology->ring = HashRing(clusters.size(), virtualNodes);
+    topology->migrating = migrating;
+    for (const std::vector<std::string> &ips : clusters)
+    {
+        std::shared_ptr<ClusterState> cluster;
+        for (size_t i = 0; old && i < old->clusters.size() && !cluster; i++)
+        {
+            const std::vector<std::shared_ptr<ServerState>> &servers = old->clusters[i]->servers;
+            bool same = servers.size() == ips.size();
+            for (size_t j = 0; same && j < ips.size(); j++)
+                same = servers[j]->ip == ips[j];
+            if (same)
+                cluster = old->clusters[i];
+        }
+
+        if (!cluster)
+        {
+            cluster = std::make_shared<ClusterState>();
+            for (const std::string &ip : ips)
+            {
+                std::shared_ptr<ServerState> server;
+                if (old && old->servers.count(ip))
+                    server = old->servers.at(ip);
+                cluster->servers.push_back(server ? server : connect(ip));
+            }
+        }
+
+        for (std::shared_ptr<ServerState> &server : cluster->servers)
+            topology->servers[server->ip] = server;
+        topology->clusters.push_back(cluster);
+    }
+
+    std::atomic_store(&shared.topology, std::shared_ptr<const Topology>(topology));
+    return true;
+}
+
+std::shared_ptr<const KVSClient::Topology> KVSClient::topology()
+{
+    return std::atomic_load(&shared_->topology);
+}
+
+KVSClient::Clusters KVSClient::route(const std::string &row, bool all)
+{
+    std::shared_ptr<const Topology> topology = this->topology();
+    size_t owner = topology->ring.Locate(row);
+
+    Clusters clusters = {topology->clusters[owner]};
+    if (all && topology->migrating)
+    {
+        for (size_t i = 0; i < topology->clusters.size(); i++)
+        {
+            if (i != owner)
+                clusters.push_back(topology->clusters[i]);
+        }
+    }
+    return clusters;
+}
+
+KVSClient::AsyncQueue::AsyncQueue()
+{
+    thread = std::thread([this]() {
+        void *tag;
+        bool ok;
+        while (cq.Next(&tag, &ok))
+        {
+            AsyncTask *task = static_cast<AsyncTask *>(tag);
+            task->Complete(ok);
+            delete task;
+        }
+    });
+}
+
+KVSClient::AsyncQueue::~AsyncQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stop = true;
+        for (grpc::ClientContext *context : active)
+            context->TryCancel();
+        for (grpc::Alarm *alarm : alarms)
+            alarm->Cancel();
+    }
+    cq.Shutdown();
+    thread.join();
+}
+
+// A callback run on the completion queue thread after a delay
+struct KVSClient::AsyncTimer : KVSClient::AsyncTask
+{
+    AsyncQueue *queue;
+    grpc::Alarm alarm;
+    std::function<void(bool)> fn;
+
+    void Complete(bool ok) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue->mu);
+            queue->alarms.erase(&alarm);
+        }
+        fn(ok);
+    }
+};
+
+bool KVSClient::AsyncQueue::After(int delayMs, std::function<void(bool)> fn)
+{
+    std::lock_guard<std::mutex> lock(mu);
+    if (stop)
+        return false;
+
+    auto timer = new AsyncTimer();
+    timer->queue = this;
+    timer->fn = std::move(fn);
+    timer->alarm.Set(&cq, std::chrono::system_clock::now() + std::chrono::milliseconds(delayMs), timer);
+    alarms.insert(&timer->alarm);
+    return true;
+}
+
+// A request sent to the servers of a cluster in turn until one answers. Each call has a
+// deadline, and a hedged request is also sent to the next server once the first is slow.
+template <typename Args, typename Reply>
+struct KVSClient::AsyncRequest : std::enable_shared_from_this<KVSClient::AsyncRequest<Args, Reply>>
+{
+    // One call to one server
+    struct Call : AsyncTask
+    {
+        std::shared_ptr<AsyncRequest> request;
+        size_t server;                                  // index of the server in the cluster
+        grpc::ClientContext context;
+        std::unique_ptr<grpc::ClientAsyncResponseReader<Reply>> reader;
+        grpc::Status status;
+        Reply reply;
+        std::chrono::steady_clock::time_point start;
+
+        void Complete(bool /*ok*/) override
+        {
+            request->onReply(*this);
+        }
+    };
+
+    AsyncQueue *queue;
+    std::shared_ptr<SharedState> shared;
+    std::shared_ptr<ClusterState> cluster;
+    std::vector<size_t> order;                          // indexes of the servers in the order to try them
+    AsyncMethod<Args, Reply> method;
+    Args args;
+    int timeoutMs;                                      // deadline of each call
+    int hedgeMs;                                        // delay before sending to a second server, or 0
+    bool timed;                                         // whether to record the latency of the servers
+    std::function<void(bool, Reply &)> done;
+
+    std::mutex mu;                                      // lock for the fields below
+    size_t next = 0;                                    // position in order of the server to send to next
+    bool finished = false;                              // whether done has been called
+    std::set<Call *> calls;                             // calls in flight
+    std::set<size_t> failed;                            // servers which did not answer
+
+    // Start the first round, false if the client is being destroyed
+    bool start()
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        return send();
+    }
+
+    // Send the request to the next server and arm the hedging timer. Called with mu held,
+    // false if the client is being destroyed.
+    bool send()
+    {
+        auto call = new Call();
+        call->request = this->shared_from_this();
+        call->server = order[next++];
+        call->context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(timeoutMs));
+        {
+            std::lock_guard<std::mutex> lock(queue->mu);
+            if (queue->stop)
+            {
+                delete call;
+                return false;
+            }
+
+            call->start = std::chrono::steady_clock::now();
+            call->reader = (cluster->servers[call->server]->stub.get()->*method)(&call->context, args, &queue->cq);
+            call->reader->StartCall();
+            call->reader->Finish(&call->reply, &call->status, call);
+            queue->active.insert(&call->context);
+        }
+        calls.insert(call);
+
+        if (hedgeMs > 0 && next < order.size())
+        {
+            auto self = this->shared_from_this();
+            queue->After(hedgeMs, [self](bool fired) {
+                if (fired)
+                    self->hedge();
+            });
+        }
+        return true;
+    }
+
+    // The server last sent to is slow, send to the next one as well
+    void hedge()
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        if (!finished && !calls.empty() && next < order.size())
+            send();
+    }
+
+    // Start over after a round in which no server answered
+    void retry(bool fired)
+    {
+        std::unique_lock<std::mutex> lock(mu);
+        next = 0;
+        // A large write may start above the cap, keep its deadline then
+        if (timeoutMs < RPC_TIMEOUT_MAX_MS)
+            timeoutMs = std::min(timeoutMs * 2, RPC_TIMEOUT_MAX_MS);
+        if (!fired || !send())
+            fail(lock);
+    }
+
+    void onReply(Call &call)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue->mu);
+            queue->active.erase(&call.context);
+        }
+        if (timed && call.status.error_code() != grpc::StatusCode::CANCELLED)
+            recordLatency(*shared, *cluster->servers[call.server], call.start, call.status.ok());
+
+        std::unique_lock<std::mutex> lock(mu);
+        calls.erase(&call);
+        if (finished)
+            return;
+
+        if (call.status.ok())
+        {
+            // Cancel the other calls of a hedged request, the first answer wins
+            finished = true;
+            for (Call *other : calls)
+                other->context.TryCancel();
+            learnLeader(call);
+            lock.unlock();
+            done(true, call.reply);
+            return;
+        }
+
+        failed.insert(call.server);
+        if (next < order.size())
+        {
+            if (!send())
+                fail(lock);
+        }
+        else if (calls.empty())
+        {
+            auto self = this->shared_from_this();
+            if (!queue->After(RETRY_INTERVAL_MS, [self](bool fired) { self->retry(fired); }))
+                fail(lock);
+        }
+    }
 
-    for (std::vector<std::string> cluster : clusters)
+    // Send the next requests to the cluster to the leader reported by a server, unless the
+    // leader did not answer, in which case to the server which did
+    void learnLeader(const Call &call)
     {
-        std::vector<std::shared_ptr<KVS::Stub>> servers;
-        initCluster(cluster, servers);
-        clusters_.emplace_back(servers);
+        int leader = call.reply.leader();
+        if (leader < 0 || leader >= (int)cluster->servers.size() || failed.count(leader))
+            leader = call.server;
+
+        cluster->leader.store(leader);
+    }
+
+    void fail(std::unique_lock<std::mutex> &lock)
+    {
+        finished = true;
+        lock.unlock();
+        Reply none;
+        done(false, none);
+    }
+};
+
+template <typename Args, typename Reply>
+void KVSClient::callAsync(const std::shared_ptr<ClusterState> &cluster, const std::vector<size_t> &order, AsyncMethod<Args, Reply> method, const Args &args, int timeoutMs, int hedgeMs, bool timed, std::function<void(bool, Reply &)> done)
+{
+    auto request = std::make_shared<AsyncRequest<Args, Reply>>();
+    request->queue = queue_.get();
+    request->shared = shared_;
+    request->cluster = cluster;
+    request->order = order;
+    request->method = method;
+    request->args = args;
+    request->timeoutMs = timeoutMs;
+    request->hedgeMs = hedgeMs;
+    request->timed = timed;
+    request->done = std::move(done);
+
+    if (!request->start())
+    {
+        Reply none;
+        request->done(false, none);
     }
 }
 
-void KVSClient::initCluster(std::vector<std::string> cluster, std::vector<std::shared_ptr<KVS::Stub>>& servers)
+template <typename Args, typename Reply>
+void KVSClient::callClusters(const Clusters &clusters, AsyncMethod<Args, Reply> method, const Args &args, int timeoutMs, const ReadOptions *options, std::function<void(std::vector<Reply *> &)> done)
 {
-    for (std::string ip : cluster)
+    // The replies gathered so far
+    struct Gather
+    {
+        std::mutex mu;
+        size_t pending;
+        std::vector<std::unique_ptr<Reply>> replies;
+        std::function<void(std::vector<Reply *> &)> done;
+    };
+    auto gather = std::make_shared<Gather>();
+    gather->pending = clusters.size();
+    gather->replies.resize(clusters.size());
+    gather->done = std::move(done);
+
+    for (size_t i = 0; i < clusters.size(); i++)
     {
-        grpc::ChannelArguments channelArgs;
-        channelArgs.SetMaxReceiveMessageSize(1024 * 1024 * 1024);
+        std::vector<size_t> order = options ? readOrder(*clusters[i], *options) : writeOrder(*clusters[i]);
+        int hedgeMs = options ? hedgeDelayMs(*options) : 0;
+        callAsync<Args, Reply>(clusters[i], order, method, args, timeoutMs, hedgeMs, options != nullptr, [gather, i](bool answered, Reply &reply) {
+            std::unique_lock<std::mutex> lock(gather->mu);
+            if (answered)
+                gather->replies[i] = std::make_unique<Reply>(std::move(reply));
+            if (--gather->pending > 0)
+                return;
+            lock.unlock();
 
-        std::shared_ptr<grpc::Channel> channel = grpc::CreateCustomChannel(ip, grpc::InsecureChannelCredentials(), channelArgs);
-        std::shared_ptr<KVS::Stub> stub = std::move(KVS::NewStub(channel));
-        servers.push_back(stub);
-        ipToStub_[ip] = stub;
+            std::vector<Reply *> replies;
+            for (std::unique_ptr<Reply> &reply : gather->replies)
+                replies.push_back(reply.get());
+            gather->done(replies);
+        });
     }
+}
 
-    assert(servers.size() == cluster.size());
+template <typename Args, typename Reply>
+void KVSClient::callClustersSync(const Clusters &clusters, AsyncMethod<Args, Reply> method, const Args &args, int timeoutMs, const ReadOptions *options, std::vector<std::unique_ptr<Reply>> &replies)
+{
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    callClusters<Args, Reply>(clusters, method, args, timeoutMs, options, [&promise, &replies](std::vector<Reply *> &results) {
+        replies.clear();
+        for (Reply *result : results)
+            replies.emplace_back(result ? new Reply(std::move(*result)) : nullptr);
+        promise.set_value();
+    });
+    future.get();
 }
 
 bool KVSClient::Put(const std::string &row, const std::string &col, const std::string &value, const std::string &key)
 {
     validateArgs(row, col);
-    return DoPut(row, col, value, "", key, 0);
+    return DoPutAsync(route(row, false), row, col, value, "", key, 0).get();
 }
 
 bool KVSClient::CPut(const std::string &row, const std::string &col, const std::string &oldValue, const std::string &newValue, const std::string &key)
 {
     validateArgs(row, col);
-    return DoPut(row, col, newValue, oldValue, key, 1);
+    if (!moveToOwner(row, key))
+        return false;
+    return DoPutAsync(route(row, false), row, col, newValue, oldValue, key, 1).get();
 }
 
-bool KVSClient::Get(const std::string &row, const std::string &col, std::string &value, const std::string &key)
+bool KVSClient::Get(const std::string &row, const std::string &col, std::string &value, const std::string &key, const ReadOptions &options)
 {
     validateArgs(row, col);
-    return DoGet(row, col, value, key);
+    return DoGetAsync(route(row, true), row, col, value, key, options).get();
+}
+
+bool KVSClient::Get(const std::string &row, const std::string &col, std::string &value, uint64_t &version, const std::string &key, const ReadOptions &options)
+{
+    return GetAsync(row, col, value, version, key, options).get();
+}
+
+bool KVSClient::PutIfVersion(const std::string &row, const std::string &col, uint64_t version, const std::string &value, const std::string &key)
+{
+    return PutIfVersionAsync(row, col, version, value, key).get();
+}
+
+bool KVSClient::AppendLine(const std::string &row, const std::string &col, const std::string &line, const std::string &uniquePrefix, const std::string &key)
+{
+    validateArgs(row, col);
+    if (!moveToOwner(row, key))
+        return false;
+    return DoPutAsync(route(row, false), row, col, line, uniquePrefix, key, 4).get();
+}
+
+bool KVSClient::RemoveLine(const std::string &row, const std::string &col, const std::string &prefix, const std::string &key)
+{
+    validateArgs(row, col);
+    if (!moveToOwner(row, key))
+        return false;
+    return DoPutAsync(route(row, false), row, col, "", prefix, key, 5).get();
+}
+
+bool KVSClient::ReplaceLine(const std::string &row, const std::string &col, const std::string &prefix, const std::string &line, const std::string &key)
+{
+    validateArgs(row, col);
+    if (!moveToOwner(row, key))
+        return false;
+    return DoPutAsync(route(row, false), row, col, line, prefix, key, 6).get();
 }
 
 bool KVSClient::Delete(const std::string &row, const std::string &col, const std::string &key)
 {
     validateArgs(row, col);
-    return DoPut(row, col, "", "", key, 2);
+    return DoPutAsync(route(row, true), row, col, "", "", key, 2).get();
 }
 
 bool KVSClient::SetNX(const std::string &row, std::string &key)
 {
     validateArgs(row);
-    if (locks_.find(row) != locks_.end())
     {
-        return false;
+        std::lock_guard<std::mutex> lock(shared_->mu);
+        if (shared_->locks.find(row) != shared_->locks.end())
+            return false;
     }
-    return DoSetNX(row, key);
+
+    key = std::to_string(nrand());
+    if (!DoSetNX(route(row, false)[0], row, key))
+        return false;
+
+    std::lock_guard<std::mutex> lock(shared_->mu);
+    shared_->locks.insert({row, key});
+    return true;
 }
 
 bool KVSClient::Del(const std::string &row, const std::string &key)
 {
     validateArgs(row);
-    if (locks_.find(row) == locks_.end())
     {
-        return false;
-    }
-    if (locks_[row] != key)
-    {
-        return false;
+        // Claim the lock, so that only one thread releases it
+        std::lock_guard<std::mutex> lock(shared_->mu);
+        auto it = shared_->locks.find(row);
+        if (it == shared_->locks.end() || it->second != key)
+            return false;
+        shared_->locks.erase(it);
     }
-    DoDel(row);
+    DoDel(route(row, true), row);
     return true;
 }
 
-bool KVSClient::GetAllRows(std::vector<std::string> &rows, const std::string &ip)
+bool KVSClient::GetAllRows(std::vector<std::string> &rows, const std::string &ip, const ReadOptions &options)
 {
     // Get all rows from the system if ip is empty
     if (ip.empty())
-        return DoGetAllRows(rows);
+        return DoGetAllRows(topology()->clusters, rows, options);
 
     // Get all rows from a specific server
-    if (ipToStub_.find(ip) == ipToStub_.end())
+    std::shared_ptr<const Topology> topology = this->topology();
+    if (topology->servers.find(ip) == topology->servers.end())
         return false;
 
     GetArgs args;
     GetAllReply reply;
     grpc::ClientContext context;
-    std::shared_ptr<KVS::Stub> &server = ipToStub_[ip];
+    const std::shared_ptr<KVS::Stub> &server = topology->servers.at(ip)->stub;
     grpc::Status status = server->GetAllRowsByIp(&context, args, &reply);
 
     if (status.ok())
     {
         for (std::string row : reply.item())
-            rows.push_back(row);
+        {
+            if (row != KVS_META_ROW)
+                rows.push_back(row);
+        }
     }
 
     return true;
 }
 
-bool KVSClient::GetColsInRow(const std::string &row, std::vector<std::string> &cols, const std::string &key, const std::string &ip)
+bool KVSClient::GetColsInRow(const std::string &row, std::vector<std::string> &cols, const std::string &key, const std::string &ip, const ReadOptions &options)
 {
     // Get cols from the system if ip is not specified
     if (ip.empty())
-        return DoGetColsInRow(row, cols, key);
+        return DoGetColsInRow(route(row, true), row, cols, key, options);
 
     // Get cols from a specific server
-    if (ipToStub_.find(ip) == ipToStub_.end())
+    std::shared_ptr<const Topology> topology = this->topology();
+    if (topology->servers.find(ip) == topology->servers.end())
         return false;
 
     GetArgs args;
@@ -136,7 +529,7 @@ bool KVSClient::GetColsInRow(const std::string &row, std::vector<std::string> &c
 
     GetAllReply reply;
     grpc::ClientContext context;
-    std::shared_ptr<KVS::Stub> &server = ipToStub_[ip];
+    const std::shared_ptr<KVS::Stub> &server = topology->servers.at(ip)->stub;
     grpc::Status status = server->GetColsInRowByIp(&context, args, &reply);
 
     if (status.ok())
@@ -148,178 +541,651 @@ bool KVSClient::GetColsInRow(const std::string &row, std::vector<std::string> &c
     return true;
 }
 
-bool KVSClient::DoGet(const std::string &row, const std::string &col, std::string &value, const std::string &key)
+std::future<bool> KVSClient::PutAsync(const std::string &row, const std::string &col, const std::string &value, const std::string &key)
+{
+    validateArgs(row, col);
+    return DoPutAsync(route(row, false), row, col, value, "", key, 0);
+}
+
+std::future<bool> KVSClient::CPutAsync(const std::string &row, const std::string &col, const std::string &oldValue, const std::string &newValue, const std::string &key)
+{
+    validateArgs(row, col);
+    if (!moveToOwner(row, key))
+        return failedFuture();
+    return DoPutAsync(route(row, false), row, col, newValue, oldValue, key, 1);
+}
+
+std::future<bool> KVSClient::GetAsync(const std::string &row, const std::string &col, std::string &value, const std::string &key, const ReadOptions &options)
+{
+    validateArgs(row, col);
+    return DoGetAsync(route(row, true), row, col, value, key, options);
+}
+
+std::future<bool> KVSClient::GetAsync(const std::string &row, const std::string &col, std::string &value, uint64_t &version, const std::string &key, const ReadOptions &options)
+{
+    validateArgs(row, col);
+    return DoGetAsync(route(row, true), row, col, value, key, options, &version);
+}
+
+std::future<bool> KVSClient::PutIfVersionAsync(const std::string &row, const std::string &col, uint64_t version, const std::string &value, const std::string &key)
+{
+    validateArgs(row, col);
+    if (!moveToOwner(row, key))
+        return failedFuture();
+    return DoPutAsync(route(row, false), row, col, value, "", key, 3, version);
+}
+
+std::future<bool> KVSClient::DeleteAsync(const std::string &row, const std::string &col, const std::string &key)
+{
+    validateArgs(row, col);
+    return DoPutAsync(route(row, true), row, col, "", "", key, 2);
+}
+
+bool KVSClient::Commit(const Transaction &txn, std::vector<std::string> &values, bool *partial)
+{
+    if (partial)
+        *partial = false;
+
+    for (const Op &op : txn.ops)
+        validateArgs(op.row(), op.col());
+    for (const Op &op : txn.ops)
+    {
+        if (!moveToOwner(op.row(), "-"))
+            return false;
+    }
+
+    // Split the operations by the cluster owning their rows, keeping their order
+    Clusters clusters;
+    std::vector<TxnArgs> parts;
+    std::vector<std::vector<size_t>> positions;
+    size_t gets = 0;
+    for (const Op &op : txn.ops)
+    {
+        std::shared_ptr<ClusterState> cluster = route(op.row(), false)[0];
+        size_t i = std::find(clusters.begin(), clusters.end(), cluster) - clusters.begin();
+        if (i == clusters.size())
+        {
+            clusters.push_back(cluster);
+            parts.emplace_back();
+            positions.emplace_back();
+        }
+        *parts[i].add_ops() = op;
+        if (op.type() == GET)
+            positions[i].push_back(gets++);
+    }
+    values.assign(gets, "");
+
+    if (parts.empty())
+        return true;
+    if (parts.size() == 1)
+    {
+        parts[0].set_phase(TXN_ONE_PHASE);
+        return DoTxnAsync(clusters[0], parts[0], &values, &positions[0]).get();
+    }
+
+    // Prepare the transaction on every cluster, then commit it if all are prepared
+    std::string txnId = generateID();
+    std::vector<std::future<bool>> prepared;
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+        parts[i].set_txnid(txnId);
+        parts[i].set_phase(TXN_PREPARE);
+        prepared.push_back(DoTxnAsync(clusters[i], parts[i], &values, &positions[i]));
+    }
+    bool success = true;
+    for (std::future<bool> &future : prepared)
+        success = future.get() && success;
+
+    // Aborting unlocks the rows of the clusters which did prepare, and changes nothing elsewhere
+    // Once all are prepared the transaction is decided: a cluster which answers the commit applies
+    // its part, unless its locks expired and the rows changed meanwhile, so only such a cluster or
+    // one which cannot be reached leaves the transaction partly committed
+    std::vector<std::future<bool>> finished;
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+        parts[i].set_phase(success ? TXN_COMMIT : TXN_ABORT);
+        finished.push_back(DoTxnAsync(clusters[i], parts[i], nullptr, nullptr));
+    }
+    bool finishedAll = true;
+    for (std::future<bool> &future : finished)
+        finishedAll = future.get() && finishedAll;
+    if (success && !finishedAll && partial)
+        *partial = true;
+    return success && finishedAll;
+}
+
+bool KVSClient::GetStats(const std::string &ip, std::map<std::string, uint64_t> &stats)
+{
+    std::shared_ptr<const Topology> topology = this->topology();
+    if (topology->servers.find(ip) == topology->servers.end())
+        return false;
+
+    GetArgs args;
+    StatsReply reply;
+    grpc::ClientContext context;
+    const std::shared_ptr<KVS::Stub> &server = topology->servers.at(ip)->stub;
+    grpc::Status status = server->GetStatsByIp(&context, args, &reply);
+
+    if (!status.ok())
+        return false;
+
+    for (const auto &counter : reply.counters())
+        stats[counter.first] = counter.second;
+
+    return true;
+}
+
+bool KVSClient::SetRing(const Ring &ring)
 {
-    size_t rowIndex = getClusterIndex(row);
+    return setRing(*shared_, ring);
+}
+
+bool KVSClient::setRing(SharedState &shared, const Ring &ring)
+{
+    if (ring.clusters_size() == 0 || ring.virtualnodes() <= 0)
+        return false;
+
+    std::vector<std::vector<std::string>> clusters;
+    for (const Cluster &cluster : ring.clusters())
+        clusters.emplace_back(cluster.ips().begin(), cluster.ips().end());
+    return setTopology(shared, ring.epoch(), clusters, ring.virtualnodes(), ring.migrating());
+}
+
+bool KVSClient::FollowRing(const std::vector<std::string> &controllers)
+{
+    auto controller = std::make_shared<KVSCTRLClient>(controllers);
+    Ring ring;
+    bool answered = controller->GetRing(ring);
+    if (answered)
+        setRing(*shared_, ring);
+
+    // The thread only holds the state while it sets a ring, so it stops once the client and its copies are gone
+    std::weak_ptr<SharedState> weak = shared_;
+    std::thread([weak, controller]() {
+        while (true)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(RING_REFRESH_MS));
+            Ring ring;
+            bool answered = controller->GetRing(ring);
+            std::shared_ptr<SharedState> shared = weak.lock();
+            if (!shared)
+                return;
+            if (answered)
+                setRing(*shared, ring);
+        }
+    }).detach();
+    return answered;
+}
+
+bool KVSClient::Migrate(size_t &moved)
+{
+    moved = 0;
+    std::shared_ptr<const Topology> topology = this->topology();
+
+    GetArgs args;
+    std::vector<std::unique_ptr<GetAllReply>> replies;
+    callClustersSync<GetArgs, GetAllReply>(topology->clusters, &KVS::Stub::PrepareAsyncGetAllRows, args, RPC_TIMEOUT_MS, nullptr, replies);
+
+    bool done = true;
+    for (size_t from = 0; from < topology->clusters.size(); from++)
+    {
+        if (!replies[from])
+            return false;
+
+        for (const std::string &row : replies[from]->item())
+        {
+            // Each cluster keeps its own meta row
+            size_t owner = topology->ring.Locate(row);
+            if (owner == from || row == KVS_META_ROW)
+                continue;
+
+            if (moveRow(topology->clusters[from], topology->clusters[owner], row))
+                moved++;
+            else
+                done = false;
+        }
+    }
+    return done;
+}
+
+bool KVSClient::ConvertLegacyValues(size_t &converted)
+{
+    converted = 0;
+    std::shared_ptr<const Topology> topology = this->topology();
+
+    bool done = true;
+    for (const std::shared_ptr<ClusterState> &cluster : topology->clusters)
+    {
+        std::string flag;
+        if (DoGetAsync({cluster}, KVS_META_ROW, KVS_CONVERTED_COL, flag, LOCK_BYPASS_ID, ReadOptions()).get())
+            continue;
+
+        // Values older than the mark were written by older clients
+        uint64_t rawVersion;
+        if (!markRaw(cluster, &rawVersion))
+        {
+            done = false;
+            continue;
+        }
+
+        GetArgs args;
+        std::vector<std::unique_ptr<GetAllReply>> replies;
+        callClustersSync<GetArgs, GetAllReply>({cluster}, &KVS::Stub::PrepareAsyncGetAllRows, args, RPC_TIMEOUT_MS, nullptr, replies);
+        if (!replies[0])
+        {
+            done = false;
+            continue;
+        }
+
+        // Mark the cluster only once all of its values are decoded, so that a failed pass can be run again
+        bool decoded = true;
+        for (const std::string &row : replies[0]->item())
+        {
+            if (row != KVS_META_ROW)
+                decoded = convertRow(cluster, row, rawVersion, converted) && decoded;
+        }
+        if (!decoded || !DoPutAsync({cluster}, KVS_META_ROW, KVS_CONVERTED_COL, "1", "", LOCK_BYPASS_ID, 0).get())
+            done = false;
+    }
+    return done;
+}
 
+std::future<bool> KVSClient::DoGetAsync(const Clusters &clusters, const std::string &row, const std::string &col, std::string &value, const std::string &key, const ReadOptions &options, uint64_t *version)
+{
     GetArgs args;
     args.set_row(row);
     args.set_col(col);
     args.set_requestid(generateID());
     args.set_lockid(key);
+    setReadOptions(args, options);
 
-    while (true)
-    {
-        for (std::shared_ptr<KVS::Stub> &server : clusters_[rowIndex])
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    std::string *result = &value;
+    callClusters<GetArgs, GetReply>(clusters, &KVS::Stub::PrepareAsyncGetValue, args, RPC_TIMEOUT_MS, &options, [promise, result, version](std::vector<GetReply *> &replies) {
+        for (GetReply *reply : replies)
         {
-            GetReply reply;
-            grpc::ClientContext context;
-            grpc::Status status = server->GetValue(&context, args, &reply);
-            if (status.ok())
+            if (reply && reply->success())
             {
-                if (reply.success())
-                {
-                    value = base64::from_base64(reply.value());
-                    return true;
-                }
-                else
-                {
-                    return false;
-                }
+                *result = reply->value();
+                if (version)
+                    *version = reply->version();
+                promise->set_value(true);
+                return;
             }
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    }
+        promise->set_value(false);
+    });
+    return future;
 }
 
-bool KVSClient::DoPut(const std::string &row, const std::string &col, const std::string &newValue, const std::string &oldValue, const std::string &key, const int32_t option)
+std::future<bool> KVSClient::DoTxnAsync(const std::shared_ptr<ClusterState> &cluster, TxnArgs args, std::vector<std::string> *values, const std::vector<size_t> *positions)
 {
-    size_t rowIndex = getClusterIndex(row);
+    if (!markRaw(cluster))
+        return failedFuture();
+
+    args.set_requestid(generateID());
+    uint64_t seq = setSession(args);
+
+    int timeoutMs = RPC_TIMEOUT_MS + RPC_TIMEOUT_MS_PER_MB * (int)(args.ByteSizeLong() >> 20);
+
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    std::shared_ptr<SharedState> shared = shared_;
+    callClusters<TxnArgs, TxnReply>({cluster}, &KVS::Stub::PrepareAsyncTxn, args, timeoutMs, nullptr, [promise, shared, seq, values, positions](std::vector<TxnReply *> &replies) {
+        clearSession(*shared, seq);
+        TxnReply *reply = replies[0];
+        bool success = reply && reply->success();
+        if (success && values && (size_t)reply->values_size() == positions->size())
+        {
+            for (size_t i = 0; i < positions->size(); i++)
+                (*values)[(*positions)[i]] = reply->values(i);
+        }
+        promise->set_value(success);
+    });
+    return future;
+}
+
+std::future<bool> KVSClient::DoPutAsync(const Clusters &clusters, const std::string &row, const std::string &col, const std::string &newValue, const std::string &oldValue, const std::string &key, const int32_t option, uint64_t version)
+{
+    // The mark itself lives in the meta row
+    for (size_t i = 0; i < clusters.size() && row != KVS_META_ROW; i++)
+    {
+        if (!markRaw(clusters[i]))
+            return failedFuture();
+    }
 
     PutArgs args;
     args.set_row(row);
     args.set_col(col);
-    args.set_newvalue(base64::to_base64(newValue));
-    args.set_currvalue(base64::to_base64(oldValue));
+    args.set_newvalue(newValue);
+    args.set_currvalue(oldValue);
     args.set_option(option);
+    args.set_version(version);
     args.set_requestid(generateID());
     args.set_lockid(key);
+    uint64_t seq = setSession(args);
 
-    while (true)
-    {
-        for (std::shared_ptr<KVS::Stub> &server : clusters_[rowIndex])
-        {
-            PutReply reply;
-            grpc::ClientContext context;
-            grpc::Status status = server->PutValue(&context, args, &reply);
-            if (status.ok())
-                return reply.success();
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    }
+    // Large values take longer to send and to agree on
+    int timeoutMs = RPC_TIMEOUT_MS + RPC_TIMEOUT_MS_PER_MB * (int)((newValue.size() + oldValue.size()) >> 20);
+
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    std::shared_ptr<SharedState> shared = shared_;
+    callClusters<PutArgs, PutReply>(clusters, &KVS::Stub::PrepareAsyncPutValue, args, timeoutMs, nullptr, [promise, shared, seq](std::vector<PutReply *> &replies) {
+        clearSession(*shared, seq);
+        bool success = false;
+        for (PutReply *reply : replies)
+            success = success || (reply && reply->success());
+        promise->set_value(success);
+    });
+    return future;
 }
 
-bool KVSClient::DoSetNX(const std::string row, std::string &key)
+bool KVSClient::DoSetNX(const std::shared_ptr<ClusterState> &cluster, const std::string &row, const std::string &key)
 {
-    key = std::to_string(nrand());
-    size_t rowIndex = getClusterIndex(row);
-
     LockArgs args;
     args.set_row(row);
     args.set_lockid(key);
     args.set_requestid(generateID());
+    uint64_t seq = setSession(args);
+
+    std::vector<std::unique_ptr<LockReply>> replies;
+    callClustersSync<LockArgs, LockReply>({cluster}, &KVS::Stub::PrepareAsyncSetNX, args, RPC_TIMEOUT_MS, nullptr, replies);
+    clearSession(*shared_, seq);
+    return replies[0] && replies[0]->success();
+}
 
-    while (true)
+bool KVSClient::DoDel(const Clusters &clusters, const std::string &row)
+{
+    LockArgs args;
+    args.set_row(row);
+    args.set_requestid(generateID());
+    uint64_t seq = setSession(args);
+
+    std::vector<std::unique_ptr<LockReply>> replies;
+    callClustersSync<LockArgs, LockReply>(clusters, &KVS::Stub::PrepareAsyncDel, args, RPC_TIMEOUT_MS, nullptr, replies);
+    clearSession(*shared_, seq);
+    return std::all_of(replies.begin(), replies.end(), [](const std::unique_ptr<LockReply> &reply) { return reply != nullptr; });
+}
+
+bool KVSClient::DoGetAllRows(const Clusters &clusters, std::vector<std::string> &rows, const ReadOptions &options)
+{
+    GetArgs args;
+    setReadOptions(args, options);
+
+    // Ask every cluster at once, and list the rows in the order of the clusters
+    std::vector<std::unique_ptr<GetAllReply>> replies;
+    callClustersSync<GetArgs, GetAllReply>(clusters, &KVS::Stub::PrepareAsyncGetAllRows, args, RPC_TIMEOUT_MS, &options, replies);
+
+    // While rows migrate, a row may be on two clusters
+    std::set<std::string> listed;
+    bool migrating = topology()->migrating;
+    bool answered = true;
+    for (std::unique_ptr<GetAllReply> &reply : replies)
     {
-        for (std::shared_ptr<KVS::Stub> &server : clusters_[rowIndex])
+        if (!reply)
         {
-            LockReply reply;
-            grpc::ClientContext context;
-            grpc::Status status = server->SetNX(&context, args, &reply);
-            if (!status.ok())
-                continue;
-
-            if (reply.success())
-            {
-                locks_.insert({row, key});
-                return true;
-            }
-            else
-            {
-                return false;
-            }
+            answered = false;
+            continue;
+        }
+        for (const std::string &row : reply->item())
+        {
+            if (row != KVS_META_ROW && (!migrating || listed.insert(row).second))
+                rows.push_back(row);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
+    return answered;
 }
 
-bool KVSClient::DoDel(const std::string row)
+bool KVSClient::DoGetColsInRow(const Clusters &clusters, const std::string &row, std::vector<std::string> &cols, const std::string &key, const ReadOptions &options)
 {
-    size_t rowIndex = getClusterIndex(row);
-
-    LockArgs args;
+    GetArgs args;
     args.set_row(row);
-    args.set_requestid(generateID());
+    args.set_lockid(key);
+    setReadOptions(args, options);
 
-    while (true)
+    std::vector<std::unique_ptr<GetAllReply>> replies;
+    callClustersSync<GetArgs, GetAllReply>(clusters, &KVS::Stub::PrepareAsyncGetColsInRow, args, RPC_TIMEOUT_MS, &options, replies);
+
+    std::set<std::string> listed;
+    for (std::unique_ptr<GetAllReply> &reply : replies)
     {
-        for (std::shared_ptr<KVS::Stub> &server : clusters_[rowIndex])
+        if (!reply)
+            return false;
+        for (const std::string &col : reply->item())
         {
-            LockReply reply;
-            grpc::ClientContext context;
-            grpc::Status status = server->Del(&context, args, &reply);
-            if (status.ok())
-            {
-                locks_.erase(row);
-                return true;
-            }
+            if (listed.insert(col).second)
+                cols.push_back(col);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
+
+    return true;
 }
 
-bool KVSClient::DoGetAllRows(std::vector<std::string> &rows)
+bool KVSClient::moveToOwner(const std::string &row, const std::string &key)
 {
-    for (std::vector<std::shared_ptr<KVS::Stub>> &cluster : clusters_)
+    std::shared_ptr<const Topology> topology = this->topology();
+    if (!topology->migrating)
+        return true;
+
+    // A lock the caller holds on the owner covers the move
+    std::string heldKey = key != "-" && key != LOCK_BYPASS_ID ? key : "";
+    size_t owner = topology->ring.Locate(row);
+    for (int tries = 0; tries < MOVE_ROW_TRIES; tries++)
     {
-        while (true)
+        if (tries > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_INTERVAL_MS));
+
+        bool moved = true;
+        for (size_t i = 0; i < topology->clusters.size() && moved; i++)
         {
-            for (std::shared_ptr<KVS::Stub> &server : cluster)
-            {
-                GetArgs args;
-                GetAllReply reply;
-                grpc::ClientContext context;
-                grpc::Status status = server->GetAllRows(&context, args, &reply);
-                if (status.ok())
-                {
-                    for (std::string row : reply.item())
-                        rows.push_back(row);
-
-                    goto CLUSTER_COMPLETE;
-                }
-            }
-CLUSTER_COMPLETE:
-            break;
+            if (i == owner)
+                continue;
+            std::vector<std::string> cols;
+            if (!DoGetColsInRow({topology->clusters[i]}, row, cols, LOCK_BYPASS_ID, ReadOptions()))
+                moved = false;
+            else if (!cols.empty())
+                moved = moveRow(topology->clusters[i], topology->clusters[owner], row, heldKey);
         }
+        if (moved)
+            return true;
     }
-    return true;
+    return false;
 }
 
-bool KVSClient::DoGetColsInRow(const std::string &row, std::vector<std::string> &cols, const std::string &key)
+bool KVSClient::moveRow(const std::shared_ptr<ClusterState> &from, const std::shared_ptr<ClusterState> &to, const std::string &row, const std::string &heldKey)
 {
-    size_t rowIndex = getClusterIndex(row);
+    std::string key = heldKey.empty() ? std::to_string(nrand()) : heldKey;
+    if (!DoSetNX(from, row, key))
+        return false;
+    if (heldKey.empty() && !DoSetNX(to, row, key))
+    {
+        DoDel({from}, row);
+        return false;
+    }
 
-    GetArgs args;
-    args.set_row(row);
-    args.set_lockid(key);
+    std::vector<std::string> cols, written;
+    bool listed = DoGetColsInRow({from}, row, cols, key, ReadOptions()) && DoGetColsInRow({to}, row, written, key, ReadOptions());
+    std::set<std::string> kept(written.begin(), written.end());
 
-    while (true)
+    // Copy the columns, then delete them from the old cluster
+    std::vector<std::string> values(cols.size());
+    std::vector<std::future<bool>> gets, puts, deletes;
+    for (size_t i = 0; listed && i < cols.size(); i++)
+        gets.push_back(kept.count(cols[i]) ? std::future<bool>() : DoGetAsync({from}, row, cols[i], values[i], key, ReadOptions()));
+    // A column which cannot be read is not copied, so the row must not be deleted
+    bool copied = listed;
+    for (size_t i = 0; i < gets.size(); i++)
     {
-        for (std::shared_ptr<KVS::Stub> &server : clusters_[rowIndex])
+        if (!gets[i].valid())
+            continue;
+        if (gets[i].get())
+            puts.push_back(DoPutAsync({to}, row, cols[i], values[i], "", key, 0));
+        else
+            copied = false;
+    }
+    for (std::future<bool> &put : puts)
+        copied = put.get() && copied;
+
+    for (size_t i = 0; copied && i < cols.size(); i++)
+        deletes.push_back(DoPutAsync({from}, row, cols[i], "", "", key, 2));
+    for (std::future<bool> &del : deletes)
+        del.get();
+
+    DoDel(heldKey.empty() ? Clusters{from, to} : Clusters{from}, row);
+    return copied;
+}
+
+bool KVSClient::convertRow(const std::shared_ptr<ClusterState> &cluster, const std::string &row, uint64_t rawVersion, size_t &converted)
+{
+    std::vector<std::string> cols;
+    if (!DoGetColsInRow({cluster}, row, cols, LOCK_BYPASS_ID, ReadOptions()))
+        return false;
+
+    std::vector<std::string> values(cols.size());
+    std::vector<uint64_t> versions(cols.size());
+    std::vector<std::future<bool>> gets, puts;
+    for (size_t i = 0; i < cols.size(); i++)
+        gets.push_back(DoGetAsync({cluster}, row, cols[i], values[i], LOCK_BYPASS_ID, ReadOptions(), &versions[i]));
+
+    // Values written since the mark are raw, and a PutIfVersion leaves a value written since it was read untouched
+    bool read = true;
+    for (size_t i = 0; i < cols.size(); i++)
+    {
+        if (!gets[i].get())
         {
-            GetAllReply reply;
-            grpc::ClientContext context;
-            grpc::Status status = server->GetColsInRow(&context, args, &reply);
-            if (status.ok())
-            {
-                for (std::string col : reply.item())
-                    cols.push_back(col);
+            read = false;
+            continue;
+        }
+        if (versions[i] >= rawVersion)
+            continue;
 
-                return true;
-            }
+        std::string decoded;
+        try
+        {
+            decoded = base64::from_base64(values[i]);
+        }
+        catch (const std::runtime_error &e)
+        {
+            continue;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (decoded != values[i])
+            puts.push_back(DoPutAsync({cluster}, row, cols[i], decoded, "", LOCK_BYPASS_ID, 3, versions[i]));
+    }
+
+    bool written = read;
+    for (std::future<bool> &put : puts)
+    {
+        if (put.get())
+            converted++;
+        else
+            written = false;
     }
+    return written;
+}
+
+bool KVSClient::markRaw(const std::shared_ptr<ClusterState> &cluster, uint64_t *rawVersion)
+{
+    if (cluster->markedRaw && rawVersion == nullptr)
+        return true;
+
+    // Only the first client creates the mark, the others find it. The write goes first, as an
+    // idle cluster may have no leader to serve the read yet.
+    std::string encoding;
+    uint64_t version;
+    DoPutAsync({cluster}, KVS_META_ROW, KVS_ENCODING_COL, KVS_ENCODING_RAW, "", LOCK_BYPASS_ID, 3, 0).get();
+    if (!DoGetAsync({cluster}, KVS_META_ROW, KVS_ENCODING_COL, encoding, LOCK_BYPASS_ID, ReadOptions(), &version).get())
+        return false;
+
+    cluster->markedRaw = true;
+    if (rawVersion != nullptr)
+        *rawVersion = version;
+    return true;
+}
+
+void KVSClient::setReadOptions(GetArgs &args, const ReadOptions &options)
+{
+    args.set_consistency(options.consistency);
+    args.set_maxstalenessops(options.maxStalenessOps);
+    args.set_maxstalenessms(options.maxStalenessMs);
+}
+
+std::vector<size_t> KVSClient::writeOrder(const ClusterState &cluster)
+{
+    std::vector<size_t> order(cluster.servers.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+
+    int leader = cluster.leader.load();
+    if (leader > 0)
+        std::rotate(order.begin(), order.begin() + leader, order.end());
+    return order;
+}
+
+std::vector<size_t> KVSClient::readOrder(const ClusterState &cluster, const ReadOptions &options)
+{
+    std::vector<size_t> order = writeOrder(cluster);
+    if (options.consistency == LINEARIZABLE || order.size() < 2)
+        return order;
+
+    // Power of two choices: servers never heard from count as the fastest
+    auto latency = [&cluster](size_t server) {
+        return std::max(0.0, cluster.servers[server]->latencyMs.load());
+    };
+    size_t first = nrand(0, order.size() - 1);
+    size_t second = (first + nrand(1, order.size() - 1)) % order.size();
+    size_t chosen = latency(order[second]) < latency(order[first]) ? second : first;
+
+    std::swap(order[0], order[chosen]);
+    return order;
+}
+
+int KVSClient::hedgeDelayMs(const ReadOptions &options)
+{
+    if (!options.hedged)
+        return 0;
+
+    uint64_t count = std::min<uint64_t>(shared_->readSamples.load(), HEDGE_SAMPLES);
+    if (count < HEDGE_MIN_SAMPLES)
+        return 0;
+
+    std::vector<double> samples(count);
+    for (size_t i = 0; i < count; i++)
+        samples[i] = shared_->recentReadsMs[i].load(std::memory_order_relaxed);
+
+    auto percentile = samples.begin() + (samples.size() - 1) * HEDGE_PERCENTILE / 100;
+    std::nth_element(samples.begin(), percentile, samples.end());
+    return std::max(1, (int)std::ceil(*percentile));
+}
+
+void KVSClient::recordLatency(SharedState &shared, ServerState &server, std::chrono::steady_clock::time_point start, bool ok)
+{
+    double sample = ok ? std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() : FAILED_RPC_LATENCY_MS;
+
+    std::atomic<double> &average = server.latencyMs;
+    double current = average.load();
+    while (!average.compare_exchange_weak(current, current < 0 ? sample : current + LATENCY_EWMA_WEIGHT * (sample - current)))
+        ;
+
+    if (!ok)
+        return;
+    // Samples may be written out of order by concurrent reads, which only blurs which are the most recent
+    uint64_t slot = shared.readSamples.fetch_add(1);
+    shared.recentReadsMs[slot % HEDGE_SAMPLES].store(sample, std::memory_order_relaxed);
+}
+
+void KVSClient::clearSession(SharedState &shared, uint64_t seq)
+{
+    std::lock_guard<std::mutex> lock(shared.mu);
+    shared.pendingWrites.erase(seq);
+}
+
+std::future<bool> KVSClient::failedFuture()
+{
+    std::promise<bool> promise;
+    promise.set_value(false);
+    return promise.get_future();
 }
 
 void KVSClient::validateArgs(const std::string &row, const std::string &col)
@@ -336,41 +1202,72 @@ std::string KVSClient::generateID()
     std::stringstream ss;
     ss << clientID_ << '-'
        << std::chrono::system_clock::now().time_since_epoch().count() << '-'
-       << transactionID_ << '-'
+       << shared_->transactionID.load() << '-'
        << nrand();
     return ss.str();
 }
 
 uint64_t KVSClient::nrand(uint64_t min, uint64_t max)
 {
-    static std::mt19937_64 rng(std::random_device{}());
+    thread_local std::mt19937_64 rng(std::random_device{}());
     std::uniform_int_distribution<uint64_t> dist(min, max);
     return dist(rng);
 }
 
-size_t KVSClient::getClusterIndex(const std::string &row)
+Transaction &Transaction::Get(const std::string &row, const std::string &col, const std::string &key)
 {
-    if (clusters_.size() == 1)
-        return 0;
+    return add(GET, row, col, "", "", 0, key);
+}
+
+Transaction &Transaction::Check(const std::string &row, const std::string &col, uint64_t version, const std::string &key)
+{
+    return add(CHECKVERSION, row, col, "", "", version, key);
+}
+
+Transaction &Transaction::Put(const std::string &row, const std::string &col, const std::string &value, const std::string &key)
+{
+    return add(PUT, row, col, "", value, 0, key);
+}
+
+Transaction &Transaction::CPut(const std::string &row, const std::string &col, const std::string &oldValue, const std::string &newValue, const std::string &key)
+{
+    return add(CPUT, row, col, oldValue, newValue, 0, key);
+}
+
+Transaction &Transaction::PutIfVersion(const std::string &row, const std::string &col, uint64_t version, const std::string &value, const std::string &key)
+{
+    return add(PUTIFVERSION, row, col, "", value, version, key);
+}
 
-    std::string hash = md5(row);
-    unsigned long long part1 = std::stoull(hash.substr(0, 16), nullptr, 16);
-    unsigned long long part2 = std::stoull(hash.substr(16, 16), nullptr, 16);
-    unsigned long long combined = part1 ^ part2; 
-    size_t index = combined % clusters_.size();
+Transaction &Transaction::Delete(const std::string &row, const std::string &col, const std::string &key)
+{
+    return add(DELETE, row, col, "", "", 0, key);
+}
 
-    return index;
+Transaction &Transaction::AppendLine(const std::string &row, const std::string &col, const std::string &line, const std::string &uniquePrefix, const std::string &key)
+{
+    return add(APPEND_LINE, row, col, uniquePrefix, line, 0, key);
 }
 
-std::string KVSClient::md5(const std::string &input)
+Transaction &Transaction::RemoveLine(const std::string &row, const std::string &col, const std::string &prefix, const std::string &key)
 {
-    unsigned char result[MD5_DIGEST_LENGTH];
-    MD5((unsigned char*)input.c_str(), input.size(), result);
+    return add(REMOVE_LINE_BY_PREFIX, row, col, prefix, "", 0, key);
+}
 
-    std::ostringstream sout;
-    sout << std::hex << std::setfill('0');
-    for (long long c: result)
-        sout << std::setw(2) << (int)c;
+Transaction &Transaction::ReplaceLine(const std::string &row, const std::string &col, const std::string &prefix, const std::string &line, const std::string &key)
+{
+    return add(REPLACE_LINE, row, col, prefix, line, 0, key);
+}
 
-    return sout.str();
-}
\ No newline at end of file
+Transaction &Transaction::add(OpType type, const std::string &row, const std::string &col, const std::string &currValue, const std::string &newValue, uint64_t version, const std::string &key)
+{
+    Op &op = ops.emplace_back();
+    op.set_type(type);
+    op.set_row(row);
+    op.set_col(col);
+    op.set_currvalue(currValue);
+    op.set_newvalue(newValue);
+    op.set_version(version);
+    op.set_lockid(key);
+    return *this;
+}
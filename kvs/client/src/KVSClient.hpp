@@ -3,18 +3,87 @@
 
 #include <random>
 #include <limits>
+#include <algorithm>
+#include <cmath>
 #include <thread>
 #include <chrono>
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <array>
+#include <future>
+#include <functional>
 
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/create_channel.h>
 #include <grpcpp/client_context.h>
-#include <openssl/md5.h>
+#include <grpcpp/alarm.h>
 
 #include "base64.hpp"
+#include "HashRing.hpp"
 
 #include "proto/server.pb.h"
 #include "proto/server.grpc.pb.h"
+#include "proto/controller.pb.h"
+
+#define LATENCY_EWMA_WEIGHT 0.2    // weight of the latest sample in the average latency of a server
+#define FAILED_RPC_LATENCY_MS 1000 // latency sample recorded when a server does not answer
+#define RETRY_INTERVAL_MS 100      // delay before trying the servers of a cluster again, once none has answered
+#define RPC_TIMEOUT_MS 2000        // deadline of a call to a server, doubled after each round in which none answered
+#define RPC_TIMEOUT_MAX_MS 16000   // longest deadline the doubling reaches
+#define RPC_TIMEOUT_MS_PER_MB 200  // extra deadline of a write per megabyte of its values
+#define HEDGE_PERCENTILE 95        // a read is also sent to a second server once the first is slower than this percentile of recent reads
+#define HEDGE_MIN_SAMPLES 16       // reads are not hedged until this many latencies are known
+#define HEDGE_SAMPLES 128          // number of recent read latencies the percentile is taken over
+#define LOCK_BYPASS_ID "LOCK_BYPASS" // lock id passing the locks of the servers, for maintenance
+#define KVS_META_ROW " kvs"          // row kept by the clients on each cluster, out of reach of callers as it has a space
+#define KVS_ENCODING_COL "encoding"  // column of the meta row set before the first raw value is written, older values are base64
+#define KVS_ENCODING_RAW "raw"       // value of the encoding column
+#define KVS_CONVERTED_COL "converted" // column of the meta row set once the values older than the encoding column are decoded
+#define RING_REFRESH_MS 5000         // interval at which a client following the controllers loads the ring they publish
+#define MOVE_ROW_TRIES 10            // tries to move a row to its owner before a conditional write on it fails, while rows migrate
+
+/**
+ * @brief How fresh the result of a read must be.
+ * A linearizable read observes every write completed before it started. A relaxed
+ * read is routed to the replica answering fastest, and served from its local copy
+ * if the replica lags behind the leader by at most maxStalenessOps operations or
+ * maxStalenessMs milliseconds (bounded staleness), or at any lag (any replica).
+ * A hedged read is also sent to a second replica if the first is slower than
+ * HEDGE_PERCENTILE of recent reads, and the first answer wins.
+ */
+struct ReadOptions
+{
+    ReadConsistency consistency = LINEARIZABLE;
+    int maxStalenessOps = 0;
+    int maxStalenessMs = 0;
+    bool hedged = true;
+};
+
+/**
+ * @brief The operations of a transaction, see KVSClient::Commit().
+ * Each operation succeeds or fails as it would on its own, and a transaction applies
+ * the writes of all its operations or of none. A Get succeeds if the cell exists, and
+ * a Check if the cell has the version, 0 if it must be missing.
+ */
+struct Transaction
+{
+    std::vector<Op> ops;
+
+    Transaction &Get(const std::string &row, const std::string &col, const std::string &key = "-");
+    Transaction &Check(const std::string &row, const std::string &col, uint64_t version, const std::string &key = "-");
+    Transaction &Put(const std::string &row, const std::string &col, const std::string &value, const std::string &key = "-");
+    Transaction &CPut(const std::string &row, const std::string &col, const std::string &oldValue, const std::string &newValue, const std::string &key = "-");
+    Transaction &PutIfVersion(const std::string &row, const std::string &col, uint64_t version, const std::string &value, const std::string &key = "-");
+    Transaction &Delete(const std::string &row, const std::string &col, const std::string &key = "-");
+    Transaction &AppendLine(const std::string &row, const std::string &col, const std::string &line, const std::string &uniquePrefix = "", const std::string &key = "-");
+    Transaction &RemoveLine(const std::string &row, const std::string &col, const std::string &prefix, const std::string &key = "-");
+    Transaction &ReplaceLine(const std::string &row, const std::string &col, const std::string &prefix, const std::string &line, const std::string &key = "-");
+
+private:
+    Transaction &add(OpType type, const std::string &row, const std::string &col, const std::string &currValue, const std::string &newValue, uint64_t version, const std::string &key);
+};
 
 /**
  * @brief A client for the key-value store.
@@ -27,6 +96,51 @@
  *    Get the value of a key-value pair from the key-value store.
  * 4. client.Delete("row1", "col1"):
  *    Delete a key-value pair from the key-value store.
+ * 5. client.PutAsync(...), client.CPutAsync(...), client.GetAsync(...), client.DeleteAsync(...):
+ *    Start the same operations without blocking, and get their results from futures.
+ *    They are sent on a completion queue shared by the client and its copies, so that
+ *    independent operations can run in parallel from one thread.
+ * 6. client.FollowRing(controllers), client.SetRing(ring), client.Migrate(moved):
+ *    Route rows by the ring of clusters published by the controllers, and move the rows
+ *    to the clusters owning them on the ring.
+ * 7. client.Get("row1", "col1", value, version), client.PutIfVersion("row1", "col1", version, "value2"):
+ *    Read a value with its version, and put a new value only if the version is unchanged.
+ *    Unlike CPut(), the old value is not sent back, so index cells cost the same to update
+ *    whatever their size. Versions grow with every write to a cluster, and a missing cell
+ *    has version 0. A row moved to another cluster gets new versions there.
+ * 8. client.AppendLine("row1", "index", "name1 size"), client.RemoveLine("row1", "index", "name1"), ...:
+ *    Edit a cell holding one line per entry, such as a file index, on the servers. Lines
+ *    are found by their first field, so concurrent edits of different entries never
+ *    conflict, and the cell is never sent back and forth.
+ * 9. client.ConvertLegacyValues(converted):
+ *    Decode the values written base64-encoded by older clients, once per cluster.
+ * 10. client.Commit(Transaction().Check("row1", "col1", version).Delete("row1", "col1").Put("row2", "col1", value), values):
+ *    Apply several operations on any rows all or none. A transaction on the rows of one
+ *    cluster is decided in one round. One spanning clusters is prepared on each of them,
+ *    locking its rows, and then committed, or aborted if any cluster fails to prepare.
+ *
+ * Values are sent and stored as raw bytes. Older clients stored them base64-encoded. Before
+ * its first write to a cluster, a client of this version makes sure the cluster is marked as
+ * holding raw bytes from then on, so values older than the mark are known to be base64 and
+ * ConvertLegacyValues() decodes only those. Stop the older clients before starting new ones.
+ *
+ * Rows are spread over the clusters by a consistent-hash ring (see HashRing.hpp). Until the
+ * controllers publish one, a client places rows by their hash modulo the number of clusters,
+ * as older clients did, so the first ring published must have Migrating set. To add a cluster
+ * without downtime, start its servers, publish a ring with the cluster appended and Migrating
+ * set, wait until every client has loaded it, by FollowRing() or SetRing(), run Migrate() until
+ * it returns true, then publish the same clusters with Migrating cleared. The console does all of
+ * it in its migrate action. While rows migrate, reads of a row missing
+ * from its owner fall back to the other clusters, and deletes and unlocks go to every cluster,
+ * so clients see each row whether it has moved yet or not. Writes which depend on the current
+ * value, CPut(), PutIfVersion(), the line edits and Commit(), first move their rows to their
+ * owners, blocking meanwhile. Reads and writes of a row while it is moved fail, as it is locked.
+ *
+ * A client may be used by any number of threads at once. Copies of a client share its
+ * session, its locks and its connections, so that their writes are numbered in order.
+ * Requests go to the leader of a cluster first, as last reported by its servers, and
+ * each call has a deadline, so that a dead or hung server only delays the requests
+ * sent to it until the next server is tried.
  */
 
 class KVSClient
@@ -77,9 +191,73 @@ public:
      * @param row the row of the key-value pair
      * @param col the column of the key-value pair
      * @param value the value to store the result
+     * @param options how fresh the value must be
      * @return bool whether the operation is successful
      */
-    bool Get(const std::string &row, const std::string &col, std::string &value, const std::string &key = "-");
+    bool Get(const std::string &row, const std::string &col, std::string &value, const std::string &key = "-", const ReadOptions &options = ReadOptions());
+
+    /**
+     * @brief Get the value of a key-value pair and its version, for a later PutIfVersion().
+     * @note See validation rules in validateArgs().
+     *
+     * @param row the row of the key-value pair
+     * @param col the column of the key-value pair
+     * @param value the value to store the result
+     * @param version the version to store the result, 0 for values written before versions were kept
+     * @param options how fresh the value must be
+     * @return bool whether the operation is successful
+     */
+    bool Get(const std::string &row, const std::string &col, std::string &value, uint64_t &version, const std::string &key = "-", const ReadOptions &options = ReadOptions());
+
+    /**
+     * @brief Put a key-value pair into the key-value store, but only if the current value has the given version.
+     * @note See validation rules in validateArgs().
+     *
+     * @param row the row of the key-value pair
+     * @param col the column of the key-value pair
+     * @param version the version of the value to be replaced, as returned by Get(), or 0 if the pair must not exist
+     * @param value the new value of the key-value pair
+     * @return bool whether the operation is successful
+     */
+    bool PutIfVersion(const std::string &row, const std::string &col, uint64_t version, const std::string &value, const std::string &key = "-");
+
+    /**
+     * @brief Append a line to the value of an existing key-value pair.
+     * @note See validation rules in validateArgs().
+     *
+     * @param row the row of the key-value pair
+     * @param col the column of the key-value pair
+     * @param line the line to append, without a newline
+     * @param uniquePrefix if not empty, the line is not appended if a line already matches this prefix,
+     *                     as in RemoveLine()
+     * @return bool whether the line is appended
+     */
+    bool AppendLine(const std::string &row, const std::string &col, const std::string &line, const std::string &uniquePrefix = "", const std::string &key = "-");
+
+    /**
+     * @brief Remove the first line starting with a field from the value of a key-value pair.
+     * @note See validation rules in validateArgs().
+     *
+     * @param row the row of the key-value pair
+     * @param col the column of the key-value pair
+     * @param prefix the first field of the line, which is either the whole line or followed by a space,
+     *               or the whole line followed by a newline, for lines with spaces in them
+     * @return bool whether a line is removed
+     */
+    bool RemoveLine(const std::string &row, const std::string &col, const std::string &prefix, const std::string &key = "-");
+
+    /**
+     * @brief Replace the first line starting with a field in the value of a key-value pair.
+     * @note See validation rules in validateArgs().
+     *
+     * @param row the row of the key-value pair
+     * @param col the column of the key-value pair
+     * @param prefix the first field of the line, which is either the whole line or followed by a space,
+     *               or the whole line followed by a newline, for lines with spaces in them
+     * @param line the new line, without a newline
+     * @return bool whether a line is replaced
+     */
+    bool ReplaceLine(const std::string &row, const std::string &col, const std::string &prefix, const std::string &line, const std::string &key = "-");
 
     /**
      * @brief Delete a key-value pair from the key-value store.
@@ -122,9 +300,10 @@ public:
      * @param ip the IP of the server to get the rows from.
      *           If empty, then the client will get the rows from the storage system via Paxos.
      *           Otherwise, the client will get the rows from the server with the given IP.
+     * @param options how fresh the rows must be, if ip is empty
      * @return bool whether the operation is successful
      */
-    bool GetAllRows(std::vector<std::string> &rows, const std::string &ip = "");
+    bool GetAllRows(std::vector<std::string> &rows, const std::string &ip = "", const ReadOptions &options = ReadOptions());
 
     /**
      * @brief Get all columns in a row.
@@ -136,85 +315,492 @@ public:
      * @param ip the IP of the server to get the rows from.
      *           If empty, then the client will get the rows from all servers.
      *           Otherwise, the client will get the rows from the server with the given IP.
+     * @param options how fresh the columns must be, if ip is empty
      * @return bool whether the operation is successful
      */
-    bool GetColsInRow(const std::string &row, std::vector<std::string> &cols, const std::string &key = "-", const std::string &ip = "");
+    bool GetColsInRow(const std::string &row, std::vector<std::string> &cols, const std::string &key = "-", const std::string &ip = "", const ReadOptions &options = ReadOptions());
 
-private:
+    /**
+     * @brief Get the cache and Bloom filter counters of a server's store.
+     *
+     * @param ip the IP of the server
+     * @param stats the map to store the counters, keyed by counter name
+     * @return bool whether the operation is successful
+     */
+    bool GetStats(const std::string &ip, std::map<std::string, uint64_t> &stats);
 
-    uint64_t transactionID_;  // monotonically increasing transaction ID
-    uint64_t clientID_;       // unique client ID
+    /**
+     * @brief Put a key-value pair into the key-value store without blocking.
+     * @note See validation rules in validateArgs(), which throws before anything is sent.
+     *
+     * @param row the row of the key-value pair
+     * @param col the column of the key-value pair
+     * @param value the value of the key-value pair
+     * @return std::future<bool> whether the operation is successful
+     */
+    std::future<bool> PutAsync(const std::string &row, const std::string &col, const std::string &value, const std::string &key = "-");
 
-    std::unordered_map<std::string, std::shared_ptr<KVS::Stub>> ipToStub_;  // map from IP to stub
-    std::vector<std::vector<std::shared_ptr<KVS::Stub>>> clusters_;         // list of clusters, each cluster is a list of servers
+    /**
+     * @brief Put a key-value pair into the key-value store without blocking, but only if the
+     * current value is oldValue.
+     * @note See validation rules in validateArgs(), which throws before anything is sent.
+     *
+     * @param row the row of the key-value pair
+     * @param col the column of the key-value pair
+     * @param oldValue the old value of the key-value pair to be replaced
+     * @param newValue the new value of the key-value pair
+     * @return std::future<bool> whether the operation is successful
+     */
+    std::future<bool> CPutAsync(const std::string &row, const std::string &col, const std::string &oldValue, const std::string &newValue, const std::string &key = "-");
 
-    std::unordered_map<std::string, std::string> locks_;  // locks on rows
+    /**
+     * @brief Get the value of a key-value pair from the key-value store without blocking.
+     * @note See validation rules in validateArgs(), which throws before anything is sent.
+     * @note value is written before the future is ready, so it must outlive the future.
+     *
+     * @param row the row of the key-value pair
+     * @param col the column of the key-value pair
+     * @param value the value to store the result
+     * @param options how fresh the value must be
+     * @return std::future<bool> whether the operation is successful
+     */
+    std::future<bool> GetAsync(const std::string &row, const std::string &col, std::string &value, const std::string &key = "-", const ReadOptions &options = ReadOptions());
 
     /**
-     * @brief Get the value of a key-value pair from the key-value store.
-     * Keep trying until the operation is successful.
+     * @brief Get the value of a key-value pair and its version without blocking.
+     * @note See validation rules in validateArgs(), which throws before anything is sent.
+     * @note value and version are written before the future is ready, so they must outlive the future.
      *
      * @param row the row of the key-value pair
      * @param col the column of the key-value pair
      * @param value the value to store the result
-     * @return bool whether the operation is successful
+     * @param version the version to store the result
+     * @param options how fresh the value must be
+     * @return std::future<bool> whether the operation is successful
      */
-    bool DoGet(const std::string &row, const std::string &col, std::string &value, const std::string &key);
+    std::future<bool> GetAsync(const std::string &row, const std::string &col, std::string &value, uint64_t &version, const std::string &key = "-", const ReadOptions &options = ReadOptions());
 
     /**
-     * @brief Put a key-value pair into the key-value store.
-     * Keep trying until the operation is successful.
+     * @brief Put a key-value pair into the key-value store without blocking, but only if the
+     * current value has the given version.
+     * @note See validation rules in validateArgs(), which throws before anything is sent.
+     *
      * @param row the row of the key-value pair
      * @param col the column of the key-value pair
-     * @param value the value of the key-value pair
-     * @return bool whether the operation is successful
+     * @param version the version of the value to be replaced, or 0 if the pair must not exist
+     * @param value the new value of the key-value pair
+     * @return std::future<bool> whether the operation is successful
+     */
+    std::future<bool> PutIfVersionAsync(const std::string &row, const std::string &col, uint64_t version, const std::string &value, const std::string &key = "-");
+
+    /**
+     * @brief Delete a key-value pair from the key-value store without blocking.
+     * @note See validation rules in validateArgs(), which throws before anything is sent.
+     *
+     * @param row the row of the key-value pair
+     * @param col the column of the key-value pair
+     * @return std::future<bool> whether the operation is successful
+     */
+    std::future<bool> DeleteAsync(const std::string &row, const std::string &col, const std::string &key = "-");
+
+    /**
+     * @brief Route rows by a ring of clusters published by the controller.
+     * Connections to the servers already known are kept.
+     *
+     * @param ring the ring
+     * @return bool whether the ring is now in use, false if it is empty or not newer than the one in use
      */
-    bool DoPut(const std::string &row, const std::string &col, const std::string &newValue, const std::string &oldValue, const std::string &key, const int32_t option);
+    bool SetRing(const Ring &ring);
+
+    /**
+     * @brief Route rows by the ring published on the controllers, and load it again every
+     * RING_REFRESH_MS in the background, for as long as the client or a copy of it exists.
+     * The clusters given to the constructor are used until a ring is published.
+     *
+     * @param controllers the addresses of the controllers
+     * @return bool whether a controller answered the first time
+     */
+    bool FollowRing(const std::vector<std::string> &controllers);
+
+    /**
+     * @brief Move every row stored on a cluster other than its owner on the ring to its owner.
+     * A row is moved under a lock on both clusters, and columns written on the owner since the
+     * ring changed are not overwritten. Rows locked by clients are left for a later call.
+     *
+     * @param moved the number of rows moved
+     * @return bool whether every row is now on its owner
+     */
+    bool Migrate(size_t &moved);
+
+    /**
+     * @brief Decode in place the values stored base64-encoded by older clients.
+     * Only values written before the cluster was marked as holding raw bytes are decoded, so a
+     * raw value which is also valid base64 is left as it is. Each cluster is converted once, and
+     * then marked as converted, so that later calls skip it. Values that are not valid base64
+     * are left as they are.
+     * @note Run it before Migrate(), as a value moved to another cluster counts as raw there.
+     *
+     * @param converted the number of values decoded
+     * @return bool whether every cluster is now marked as holding raw bytes
+     */
+    bool ConvertLegacyValues(size_t &converted);
+
+    /**
+     * @brief Apply the operations of a transaction, all or none.
+     * @note See validation rules in validateArgs(), which throws before anything is sent.
+     * @note A transaction spanning clusters fails on rows locked by a client, and if the client
+     * dies between the two phases, its rows stay locked until the locks of the servers expire.
+     * @note Once every cluster is prepared, the transaction is decided and each cluster commits its
+     * part, checking the operations again. They pass while its locks are held, but if the locks
+     * expired before the commit reached it and the rows changed meanwhile, the cluster refuses its
+     * part; such a cluster, or one which cannot be told to commit, leaves the transaction partly applied.
+     *
+     * @param txn the transaction
+     * @param values the values read by the Get operations of the transaction, in order
+     * @param partial if given, set to whether the transaction failed with its writes applied on
+     * some clusters only, rather than on none
+     * @return bool whether the writes of the transaction are applied
+     */
+    bool Commit(const Transaction &txn, std::vector<std::string> &values, bool *partial = nullptr);
+
+private:
+
+    // A server and the connection to it
+    struct ServerState
+    {
+        std::string ip;
+        std::shared_ptr<KVS::Stub> stub;
+        std::atomic<double> latencyMs{-1};  // average latency, negative until the server answers, for routing relaxed reads
+    };
+
+    // A cluster of servers replicating the same rows
+    struct ClusterState
+    {
+        std::vector<std::shared_ptr<ServerState>> servers;
+        std::atomic<int> leader{-1};        // server to send requests to first, or -1 if unknown
+        std::atomic<bool> markedRaw{false}; // whether the encoding column of the cluster is known to be set, see markRaw()
+    };
+
+    // The clusters rows are routed to, replaced as a whole when a new ring is set
+    struct Topology
+    {
+        uint64_t epoch = 0;                                                   // epoch of the ring
+        HashRing ring;                                                        // owner of each row
+        bool migrating = false;                                               // whether rows may be on a cluster other than their owner
+        std::vector<std::shared_ptr<ClusterState>> clusters;                  // clusters in the order of the ring
+        std::unordered_map<std::string, std::shared_ptr<ServerState>> servers; // servers by IP
+    };
+
+    // The state a client shares with its copies and with its calls in flight. Only the session,
+    // the locks and replacing the topology take a mutex, everything read on every request is atomic.
+    struct SharedState
+    {
+        std::mutex mu;                                                  // lock for pendingWrites and locks, and for replacing topology
+        std::atomic<uint64_t> transactionID{1};                         // monotonically increasing transaction ID, numbers the writes of the session
+        std::set<uint64_t> pendingWrites;                               // numbers of the writes not answered yet
+        std::unordered_map<std::string, std::string> locks;             // keys of the locks held on rows, by row
+        std::shared_ptr<const Topology> topology;                       // clusters in use, read and replaced with std::atomic_load and std::atomic_store
+        std::array<std::atomic<double>, HEDGE_SAMPLES> recentReadsMs{}; // latencies of recent reads, for the hedging delay
+        std::atomic<uint64_t> readSamples{0};                           // number of latencies ever added to recentReadsMs
+    };
+
+    using Clusters = std::vector<std::shared_ptr<ClusterState>>;
+
+    // An RPC or a timer on the completion queue, deleted once completed
+    struct AsyncTask
+    {
+        virtual ~AsyncTask() = default;
+
+        // Called by the completion queue thread
+        virtual void Complete(bool ok) = 0;
+    };
+
+    // The completion queue of the async calls of a client and its copies, and the thread
+    // completing them. Calls and timers still pending are cancelled when it is destroyed.
+    struct AsyncQueue
+    {
+        grpc::CompletionQueue cq;
+        std::thread thread;
+        std::mutex mu;                            // lock for stop, active and alarms
+        bool stop = false;                        // whether no more calls may be issued
+        std::set<grpc::ClientContext *> active;   // calls in flight
+        std::set<grpc::Alarm *> alarms;           // timers pending
+
+        AsyncQueue();
+        ~AsyncQueue();
+
+        // Run fn(true) on the queue thread after delayMs, or fn(false) if the queue stops first.
+        // Returns false, without running fn, if the queue is already stopped.
+        bool After(int delayMs, std::function<void(bool)> fn);
+    };
+
+    struct AsyncTimer;
+
+    template <typename Args, typename Reply>
+    struct AsyncRequest;
+
+    template <typename Args, typename Reply>
+    using AsyncMethod = std::unique_ptr<grpc::ClientAsyncResponseReader<Reply>> (KVS::Stub::*)(grpc::ClientContext *, const Args &, grpc::CompletionQueue *);
+
+    uint64_t clientID_;       // unique client ID, identifies the session
+
+    std::shared_ptr<SharedState> shared_;  // session, locks and clusters, shared with copies
+    std::shared_ptr<AsyncQueue> queue_;    // completion queue of async calls, shared with copies
+
+    /**
+     * @brief Get the value of a key-value pair from the key-value store without blocking.
+     * Keep trying until a server of each cluster answers.
+     *
+     * @param clusters the clusters to ask, the value of the first one holding it wins
+     * @param row the row of the key-value pair
+     * @param col the column of the key-value pair
+     * @param value the value to store the result
+     * @param options how fresh the value must be
+     * @param version the version to store the result, if not nullptr
+     * @return std::future<bool> whether the operation is successful
+     */
+    std::future<bool> DoGetAsync(const Clusters &clusters, const std::string &row, const std::string &col, std::string &value, const std::string &key, const ReadOptions &options, uint64_t *version = nullptr);
+
+    /**
+     * @brief Run one phase of a transaction on a cluster without blocking.
+     * Keep trying until a server of the cluster answers.
+     *
+     * @param cluster the cluster owning the rows of the operations
+     * @param args the operations, the id and the phase of the transaction
+     * @param values the values to store the results of the Get operations, or nullptr
+     * @param positions the position in values of the result of each Get operation
+     * @return std::future<bool> whether the phase is successful
+     */
+    std::future<bool> DoTxnAsync(const std::shared_ptr<ClusterState> &cluster, TxnArgs args, std::vector<std::string> *values, const std::vector<size_t> *positions);
+
+    /**
+     * @brief Put a key-value pair into the key-value store without blocking.
+     * Keep trying until a server of each cluster answers.
+     *
+     * @param clusters the clusters to write to
+     * @param option 0 to put, 1 to put if the value is oldValue, 2 to delete, 3 to put if the version is version,
+     *               4 to append newValue as a line unless a line starts with oldValue, 5 to remove the line
+     *               starting with oldValue, 6 to replace the line starting with oldValue by newValue
+     * @param version the version the current value must have, for option 3
+     * @return std::future<bool> whether the operation is successful on any cluster
+     */
+    std::future<bool> DoPutAsync(const Clusters &clusters, const std::string &row, const std::string &col, const std::string &newValue, const std::string &oldValue, const std::string &key, const int32_t option, uint64_t version = 0);
+
+    /**
+     * @brief Send a request to the servers of a cluster in turn, on the completion queue.
+     * A server which does not answer within the deadline is given up for the next one, and
+     * once none has answered, wait RETRY_INTERVAL_MS and start over with twice the deadline.
+     *
+     * @param cluster the cluster
+     * @param order the indexes of the servers of the cluster, in the order to try them
+     * @param method the async method of the stub
+     * @param args the request
+     * @param timeoutMs the deadline of each call
+     * @param hedgeMs the delay before also sending the request to the next server, or 0 not to
+     * @param timed whether to add the latency of the calls to the latencies of the servers
+     * @param done called on the completion queue thread with true and the reply of the server
+     *             which answered first, or with false if the client is destroyed before one does
+     */
+    template <typename Args, typename Reply>
+    void callAsync(const std::shared_ptr<ClusterState> &cluster, const std::vector<size_t> &order, AsyncMethod<Args, Reply> method, const Args &args, int timeoutMs, int hedgeMs, bool timed, std::function<void(bool, Reply &)> done);
+
+    /**
+     * @brief Send a request to several clusters at once, on the completion queue.
+     * Writes go to the leaders first, reads are routed and hedged by their options.
+     *
+     * @param clusters the clusters
+     * @param method the async method of the stub
+     * @param args the request
+     * @param timeoutMs the deadline of each call
+     * @param options how fresh the result must be, or nullptr for a write
+     * @param done called once every cluster answered, with the reply of each cluster in order,
+     *             nullptr for a cluster which did not answer
+     */
+    template <typename Args, typename Reply>
+    void callClusters(const Clusters &clusters, AsyncMethod<Args, Reply> method, const Args &args, int timeoutMs, const ReadOptions *options, std::function<void(std::vector<Reply *> &)> done);
+
+    /**
+     * @brief Send a request to several clusters at once and wait for their replies.
+     *
+     * @param replies the reply of each cluster in order, nullptr for a cluster which did not answer
+     */
+    template <typename Args, typename Reply>
+    void callClustersSync(const Clusters &clusters, AsyncMethod<Args, Reply> method, const Args &args, int timeoutMs, const ReadOptions *options, std::vector<std::unique_ptr<Reply>> &replies);
 
     /**
      * @brief Set a lock on a row if no such lock exists.
      * Keep trying until the operation is successful.
      *
-     * @param key the key of the key-value pair
+     * @param cluster the cluster holding the row
+     * @param key the key of the lock
      * @return bool whether the operation is successful
      */
-    bool DoSetNX(const std::string row, std::string &key);
+    bool DoSetNX(const std::shared_ptr<ClusterState> &cluster, const std::string &row, const std::string &key);
 
     /**
-     * @brief Release a lock on a row if it is aquired by this client.
+     * @brief Release a lock on a row.
      * Keep trying until the operation is successful.
      *
+     * @param clusters the clusters to release the lock on
      * @param row the row which the lock is set
      * @return bool whether the operation is successful
      */
-    bool DoDel(const std::string row);
+    bool DoDel(const Clusters &clusters, const std::string &row);
 
     /**
      * @brief Get all rows in the storage system.
      * Keep trying until the operation is successful.
      * 
+     * @param clusters the clusters to ask
      * @param rows the vector to store the result
+     * @param options how fresh the rows must be
      * @return bool whether the operation is successful
     */
-    bool DoGetAllRows(std::vector<std::string> &rows);
+    bool DoGetAllRows(const Clusters &clusters, std::vector<std::string> &rows, const ReadOptions &options);
 
     /**
      * @brief Get all columns in a row from the storage system.
      * Keep trying until the operation is successful.
      * 
+     * @param clusters the clusters to ask, the columns of all of them are listed once
      * @param row the row of the key-value pair
      * @param cols the vector to store the result
      * @param key the lockId if necessary
-     * @param row the row of the key-value pair
+     * @param options how fresh the columns must be
+    */
+    bool DoGetColsInRow(const Clusters &clusters, const std::string &row, std::vector<std::string> &cols, const std::string &key, const ReadOptions &options);
+
+    /**
+     * @brief Move a row to its owner, under a lock on both clusters.
+     * Columns already on the owner were written since the ring changed, and are kept.
+     *
+     * @param from the cluster holding the row
+     * @param to the owner of the row
+     * @param row the row
+     * @param heldKey the key of a lock the caller holds on the row on the owner, used for the move, or empty
+     * @return bool whether the row is moved, false if a client holds a lock on it
+     */
+    bool moveRow(const std::shared_ptr<ClusterState> &from, const std::shared_ptr<ClusterState> &to, const std::string &row, const std::string &heldKey = "");
+
+    /**
+     * @brief While rows migrate, move a row to its owner if another cluster still holds some of it,
+     * before a write which depends on its current value. Blocks, and tries MOVE_ROW_TRIES times.
+     *
+     * @param row the row
+     * @param key the key of the write, the lock the caller holds on the row if not "-"
+     * @return bool whether the row is only on its owner
+     */
+    bool moveToOwner(const std::string &row, const std::string &key);
+
+    /**
+     * @brief Decode the base64 values of a row on one cluster.
+     *
+     * @param cluster the cluster holding the row
+     * @param row the row
+     * @param rawVersion the version of the encoding column, values from it on are raw
+     * @param converted incremented by the number of values decoded
+     * @return bool whether every value of the row was read, and every decoded value written
+     */
+    bool convertRow(const std::shared_ptr<ClusterState> &cluster, const std::string &row, uint64_t rawVersion, size_t &converted);
+
+    /**
+     * @brief Make sure a cluster is marked as holding raw bytes, before writing to it.
+     * The first client creates the encoding column, which is never written again, so its
+     * version tells the values of older clients from raw ones. Blocks the first time only.
+     *
+     * @param cluster the cluster
+     * @param rawVersion set to the version of the encoding column if not nullptr
+     * @return bool whether the mark is set, false if the cluster cannot be reached
+     */
+    bool markRaw(const std::shared_ptr<ClusterState> &cluster, uint64_t *rawVersion = nullptr);
+
+    /**
+     * @brief Fill the consistency fields of a read request.
+     *
+     * @param args the read request
+     * @param options how fresh the result must be
+    */
+    void setReadOptions(GetArgs &args, const ReadOptions &options);
+
+    /**
+     * @brief Order the servers of a cluster to send a write to.
+     * The leader goes first, as it would be forwarded the write by any other server.
+     *
+     * @param cluster the cluster
+     * @return std::vector<size_t> the indexes of the servers in the order to try them
+    */
+    std::vector<size_t> writeOrder(const ClusterState &cluster);
+
+    /**
+     * @brief Order the servers of a cluster to send a read to.
+     * Linearizable reads go to the leader first, like writes. Relaxed reads start with the
+     * faster of two random servers, by average latency, so that they spread over the replicas
+     * and favor the nearest and least loaded ones.
+     *
+     * @param cluster the cluster
+     * @param options how fresh the result must be
+     * @return std::vector<size_t> the indexes of the servers in the order to try them
+    */
+    std::vector<size_t> readOrder(const ClusterState &cluster, const ReadOptions &options);
+
+    /**
+     * @brief Get the delay before a read is also sent to a second server.
+     *
+     * @param options the options of the read
+     * @return int HEDGE_PERCENTILE of recent read latencies, or 0 not to hedge the read
     */
-    bool DoGetColsInRow(const std::string &row, std::vector<std::string> &cols, const std::string &key);
+    int hedgeDelayMs(const ReadOptions &options);
+
+    /**
+     * @brief Add a latency sample to the average latency of a server, and to the recent
+     * read latencies if the server answered.
+     *
+     * @param shared the state holding the recent latencies
+     * @param server the server
+     * @param start the time the request was sent
+     * @param ok whether the server answered
+    */
+    static void recordLatency(SharedState &shared, ServerState &server, std::chrono::steady_clock::time_point start, bool ok);
+
+    /**
+     * @brief Get the clusters in use.
+     */
+    std::shared_ptr<const Topology> topology();
+
+    /**
+     * @brief Get the cluster owning a row, then while rows migrate the other clusters,
+     * which may still hold it.
+     *
+     * @param row the row of the key-value pair
+     * @param all whether to include the other clusters while rows migrate
+     * @return Clusters the clusters, the owner first
+     */
+    Clusters route(const std::string &row, bool all);
 
     /**
-     * @brief Connect to the servers in the given cluster.
-     * @param clusters the list of server ips in the cluster
-     * @return std::shared_ptr<KVS::Stub> the stub to the server
+     * @brief Replace the clusters in use, keeping the connections to servers already known,
+     * and the leader of clusters whose servers did not change.
+     *
+     * @param shared the state holding the clusters
+     * @param epoch the epoch of the ring, which must be higher than the one in use
+     * @param clusters the list of server ips of each cluster, in the order of the ring
+     * @param virtualNodes the number of points of each cluster on the ring, RING_MODULO before a ring is published
+     * @param migrating whether rows may be on a cluster other than their owner
+     * @return bool whether the clusters are replaced
+     */
+    static bool setTopology(SharedState &shared, uint64_t epoch, const std::vector<std::vector<std::string>> &clusters, int virtualNodes, bool migrating);
+
+    /**
+     * @brief Replace the clusters in use by those of a ring, see SetRing().
+     */
+    static bool setRing(SharedState &shared, const Ring &ring);
+
+    /**
+     * @brief Connect to a server.
+     * @param ip the ip of the server
+     * @return std::shared_ptr<ServerState> the server
      */
-    void initCluster(std::vector<std::string> cluster, std::vector<std::shared_ptr<KVS::Stub>>& servers);
+    static std::shared_ptr<ServerState> connect(const std::string &ip);
 
     /**
      * @brief Check if the row and col are valid.
@@ -228,6 +814,41 @@ private:
      */
     void validateArgs(const std::string &row, const std::string &col = "1");
 
+    /**
+     * @brief Number a write in the session of this client, so that servers apply it at
+     * most once even if it is retried. The write is pending until clearSession().
+     * Servers keep the replies of every write from the oldest pending one on.
+     *
+     * @param args the write request
+     * @return uint64_t the number of the write
+     */
+    template <typename Args>
+    uint64_t setSession(Args &args)
+    {
+        std::lock_guard<std::mutex> lock(shared_->mu);
+        uint64_t seq = shared_->transactionID.fetch_add(1);
+        uint64_t oldest = shared_->pendingWrites.empty() ? seq : *shared_->pendingWrites.begin();
+        shared_->pendingWrites.insert(seq);
+
+        args.set_clientid(clientID_);
+        args.set_clientseq(seq);
+        args.set_clientacked(oldest - 1);
+        return seq;
+    }
+
+    /**
+     * @brief Mark a write numbered by setSession() as answered.
+     *
+     * @param shared the state holding the session
+     * @param seq the number of the write
+     */
+    static void clearSession(SharedState &shared, uint64_t seq);
+
+    /**
+     * @brief Get a future already holding false, for a request failed before being sent.
+     */
+    static std::future<bool> failedFuture();
+
     /**
      * @brief Generate a unique ID for a transaction:
      * ClientID-TimeStamp-ClientMonotonicallyIncreasingTransactionID-
@@ -239,26 +860,12 @@ private:
     /**
      * @brief Generate a big random number in the range [min, max].
      * If no arguments are provided, the range is [0, 2^64-1].
+     * Each thread draws from its own generator.
      * @param min the lower bound of the range
      * @param max the upper bound of the range
      * @return uint64_t
      */
     uint64_t nrand(uint64_t min = std::numeric_limits<uint64_t>::min(), uint64_t max = std::numeric_limits<uint64_t>::max());
-
-    /**
-     * @brief Get the index of the cluster that the row belongs to.
-     * 
-     * @param row the row of the key-value pair
-     * @return size_t the index of the cluster
-    */
-    size_t getClusterIndex(const std::string &row);
-
-    /**
-     * @brief Generate a MD5 hash of a string.
-     * @param str the string to be hashed
-     * @return std::string the MD5 hash
-     */
-    std::string md5(const std::string &str);
 };
 
 #endif
\ No newline at end of file
@@ -14,6 +14,10 @@
 #include <bit>  // For std::bit_cast.
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
 namespace base64 {
 
 namespace detail {
@@ -488,10 +492,258 @@ std::array<char, 256> constexpr encode_table_1 = {
     'w', 'x', 'y', 'z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+',
     '/'};
 
+// Vectorized codecs for x86, after Wojciech Muła and Daniel Lemire, "Faster
+// Base64 Encoding and Decoding Using AVX2 Instructions". They are compiled for
+// their instruction sets with target attributes, so that the header builds
+// without -mavx2, and are picked at run time by the CPU they run on.
+enum class cpu_isa { scalar, sse41, avx2 };
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_X86_SIMD
+
+inline cpu_isa detect_isa() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return cpu_isa::avx2;
+  }
+  if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3")) {
+    return cpu_isa::sse41;
+  }
+  return cpu_isa::scalar;
+}
+
+// Spread 12 bytes into the 16 sextets of their 4 byte groups, one per byte.
+__attribute__((target("ssse3,sse4.1"))) inline __m128i encode_unpack_sse(
+    __m128i in) {
+  in = _mm_shuffle_epi8(
+      in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+// Map sextets to their characters, by adding the offset of their range.
+__attribute__((target("ssse3,sse4.1"))) inline __m128i encode_lookup_sse(
+    __m128i sextets) {
+  const __m128i offsets =
+      _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  __m128i range = _mm_subs_epu8(sextets, _mm_set1_epi8(51));
+  const __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), sextets);
+  range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), sextets);
+}
+
+// Map characters to their sextets, and set valid to whether all of them are
+// base64 characters.
+__attribute__((target("ssse3,sse4.1"))) inline __m128i decode_lookup_sse(
+    __m128i in, bool& valid) {
+  const __m128i offsets =
+      _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  // Bit h of masks[l] is set if character 0xhl is valid.
+  const __m128i masks = _mm_setr_epi8(
+      (char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+      (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf0, 0x54, 0x50,
+      0x50, 0x50, 0x54);
+  const __m128i bits = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40,
+                                     (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i high =
+      _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+  const __m128i low = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+  const __m128i invalid = _mm_cmpeq_epi8(
+      _mm_and_si128(_mm_shuffle_epi8(masks, low),
+                    _mm_shuffle_epi8(bits, high)),
+      _mm_setzero_si128());
+  valid = _mm_movemask_epi8(invalid) == 0;
+  // '+' and '/' share their high nibble, so '/' is offset apart.
+  const __m128i offset =
+      _mm_blendv_epi8(_mm_shuffle_epi8(offsets, high), _mm_set1_epi8(16),
+                      _mm_cmpeq_epi8(in, _mm_set1_epi8('/')));
+  return _mm_add_epi8(in, offset);
+}
+
+// Pack 16 sextets into 12 bytes, left in the low 12 bytes.
+__attribute__((target("ssse3,sse4.1"))) inline __m128i decode_pack_sse(
+    __m128i sextets) {
+  const __m128i pairs =
+      _mm_maddubs_epi16(sextets, _mm_set1_epi32(0x01400140));
+  const __m128i groups = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(groups, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14,
+                                                13, 12, -1, -1, -1, -1));
+}
+
+// Encode whole blocks of 12 bytes while 16 can be loaded, and return the
+// number of bytes encoded.
+__attribute__((target("ssse3,sse4.1"))) inline size_t encode_sse41(
+    const uint8_t* in, size_t size, char* out) {
+  size_t done = 0;
+  for (; done + 16 <= size; done += 12) {
+    const __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + done / 3 * 4),
+                     encode_lookup_sse(encode_unpack_sse(block)));
+  }
+  return done;
+}
+
+// Decode whole blocks of 16 characters while 16 bytes can be stored, and
+// return the number of characters decoded. Stops before the first block with
+// an invalid character, for the scalar decoder to report it.
+__attribute__((target("ssse3,sse4.1"))) inline size_t decode_sse41(
+    const uint8_t* in, size_t size, char* out) {
+  size_t done = 0;
+  for (; done + 24 <= size; done += 16) {
+    bool valid;
+    const __m128i sextets = decode_lookup_sse(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done)), valid);
+    if (!valid) {
+      break;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + done / 4 * 3),
+                     decode_pack_sse(sextets));
+  }
+  return done;
+}
+
+__attribute__((target("avx2"))) inline size_t encode_avx2(const uint8_t* in,
+                                                          size_t size,
+                                                          char* out) {
+  const __m256i shuffle = _mm256_set_epi8(
+      10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1, 10, 11, 9, 10, 7, 8, 6,
+      7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m256i offsets = _mm256_broadcastsi128_si256(
+      _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0));
+  size_t done = 0;
+  // Each lane takes 12 of the 24 bytes of a block.
+  for (; done + 28 <= size; done += 24) {
+    __m256i block = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done + 12)), 1);
+    block = _mm256_shuffle_epi8(block, shuffle);
+    const __m256i t0 = _mm256_and_si256(block, _mm256_set1_epi32(0x0fc0fc00));
+    const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const __m256i t2 = _mm256_and_si256(block, _mm256_set1_epi32(0x003f03f0));
+    const __m256i t3 =
+        _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    const __m256i sextets = _mm256_or_si256(t1, t3);
+
+    __m256i range = _mm256_subs_epu8(sextets, _mm256_set1_epi8(51));
+    const __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), sextets);
+    range =
+        _mm256_or_si256(range, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(out + done / 3 * 4),
+        _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), sextets));
+  }
+  return done;
+}
+
+__attribute__((target("avx2"))) inline size_t decode_avx2(const uint8_t* in,
+                                                          size_t size,
+                                                          char* out) {
+  const __m256i offsets = _mm256_broadcastsi128_si256(
+      _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+  const __m256i masks = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      (char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+      (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf0, 0x54, 0x50,
+      0x50, 0x50, 0x54));
+  const __m256i bits = _mm256_broadcastsi128_si256(
+      _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80, 0, 0,
+                    0, 0, 0, 0, 0, 0));
+  const __m256i pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+  size_t done = 0;
+  // The 24 bytes of a block are stored with 8 spare bytes past them.
+  for (; done + 48 <= size; done += 32) {
+    const __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + done));
+    const __m256i high = _mm256_and_si256(_mm256_srli_epi32(block, 4),
+                                          _mm256_set1_epi8(0x0f));
+    const __m256i low = _mm256_and_si256(block, _mm256_set1_epi8(0x0f));
+    const __m256i invalid = _mm256_cmpeq_epi8(
+        _mm256_and_si256(_mm256_shuffle_epi8(masks, low),
+                         _mm256_shuffle_epi8(bits, high)),
+        _mm256_setzero_si256());
+    if (_mm256_movemask_epi8(invalid) != 0) {
+      break;
+    }
+    const __m256i offset = _mm256_blendv_epi8(
+        _mm256_shuffle_epi8(offsets, high), _mm256_set1_epi8(16),
+        _mm256_cmpeq_epi8(block, _mm256_set1_epi8('/')));
+    const __m256i sextets = _mm256_add_epi8(block, offset);
+
+    const __m256i pairs =
+        _mm256_maddubs_epi16(sextets, _mm256_set1_epi32(0x01400140));
+    const __m256i groups =
+        _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(out + done / 4 * 3),
+        _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(groups, pack), lanes));
+  }
+  // Leave the tail to the 16-character blocks.
+  return done + decode_sse41(in + done, size - done, out + done / 4 * 3);
+}
+
+inline size_t encode_simd(const uint8_t* in, size_t size, char* out,
+                          cpu_isa isa) {
+  switch (isa) {
+    case cpu_isa::avx2: {
+      const size_t done = encode_avx2(in, size, out);
+      return done + encode_sse41(in + done, size - done, out + done / 3 * 4);
+    }
+    case cpu_isa::sse41:
+      return encode_sse41(in, size, out);
+    default:
+      return 0;
+  }
+}
+
+inline size_t decode_simd(const uint8_t* in, size_t size, char* out,
+                          cpu_isa isa) {
+  switch (isa) {
+    case cpu_isa::avx2:
+      return decode_avx2(in, size, out);
+    case cpu_isa::sse41:
+      return decode_sse41(in, size, out);
+    default:
+      return 0;
+  }
+}
+
+#else
+
+inline cpu_isa detect_isa() { return cpu_isa::scalar; }
+
+inline size_t encode_simd(const uint8_t*, size_t, char*, cpu_isa) {
+  return 0;
+}
+
+inline size_t decode_simd(const uint8_t*, size_t, char*, cpu_isa) {
+  return 0;
+}
+
+#endif
+
 }  // namespace detail
 
+using detail::cpu_isa;
+
+// The fastest instruction set of this CPU, detected once.
+inline cpu_isa best_isa() {
+  static const cpu_isa isa = detail::detect_isa();
+  return isa;
+}
+
 template <class OutputBuffer, class InputIterator>
-inline OutputBuffer encode_into(InputIterator begin, InputIterator end) {
+inline OutputBuffer encode_into(InputIterator begin, InputIterator end,
+                                cpu_isa isa = best_isa()) {
   typedef std::decay_t<decltype(*begin)> input_value_type;
   static_assert(std::is_same_v<input_value_type, char> ||
                 std::is_same_v<input_value_type, signed char> ||
@@ -510,7 +762,12 @@ inline OutputBuffer encode_into(InputIterator begin, InputIterator end) {
   const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&*begin);
   char* currEncoding = reinterpret_cast<char*>(&encoded[0]);
 
-  for (size_t i = binarytextsize / 3; i; --i) {
+  const size_t vectorized =
+      detail::encode_simd(bytes, binarytextsize, currEncoding, isa);
+  bytes += vectorized;
+  currEncoding += vectorized / 3 * 4;
+
+  for (size_t i = (binarytextsize - vectorized) / 3; i; --i) {
     const uint8_t t1 = *bytes++;
     const uint8_t t2 = *bytes++;
     const uint8_t t3 = *bytes++;
@@ -553,16 +810,18 @@ inline OutputBuffer encode_into(InputIterator begin, InputIterator end) {
 }
 
 template <class OutputBuffer>
-inline OutputBuffer encode_into(std::string_view data) {
-  return encode_into<OutputBuffer>(std::begin(data), std::end(data));
+inline OutputBuffer encode_into(std::string_view data,
+                                cpu_isa isa = best_isa()) {
+  return encode_into<OutputBuffer>(std::begin(data), std::end(data), isa);
 }
 
-inline std::string to_base64(std::string_view data) {
-  return encode_into<std::string>(std::begin(data), std::end(data));
+inline std::string to_base64(std::string_view data, cpu_isa isa = best_isa()) {
+  return encode_into<std::string>(std::begin(data), std::end(data), isa);
 }
 
 template <class OutputBuffer>
-inline OutputBuffer decode_into(std::string_view base64Text) {
+inline OutputBuffer decode_into(std::string_view base64Text,
+                                cpu_isa isa = best_isa()) {
   typedef typename OutputBuffer::value_type output_value_type;
   static_assert(std::is_same_v<output_value_type, char> ||
                 std::is_same_v<output_value_type, signed char> ||
@@ -590,7 +849,13 @@ inline OutputBuffer decode_into(std::string_view base64Text) {
   const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&base64Text[0]);
   char* currDecoding = reinterpret_cast<char*>(&decoded[0]);
 
-  for (size_t i = (base64Text.size() >> 2) - (numPadding != 0); i; --i) {
+  const size_t quartets = (base64Text.size() >> 2) - (numPadding != 0);
+  const size_t vectorized =
+      detail::decode_simd(bytes, quartets << 2, currDecoding, isa);
+  bytes += vectorized;
+  currDecoding += vectorized / 4 * 3;
+
+  for (size_t i = quartets - (vectorized >> 2); i; --i) {
     const uint8_t t1 = *bytes++;
     const uint8_t t2 = *bytes++;
     const uint8_t t3 = *bytes++;
@@ -677,18 +942,20 @@ inline OutputBuffer decode_into(std::string_view base64Text) {
 }
 
 template <class OutputBuffer, class InputIterator>
-inline OutputBuffer decode_into(InputIterator begin, InputIterator end) {
+inline OutputBuffer decode_into(InputIterator begin, InputIterator end,
+                                cpu_isa isa = best_isa()) {
   typedef std::decay_t<decltype(*begin)> input_value_type;
   static_assert(std::is_same_v<input_value_type, char> ||
                 std::is_same_v<input_value_type, signed char> ||
                 std::is_same_v<input_value_type, unsigned char> ||
                 std::is_same_v<input_value_type, std::byte>);
   std::string_view data(reinterpret_cast<const char*>(&*begin), end - begin);
-  return decode_into<OutputBuffer>(data);
+  return decode_into<OutputBuffer>(data, isa);
 }
 
-inline std::string from_base64(std::string_view data) {
-  return decode_into<std::string>(data);
+inline std::string from_base64(std::string_view data,
+                               cpu_isa isa = best_isa()) {
+  return decode_into<std::string>(data, isa);
 }
 
 }  // namespace base64
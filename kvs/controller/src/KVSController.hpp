@@ -14,7 +14,7 @@
 
 class KVSController final : public Controller::Service {
 public:
-    KVSController(const std::string& address) : address_(address) {}
+    KVSController(const std::string& address, Logger::Durability durability = Logger::Durability::PERIODIC) : address_(address), durability_(durability) {}
 
     /**
      * @brief Start the server only if it is not already running.
@@ -23,13 +23,13 @@ public:
      * @return grpc::Status::ALREADY_EXISTS (6) if server is already running.
      * @return grpc::Status::OK if server is started successfully.
     */
-    grpc::Status StartServer(grpc::ServerContext* context, const StartArgs* args, StartReply* reply) override {
+    grpc::Status StartServer(grpc::ServerContext* /*context*/, const StartArgs* args, StartReply* /*reply*/) override {
         int me = args->index();
         std::vector<std::string> peersIP;
         for (const std::string& ip : args->ips())
             peersIP.push_back(ip);
 
-        if (me < 0 || me >= peersIP.size())
+        if (me < 0 || me >= (int)peersIP.size())
             return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Index out of bounds.");
 
         const std::string& ipPort = peersIP[me];
@@ -58,7 +58,7 @@ public:
     /**
      * @brief Stop the server only if it is running.
     */
-    grpc::Status StopServer(grpc::ServerContext* context, const StopArgs* args, StopReply* reply) override {
+    grpc::Status StopServer(grpc::ServerContext* /*context*/, const StopArgs* args, StopReply* /*reply*/) override {
         const std::string& ipPort = args->ip();
         size_t colonPos = ipPort.find(':');
         if (colonPos == std::string::npos)
@@ -85,7 +85,7 @@ public:
     /**
      * @brief Get all servers on the machine.
     */
-    grpc::Status GetAll(grpc::ServerContext* context, const ServersArgs* args, ServersReply* reply) override {
+    grpc::Status GetAll(grpc::ServerContext* /*context*/, const ServersArgs* /*args*/, ServersReply* reply) override {
         std::lock_guard<std::mutex> lock(mu_);
         for (const auto& pair : servers_)
             reply->add_ips(address_ + ":" + pair.first);
@@ -96,7 +96,7 @@ public:
     /**
      * @brief Stop all servers on the machine.
     */
-    grpc::Status KillAll(grpc::ServerContext* context, const ServersArgs* args, StopReply* reply) override {
+    grpc::Status KillAll(grpc::ServerContext* /*context*/, const ServersArgs* /*args*/, StopReply* /*reply*/) override {
         std::lock_guard<std::mutex> lock(mu_);
         for (const auto& pair : servers_) {
             ABSL_LOG(INFO) << absl::StrFormat("Server %s is stopped.", address_ + ":" + pair.first);
@@ -105,11 +105,47 @@ public:
         servers_.clear();
         return grpc::Status::OK;
     }
+
+    /**
+     * @brief Get the ring of clusters published last, epoch 0 if none was.
+    */
+    grpc::Status GetRing(grpc::ServerContext* /*context*/, const ServersArgs* /*args*/, Ring* reply) override {
+        std::lock_guard<std::mutex> lock(mu_);
+        *reply = ring_;
+        return grpc::Status::OK;
+    }
+
+    /**
+     * @brief Publish a new ring of clusters, for clients to route rows by.
+     * 
+     * @return grpc::Status::INVALID_ARGUMENT (3) if the ring has no cluster or a cluster has no server.
+     * @return grpc::Status::FAILED_PRECONDITION (9) if the ring is not newer than the one published.
+     * @return grpc::Status::OK if the ring is published.
+    */
+    grpc::Status SetRing(grpc::ServerContext* /*context*/, const Ring* args, StopReply* /*reply*/) override {
+        if (args->clusters_size() == 0 || args->virtualnodes() <= 0)
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Empty ring.");
+        for (const Cluster& cluster : args->clusters()) {
+            if (cluster.ips_size() == 0)
+                return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Empty cluster.");
+        }
+
+        std::lock_guard<std::mutex> lock(mu_);
+        if (args->epoch() <= ring_.epoch())
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Ring is not newer than the published one.");
+
+        ring_ = *args;
+        ABSL_LOG(INFO) << absl::StrFormat("Ring %d is published with %d clusters%s.", ring_.epoch(), ring_.clusters_size(), ring_.migrating() ? ", migrating" : "");
+
+        return grpc::Status::OK;
+    }
     
 private:
-    std::mutex mu_;  // mutex for servers_
+    std::mutex mu_;  // mutex for servers_ and ring_
     std::string address_;  // address of the controller (127.0.0.1:40050)
+    Logger::Durability durability_;  // durability mode of the servers' logs
     std::unordered_map<std::string, std::unique_ptr<grpc::Server>> servers_;  // servers on the machine
+    Ring ring_;  // ring of clusters published last, kept in memory only
 
     // Initialize the server and wait for requests
     void initializeServer(int me, std::string port, std::vector<std::string> peersIP) {
@@ -125,8 +161,8 @@ private:
         }
         
         // Initialize services
-        auto storePtr = std::make_shared<Store>(address + "_sstables", CACHE_SIZE);
-        auto loggerPtr = std::make_shared<Logger>("../../server_logs/" + address + "_logs");
+        auto storePtr = std::make_shared<Store>(address + "_sstables", CACHE_SIZE, BLOCK_CACHE_SIZE);
+        auto loggerPtr = std::make_shared<Logger>("../../server_logs/" + address + "_logs", durability_);
         auto paxosServicePtr = std::make_shared<PaxosImpl>(peersIP, me);
         KVSServer kvsService(me, paxosServicePtr, storePtr, loggerPtr);
 
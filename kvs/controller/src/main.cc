@@ -3,20 +3,30 @@
 #define DEFAULT_PORT "40050"
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <public ip>" << std::endl;
+    // Parse log durability mode of the servers
+    Logger::Durability durability = Logger::Durability::PERIODIC;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        if (opt != 'd' || !Logger::ParseDurability(optarg, durability)) {
+            std::cerr << "Usage: " << argv[0] << " [-d none|periodic|commit] <public ip>" << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc - optind < 1) {
+        std::cerr << "Usage: " << argv[0] << " [-d none|periodic|commit] <public ip>" << std::endl;
         return 1;
     }
     grpc::EnableDefaultHealthCheckService(true);
     grpc::ServerBuilder builder;
 
-    KVSController kvsController(argv[1]);
+    KVSController kvsController(argv[optind], durability);
     builder.AddListeningPort(absl::StrFormat("0.0.0.0:%s", DEFAULT_PORT), grpc::InsecureServerCredentials());
     builder.RegisterService(&kvsController);
 
     std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
 
-    ABSL_LOG(INFO) << absl::StrFormat("Controller is listening on %s:%s", argv[1], DEFAULT_PORT);
+    ABSL_LOG(INFO) << absl::StrFormat("Controller is listening on %s:%s", argv[optind], DEFAULT_PORT);
 
     server->Wait();
     return 0;
@@ -0,0 +1,82 @@
+#ifndef BLOCK_CACHE_HPP
+#define BLOCK_CACHE_HPP
+
+#include <mutex>
+#include <string>
+
+#include "Scheduler.hpp"
+
+/**
+ * @brief A thread-safe LRU cache of SSTable data blocks with a fixed capacity in bytes.
+ * @author Lang Qin
+ *
+ * Blocks are identified by the number of the table they belong to and their offset
+ * in the table file. Table numbers are never reused, so blocks of deleted tables are
+ * simply aged out. The cache is sized separately from the value cache in Store, and
+ * it keeps hit and miss counters.
+ *
+ * APIs:
+ * 1. bool Get(uint64_t table, uint64_t offset, std::string& block):
+ *     Get a block from the cache.
+ * 2. void Put(uint64_t table, uint64_t offset, const std::string& block):
+ *     Put a block into the cache.
+ * 3. uint64_t Hits() / uint64_t Misses():
+ *     Get the number of lookups that hit or missed the cache.
+*/
+
+class BlockCache {
+public:
+    BlockCache(size_t capacity) : blocks_(capacity) {}
+
+    /**
+     * @brief Get a block from the cache.
+     *
+     * @param table the table number
+     * @param offset the offset of the block in the table file
+     * @param block the block to store the result
+     * @return true if the block is cached, false otherwise
+    */
+    bool Get(uint64_t table, uint64_t offset, std::string& block) {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (blocks_.Get(table, offset, block)) {
+            hits_++;
+            return true;
+        }
+        misses_++;
+        return false;
+    }
+
+    /**
+     * @brief Put a block into the cache. Blocks larger than the cache are ignored.
+     *
+     * @param table the table number
+     * @param offset the offset of the block in the table file
+     * @param block the block
+    */
+    void Put(uint64_t table, uint64_t offset, const std::string& block) {
+        std::lock_guard<std::mutex> lock(mu_);
+        try {
+            blocks_.Put(table, offset, block);
+        } catch (std::runtime_error& e) {
+            // The block is larger than the whole cache
+        }
+    }
+
+    uint64_t Hits() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return hits_;
+    }
+
+    uint64_t Misses() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return misses_;
+    }
+
+private:
+    std::mutex mu_;                                    // lock for all the fields below
+    Scheduler<uint64_t, uint64_t, std::string> blocks_;  // LRU of blocks keyed by (table, offset)
+    uint64_t hits_ = 0;                                // number of lookups served from the cache
+    uint64_t misses_ = 0;                              // number of lookups that went to disk
+};
+
+#endif
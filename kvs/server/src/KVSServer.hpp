@@ -14,26 +14,81 @@
 #include "Scheduler.hpp"
 #include "Store.hpp"
 #include "Logger.hpp"
+#include "SessionTable.hpp"
 
 #define PUT_ARGS_PUT 0
 #define PUT_ARGS_CPUT 1
 #define PUT_ARGS_DEL 2
+#define PUT_ARGS_IF_VERSION 3
+#define PUT_ARGS_APPEND_LINE 4
+#define PUT_ARGS_REMOVE_LINE 5
+#define PUT_ARGS_REPLACE_LINE 6
 
 #define CACHE_SIZE 500 * 1024 * 1024
+#define BLOCK_CACHE_SIZE 64 * 1024 * 1024
+#ifndef SNAPSHOT_INTERVAL
+#define SNAPSHOT_INTERVAL 10000     // number of decided operations between two snapshots
+#endif
+#define REPLAY_MIN_OPS 256          // minimum number of operations per replay thread
+#define APPLY_WAIT_MS 100           // how long the apply thread waits for a slot before checking for shutdown
+#define APPLY_HOLE_TIMEOUT_MS 1000  // how long a slot may stay undecided behind later slots before it is filled with a no-op
+#define APPLY_RUN_MAX_OPS 256       // maximum number of decided slots logged with one sync
+#define BATCH_MAX_OPS 64            // maximum number of operations proposed in one slot
+#define BATCH_MAX_BYTES 1024 * 1024 // maximum size of the operations proposed in one slot
+#define BATCH_MAX_DELAY_US 200      // how long a batch stays open for more operations
+#define VERSION_INDEX_BITS 16       // low bits of a version, numbering the operations of a slot, more than BATCH_MAX_OPS
+#define READ_RETRY_MS 10            // delay between two tries to get a read index while there is no leader
+#define READ_ELECT_MS 1000          // how long a read waits for a leader before proposing a no-op to get one elected
+#ifndef STATE_TRANSFER_MIN_LAG
+#define STATE_TRANSFER_MIN_LAG 10000   // number of slots behind at which the state of a peer is installed instead
+#endif
+#define STATE_TRANSFER_RETRY_MS 1000   // delay before fetching the state of a peer again after a failure
+#define STATE_TRANSFER_MAX_FAILURES 5  // state transfers failed in a row before missed slots still known to the peers are learned through Paxos
+#define CATCH_UP_WINDOW 64             // number of missed slots learned through Paxos at once, once state transfers keep failing
+#define SNAPSHOT_CHUNK_BYTES 1024 * 1024  // size of the pieces snapshot files are streamed in
+#define SESSIONS_FILE "sessions"       // file of the client sessions in a snapshot
 
 class KVSServer final : public KVS::Service {
 public:
-    KVSServer(int me, std::shared_ptr<PaxosImpl> paxos, std::shared_ptr<Store> store, std::shared_ptr<Logger> logger) : me_(me), paxos_(paxos), store_(store),  logger_(logger), globalSeq_(-1) {
-        if (!logger_->Recoverable()) {
-            return;
+    KVSServer(int me, std::shared_ptr<PaxosImpl> paxos, std::shared_ptr<Store> store, std::shared_ptr<Logger> logger) : me_(me), globalSeq_(-1), store_(store), paxos_(paxos), logger_(logger) {
+        // Batch ids start at random, as the batches proposed before a restart may still be decided
+        std::random_device rd;
+        nextBatchId_ = (static_cast<uint64_t>(rd()) << 32) | rd();
+
+        // Start from the latest snapshot, or from scratch if the whole log is replayed
+        std::string snapshot;
+        if (logger_->LatestSnapshot(snapshot, lastSnapshotSeq_)) {
+            loadSnapshot(snapshot);
+            globalSeq_ = lastSnapshotSeq_;
+        } else if (logger_->Recoverable()) {
+            store_->Clear();
         }
 
-        logger_->RecoverGlobalSeq(globalSeq_);
-        while (logger_->HasNextOp()) {
-            Op op;
-            logger_->RecoverOp(op);
-            applyChange(op);
+        if (logger_->Recoverable()) {
+            std::vector<Logger::LogRecord> records;
+            logger_->RecoverOps(records);
+            replay(records);
+
+            ABSL_LOG(INFO) << absl::StrFormat("Server %d recovered up to globalseq %d", me_, globalSeq_);
         }
+
+        // Lagging peers catch up with the state of this server
+        paxos_->SetSnapshotSource([this](int appliedSeq, const PaxosImpl::SnapshotWriter& write) {
+            return streamState(appliedSeq, write);
+        });
+
+        // Decided operations are applied in order by a dedicated thread
+        applyThread_ = std::thread(&KVSServer::applyDecided, this);
+    }
+
+    ~KVSServer() {
+        paxos_->SetSnapshotSource(nullptr);
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stopping_ = true;
+        }
+        appliedCv_.notify_all();
+        applyThread_.join();
     }
 
     /* RPC Functions */
@@ -41,11 +96,10 @@ public:
     /**
      * @brief Put a key-value pair into the key-value store.
      * 
-     * This RPC call is reponsible for PUT, CPUT, and DELETE operations.
+     * This RPC call is reponsible for PUT, CPUT, and DELETE operations, and for the line
+     * operations editing index cells in place, see editLines().
     */
     grpc::Status PutValue(grpc::ServerContext* context, const PutArgs* args, PutReply* reply) override {
-        std::lock_guard<std::mutex> lock(mu_);
-
         Op op;
         op.set_row(args->row());
         op.set_col(args->col());
@@ -53,6 +107,10 @@ public:
         op.set_newvalue(args->newvalue());
         op.set_requestid(args->requestid());
         op.set_lockid(args->lockid());
+        op.set_clientid(args->clientid());
+        op.set_clientseq(args->clientseq());
+        op.set_clientacked(args->clientacked());
+        op.set_version(args->version());
 
         switch (args->option()) {
             case PUT_ARGS_CPUT:
@@ -61,6 +119,18 @@ public:
             case PUT_ARGS_DEL:
                 op.set_type(DELETE);
                 break;
+            case PUT_ARGS_IF_VERSION:
+                op.set_type(PUTIFVERSION);
+                break;
+            case PUT_ARGS_APPEND_LINE:
+                op.set_type(APPEND_LINE);
+                break;
+            case PUT_ARGS_REMOVE_LINE:
+                op.set_type(REMOVE_LINE_BY_PREFIX);
+                break;
+            case PUT_ARGS_REPLACE_LINE:
+                op.set_type(REPLACE_LINE);
+                break;
             default:
                 op.set_type(PUT);
                 break;
@@ -68,8 +138,9 @@ public:
 
         ABSL_LOG(INFO) << absl::StrFormat("Server %d recieved Put %s on key: %s", me_, args->requestid(), args->row() + "-" + args->col());
 
-        OpOutput output = makeAgreementAndApplyChange(op);
+        OpOutput output = makeAgreementAndApplyChange(op, context);
         reply->set_success(output.success);
+        reply->set_leader(paxos_->Leader());
 
         return grpc::Status::OK;
     }
@@ -78,8 +149,6 @@ public:
      * @brief Get the value of a key-value pair from the key-value store.
     */
     grpc::Status GetValue(grpc::ServerContext* context, const GetArgs* args, GetReply* reply) override {
-        std::lock_guard<std::mutex> lock(mu_);
-
         Op op;
         op.set_type(GET);
         op.set_row(args->row());
@@ -89,10 +158,17 @@ public:
 
         ABSL_LOG(INFO) << absl::StrFormat("Server %d recieved Get %s on key: %s", me_, args->requestid(), args->row() + "-" + args->col());
 
-        OpOutput output = makeAgreementAndApplyChange(op);
+        OpOutput output;
+        try {
+            output = readLocally(op, *args, context);
+        } catch (std::runtime_error& e) {
+            return readFailed(e);
+        }
 
         reply->set_success(output.success);
         reply->set_value(output.value);
+        reply->set_version(output.version);
+        reply->set_leader(paxos_->Leader());
 
         return grpc::Status::OK;
     }
@@ -101,19 +177,21 @@ public:
      * @brief Set a lock on a row if no such lock exists.
     */
     grpc::Status SetNX(grpc::ServerContext* context, const LockArgs* args, LockReply* reply) override {
-        std::lock_guard<std::mutex> lock(mu_);
-
         Op op;
         op.set_type(SETNX);
         op.set_row(args->row());
         op.set_requestid(args->requestid());
         op.set_lockid(args->lockid());
+        op.set_clientid(args->clientid());
+        op.set_clientseq(args->clientseq());
+        op.set_clientacked(args->clientacked());
 
         ABSL_LOG(INFO) << absl::StrFormat("Server %d recieved SetNX %s on key: %s", me_, args->requestid(), args->row());
 
-        OpOutput output = makeAgreementAndApplyChange(op);
+        OpOutput output = makeAgreementAndApplyChange(op, context);
 
         reply->set_success(output.success);
+        reply->set_leader(paxos_->Leader());
 
         return grpc::Status::OK;
     }
@@ -122,19 +200,51 @@ public:
      * @brief Release the lock on a row.
     */
     grpc::Status Del(grpc::ServerContext* context, const LockArgs* args, LockReply* reply) override {
-        std::lock_guard<std::mutex> lock(mu_);
-
         Op op;
         op.set_type(DEL);
         op.set_row(args->row());
         op.set_requestid(args->requestid());
         op.set_lockid(args->lockid());
+        op.set_clientid(args->clientid());
+        op.set_clientseq(args->clientseq());
+        op.set_clientacked(args->clientacked());
 
         ABSL_LOG(INFO) << absl::StrFormat("Server %d recieved Del %s on key: %s", me_, args->requestid(), args->row());
 
-        OpOutput output = makeAgreementAndApplyChange(op);
+        OpOutput output = makeAgreementAndApplyChange(op, context);
+
+        reply->set_success(output.success);
+        reply->set_leader(paxos_->Leader());
+
+        return grpc::Status::OK;
+    }
+
+    /**
+     * @brief Run a transaction on the rows of this cluster, or one phase of a transaction
+     * spanning clusters, see executeTxn().
+     *
+     * The operations are decided as a single operation, so they cost one round whatever
+     * their number.
+    */
+    grpc::Status Txn(grpc::ServerContext* context, const TxnArgs* args, TxnReply* reply) override {
+        Op op;
+        op.set_type(TXN);
+        *op.mutable_ops() = args->ops();
+        op.set_lockid(args->txnid());
+        op.set_phase(args->phase());
+        op.set_requestid(args->requestid());
+        op.set_clientid(args->clientid());
+        op.set_clientseq(args->clientseq());
+        op.set_clientacked(args->clientacked());
+
+        ABSL_LOG(INFO) << absl::StrFormat("Server %d recieved Txn %s phase %d with %d ops", me_, args->requestid(), args->phase(), args->ops_size());
 
+        OpOutput output = makeAgreementAndApplyChange(op, context);
+
+        // The values come packed as a reply, which is kept for retries
+        reply->ParseFromString(output.value);
         reply->set_success(output.success);
+        reply->set_leader(paxos_->Leader());
 
         return grpc::Status::OK;
     }
@@ -143,19 +253,23 @@ public:
      * @brief Get all rows in the key-value store.
     */
     grpc::Status GetAllRows(grpc::ServerContext* context, const GetArgs* args, GetAllReply* reply) override {
-        std::lock_guard<std::mutex> lock(mu_);
-
         Op op;
         op.set_type(GETALLROWS);
         op.set_requestid(args->requestid());
 
         ABSL_LOG(INFO) << absl::StrFormat("Server %d recieved GetAllRows %s", me_, args->requestid());
 
-        OpOutput output = makeAgreementAndApplyChange(op);
+        OpOutput output;
+        try {
+            output = readLocally(op, *args, context);
+        } catch (std::runtime_error& e) {
+            return readFailed(e);
+        }
 
         for (const std::string& row : output.values) {
             reply->add_item(row);
         }
+        reply->set_leader(paxos_->Leader());
 
         return grpc::Status::OK;
     }
@@ -163,11 +277,15 @@ public:
     /**
      * @brief Get all a row from a specific server.
     */
-    grpc::Status GetAllRowsByIp(grpc::ServerContext* context, const GetArgs* args, GetAllReply* reply) override {
+    grpc::Status GetAllRowsByIp(grpc::ServerContext* /*context*/, const GetArgs* /*args*/, GetAllReply* reply) override {
         std::lock_guard<std::mutex> lock(mu_);
 
         std::vector<std::string> rows;
-        store_->GetAllRows(rows);
+        try {
+            store_->GetAllRows(rows);
+        } catch (std::runtime_error& e) {
+            return readFailed(e);
+        }
 
         for (const std::string& row : rows) {
             reply->add_item(row);
@@ -180,8 +298,6 @@ public:
      * @brief Get all columns in a row.
     */
     grpc::Status GetColsInRow(grpc::ServerContext* context, const GetArgs* args, GetAllReply* reply) override {
-        std::lock_guard<std::mutex> lock(mu_);
-
         Op op;
         op.set_type(GETCOLSINROW);
         op.set_row(args->row());
@@ -190,11 +306,17 @@ public:
 
         ABSL_LOG(INFO) << absl::StrFormat("Server %d recieved GetColsInRow %s on key: %s", me_, args->requestid(), args->row());
 
-        OpOutput output = makeAgreementAndApplyChange(op);
+        OpOutput output;
+        try {
+            output = readLocally(op, *args, context);
+        } catch (std::runtime_error& e) {
+            return readFailed(e);
+        }
 
         for (const std::string& col : output.values) {
             reply->add_item(col);
         }
+        reply->set_leader(paxos_->Leader());
 
         return grpc::Status::OK;
     }
@@ -202,11 +324,15 @@ public:
     /**
      * @brief Get all columns in a row from a specific server.
     */
-    grpc::Status GetColsInRowByIp(grpc::ServerContext* context, const GetArgs* args, GetAllReply* reply) override {
+    grpc::Status GetColsInRowByIp(grpc::ServerContext* /*context*/, const GetArgs* args, GetAllReply* reply) override {
         std::lock_guard<std::mutex> lock(mu_);
 
         std::vector<std::string> cols;
-        store_->GetColsInRow(args->row(), cols, args->lockid());
+        try {
+            store_->GetColsInRow(args->row(), cols, args->lockid());
+        } catch (std::runtime_error& e) {
+            return readFailed(e);
+        }
 
         for (const std::string& col : cols) {
             reply->add_item(col);
@@ -215,102 +341,717 @@ public:
         return grpc::Status::OK;
     }
 
+    /**
+     * @brief Get the cache and Bloom filter counters of the store on this server.
+    */
+    grpc::Status GetStatsByIp(grpc::ServerContext* /*context*/, const GetArgs* /*args*/, StatsReply* reply) override {
+        Store::Stats stats = store_->GetStats();
+
+        auto& counters = *reply->mutable_counters();
+        counters["cache_hits"] = stats.cacheHits;
+        counters["cache_misses"] = stats.cacheMisses;
+        counters["block_cache_hits"] = stats.blockCacheHits;
+        counters["block_cache_misses"] = stats.blockCacheMisses;
+        counters["filter_negatives"] = stats.filterNegatives;
+        counters["filter_false_positives"] = stats.filterFalsePositives;
+
+        return grpc::Status::OK;
+    }
+
 private:
 
     /* Internal Data Structures and Variables */
 
     struct OpOutput {
-        bool success;
+        bool success = false;
         std::string value;
         std::vector<std::string> values;
+        uint64_t version = 0;  // version of the value read
+
+        OpOutput(bool success = false, const std::string& value = "") : success(success), value(value) {}
+    };
+
+    // A handler waiting for its operation to be applied
+    struct Waiter {
+        bool applied = false;
+        OpOutput output;
+    };
+
+    // Operations collected to be proposed together in one slot
+    struct Batch {
+        Op op;             // the BATCH operation holding the collected operations
+        size_t bytes = 0;  // total size of the collected operations
+
+        bool Full() const {
+            return op.ops_size() >= BATCH_MAX_OPS || bytes >= BATCH_MAX_BYTES;
+        }
     };
 
     int me_;         // this server's index
     std::mutex mu_;  // lock for data_
 
-    int globalSeq_;                                             // the highest sequence number that has been decided
+    int globalSeq_;                                             // the highest sequence number that has been applied
+    int nextSeq_ = 0;                                           // the next sequence number this server proposes at
+    uint64_t nextBatchId_;                                      // the id of the next batch opened by this server
+    int lastSnapshotSeq_ = -1;                                  // the sequence number covered by the latest snapshot
     std::shared_ptr<Store> store_;                              // store instance
-    std::unordered_map<std::string, OpOutput> visitedRequests_; // record of visited requests
+    SessionTable sessions_;                                     // replies of the latest writes of each client
     std::shared_ptr<PaxosImpl> paxos_;                          // paxos instance
     std::shared_ptr<Logger> logger_;                            // logger instance
+    std::unordered_multimap<std::string, Waiter*> waiters_;     // handlers waiting for their operations, by request id
+    std::condition_variable appliedCv_;                         // notified whenever the apply thread applies operations
+    std::shared_ptr<Batch> openBatch_;                          // the batch new operations join, if any
+    std::condition_variable batchCv_;                           // notified when the open batch is full
+    std::thread applyThread_;                                   // thread applying decided operations in order
+    bool stopping_ = false;                                     // whether the server is shutting down
+    int transfers_ = 0;                                         // number of states being streamed to lagging peers
 
     /* Internal Functions */
 
-    // Make agreement and apply change to the key-value store
-    // It will catch up all missed operations between globalSeq_ and seq
+    // Make agreement on the operation and wait for the apply thread to apply it
+    // Operations arriving together are collected into a batch, proposed in a single slot by
+    // the handler which opened it. The batch is proposed once it is full or BATCH_MAX_DELAY_US
+    // after it is opened. Many batches are in flight at different slots concurrently, and each
+    // handler only waits for its own operation.
+    // The handler gives up once the client has, e.g. past its deadline. The operation may still
+    // be applied, a retry of the client is then answered from its session. The opener of a batch
+    // others joined keeps proposing it though, as their clients still wait for it.
+    OpOutput makeAgreementAndApplyChange(Op& op, grpc::ServerContext* context) {
+        Waiter waiter;
+        std::unique_lock<std::mutex> lock(mu_);
+        auto entry = waiters_.emplace(op.requestid(), &waiter);
+
+        // Join the open batch, or open a new one
+        std::shared_ptr<Batch> batch = openBatch_;
+        bool opener = !batch || batch->Full();
+        if (opener) {
+            batch = std::make_shared<Batch>();
+            batch->op.set_type(BATCH);
+            batch->op.set_requestid(absl::StrFormat("batch-%d-%016x", me_, nextBatchId_++));
+            openBatch_ = batch;
+        }
+        *batch->op.add_ops() = op;
+        batch->bytes += op.ByteSizeLong();
+        if (batch->Full())
+            batchCv_.notify_all();
+
+        if (opener) {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(BATCH_MAX_DELAY_US);
+            batchCv_.wait_until(lock, deadline, [this, &batch]() {
+                return batch->Full() || stopping_;
+            });
+            if (openBatch_ == batch)
+                openBatch_.reset();
+
+            // A batch of one operation is proposed as is. Once other handlers have joined the
+            // batch, it is proposed until chosen even if the client of this one gives up.
+            bool joined = batch->op.ops_size() > 1;
+            Op value = joined ? batch->op : batch->op.ops(0);
+            lock.unlock();
+            proposeUntilChosen(value, waiter, joined ? nullptr : context);
+            lock.lock();
+        }
+
+        while (!waiter.applied && !stopping_ && !(context != nullptr && context->IsCancelled()))
+            appliedCv_.wait_for(lock, std::chrono::milliseconds(APPLY_WAIT_MS));
+        waiters_.erase(entry);
+
+        if (!waiter.applied)
+            return {false, ""};
+        return waiter.output;
+    }
+
+    // Propose the value until it is chosen at some slot, the waiter of one of its operations
+    // is answered, or the client given by context gives up, if any. If the value loses its slot
+    // to another one, it is proposed again at a new slot. A slot already applied and forgotten
+    // by Paxos is lost as well unless the waiter has been answered, since answers are given
+    // before Done(). The value is told apart by the id Paxos gave it at this slot, as a value
+    // with the same request id may have been proposed before a restart.
+    void proposeUntilChosen(const Op& value, const Waiter& waiter, grpc::ServerContext* context) {
+        std::unique_lock<std::mutex> lock(mu_);
+        int seq = reserveSeq();
+        lock.unlock();
+
+        bool start = true;
+        uint64_t id = 0;
+        while (true) {
+            if (start) {
+                ABSL_LOG(INFO) << absl::StrFormat("Server %d is proposing seq %d", me_, seq);
+                id = paxos_->Start(seq, value);
+            }
+            uint64_t agreedId;
+            bool decided = paxos_->WaitId(seq, agreedId, APPLY_WAIT_MS);
+
+            lock.lock();
+            if (stopping_ || waiter.applied || (decided && agreedId == id))
+                return;
+            if (context != nullptr && context->IsCancelled()) {
+                ABSL_LOG(INFO) << absl::StrFormat("Server %d stops proposing seq %d, the client is gone", me_, seq);
+                return;
+            }
+
+            start = decided || seq < paxos_->MinKnownSeq();
+            if (start)
+                seq = reserveSeq();
+            lock.unlock();
+        }
+    }
+
+    // Serve a read from the local store without a Paxos round or a log record
+    // A linearizable read asks the leader holding the lease for the highest slot a write the
+    // read must observe may be at, and runs once this server has applied every slot up to it.
+    // A relaxed read runs right away if this server is fresh enough, and is linearizable otherwise.
+    // Without a leader, the read proposes a no-op every READ_ELECT_MS until one is elected.
+    // The read gives up once the client has, e.g. past its deadline.
+    OpOutput readLocally(const Op& op, const GetArgs& args, grpc::ServerContext* context) {
+        if (args.consistency() == ANY_REPLICA || (args.consistency() == BOUNDED_STALENESS && freshEnough(args)))
+            return executeRead(op);
+
+        int readSeq, waitedMs = 0;
+        while (!paxos_->ReadIndex(readSeq)) {
+            if (context != nullptr && context->IsCancelled())
+                return {false, ""};
+            std::unique_lock<std::mutex> lock(mu_);
+            if (appliedCv_.wait_for(lock, std::chrono::milliseconds(READ_RETRY_MS), [this]() { return stopping_; }))
+                return {false, ""};
+
+            // A cluster no write went to since it started has no leader, a no-op gets one elected
+            waitedMs += READ_RETRY_MS;
+            if (waitedMs >= READ_ELECT_MS) {
+                int seq = reserveSeq();
+                lock.unlock();
+                Op noop;
+                noop.set_type(NOOP);
+                noop.set_requestid(absl::StrFormat("noop-read-%d-%d", me_, seq));
+                paxos_->Start(seq, noop);
+                waitedMs = 0;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(mu_);
+        appliedCv_.wait(lock, [this, readSeq]() {
+            return globalSeq_ >= readSeq || stopping_;
+        });
+        if (stopping_)
+            return {false, ""};
+        lock.unlock();
+
+        return executeRead(op);
+    }
+
+    // Answer a read the store failed to serve with an error, so that the client asks another
+    // server instead of taking the key for missing
+    grpc::Status readFailed(const std::runtime_error& e) {
+        ABSL_LOG(ERROR) << absl::StrFormat("Server %d failed to read the store: %s", me_, e.what());
+        return grpc::Status(grpc::StatusCode::INTERNAL, e.what());
+    }
+
+    // Whether this server lags behind the leader by no more than either bound of the read
+    bool freshEnough(const GetArgs& args) {
+        std::unique_lock<std::mutex> lock(mu_);
+        int appliedSeq = globalSeq_;
+        lock.unlock();
+
+        int opsBehind, msBehind;
+        if (!paxos_->Staleness(appliedSeq, opsBehind, msBehind))
+            return false;
+
+        if (args.maxstalenessops() <= 0 && args.maxstalenessms() <= 0)
+            return opsBehind == 0;
+        return (args.maxstalenessops() > 0 && opsBehind <= args.maxstalenessops()) ||
+               (args.maxstalenessms() > 0 && msBehind <= args.maxstalenessms());
+    }
+
+    // Pick a slot no proposal of this server or its peers is known to use
     // Caller must hold the lock
-    OpOutput makeAgreementAndApplyChange(Op& op) {
-        // increase seq num
-        int seq = globalSeq_ + 1;
+    int reserveSeq() {
+        nextSeq_ = std::max({nextSeq_, globalSeq_ + 1, paxos_->MaxKnownSeq() + 1});
+        return nextSeq_++;
+    }
 
-        // Propose until operation is successful
+    // Apply decided operations in slot order, and hand the outputs to the waiting handlers
+    void applyDecided() {
+        int waitedMs = 0;
+        int failedTransfers = 0;  // state transfers failed in a row
+        int catchUpSeq = -1;      // last slot a no-op was proposed at to learn the missed slots through Paxos
         while (true) {
-            ABSL_LOG(INFO) << absl::StrFormat("Server %d is proposing seq %d", me_, seq);
-            paxos_->Start(seq, op);
-            Op agreedOp = waitForAgreement(seq);
-            if (op.requestid() == agreedOp.requestid()) {
+            std::unique_lock<std::mutex> lock(mu_);
+            if (stopping_)
+                return;
+            int seq = globalSeq_ + 1;
+            lock.unlock();
+
+            // Slots forgotten by the peers, or too many missed slots, are caught up with the state of a peer
+            // Once that keeps failing, missed slots the peers still know are learned one by one instead
+            bool forgotten = seq < paxos_->MinKnownSeq();
+            bool lagging = paxos_->MaxKnownSeq() - seq >= STATE_TRANSFER_MIN_LAG;
+            if (forgotten || (lagging && failedTransfers < STATE_TRANSFER_MAX_FAILURES)) {
+                if (installFromPeer(seq - 1)) {
+                    failedTransfers = 0;
+                } else {
+                    failedTransfers++;
+                    lock.lock();
+                    appliedCv_.wait_for(lock, std::chrono::milliseconds(STATE_TRANSFER_RETRY_MS), [this]() { return stopping_; });
+                }
+                waitedMs = 0;
+                continue;
+            }
+            if (!lagging) {
+                failedTransfers = 0;
+            } else if (seq > catchUpSeq) {
+                // Proposing at a decided slot makes the peers send its value, without waiting for the hole timeout
+                ABSL_LOG(INFO) << absl::StrFormat("Server %d failed %d state transfers, learning seq %d to %d through Paxos", me_, failedTransfers, seq, seq + CATCH_UP_WINDOW - 1);
+                for (int slot = seq; slot < seq + CATCH_UP_WINDOW; slot++) {
+                    Op noop;
+                    noop.set_type(NOOP);
+                    noop.set_requestid(absl::StrFormat("noop-%d-%d", me_, slot));
+                    paxos_->Start(slot, noop);
+                }
+                catchUpSeq = seq + CATCH_UP_WINDOW - 1;
+            }
+
+            Op op;
+            if (!paxos_->Wait(seq, op, APPLY_WAIT_MS)) {
+                // A proposer may have failed after taking the slot, fill it so that later slots can be applied
+                waitedMs += APPLY_WAIT_MS;
+                if (waitedMs >= APPLY_HOLE_TIMEOUT_MS && paxos_->MaxKnownSeq() > seq) {
+                    ABSL_LOG(INFO) << absl::StrFormat("Server %d is filling seq %d with a no-op", me_, seq);
+                    Op noop;
+                    noop.set_type(NOOP);
+                    noop.set_requestid(absl::StrFormat("noop-%d-%d", me_, seq));
+                    paxos_->Start(seq, noop);
+                    waitedMs = 0;
+                }
+                continue;
+            }
+            waitedMs = 0;
+
+            // The slots decided right behind are logged along, with a single sync
+            std::vector<Logger::LogRecord> run;
+            size_t runBytes = op.ByteSizeLong();
+            run.push_back({seq, std::move(op)});
+            Op next;
+            while (run.size() < APPLY_RUN_MAX_OPS && runBytes < LOG_MAX_BATCH_SIZE && paxos_->Status(seq + (int)run.size(), next)) {
+                runBytes += next.ByteSizeLong();
+                run.push_back({seq + (int)run.size(), std::move(next)});
+            }
+            if (!logger_->Log(run)) {
+                // Answering would report operations a restart may lose, and Done() would let the peers forget them
+                ABSL_LOG(FATAL) << absl::StrFormat("Server %d failed to log seq %d to %d", me_, seq, seq + (int)run.size() - 1);
+            }
+
+            lock.lock();
+            for (Logger::LogRecord& record : run) {
+                try {
+                    applySlot(record.op, record.globalSeq);
+                } catch (std::runtime_error& e) {
+                    // Going on would let this replica drift from its peers, the log replays the slot after a restart
+                    ABSL_LOG(FATAL) << absl::StrFormat("Server %d failed to apply seq %d: %s", me_, record.globalSeq, e.what());
+                }
+                globalSeq_ = record.globalSeq;
+            }
+            appliedCv_.notify_all();
+
+            paxos_->Done(globalSeq_);
+
+            // A snapshot being streamed to a lagging peer must not be dropped
+            if (globalSeq_ - lastSnapshotSeq_ >= SNAPSHOT_INTERVAL && transfers_ == 0)
+                takeSnapshot();
+        }
+    }
+
+    // Apply the operation decided at a slot, unpacking batches
+    // Caller must hold the lock
+    void applySlot(Op& op, int slot) {
+        if (op.type() == BATCH) {
+            for (int i = 0; i < op.ops_size(); i++)
+                applyAndAnswer(*op.mutable_ops(i), slot, writeVersion(slot, i));
+        } else {
+            applyAndAnswer(op, slot, writeVersion(slot, 0));
+        }
+    }
+
+    // Apply the operation and hand the output to the handlers waiting for it
+    // Caller must hold the lock
+    void applyAndAnswer(Op& op, int slot, uint64_t version) {
+        OpOutput output = applyChange(op, slot, version);
+
+        auto range = waiters_.equal_range(op.requestid());
+        for (auto it = range.first; it != range.second; it++) {
+            it->second->applied = true;
+            it->second->output = output;
+        }
+    }
+
+    // Catch up with the state of a peer: its latest snapshot if this server lags behind it,
+    // then the operations it applied after that. Only the apply thread calls this.
+    bool installFromPeer(int appliedSeq) {
+        int snapshotSeq = -1, lastSeq = -1, nextSeq = appliedSeq + 1;
+        std::string staging, fileName;
+        std::vector<std::string> stagedFiles;
+        std::ofstream file;
+        std::vector<Logger::LogRecord> tail;
+        bool first = true;
+
+        bool fetched = false;
+        try {
+            fetched = paxos_->FetchSnapshot(appliedSeq, [&](const SnapshotChunk& chunk) {
+                if (first) {
+                    first = false;
+                    snapshotSeq = chunk.snapshotseq();
+                    lastSeq = chunk.lastseq();
+                    if (lastSeq <= appliedSeq)
+                        return false;
+                    if (snapshotSeq > appliedSeq) {
+                        staging = logger_->SnapshotPath(snapshotSeq) + ".tmp";
+                        std::filesystem::remove_all(staging);
+                        std::filesystem::create_directories(staging);
+                        nextSeq = snapshotSeq + 1;
+                    }
+                }
+
+                if (!chunk.file().empty()) {
+                    if (staging.empty())
+                        return false;
+                    if (chunk.file() != fileName) {
+                        if (!fileName.empty()) {
+                            file.close();
+                            if (!file)
+                                return false;
+                        }
+                        fileName = chunk.file();
+                        stagedFiles.push_back(staging + "/" + std::filesystem::path(fileName).filename().string());
+                        file.open(stagedFiles.back(), std::ios::binary | std::ios::trunc);
+                    }
+                    file.write(chunk.data().data(), chunk.data().size());
+                    if (!file)
+                        return false;
+                }
+
+                // The operations must follow the snapshot without a gap
+                for (const DecidedSlot& slot : chunk.tail()) {
+                    if (slot.seq() != nextSeq++)
+                        return false;
+                    tail.push_back({slot.seq(), slot.v()});
+                }
+                return true;
+            });
+            file.close();
+
+            // The log is truncated to the snapshot, which must be on disk by then
+            if (fetched && nextSeq == lastSeq + 1 && !staging.empty()) {
+                if (!fileName.empty() && !file)
+                    throw std::runtime_error("Can't write snapshot file.");
+                Store::SyncFolder(staging, stagedFiles);
+                std::filesystem::rename(staging, logger_->SnapshotPath(snapshotSeq));
+                if (!syncPath(std::filesystem::absolute(staging).parent_path().string()))
+                    throw std::runtime_error("Can't sync snapshot folder.");
+            }
+        } catch (std::exception& e) {
+            ABSL_LOG(ERROR) << absl::StrFormat("Server %d failed to fetch a snapshot after globalseq %d: %s", me_, appliedSeq, e.what());
+            fetched = false;
+        }
+
+        if (!fetched || nextSeq != lastSeq + 1) {
+            if (!staging.empty())
+                std::filesystem::remove_all(staging);
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(mu_);
+        if (snapshotSeq > appliedSeq) {
+            failSkipped(appliedSeq + 1, snapshotSeq);
+            loadSnapshot(logger_->SnapshotPath(snapshotSeq));
+            logger_->Truncate(snapshotSeq);
+            lastSnapshotSeq_ = snapshotSeq;
+            globalSeq_ = snapshotSeq;
+        }
+        if (!logger_->Log(tail))
+            ABSL_LOG(FATAL) << absl::StrFormat("Server %d failed to log the slots installed after globalseq %d", me_, globalSeq_);
+        for (Logger::LogRecord& record : tail) {
+            try {
+                applySlot(record.op, record.globalSeq);
+            } catch (std::runtime_error& e) {
+                ABSL_LOG(FATAL) << absl::StrFormat("Server %d failed to apply seq %d: %s", me_, record.globalSeq, e.what());
+            }
+            globalSeq_ = record.globalSeq;
+        }
+        appliedCv_.notify_all();
+        paxos_->Done(globalSeq_);
+
+        ABSL_LOG(INFO) << absl::StrFormat("Server %d installed the state of a peer up to globalseq %d (snapshot %d)", me_, globalSeq_, snapshotSeq);
+        return true;
+    }
+
+    // Answer the handlers whose operations were decided at slots fromSeq..toSeq, which are
+    // installed from a snapshot instead of being applied here. Their outputs are unknown.
+    // Caller must hold the lock
+    void failSkipped(int fromSeq, int toSeq) {
+        if (waiters_.empty())
+            return;
+
+        for (int seq = std::max(fromSeq, paxos_->MinKnownSeq()); seq <= toSeq; seq++) {
+            Op op;
+            if (!paxos_->Status(seq, op))
+                continue;
+
+            std::vector<const Op*> ops;
+            if (op.type() == BATCH) {
+                for (const Op& batchedOp : op.ops())
+                    ops.push_back(&batchedOp);
+            } else {
+                ops.push_back(&op);
+            }
+            for (const Op* skipped : ops) {
+                auto range = waiters_.equal_range(skipped->requestid());
+                for (auto it = range.first; it != range.second; it++) {
+                    it->second->applied = true;
+                    it->second->output = {false, ""};
+                }
+            }
+        }
+    }
+
+    // Stream to a lagging peer the latest snapshot if the peer lags behind it, and the
+    // operations applied after that up to the last one applied here
+    bool streamState(int appliedSeq, const PaxosImpl::SnapshotWriter& write) {
+        std::unique_lock<std::mutex> lock(mu_);
+        int snapshotSeq = lastSnapshotSeq_;
+        int lastSeq = globalSeq_;
+        if (lastSeq <= appliedSeq || stopping_)
+            return false;
+        transfers_++;
+        lock.unlock();
+
+        bool sent = false;
+        try {
+            sent = sendState(appliedSeq, snapshotSeq, lastSeq, write);
+        } catch (std::exception& e) {
+            ABSL_LOG(ERROR) << absl::StrFormat("Server %d failed to stream its state after globalseq %d: %s", me_, appliedSeq, e.what());
+        }
+
+        lock.lock();
+        transfers_--;
+        return sent;
+    }
+
+    // Send the chunks of a state transfer, see streamState()
+    bool sendState(int appliedSeq, int snapshotSeq, int lastSeq, const PaxosImpl::SnapshotWriter& write) {
+        bool withSnapshot = snapshotSeq > appliedSeq;
+        SnapshotChunk header;
+        header.set_snapshotseq(withSnapshot ? snapshotSeq : -1);
+        header.set_lastseq(lastSeq);
+        if (!write(header))
+            return false;
+
+        if (withSnapshot) {
+            std::string data(SNAPSHOT_CHUNK_BYTES, '\0');
+            for (const auto& entry : std::filesystem::directory_iterator(logger_->SnapshotPath(snapshotSeq))) {
+                std::ifstream in(entry.path(), std::ios::binary);
+                if (!in.is_open())
+                    throw std::runtime_error("Can't open snapshot file.");
+
+                // Every file is sent in at least one chunk, even if it is empty
+                do {
+                    in.read(&data[0], data.size());
+                    SnapshotChunk chunk;
+                    chunk.set_file(entry.path().filename().string());
+                    chunk.set_data(data.data(), in.gcount());
+                    if (!write(chunk))
+                        return false;
+                } while (in);
+            }
+        }
+
+        std::vector<Logger::LogRecord> records;
+        logger_->ReadSince(withSnapshot ? snapshotSeq : appliedSeq, records);
+
+        SnapshotChunk chunk;
+        size_t bytes = 0;
+        for (Logger::LogRecord& record : records) {
+            if (record.globalSeq > lastSeq)
                 break;
+            bytes += record.op.ByteSizeLong();
+            DecidedSlot* slot = chunk.add_tail();
+            slot->set_seq(record.globalSeq);
+            *slot->mutable_v() = std::move(record.op);
+            if (bytes >= SNAPSHOT_CHUNK_BYTES) {
+                if (!write(chunk))
+                    return false;
+                chunk.Clear();
+                bytes = 0;
             }
-            seq++;
         }
+        return chunk.tail_size() == 0 || write(chunk);
+    }
 
-        // If [globalSeq_ + 1, seq) is not null, then we need to catch up
-        // on missed operations
-        for (int i = globalSeq_ + 1; i < seq; i++) {
-            Op missedOp = waitForAgreement(i);
-            logger_->Log(missedOp, globalSeq_);
-            applyChange(missedOp);
+    // Snapshot the key-value store and drop the log it covers
+    // Caller must hold the lock
+    void takeSnapshot() {
+        try {
+            std::string sessions;
+            sessions_.Serialize(sessions);
+            store_->Checkpoint(logger_->SnapshotPath(globalSeq_), {{SESSIONS_FILE, sessions}});
+        } catch (std::exception& e) {
+            ABSL_LOG(ERROR) << absl::StrFormat("Server %d failed to snapshot at globalseq %d: %s", me_, globalSeq_, e.what());
+            return;
         }
 
-        logger_->Log(op, globalSeq_ + 1);
-        OpOutput output = applyChange(op);
+        logger_->Truncate(globalSeq_);
+        lastSnapshotSeq_ = globalSeq_;
+        ABSL_LOG(INFO) << absl::StrFormat("Server %d took a snapshot at globalseq %d", me_, globalSeq_);
+    }
 
-        globalSeq_ = seq;
-        paxos_->Done(seq);
+    // Load the key-value store and the client sessions from a snapshot
+    // Snapshots taken before sessions were saved leave the sessions empty
+    void loadSnapshot(const std::string& dir) {
+        store_->RestoreCheckpoint(dir);
 
-        return output;
+        std::ifstream in(dir + "/" + SESSIONS_FILE, std::ios::binary);
+        std::string sessions((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (in.is_open() && !sessions_.Parse(sessions))
+            ABSL_LOG(ERROR) << absl::StrFormat("Server %d found corrupted sessions in %s", me_, dir);
     }
 
-    // Wait for seq to be decided by paxos, and return the decided operation (de-serialized)
-    Op waitForAgreement(int seq) {
-        while (true) {
-            Op decision;
-            bool success = paxos_->Status(seq, decision);
-        
-            if (success)
-                return decision;
+    // Replay the logged operations decided after the latest snapshot.
+    // Whether a write is a retry depends on every write before it, so the sessions are
+    // checked in log order first. Operations on different rows are independent, so rows
+    // are spread over threads which apply the writes of each row in log order. Reads
+    // change nothing and are skipped. Batches are unpacked. A transaction may span rows,
+    // so the writes before it are applied first, then the transaction alone.
+    void replay(std::vector<Logger::LogRecord>& records) {
+        std::vector<std::pair<const Op*, uint64_t>> pending;
+        auto replayOp = [this, &pending](const Op& op, int slot, uint64_t version) {
+            if (op.type() == GET || op.type() == GETALLROWS || op.type() == GETCOLSINROW || op.type() == NOOP)
+                return;
+
+            SessionTable::Reply cached;
+            if (op.clientid() != 0) {
+                if (sessions_.Duplicate(op.clientid(), op.clientseq(), op.clientacked(), slot, cached))
+                    return;
+                sessions_.Record(op.clientid(), op.clientseq(), cached);
+            }
+            if (op.type() == TXN) {
+                replayInParallel(pending);
+                pending.clear();
+            }
+            pending.emplace_back(&op, version);
+            if (op.type() == TXN) {
+                replayInParallel(pending);
+                pending.clear();
+            }
+        };
+
+        for (auto& record : records) {
+            if (record.globalSeq <= lastSnapshotSeq_)
+                continue;
+
+            if (record.op.type() == BATCH) {
+                for (int i = 0; i < record.op.ops_size(); i++)
+                    replayOp(record.op.ops(i), record.globalSeq, writeVersion(record.globalSeq, i));
+            } else {
+                replayOp(record.op, record.globalSeq, writeVersion(record.globalSeq, 0));
+            }
+            globalSeq_ = record.globalSeq;
+        }
+        replayInParallel(pending);
+    }
+
+    // Apply writes on single rows, in parallel across rows, and fill in their replies
+    // Each write comes with the version of the values it writes.
+    void replayInParallel(const std::vector<std::pair<const Op*, uint64_t>>& ops) {
+        std::vector<OpOutput> outputs(ops.size());
+        size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), ops.size() / REPLAY_MIN_OPS + 1);
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < numThreads; t++) {
+            threads.emplace_back([&, t]() {
+                std::hash<std::string> hash;
+                for (size_t i = 0; i < ops.size(); i++) {
+                    if (hash(ops[i].first->row()) % numThreads == t)
+                        outputs[i] = executeOp(*ops[i].first, ops[i].second);
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        for (size_t i = 0; i < ops.size(); i++) {
+            const Op& op = *ops[i].first;
+            if (op.clientid() != 0)
+                sessions_.Update(op.clientid(), op.clientseq(), {outputs[i].success, outputs[i].value});
         }
     }
 
-    // Apply the operation to the key-value store
+    // Apply the operation decided at a slot to the key-value store, see writeVersion()
+    // A retried write gets the reply of its first application instead
     // Caller must hold the lock
-    OpOutput applyChange(Op& op) {
+    OpOutput applyChange(Op& op, int slot, uint64_t version) {
+        // Slot left empty by a failed proposer
+        if (op.type() == NOOP) {
+            return {true, ""};
+        }
+
         // GET operation
         if (op.type() == GET) {
-            std::string value;
-            if (store_->Get(op.row(), op.col(), value, op.lockid())) {
-                return {true, value};
-            } else {
-                return {false, ""};
-            }
+            return executeRead(op);
+        }
+
+        SessionTable::Reply cached;
+        if (op.clientid() != 0 && sessions_.Duplicate(op.clientid(), op.clientseq(), op.clientacked(), slot, cached)) {
+            ABSL_LOG(INFO) << absl::StrFormat("Server %d skips retried Op: %s", me_, op.requestid());
+            return {cached.success, cached.value};
         }
     
         // operations that modify the key-value store
         ABSL_LOG(INFO) << absl::StrFormat("Server %d is applying Op: %s", me_, op.requestid());
 
+        OpOutput output = executeOp(op, version);
+        if (op.clientid() != 0)
+            sessions_.Record(op.clientid(), op.clientseq(), {output.success, output.value});
+        return output;
+    }
+
+    // Run an operation which does not modify the key-value store
+    OpOutput executeRead(const Op& op) {
+        if (op.type() != GET)
+            return executeOp(op, 0);
+
+        OpOutput output{false, ""};
+        output.success = store_->Get(op.row(), op.col(), output.value, output.version, op.lockid());
+        if (!output.success)
+            output.value = "";
+        return output;
+    }
+
+    // Run an operation other than GET against the key-value store, writing values with version
+    // The values read by a transaction are also packed into the value of the output, which the
+    // sessions keep, so that a retried transaction gets them back.
+    OpOutput executeOp(const Op& op, uint64_t version) {
         OpOutput output;
         switch (op.type()) {
             case PUT:
-                output.success = store_->Put(op.row(), op.col(), op.newvalue(), op.lockid());
+                output.success = store_->Put(op.row(), op.col(), op.newvalue(), op.lockid(), version);
                 break;
             case CPUT:
-                output.success = store_->CPut(op.row(), op.col(), op.currvalue(), op.newvalue(), op.lockid());
+                output.success = store_->CPut(op.row(), op.col(), op.currvalue(), op.newvalue(), op.lockid(), version);
+                break;
+            case PUTIFVERSION:
+                output.success = store_->PutIfVersion(op.row(), op.col(), op.version(), op.newvalue(), op.lockid(), version);
+                break;
+            case APPEND_LINE:
+            case REMOVE_LINE_BY_PREFIX:
+            case REPLACE_LINE:
+                output.success = store_->Update(op.row(), op.col(), [&op](std::string& value) {
+                    return editLines(op, value);
+                }, op.lockid(), version);
                 break;
             case DELETE:
                 output.success = store_->Delete(op.row(), op.col(), op.lockid());
                 break;
+            case TXN:
+                output.success = executeTxn(op, version, output.values);
+                break;
             case SETNX:
                 output.success = store_->SetNX(op.row(), op.lockid());
                 break;
@@ -329,9 +1070,167 @@ private:
         }
 
         output.value = "";
-        visitedRequests_[op.requestid()] = output;
+        if (op.type() == TXN) {
+            TxnReply packed;
+            for (const std::string& value : output.values)
+                packed.add_values(value);
+            output.value = packed.SerializeAsString();
+        }
         return output;
     }
+
+    // The version of the values written by the operation at position index of the slot, 0 unless
+    // the slot holds a batch. Every write gets its own version, so that a version read between
+    // two writes of a batch to the same cell is never the version of the later one, and versions
+    // grow with every write. Versions start at 1 << VERSION_INDEX_BITS, as 0 stands for a missing
+    // cell, and are larger than the slot + 1 older servers gave.
+    static uint64_t writeVersion(int slot, int index) {
+        return ((static_cast<uint64_t>(slot) + 1) << VERSION_INDEX_BITS) | static_cast<uint64_t>(index);
+    }
+
+    // Run a transaction, or one phase of it, against the key-value store, all or nothing
+    // TXN_ONE_PHASE runs the operations with their own locks, and applies the writes if they all succeed.
+    // TXN_PREPARE runs the operations in the same way but drops the writes, and locks their rows for
+    // the transaction instead, so that nothing else changes them until TXN_COMMIT. TXN_COMMIT runs
+    // them again with their checks, applies the writes if they all succeed and unlocks the rows
+    // either way. The checks pass while the locks are held, but a lock may expire before its client
+    // commits, and whatever changed the rows since must not be overwritten blindly: the commit then
+    // fails on this cluster alone, and the client reports the transaction as partly applied.
+    // TXN_ABORT unlocks the rows. Rows locked by a transaction whose client never commits nor aborts
+    // are freed once their locks expire.
+    // The values of the GET operations are returned in order.
+    bool executeTxn(const Op& op, uint64_t version, std::vector<std::string>& values) {
+        const std::string& txnId = op.lockid();
+        bool committed = true;
+        bool applied = store_->Transact([&](Store::Txn& txn) {
+            if (op.phase() == TXN_ABORT) {
+                for (const Op& txnOp : op.ops())
+                    txn.Unlock(txnOp.row(), txnId);
+                return true;
+            }
+
+            if (op.phase() == TXN_COMMIT) {
+                for (const Op& txnOp : op.ops()) {
+                    if (committed && (!txn.Accessible(txnOp.row(), txnId) || !executeTxnOp(txn, txnOp, version, values))) {
+                        committed = false;
+                        txn.DropWrites();
+                    }
+                }
+                for (const Op& txnOp : op.ops())
+                    txn.Unlock(txnOp.row(), txnId);
+                return true;
+            }
+
+            for (const Op& txnOp : op.ops()) {
+                const std::string& lockId = op.phase() == TXN_ONE_PHASE ? txnOp.lockid() : txnId;
+                if (!txn.Accessible(txnOp.row(), lockId) || !executeTxnOp(txn, txnOp, version, values))
+                    return false;
+            }
+
+            if (op.phase() == TXN_PREPARE) {
+                txn.DropWrites();
+                for (const Op& txnOp : op.ops())
+                    txn.Lock(txnOp.row(), txnId);
+            }
+            return true;
+        });
+        return applied && committed;
+    }
+
+    // Run one operation of a transaction, see executeTxn()
+    // A GET fails if the cell is missing, and a CHECKVERSION if the cell has another version than the
+    // one given, 0 for a missing cell. The other operations succeed or fail as they do on their own.
+    static bool executeTxnOp(Store::Txn& txn, const Op& op, uint64_t version, std::vector<std::string>& values) {
+        std::string value;
+        uint64_t currVersion = 0;
+        bool found = txn.Read(op.row(), op.col(), value, currVersion);
+
+        switch (op.type()) {
+            case GET:
+                if (!found)
+                    return false;
+                values.push_back(value);
+                return true;
+            case CHECKVERSION:
+                return (found ? currVersion : 0) == op.version();
+            case PUT:
+                txn.Write(op.row(), op.col(), op.newvalue(), version);
+                return true;
+            case CPUT:
+                if (!found || value != op.currvalue())
+                    return false;
+                txn.Write(op.row(), op.col(), op.newvalue(), version);
+                return true;
+            case PUTIFVERSION:
+                if ((found ? currVersion : 0) != op.version())
+                    return false;
+                txn.Write(op.row(), op.col(), op.newvalue(), version);
+                return true;
+            case APPEND_LINE:
+            case REMOVE_LINE_BY_PREFIX:
+            case REPLACE_LINE:
+                if (!found || !editLines(op, value))
+                    return false;
+                txn.Write(op.row(), op.col(), value, version);
+                return true;
+            case DELETE:
+                txn.Delete(op.row(), op.col());
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Edit the lines of an index cell, such as the file and folder indexes of the storage service
+    // A line matches a prefix if it is the prefix, or starts with the prefix and a space, so that
+    // lines are found by their first field. A prefix ending with a newline matches the whole line,
+    // for lines with spaces in them. The prefix is in CurrValue and the new line in NewValue.
+    // APPEND_LINE adds the line at the end, unless a line matches the prefix, if any.
+    // REMOVE_LINE_BY_PREFIX removes the first line matching the prefix.
+    // REPLACE_LINE replaces the first line matching the prefix with the new line.
+    // Returns false, leaving the value as it is, if the edit does not apply.
+    static bool editLines(const Op& op, std::string& value) {
+        std::string_view prefix = op.currvalue();
+        bool wholeLine = !prefix.empty() && prefix.back() == '\n';
+        if (wholeLine)
+            prefix.remove_suffix(1);
+        const std::string& line = op.newvalue();
+        if (line.find('\n') != std::string::npos)
+            return false;
+
+        // Find the first line matching the prefix
+        size_t start = 0, end = 0;
+        bool found = false;
+        for (; start < value.size(); start = end + 1) {
+            end = std::min(value.find('\n', start), value.size());
+            std::string_view current(value.data() + start, end - start);
+            found = current.substr(0, prefix.size()) == prefix && (current.size() == prefix.size() || (!wholeLine && current[prefix.size()] == ' '));
+            if (found)
+                break;
+        }
+
+        switch (op.type()) {
+            case APPEND_LINE:
+                if (found && !op.currvalue().empty())
+                    return false;
+                if (!value.empty() && value.back() != '\n')
+                    value.push_back('\n');
+                value.append(line).push_back('\n');
+                return true;
+            case REMOVE_LINE_BY_PREFIX:
+                if (!found)
+                    return false;
+                value.erase(start, end - start + (end < value.size() ? 1 : 0));
+                return true;
+            case REPLACE_LINE:
+                if (!found)
+                    return false;
+                value.replace(start, end - start, line);
+                return true;
+            default:
+                return false;
+        }
+    }
 };
 
 #endif
\ No newline at end of file
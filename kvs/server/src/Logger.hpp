@@ -6,125 +6,523 @@
 #include <filesystem>
 #include <vector>
 #include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define GLOBAL_SEQ_LOG "global_seq.state"
+#define SNAPSHOT_PREFIX "snapshot-"
+
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define LOG_SYNC_INTERVAL_MS 100
+#define LOG_RECORD_HEADER_SIZE 8
+#define LOG_MAX_BATCH_SIZE (4 * 1024 * 1024)
+#define LOG_RECOVERY_MIN_RECORDS 1024  // minimum number of records per recovery thread
 
 namespace fs = std::filesystem;
 
+/**
+ * @brief A segmented, append-only write-ahead log of decided operations.
+ * @author Lang Qin
+ *
+ * The log is a sequence of segment files "[logDir_]/N.wal". Each segment is
+ * preallocated to LOG_SEGMENT_SIZE bytes and filled with records of the form
+ *
+ *   fixed32 length | fixed32 crc32c(payload) | payload
+ *
+ * where the payload is the fixed64 global sequence number followed by the serialized Op.
+ * Recovery reads the records of a segment until it finds a zero length (the
+ * preallocated tail) or a record whose checksum does not match (a torn write), and
+ * then moves on to the next segment. A new segment is started every time the log is
+ * opened for writing, so a torn tail is never appended to.
+ *
+ * Segments are memory mapped for recovery. Record boundaries are found with a quick
+ * walk over the length fields, then the records are checksummed and parsed in
+ * parallel across cores.
+ *
+ * Log() takes a run of records at once, which it writes with as few writes as
+ * LOG_MAX_BATCH_SIZE allows and, depending on the durability mode, a single fsync.
+ * The caller groups the records, e.g. every slot decided by the time it logs.
+ *
+ * Durability modes:
+ * 1. NONE: records are handed to the OS, never explicitly synced.
+ * 2. PERIODIC: a background thread syncs the log every LOG_SYNC_INTERVAL_MS.
+ * 3. EVERY_COMMIT: Log() returns only after the records are synced to disk.
+ *
+ * Logs written by older versions ("[logDir_]/N.log", one Op per file, plus
+ * GLOBAL_SEQ_LOG) are replayed before the segments.
+ *
+ * Snapshots of the key-value store are kept next to the segments in folders
+ * "[logDir_]/snapshot-S", where S is the last global sequence number they cover.
+ * Once a snapshot is complete, Truncate(S) drops every segment and older snapshot,
+ * so recovery only loads the latest snapshot and replays the records after it.
+ *
+ * APIs:
+ * 1. bool Recoverable():
+ *     Check if there is any log to recover from.
+ * 2. void RecoverOps(std::vector<LogRecord>& records):
+ *     Recover all the logged operations, in the order they were logged.
+ * 3. bool Log(const std::vector<LogRecord>& records):
+ *     Append a run of operations to the log.
+ * 4. std::string SnapshotPath(int globalSeq):
+ *     Get the folder of the snapshot covering up to globalSeq.
+ * 5. bool LatestSnapshot(std::string& path, int& globalSeq):
+ *     Find the latest complete snapshot.
+ * 6. void Truncate(int globalSeq):
+ *     Drop the log and the snapshots older than the snapshot at globalSeq.
+ * 7. void ReadSince(int globalSeq, std::vector<LogRecord>& records):
+ *     Read the logged operations decided after globalSeq, while the log is written.
+*/
+
 class Logger {
 public:
-    Logger(const std::string& directory) {
+    enum class Durability { NONE, PERIODIC, EVERY_COMMIT };
+
+    struct LogRecord {
+        int globalSeq;  // the global sequence number the operation was decided at
+        Op op;          // the operation
+    };
+
+    Logger(const std::string& directory, Durability durability = Durability::PERIODIC) : durability_(durability) {
         logDir_ = fs::path(directory);
+
+        if (durability_ == Durability::PERIODIC) {
+            syncer_ = std::thread([this]() {
+                syncPeriodically();
+            });
+        }
+    }
+
+    ~Logger() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stop_ = true;
+        }
+        stopCv_.notify_all();
+        if (syncer_.joinable())
+            syncer_.join();
+
+        std::lock_guard<std::mutex> lock(ioMu_);
+        if (fd_ >= 0) {
+            if (durability_ != Durability::NONE)
+                ::fdatasync(fd_);
+            ::close(fd_);
+        }
+    }
+
+    /**
+     * @brief Parse a durability mode from its name: "none", "periodic" or "commit".
+     *
+     * @return true if the name is valid, false otherwise.
+    */
+    static bool ParseDurability(const std::string& name, Durability& durability) {
+        if (name == "none")
+            durability = Durability::NONE;
+        else if (name == "periodic")
+            durability = Durability::PERIODIC;
+        else if (name == "commit")
+            durability = Durability::EVERY_COMMIT;
+        else
+            return false;
+        return true;
     }
 
     /**
-     * @brief Recover the state of the key-value store from the log files.
-     * 
-     * @return if there is any recoverable state, return the global sequence number.
+     * @brief Check if there is any log to recover the key-value store from.
+     *
+     * @return true if there is any recoverable state, false otherwise.
     */
     bool Recoverable() {
         if (!fs::exists(logDir_))
             return false;
 
-        counter_ = getMaxLogIndex() + 1;
-        return counter_ > 0;
+        legacyCount_ = getMaxLogIndex(".log") + 1;
+        segments_ = listSegments();
+
+        if (legacyCount_ > 0) {
+            std::ifstream globalSeqFile(logDir_ / GLOBAL_SEQ_LOG);
+            globalSeqFile >> legacyGlobalSeq_;
+        }
+
+        return legacyCount_ > 0 || !segments_.empty();
     }
 
     /**
-     * @brief Recover the state of the key-value store from the log files.
-     * 
-     * @param int the global sequence number to be recovered
-     * @return true if the state is recovered successfully, false otherwise.
+     * @brief Recover all the logged operations. Legacy logs come first, then the
+     * segments in order. Must be called after Recoverable().
+     *
+     * @param records the vector to store the operations, in the order they were logged
     */
-    bool RecoverGlobalSeq(int& globalSeq) {
-        std::ifstream globalSeqFile(logDir_ / GLOBAL_SEQ_LOG);
-        if (!globalSeqFile.is_open()) {
-            return false;
+    void RecoverOps(std::vector<LogRecord>& records) {
+        for (int i = 0; i < legacyCount_; i++) {
+            std::ifstream ifs(logDir_ / (std::to_string(i) + ".log"));
+            if (!ifs.is_open()) {
+                throw std::runtime_error("Can't open log file.");
+            }
+
+            LogRecord record;
+            record.op.ParseFromIstream(&ifs);
+            record.globalSeq = legacyGlobalSeq_;
+            records.push_back(std::move(record));
         }
 
-        globalSeqFile >> globalSeq;
-        globalSeqFile.close();
+        for (int number : segments_)
+            recoverSegment(number, records);
+    }
 
-        ABSL_LOG(INFO) << absl::StrFormat("Recovered globalseq %d from log directory %s", globalSeq, logDir_.string());
+    /**
+     * @brief Log a run of operations. Blocks until the records are written, and synced
+     * to disk in EVERY_COMMIT mode. The whole run shares one sync.
+     * Only one caller may log at a time.
+     *
+     * @param records the operations to be logged, with the global sequence numbers they were decided at
+     * @return true if the operations are logged successfully, false otherwise.
+    */
+    bool Log(const std::vector<LogRecord>& records) {
+        std::string batch, record;
+        for (size_t i = 0; i < records.size(); i++) {
+            encodeRecord(records[i].op, records[i].globalSeq, record);
+            batch.append(record);
 
+            bool last = i + 1 == records.size();
+            if (last || batch.size() >= LOG_MAX_BATCH_SIZE) {
+                if (!appendBatch(batch, last))
+                    return false;
+                batch.clear();
+            }
+        }
         return true;
     }
 
     /**
-     * @brief Check if there is any operation left to recover.
-     * 
-     * @return true if there is any operation left to recover, false otherwise.
+     * @brief Get the folder of the snapshot covering up to globalSeq.
     */
-    bool HasNextOp() {
-        return currLogIndex_ < counter_;
+    std::string SnapshotPath(int globalSeq) {
+        if (!fs::exists(logDir_)) {
+            fs::create_directories(logDir_);
+        }
+        return (logDir_ / (SNAPSHOT_PREFIX + std::to_string(globalSeq))).string();
     }
 
     /**
-     * @brief Recover the next operation from the log file.
-     * 
-     * @param op the operation to be recovered
+     * @brief Find the latest complete snapshot in the log directory.
+     *
+     * @param path the folder of the snapshot
+     * @param globalSeq the last global sequence number covered by the snapshot
+     * @return true if there is any snapshot, false otherwise.
     */
-    void RecoverOp(Op& op) {
-        std::ifstream ifs(logDir_ / (std::to_string(currLogIndex_) + ".log"));
-        if (!ifs.is_open()) {
-            throw std::runtime_error("Can't open log file.");
+    bool LatestSnapshot(std::string& path, int& globalSeq) {
+        std::vector<int> snapshots = listSnapshots();
+        if (snapshots.empty())
+            return false;
+
+        globalSeq = snapshots.back();
+        path = SnapshotPath(globalSeq);
+        return true;
+    }
+
+    /**
+     * @brief Drop every log record and every snapshot older than the snapshot at
+     * globalSeq. Later records go to a new segment.
+     * Caller must make sure every record up to globalSeq has been logged and no
+     * later one has.
+     *
+     * @param globalSeq the last global sequence number covered by the latest snapshot
+    */
+    void Truncate(int globalSeq) {
+        std::lock_guard<std::mutex> lock(ioMu_);
+
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+
+        for (const auto& entry : fs::directory_iterator(logDir_)) {
+            fs::path path = entry.path();
+            if (entry.is_regular_file() && (path.extension() == ".wal" || path.extension() == ".log" || path.filename() == GLOBAL_SEQ_LOG))
+                fs::remove(path);
+        }
+
+        for (int seq : listSnapshots()) {
+            if (seq < globalSeq)
+                fs::remove_all(SnapshotPath(seq));
         }
 
-        op.ParseFromIstream(&ifs);
-        ifs.close();
-        currLogIndex_++;
+        ABSL_LOG(INFO) << absl::StrFormat("Truncated log up to globalseq %d in %s", globalSeq, logDir_.string());
     }
 
     /**
-     * @brief Log an operation to the log file.
-     * 
-     * @param op the operation to be logged
-     * @param globalSeq the global sequence number
-     * @return true if the operation is logged successfully, false otherwise.
+     * @brief Read the logged operations decided after globalSeq from the segments, while
+     * the log may be appended to. A record being written is seen as a torn tail and skipped.
+     * Legacy logs are never read. Caller must make sure Truncate() is not called meanwhile.
+     *
+     * @param globalSeq the last global sequence number not to read
+     * @param records the vector to store the operations, in the order they were logged
     */
-    bool Log(Op& op, int globalSeq) {
+    void ReadSince(int globalSeq, std::vector<LogRecord>& records) {
+        if (!fs::exists(logDir_))
+            return;
+
+        for (int number : listSegments()) {
+            std::vector<LogRecord> segment;
+            recoverSegment(number, segment);
+            for (LogRecord& record : segment) {
+                if (record.globalSeq > globalSeq)
+                    records.push_back(std::move(record));
+            }
+        }
+    }
+
+private:
+    fs::path logDir_;          // The directory where the log files are stored.
+    Durability durability_;    // When records are synced to disk.
+
+    // Recovery state
+    int legacyCount_ = 0;            // The number of log files written by older versions.
+    int legacyGlobalSeq_ = -1;       // The global sequence number of the older log files.
+    std::vector<int> segments_;      // The segment numbers in increasing order.
+
+    // Sync thread state
+    std::mutex mu_;                       // lock for stop_
+    std::condition_variable stopCv_;      // signals the sync thread to stop
+    bool stop_ = false;                   // whether the sync thread should exit
+    std::thread syncer_;                  // periodic sync thread
+
+    // Segment being written, guarded by ioMu_
+    std::mutex ioMu_;
+    int fd_ = -1;               // file descriptor of the current segment
+    uint64_t writeOffset_ = 0;  // next write offset in the current segment
+    bool dirty_ = false;        // whether there are unsynced records
+
+    // Path of the segment file with the given number
+    fs::path segmentPath(int number) {
+        return logDir_ / (std::to_string(number) + ".wal");
+    }
+
+    // Write a batch of records to the current segment, rolling over to a new one if needed
+    // The batch is synced in EVERY_COMMIT mode if sync is set
+    bool appendBatch(const std::string& batch, bool sync) {
+        std::lock_guard<std::mutex> lock(ioMu_);
+
+        if (fd_ < 0 || (writeOffset_ > 0 && writeOffset_ + batch.size() > LOG_SEGMENT_SIZE)) {
+            if (!openNextSegment())
+                return false;
+        }
+
+        size_t written = 0;
+        while (written < batch.size()) {
+            ssize_t n = ::pwrite(fd_, batch.data() + written, batch.size() - written, writeOffset_ + written);
+            if (n < 0)
+                return false;
+            written += n;
+        }
+        writeOffset_ += batch.size();
+        dirty_ = true;
+
+        if (sync && durability_ == Durability::EVERY_COMMIT) {
+            if (::fdatasync(fd_) != 0)
+                return false;
+            dirty_ = false;
+        }
+        return true;
+    }
+
+    // Close the current segment and start a new preallocated one
+    // Caller must hold ioMu_
+    bool openNextSegment() {
+        if (fd_ >= 0) {
+            if (durability_ != Durability::NONE)
+                ::fdatasync(fd_);
+            ::close(fd_);
+            fd_ = -1;
+        }
+
         if (!fs::exists(logDir_)) {
-            fs::create_directory(logDir_);
+            fs::create_directories(logDir_);
         }
 
-        // Log the operation
-        std::ofstream ofs(logDir_ / (std::to_string(counter_) + ".log"));
-        if (!ofs.is_open()) {
+        int number = getMaxLogIndex(".wal") + 1;
+        fd_ = ::open(segmentPath(number).c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd_ < 0)
             return false;
+
+        // Preallocate so that appends do not change the file size
+        ::posix_fallocate(fd_, 0, LOG_SEGMENT_SIZE);
+        writeOffset_ = 0;
+        return true;
+    }
+
+    // Sync the log every LOG_SYNC_INTERVAL_MS until asked to stop
+    void syncPeriodically() {
+        std::unique_lock<std::mutex> lock(mu_);
+        while (!stopCv_.wait_for(lock, std::chrono::milliseconds(LOG_SYNC_INTERVAL_MS), [this]() { return stop_; })) {
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> ioLock(ioMu_);
+                if (fd_ >= 0 && dirty_) {
+                    ::fdatasync(fd_);
+                    dirty_ = false;
+                }
+            }
+            lock.lock();
         }
+    }
 
-        op.SerializeToOstream(&ofs);
-        ofs.close();
+    // Encode an operation and its global sequence number into a record
+    static void encodeRecord(const Op& op, int globalSeq, std::string& record) {
+        std::string payload;
+        for (int i = 0; i < 8; i++)
+            payload.push_back(static_cast<char>((static_cast<uint64_t>(globalSeq) >> (8 * i)) & 0xff));
+        op.AppendToString(&payload);
 
-        // Log the global sequence number
-        std::ofstream globalSeqFile(logDir_ / GLOBAL_SEQ_LOG);
-        if (!globalSeqFile.is_open()) {
-            return false;
+        record.clear();
+        putFixed32(record, payload.size());
+        putFixed32(record, crc32c(payload.data(), payload.size()));
+        record.append(payload);
+    }
+
+    // Map a segment into memory and append its valid records to records
+    void recoverSegment(int number, std::vector<LogRecord>& records) {
+        int fd = ::open(segmentPath(number).c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Can't open log file.");
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return;
         }
-        globalSeqFile << globalSeq;
 
-        counter_++;
-        return true;
+        size_t size = st.st_size;
+        void* addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("Can't map log file.");
+        ::madvise(addr, size, MADV_WILLNEED);
+
+        // Walk the length fields to find where each record starts
+        const char* data = static_cast<const char*>(addr);
+        std::vector<size_t> offsets;
+        size_t offset = 0;
+        while (offset + LOG_RECORD_HEADER_SIZE <= size) {
+            uint32_t length = decodeFixed32(data + offset);
+            if (length < 8 || length > size - offset - LOG_RECORD_HEADER_SIZE)
+                break;
+            offsets.push_back(offset);
+            offset += LOG_RECORD_HEADER_SIZE + length;
+        }
+
+        // Verify and parse the records in parallel, each thread taking a contiguous range
+        size_t base = records.size();
+        records.resize(base + offsets.size());
+        std::vector<char> valid(offsets.size(), 0);
+
+        size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), offsets.size() / LOG_RECOVERY_MIN_RECORDS + 1);
+        size_t chunk = (offsets.size() + numThreads - 1) / numThreads;
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < numThreads; t++) {
+            threads.emplace_back([&, t]() {
+                for (size_t i = t * chunk; i < std::min(offsets.size(), (t + 1) * chunk); i++)
+                    valid[i] = parseRecord(data + offsets[i], records[base + i].op, records[base + i].globalSeq);
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        ::munmap(addr, size);
+
+        // Everything after a torn record is discarded
+        size_t count = std::find(valid.begin(), valid.end(), 0) - valid.begin();
+        records.resize(base + count);
     }
 
-private:
+    // Verify and decode a record whose length field has already been checked
+    static bool parseRecord(const char* p, Op& op, int& globalSeq) {
+        uint32_t length = decodeFixed32(p);
+        uint32_t crc = decodeFixed32(p + 4);
+        const char* payload = p + LOG_RECORD_HEADER_SIZE;
+        if (crc32c(payload, length) != crc)
+            return false;
+
+        uint64_t seq = 0;
+        for (int i = 0; i < 8; i++)
+            seq |= static_cast<uint64_t>(static_cast<unsigned char>(payload[i])) << (8 * i);
+        globalSeq = static_cast<int>(seq);
+
+        return op.ParseFromArray(payload + 8, length - 8);
+    }
+
+    static void putFixed32(std::string& dst, uint32_t v) {
+        for (int i = 0; i < 4; i++)
+            dst.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+    }
 
-    fs::path logDir_;  // The directory where the log files are stored.
-    int counter_ = 0;  // The counter for the log files.
-    int currLogIndex_ = 0;  // The current log index for recovery.
+    static uint32_t decodeFixed32(const char* p) {
+        uint32_t v = 0;
+        for (int i = 0; i < 4; i++)
+            v |= static_cast<uint32_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+        return v;
+    }
 
-    // Search for the highest log index in the log directory,
-    // where log files are named as "index.log" and index increases
-    // by 1 for each log file.
-    int getMaxLogIndex() {
+    // CRC-32C (Castagnoli) checksum
+    static uint32_t crc32c(const char* data, size_t size) {
+        static const std::vector<uint32_t> table = []() {
+            std::vector<uint32_t> t(256);
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+
+        uint32_t crc = 0xffffffff;
+        for (size_t i = 0; i < size; i++)
+            crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+        return crc ^ 0xffffffff;
+    }
+
+    // List the global sequence numbers of the complete snapshots in increasing order
+    std::vector<int> listSnapshots() {
+        std::vector<int> snapshots;
+        if (!fs::exists(logDir_))
+            return snapshots;
+
+        for (const auto& entry : fs::directory_iterator(logDir_)) {
+            std::string name = entry.path().filename().string();
+            if (entry.is_directory() && name.rfind(SNAPSHOT_PREFIX, 0) == 0 && entry.path().extension() != ".tmp")
+                snapshots.push_back(std::stoi(name.substr(std::string(SNAPSHOT_PREFIX).size())));
+        }
+        std::sort(snapshots.begin(), snapshots.end());
+        return snapshots;
+    }
+
+    // List the segment numbers in the log directory in increasing order
+    std::vector<int> listSegments() {
+        std::vector<int> segments;
+        for (const auto& entry : fs::directory_iterator(logDir_)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".wal")
+                segments.push_back(std::stoi(entry.path().stem().string()));
+        }
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    // Search for the highest index of the files with the given extension in the
+    // log directory, where files are named as "index.ext".
+    int getMaxLogIndex(const std::string& ext) {
         int maxIndex = -1;
+        if (!fs::exists(logDir_))
+            return maxIndex;
 
         for (const auto& entry : fs::directory_iterator(logDir_)) {
-            if (entry.is_regular_file()) {
-                std::string filename = entry.path().filename().string();
-                if (filename.size() > 4 && filename.substr(filename.size() - 4) == ".log")
-                    maxIndex = std::max(maxIndex, std::stoi(filename.substr(0, filename.size() - 4)));
-            }
+            if (entry.is_regular_file() && entry.path().extension() == ext)
+                maxIndex = std::max(maxIndex, std::stoi(entry.path().stem().string()));
         }
 
         return maxIndex;
@@ -132,4 +530,4 @@ private:
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -4,12 +4,33 @@
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/create_channel.h>
 #include <grpcpp/client_context.h>
+#include <grpcpp/alarm.h>
 #include "proto/paxos.pb.h"
 #include "proto/paxos.grpc.pb.h"
 
 #include <thread>
+#include <chrono>
+#include <climits>
+#include <map>
+#include <functional>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <random>
 
 #define PEER_ID_BITS 8
+#define LEADER_HEARTBEAT_MS 100  // interval between two heartbeats of the leader
+#define LEADER_TIMEOUT_MS 500    // time without hearing from the leader before taking over
+#define LEADER_LEASE_MS 400      // how long a heartbeat acknowledged by a majority lets the leader serve reads
+#define PAXOS_CQ_THREADS 2       // threads completing the async RPCs to peers
+#define PAXOS_RPC_TIMEOUT_MS 1000  // deadline of the RPCs to peers
+#define DECIDE_RETRY_MAX_MS 1000   // longest delay between two tries of a Decide RPC
+#define DECIDE_MAX_TRIES 10        // tries of a Decide RPC, a peer still not reached learns the slot when it proposes there
+#define LEADER_PROGRESS_HISTORY 64  // number of heartbeats remembered to tell how far behind the leader a replica is
+#define INSTANCE_WINDOW_INITIAL 1024  // initial capacity of the window of instances, a power of two
+#define SNAPSHOT_FETCH_TIMEOUT_MS (10 * 60 * 1000)  // deadline of a state transfer from a peer
+#define PAXOS_MAX_MESSAGE_BYTES (1024 * 1024 * 1024)  // largest message received from a peer, as large as a value may be
+#define VALUE_FETCH_RETRY_MS 100      // delay before asking the next peer for a value the previous one did not send
 
 /**
  * @brief A Paxos implementation. It is used to be included in an application.
@@ -18,34 +39,125 @@
  * Manages a sequence of agreed values with a fixed set of peers. This implementation
  * copes with network failures (partitions, message loss, duplication) and peer failures.
  * 
+ * Multi-Paxos: a peer becomes the leader by running one Prepare phase that covers every
+ * slot from Min() on. Acceptors promise the leader's proposal number for all those slots
+ * and report what they have accepted, which the leader proposes again. From then on the
+ * leader runs only the Accept and Decide phases for each slot. Other peers forward their
+ * proposals to the leader. The leader sends a heartbeat every LEADER_HEARTBEAT_MS, and a
+ * peer that has not heard from any leader for LEADER_TIMEOUT_MS takes over on its next
+ * proposal. A leader steps down as soon as an acceptor reports a higher promise.
+ * 
+ * RPCs to peers go through async stubs. PAXOS_CQ_THREADS threads drive the completion
+ * queues and run the reply handlers, and retries wait on timers of the same queues, so
+ * proposing never creates a thread or blocks one.
+ * 
+ * Leases: a peer which heard from the leader in the last LEADER_TIMEOUT_MS refuses to
+ * promise to anyone else, and so does a peer which just started. Once a majority has
+ * acknowledged a heartbeat, no other peer can become the leader for LEADER_LEASE_MS
+ * from the time it was sent, so the leader knows every decided value until then and
+ * can serve reads without running a round. The read index is the highest slot known
+ * decided, or reported at the election, and a read is linearizable once the
+ * application has applied every slot up to it.
+ * 
+ * Instances live in a sliding window indexed by seq - Min(), kept in a ring buffer.
+ * Whenever Min() moves up, the instances below it are released in O(1) each while the
+ * lock is already held for the update of the done values.
+ * 
+ * Every heartbeat carries the highest slot the leader knows decided. Peers remember the
+ * last LEADER_PROGRESS_HISTORY of them, so that the application can tell how far behind
+ * the leader it is and serve reads which tolerate some staleness without asking anyone.
+ * 
+ * Values: a value is identified by an id assigned by the peer which first proposes it,
+ * and is sent to a peer only when the peer may not have it yet, i.e. once to the leader
+ * in Forward and once to each acceptor in Accept. Prepare replies, Decide and every
+ * retry carry the id alone, and a peer missing the value asks for it again. Instances
+ * share the value by pointer, so consensus traffic and memory do not grow with the size
+ * of the value. A peer which learns only the id of a decided value fetches the value
+ * from its peers before Status() and Wait() report the slot as decided.
+ * 
+ * State transfer: a peer which missed slots its peers have forgotten, or too many of
+ * them to catch up one by one, fetches the state of the application from a peer with
+ * FetchSnapshot(). The InstallSnapshot RPC streams whatever the application of that
+ * peer sends through its snapshot source.
+ * 
  * APIs:
  * 1. PaxosImpl(std::vector<std::string> peersIP, int me): Constructor
- * 2. void Start(int seq, const std::string& v): 
- *      Start a new proposal with seq number and value
+ * 2. uint64_t Start(int seq, const Op& v): 
+ *      Start a new proposal with seq number and value, and get the id of the value
  * 3. bool Status(int seq, std::string& value): 
  *      Check if the seq number is decided and return the value if it is
- * 4. void Done(int seq): 
+ * 4. bool Wait(int seq, Op& value, int timeoutMs):
+ *      Block until the seq number is decided and return the value
+ * 5. void Done(int seq): 
  *      Called by the application when the application on this machine is done with all instances <= seq
- * 5. int MaxKnownSeq(): 
+ * 6. int MaxKnownSeq(): 
  *      Get the highest seq number scene, or -1
- * 6. int MinKnownSeq(): 
+ * 7. int MinKnownSeq(): 
  *      Get the minimum seq number where instances before this seq have been forgotten
+ * 8. int Leader():
+ *      Get the peer believed to be the leader, or -1
+ * 9. bool ReadIndex(int& seq):
+ *      Get the slot a linearizable read must wait for, from the leader holding the lease
+ * 10. bool Staleness(int appliedSeq, int& opsBehind, int& msBehind):
+ *      Get how far an application which applied every slot up to appliedSeq is behind the leader
+ * 11. void SetSnapshotSource(SnapshotSource source):
+ *      Set how the application streams its state to a lagging peer
+ * 12. bool FetchSnapshot(int appliedSeq, const std::function<bool(const SnapshotChunk&)>& onChunk):
+ *      Fetch the state a lagging application missed from a peer
+ * 13. bool WaitId(int seq, uint64_t& id, int timeoutMs):
+ *      Block until the seq number is decided and return the id of the value
 */
 
 class PaxosImpl final : public Paxos::Service {
 public:
-    PaxosImpl(std::vector<std::string> peersIP, int me) : me_(me), highestSeqSeen_(-1), doneFreed_(0) {
-        for (int i = 0; i < peersIP.size(); i++) {
+    // Sends a chunk to the lagging peer, false once the peer is gone
+    using SnapshotWriter = std::function<bool(const SnapshotChunk&)>;
+    // Streams every chunk a peer which applied every slot up to appliedSeq needs, false if there is none
+    using SnapshotSource = std::function<bool(int appliedSeq, const SnapshotWriter& write)>;
+
+    PaxosImpl(std::vector<std::string> peersIP, int me) : me_(me), highestSeqSeen_(-1), lastLeaderContact_(std::chrono::steady_clock::now()) {
+        // Ids of values start at a random point, so that they do not repeat after a restart
+        std::random_device rd;
+        uint64_t start = ((static_cast<uint64_t>(rd()) << 32) | rd()) & ((1ULL << (64 - PEER_ID_BITS)) - 1);
+        nextValueId_ = (static_cast<uint64_t>(me) << (64 - PEER_ID_BITS)) | start;
+
+        for (int i = 0; i < (int)peersIP.size(); i++) {
             peerDone_[i] = -1;
 
             if (i != me) {
-                std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(peersIP[i], grpc::InsecureChannelCredentials());
+                grpc::ChannelArguments channelArgs;
+                channelArgs.SetMaxReceiveMessageSize(PAXOS_MAX_MESSAGE_BYTES);
+
+                std::shared_ptr<grpc::Channel> channel = grpc::CreateCustomChannel(peersIP[i], grpc::InsecureChannelCredentials(), channelArgs);
                 std::shared_ptr<Paxos::Stub> stub = std::move(Paxos::NewStub(channel));
                 peers_.push_back(stub);
             } else {
                 peers_.push_back(nullptr);
             }
         }
+
+        for (int i = 0; i < PAXOS_CQ_THREADS; i++) {
+            cqs_.push_back(std::make_unique<grpc::CompletionQueue>());
+            grpc::CompletionQueue* cq = cqs_.back().get();
+            cqThreads_.emplace_back([this, cq]() {
+                pollCompletionQueue(cq);
+            });
+        }
+
+        runAfter(LEADER_HEARTBEAT_MS, [this]() {
+            sendHeartbeats();
+        });
+    }
+
+    ~PaxosImpl() {
+        {
+            std::lock_guard<std::mutex> lock(cqMu_);
+            stop_ = true;
+        }
+        for (auto& cq : cqs_)
+            cq->Shutdown();
+        for (auto& thread : cqThreads_)
+            thread.join();
     }
 
     /*       Paxos APIs       */
@@ -54,31 +166,13 @@ public:
      * @brief Start a new proposal with seq number and value.
      * Start() returns immediately and propose in the background.
      * One may call Status() to check if/when the agreement is decided.
+     *
+     * @return the id of the value, unique across peers and restarts, see WaitId()
     */
-    void Start(int seq, const Op& v) {
-        // Ignore if the seq number < Min()
-        if (seq < MinKnownSeq()) {
-            std::cout << "Ignore seq " << seq << " < Min()" << std::endl;
-            return;
-        }
-            
-
-        std::lock_guard<std::mutex> lock(mu_);
-
-        // Update highestSeqSeen_
-        if (seq > highestSeqSeen_)
-            highestSeqSeen_ = seq;
-
-        // Check if seq is already decided
-        auto it = instances_.find(seq);
-        if (it != instances_.end() && it->second.Decided)
-            return;
-
-        // Non-blocking
-        // Return immediate and propose in the background
-        std::thread([this, seq, v]() {
-            propose(seq, v);
-        }).detach();
+    uint64_t Start(int seq, const Op& v) {
+        uint64_t id = nextValueId_++;
+        start(seq, id, std::make_shared<const Op>(v));
+        return id;
     }
 
     /**
@@ -92,14 +186,50 @@ public:
     bool Status(int seq, Op& value) {
         std::lock_guard<std::mutex> lock(mu_);
 
-        if (instances_[seq].Decided) {
-            value = instances_[seq].DecidedV;
+        if (known(seq)) {
+            value = *instances_.Find(seq)->DecidedV;
             return true;
         } else {
             return false;
         }
     }
 
+    /**
+     * @brief Block until the seq number is decided and return the value.
+     * The caller is woken up as soon as the decision arrives, without polling.
+     * 
+     * @param seq seq number of the proposal
+     * @param value value of the proposal returned
+     * @param timeoutMs give up after this many milliseconds, or never if negative
+     * @return true if the seq number is decided, false on timeout or if it is forgotten
+    */
+    bool Wait(int seq, Op& value, int timeoutMs = -1) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (!waitKnown(lock, seq, timeoutMs))
+            return false;
+
+        value = *instances_.Find(seq)->DecidedV;
+        return true;
+    }
+
+    /**
+     * @brief Block until the seq number is decided and return the id of the value, which
+     * tells a proposer whether its own value won without copying the value.
+     *
+     * @param seq seq number of the proposal
+     * @param id id of the value decided, as returned by Start() on the peer proposing it
+     * @param timeoutMs give up after this many milliseconds, or never if negative
+     * @return true if the seq number is decided, false on timeout or if it is forgotten
+    */
+    bool WaitId(int seq, uint64_t& id, int timeoutMs = -1) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (!waitKnown(lock, seq, timeoutMs))
+            return false;
+
+        id = instances_.Find(seq)->DecidedId;
+        return true;
+    }
+
     /**
      * @brief Called by the application when the application on this machine is done with
      * all instances <= seq.
@@ -109,8 +239,10 @@ public:
     void Done(int seq) {
         std::lock_guard<std::mutex> lock(mu_);
         
-        if (seq > peerDone_[me_])
+        if (seq > peerDone_[me_]) {
             peerDone_[me_] = seq;
+            forgetDone();
+        }
     }
 
     /**
@@ -126,7 +258,6 @@ public:
 
     /**
      * @brief Get the minimum seq number which is marked as done by all peers.
-     * MinKnownSeq() requires mu_ lock
      * 
      * Paxos is required to have forgotten all information about any instances
      * it knows that are < Min(). This is to free up memeory in long-running
@@ -140,64 +271,180 @@ public:
      * @return int minSeq
     */
     int MinKnownSeq() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return getMinSeqNum();
+    }
+
+    /**
+     * @brief Get the peer believed to be the leader.
+     * 
+     * @return int index of the leader, or -1 if unknown
+    */
+    int Leader() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return leader_;
+    }
+
+    /**
+     * @brief Get the slot a linearizable read must wait for.
+     * Asks the leader unless this peer is the leader. Blocks for at most LEADER_TIMEOUT_MS.
+     * 
+     * @param seq highest slot the read must observe, or -1 if none
+     * @return true if the leader holds the lease, false otherwise
+    */
+    bool ReadIndex(int& seq) {
         std::unique_lock<std::mutex> lock(mu_);
-        int minSeq = getMinSeqNum();
+        if (holdsLease()) {
+            seq = std::max(highestDecidedSeq_, electionSeq_);
+            return true;
+        }
+        int leader = leader_;
+        lock.unlock();
+
+        if (leader < 0 || leader == me_)
+            return false;
+
+        grpc::ClientContext context;
+        context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(LEADER_TIMEOUT_MS));
+        ReadIndexArgs args;
+        ReadIndexReply reply;
+        args.set_sender(me_);
+        if (!peers_[leader]->ReadIndex(&context, args, &reply).ok() || !reply.ok())
+            return false;
+
+        seq = reply.seq();
+        return true;
+    }
 
-        // Free memory according to Done
+    /**
+     * @brief Get how far behind the leader an application is, from the recent heartbeats.
+     * 
+     * @param appliedSeq highest slot the application has applied
+     * @param opsBehind number of slots the leader knew decided past appliedSeq at the last heartbeat
+     * @param msBehind time since the leader knew no more slots than appliedSeq decided, or INT_MAX
+     * @return false if no leader has been heard from recently, true otherwise
+    */
+    bool Staleness(int appliedSeq, int& opsBehind, int& msBehind) {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto now = std::chrono::steady_clock::now();
+        if (leaderProgress_.empty() || now - leaderProgress_.back().first >= std::chrono::milliseconds(LEADER_TIMEOUT_MS))
+            return false;
+
+        opsBehind = std::max(0, leaderProgress_.back().second - appliedSeq);
+        msBehind = INT_MAX;
+        for (auto it = leaderProgress_.rbegin(); it != leaderProgress_.rend(); it++) {
+            if (it->second <= appliedSeq) {
+                msBehind = std::chrono::duration_cast<std::chrono::milliseconds>(now - it->first).count();
+                break;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Set how the application streams its state to a lagging peer.
+     * 
+     * @param source called by the InstallSnapshot RPC, or nullptr to refuse state transfers
+    */
+    void SetSnapshotSource(SnapshotSource source) {
+        std::lock_guard<std::mutex> lock(mu_);
+        snapshotSource_ = std::move(source);
+    }
+
+    /**
+     * @brief Fetch the state a lagging application missed from a peer.
+     * Asks the leader, or the other peers in turn if there is none. Blocks until the
+     * stream ends, for at most SNAPSHOT_FETCH_TIMEOUT_MS.
+     * 
+     * @param appliedSeq highest slot the application has applied
+     * @param onChunk called on every chunk in order, returns false to abort the transfer
+     * @return true if the whole stream was received and accepted, false otherwise
+    */
+    bool FetchSnapshot(int appliedSeq, const std::function<bool(const SnapshotChunk&)>& onChunk) {
+        std::unique_lock<std::mutex> lock(mu_);
+        int peer = leader_;
+        if (peer < 0 || peer == me_) {
+            nextSnapshotPeer_ = (nextSnapshotPeer_ + 1) % peers_.size();
+            if (nextSnapshotPeer_ == me_)
+                nextSnapshotPeer_ = (nextSnapshotPeer_ + 1) % peers_.size();
+            peer = nextSnapshotPeer_;
+        }
         lock.unlock();
-        collectGarbage();
 
-        return minSeq;
+        if (peer == me_)
+            return false;
+
+        ABSL_LOG(INFO) << absl::StrFormat("Peer %d is fetching a snapshot from peer %d after seq %d", me_, peer, appliedSeq);
+
+        grpc::ClientContext context;
+        context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(SNAPSHOT_FETCH_TIMEOUT_MS));
+        InstallSnapshotArgs args;
+        args.set_sender(me_);
+        args.set_applied(appliedSeq);
+
+        std::unique_ptr<grpc::ClientReader<SnapshotChunk>> reader = peers_[peer]->InstallSnapshot(&context, args);
+        SnapshotChunk chunk;
+        while (reader->Read(&chunk)) {
+            if (!onChunk(chunk)) {
+                context.TryCancel();
+                reader->Finish();
+                return false;
+            }
+        }
+        return reader->Finish().ok();
     }
 
     /*       RPC Calls       */
 
     /**
      * PRCCall Prepare
-     * @brief Handles Paxos prepare request
+     * @brief Handles Paxos prepare request for every slot >= Args.Seq
      * Cases:
-     * 1. Args.N > HighestSeen for seq number: accept
-     * 2. Args.N <= HighestSeen for seq number: reject
+     * 1. Another peer holds the lease: reject
+     * 2. Args.N > Promised: promise, and report every value accepted at a slot >= Args.Seq
+     * 3. Args.N <= Promised: reject
     */
-    grpc::Status Prepare(grpc::ServerContext* context, const PrepareArgs* args, PrepareReply* reply) override {
+    grpc::Status Prepare(grpc::ServerContext* /*context*/, const PrepareArgs* args, PrepareReply* reply) override {
         std::unique_lock<std::mutex> lock(mu_);
 
-        Instance acc;
-        // Check if this peer has accepted a proposal with the same seq number
-        auto it = acceptorIns_.find(args->seq());
-        if (it == acceptorIns_.end()) {
-            acc.HighestSeen = -1;
-            acc.HighestAcN = -1;
-        } else {
-            acc = it->second;
-        }
+        if (leaseGranted(args->sender())) {
+            // Reject this proposal until the lease of the leader expires
+            reply->set_ok(false);
 
-        if (args->n() > acc.HighestSeen) {
+            ABSL_LOG(INFO) << absl::StrFormat("RPCPrepare Reject: me %d, N %d, leader %d holds the lease", me_, args->n(), leader_);
+        } else if (args->n() > promised_) {
             // Can accept this proposal
-            acc.HighestSeen = args->n();
+            promised_ = args->n();
+            if (leader_ == me_)
+                leader_ = -1;
             reply->set_ok(true);
-            reply->set_na(acc.HighestAcN);
-            reply->set_allocated_va(new Op(acc.HighestAcV));
-            acceptorIns_[args->seq()] = acc;
 
-            ABSL_LOG(INFO) << absl::StrFormat("RPCPrepare OK: me %d, N %d, na %d, va %s", me_, args->n(), reply->na(), reply->va().requestid());
+            // A decided value is reported as accepted at the highest possible number
+            instances_.ForEach(args->seq(), [reply](int seq, const Instance& ins) {
+                if (!ins.Decided && ins.HighestAcN < 0)
+                    return;
+                AcceptedSlot* slot = reply->add_accepted();
+                slot->set_seq(seq);
+                slot->set_na(ins.Decided ? INT_MAX : ins.HighestAcN);
+                slot->set_vaid(ins.Decided ? ins.DecidedId : ins.HighestAcId);
+            });
+
+            ABSL_LOG(INFO) << absl::StrFormat("RPCPrepare OK: me %d, N %d, from seq %d, accepted %d", me_, args->n(), args->seq(), reply->accepted_size());
         } else {
             // Reject this proposal
             reply->set_ok(false);
 
-            ABSL_LOG(INFO) << absl::StrFormat("RPCPrepare Reject: me %d, N %d, HighestSeen %d", me_, args->n(), reply->na());
+            ABSL_LOG(INFO) << absl::StrFormat("RPCPrepare Reject: me %d, N %d, Promised %d", me_, args->n(), promised_);
         }
 
+        reply->set_promised(promised_);
         reply->set_done(peerDone_[me_]);
 
         // Retrieve and update the done value of the sender from args
-        if (args->done() > peerDone_[args->sender()])
+        if (args->done() > peerDone_[args->sender()]) {
             peerDone_[args->sender()] = args->done();
-                
-        lock.unlock();
-
-        // Free memory according to Done
-        collectGarbage();
+            forgetDone();
+        }
 
         return grpc::Status::OK;
     }
@@ -206,39 +453,52 @@ public:
      * PRCCall Accept
      * @brief Handles Paxos accept request
      * Cases:
-     * 1. Args.N >= HighestSeen for seq number in accept stage: accept
-     * 2. Args.N < HighestSeen for seq number in accept stage: reject
+     * 1. Args.N >= Promised: accept, and follow the sender as the leader
+     *    The slot is already decided and forgotten by every peer if Args.Seq < Min()
+     * 2. Args.N >= Promised, but the value is neither sent nor known here: ask for it
+     * 3. Args.N < Promised: reject
     */
-    grpc::Status Accept(grpc::ServerContext* context, const AcceptArgs* args, AcceptReply* reply) override {
-        std::lock_guard<std::mutex> lock(mu_);
+    grpc::Status Accept(grpc::ServerContext* /*context*/, const AcceptArgs* args, AcceptReply* reply) override {
+        std::unique_lock<std::mutex> lock(mu_);
 
-        Instance acc;
-        // Check if this peer has accepted a proposal with the same seq number
-        auto it = acceptorIns_.find(args->seq());
-        if (it == acceptorIns_.end()) {
-            acc.HighestSeen = -1;
-            acc.HighestAcN = -1;
-        } else {
-            acc = it->second;
+        // Copy a value sent along outside the lock, unless it is already known
+        Value value = findValue(args->vid());
+        if (!value && args->has_v()) {
+            lock.unlock();
+            value = std::make_shared<const Op>(args->v());
+            lock.lock();
         }
 
-        if (args->n() >= acc.HighestSeen) {
+        if (args->n() >= promised_ && !value && args->seq() >= instances_.Base()) {
+            // Ask the sender for the value before accepting
+            reply->set_ok(false);
+            reply->set_missing(true);
+
+            ABSL_LOG(INFO) << absl::StrFormat("RPCAccept Missing: me %d, seq %d, vid %d", me_, args->seq(), args->vid());
+        } else if (args->n() >= promised_) {
             // Accept this proposal
-            acc.HighestSeen = args->n();
-            acc.HighestAcN = args->n();
-            acc.HighestAcV = args->v();
-            acceptorIns_[args->seq()] = acc;
+            promised_ = args->n();
+            if (args->seq() >= instances_.Base()) {
+                Instance& acc = instances_.At(args->seq());
+                acc.HighestAcN = args->n();
+                acc.HighestAcId = args->vid();
+                acc.HighestAcV = internValue(args->vid(), value);
+            }
+            followLeader(args->sender());
+            if (args->seq() > highestSeqSeen_)
+                highestSeqSeen_ = args->seq();
             reply->set_ok(true);
             reply->set_n(args->n());
 
-            ABSL_LOG(INFO) << absl::StrFormat("RPCAccept OK: me %d, na %d, va %s", me_, reply->n(), args->v().requestid());
+            ABSL_LOG(INFO) << absl::StrFormat("RPCAccept OK: me %d, na %d, va %s", me_, reply->n(), value ? value->requestid() : "");
         } else {
             // Reject this proposal
             reply->set_ok(false);
 
-            ABSL_LOG(INFO) << absl::StrFormat("RPCAccept Reject: me %d, N %d, HighestSeen %d", me_, args->n(), acc.HighestSeen);
+            ABSL_LOG(INFO) << absl::StrFormat("RPCAccept Reject: me %d, N %d, Promised %d", me_, args->n(), promised_);
         }
 
+        reply->set_promised(promised_);
         return grpc::Status::OK;
     }
 
@@ -246,24 +506,145 @@ public:
      * PRCCall Decide
      * @brief Handles Paxos decide request by marking the seq num as decided
     */
-    grpc::Status Decide(grpc::ServerContext* context, const DecideArgs* args, DecideReply* reply) override {
+    grpc::Status Decide(grpc::ServerContext* /*context*/, const DecideArgs* args, DecideReply* reply) override {
+        std::unique_lock<std::mutex> lock(mu_);
+        learn(args->seq(), args->vid(), args->sender());
+        lock.unlock();
+
+        reply->set_ok(true);
+
+        ABSL_LOG(INFO) << absl::StrFormat("RPCDecide OK: me %d, seq %d, vid %d", me_, args->seq(), args->vid());
+
+        return grpc::Status::OK;
+    }
+
+    /**
+     * PRCCall Forward
+     * @brief Handles a proposal forwarded by a peer which is not the leader
+     * Cases:
+     * 1. The slot is already decided: send the id of the decided value back
+     * 2. This peer is the leader, but the value is neither sent nor known here: ask for it
+     * 3. This peer is the leader: start proposing the value at the slot
+     * 4. Otherwise: reject and tell the sender who the leader is
+    */
+    grpc::Status Forward(grpc::ServerContext* /*context*/, const ForwardArgs* args, ForwardReply* reply) override {
+        std::unique_lock<std::mutex> lock(mu_);
+        reply->set_leader(leader_);
+        if (decided(args->seq())) {
+            reply->set_ok(true);
+            reply->set_decided(true);
+            reply->set_vid(instances_.Find(args->seq())->DecidedId);
+            return grpc::Status::OK;
+        }
+        if (leader_ != me_) {
+            reply->set_ok(false);
+            return grpc::Status::OK;
+        }
+        Value value = findValue(args->vid());
+        lock.unlock();
+
+        if (!value && !args->has_v()) {
+            reply->set_ok(false);
+            reply->set_missing(true);
+            return grpc::Status::OK;
+        }
+        if (!value)
+            value = std::make_shared<const Op>(args->v());
+
+        start(args->seq(), args->vid(), value);
+        reply->set_ok(true);
+
+        return grpc::Status::OK;
+    }
+
+    /**
+     * PRCCall ReadIndex
+     * @brief Handles a peer asking for the slot a linearizable read must wait for
+     * Cases:
+     * 1. This peer is the leader and holds the lease: reply the read index
+     * 2. Otherwise: reject and tell the sender who the leader is
+    */
+    grpc::Status ReadIndex(grpc::ServerContext* /*context*/, const ReadIndexArgs* /*args*/, ReadIndexReply* reply) override {
         std::lock_guard<std::mutex> lock(mu_);
+        reply->set_leader(leader_);
+        reply->set_ok(holdsLease());
+        if (reply->ok())
+            reply->set_seq(std::max(highestDecidedSeq_, electionSeq_));
+
+        return grpc::Status::OK;
+    }
+
+    /**
+     * PRCCall InstallSnapshot
+     * @brief Streams the state of the application to a lagging peer, which installs it
+     * Cases:
+     * 1. The application has state past Args.Applied: stream it from its snapshot source
+     * 2. Otherwise: fail with UNAVAILABLE so that the sender asks another peer
+    */
+    grpc::Status InstallSnapshot(grpc::ServerContext* /*context*/, const InstallSnapshotArgs* args, grpc::ServerWriter<SnapshotChunk>* writer) override {
+        std::unique_lock<std::mutex> lock(mu_);
+        SnapshotSource source = snapshotSource_;
+        lock.unlock();
 
-        Instance record;
-        // Mark the seq num as decided
-        auto it = instances_.find(args->seq());
-        if (it == instances_.end()) {
-            record.Decided = true;
-            record.DecidedV = args->v();
-            instances_[args->seq()] = record;
+        bool sent = source && source(args->applied(), [writer](const SnapshotChunk& chunk) {
+            return writer->Write(chunk);
+        });
+        if (!sent)
+            return grpc::Status(grpc::StatusCode::UNAVAILABLE, "no state past the applied slot");
+
+        ABSL_LOG(INFO) << absl::StrFormat("RPCInstallSnapshot OK: me %d, sent to %d after seq %d", me_, args->sender(), args->applied());
+
+        return grpc::Status::OK;
+    }
+
+    /**
+     * PRCCall FetchValue
+     * @brief Sends a value to a peer which learned only its id
+     * Cases:
+     * 1. The value is still held by an instance or a proposal here: send it back
+     * 2. Otherwise: reject so that the sender asks another peer
+    */
+    grpc::Status FetchValue(grpc::ServerContext* /*context*/, const FetchValueArgs* args, FetchValueReply* reply) override {
+        std::unique_lock<std::mutex> lock(mu_);
+        Value value = findValue(args->vid());
+        lock.unlock();
+
+        reply->set_ok(value != nullptr);
+        if (value)
+            *reply->mutable_v() = *value;
+
+        ABSL_LOG(INFO) << absl::StrFormat("RPCFetchValue %s: me %d, vid %d", value ? "OK" : "Reject", me_, args->vid());
+
+        return grpc::Status::OK;
+    }
+
+    /**
+     * PRCCall Heartbeat
+     * @brief Handles the heartbeat of the leader, which also spreads the done values of all peers
+     * Cases:
+     * 1. Args.N >= Promised: follow the sender as the leader
+     * 2. Args.N < Promised: reject, the sender is no longer the leader
+    */
+    grpc::Status Heartbeat(grpc::ServerContext* /*context*/, const HeartbeatArgs* args, HeartbeatReply* reply) override {
+        std::unique_lock<std::mutex> lock(mu_);
+
+        if (args->n() >= promised_) {
+            promised_ = args->n();
+            followLeader(args->sender());
+            recordLeaderProgress(args->decided());
+            reply->set_ok(true);
         } else {
-            it->second.Decided = true;
-            it->second.DecidedV = args->v();   
+            reply->set_ok(false);
         }
 
-        reply->set_ok(true);
+        for (int i = 0; i < args->peerdone_size() && i < (int)peers_.size(); i++) {
+            if (args->peerdone(i) > peerDone_[i])
+                peerDone_[i] = args->peerdone(i);
+        }
+        forgetDone();
 
-        ABSL_LOG(INFO) << absl::StrFormat("RPCDecide OK: me %d, seq %d, v %s", me_, args->seq(), args->v().requestid());
+        reply->set_promised(promised_);
+        reply->set_done(peerDone_[me_]);
 
         return grpc::Status::OK;
     }
@@ -272,282 +653,877 @@ private:
 
     /* Internal Data Structures and Variables */
 
+    // A value shared by the instances and the proposals holding it
+    using Value = std::shared_ptr<const Op>;
+
     struct Instance {
         int HighestAcN;          // Na: highest accepted proposal
-        Op HighestAcV;  // Va: value
-        int HighestSeen;         // Np: highest seen proposal number
+        uint64_t HighestAcId;    // Va: id of the value
+        Value HighestAcV;        // Va: value
         bool Decided;
-        Op DecidedV;
+        uint64_t DecidedId;      // id of the decided value
+        Value DecidedV;          // decided value, or nullptr while it is fetched from a peer
+        bool Fetching;           // whether the decided value is being fetched from a peer
+        int ProposedN;           // proposal number this peer led the slot with, or -1
+
+        Instance() : HighestAcN(-1), HighestAcId(0), Decided(false), DecidedId(0), Fetching(false), ProposedN(-1) {}
+    };
+
+    // A sliding window of instances indexed by seq - Base(), kept in a ring buffer.
+    // Instances below Base() are forgotten. The ring doubles when the window outgrows it,
+    // and moving Base() up releases the instances below it in O(1) each.
+    class InstanceWindow {
+    public:
+        InstanceWindow() : ring_(INSTANCE_WINDOW_INITIAL) {}
+
+        // The lowest seq number not forgotten
+        int Base() const {
+            return base_;
+        }
+
+        // The instance of seq, or nullptr if it is forgotten or was never touched
+        Instance* Find(int seq) {
+            if (seq < base_ || seq - base_ >= (long long)size_)
+                return nullptr;
+            return &ring_[index(seq)];
+        }
+
+        // The instance of seq, extending the window up to it
+        // seq must not be below Base()
+        Instance& At(int seq) {
+            size_t size = seq - base_ + 1;
+            if (size > size_) {
+                if (size > ring_.size())
+                    grow(size);
+                size_ = size;
+            }
+            return ring_[index(seq)];
+        }
+
+        // Forget the instances below seq
+        void ReleaseBefore(int seq) {
+            if (seq <= base_)
+                return;
+
+            size_t count = std::min<size_t>(seq - base_, size_);
+            for (size_t i = 0; i < count; i++) {
+                ring_[head_] = Instance();
+                head_ = (head_ + 1) & (ring_.size() - 1);
+            }
+            size_ -= count;
+            base_ = seq;
+        }
+
+        // Call f(seq, instance) on every instance in the window from fromSeq on
+        template <typename F>
+        void ForEach(int fromSeq, F f) const {
+            for (int seq = std::max(fromSeq, base_); seq - base_ < (long long)size_; seq++)
+                f(seq, ring_[index(seq)]);
+        }
+
+    private:
+        size_t index(int seq) const {
+            return (head_ + (seq - base_)) & (ring_.size() - 1);
+        }
+
+        void grow(size_t size) {
+            size_t capacity = ring_.size();
+            while (capacity < size)
+                capacity *= 2;
+
+            std::vector<Instance> ring(capacity);
+            for (size_t i = 0; i < size_; i++)
+                ring[i] = std::move(ring_[(head_ + i) & (ring_.size() - 1)]);
+            ring_.swap(ring);
+            head_ = 0;
+        }
 
-        Instance() : HighestAcN(0), HighestSeen(0), Decided(false) {}
+        std::vector<Instance> ring_;  // capacity is a power of two
+        size_t head_ = 0;             // position of Base() in ring_
+        int base_ = 0;                // lowest seq number not forgotten
+        size_t size_ = 0;             // number of seq numbers in the window
+    };
+
+    // Result of a phase after a reply
+    enum class Outcome { kPending, kMajority, kFailed };
+
+    // The highest value accepted at a slot, as reported by a peer which has it
+    struct ReportedValue {
+        int na;
+        uint64_t id;
+        int peer;
     };
 
     struct SharedPrepareState {
-        int highestNAccepted = -1, prepareOKCount = 0, allResopnse = 0;
-        Op nextPhaseV;
+        int prepareOKCount = 0, allResopnse = 0, highestPromised = -1;
+        int peerCount, majorityPeerCount;
+        std::map<int, ReportedValue> accepted;  // highest accepted (Na, Va) per slot
         std::mutex mu;
         bool done = false;
 
-        SharedPrepareState(const Op& v) : nextPhaseV(v) {}
-
-        // Mark the prepare phase as done so that no more updates are allowed
-        void donePrepare() {
-            std::lock_guard<std::mutex> lock(this->mu);
-            this->done = true;
-        }
+        SharedPrepareState(int peers) : peerCount(peers), majorityPeerCount(peers / 2 + 1) {}
 
         // Update the prepare phase with a reply
-        void update(const PrepareReply &reply, bool status = true) {
+        // Returns kMajority or kFailed exactly once, when the phase is settled
+        Outcome update(const PrepareReply &reply, int peer, bool status = true) {
             std::lock_guard<std::mutex> lock(this->mu);
             if (this->done)
-                return;
+                return Outcome::kPending;
 
             this->allResopnse++;
-            if (status && reply.ok()) {
-                this->prepareOKCount++;
-                if (reply.na() > this->highestNAccepted) {
-                    this->highestNAccepted = reply.na();
-                    this->nextPhaseV = reply.va();
+            if (status) {
+                this->highestPromised = std::max(this->highestPromised, reply.promised());
+                if (reply.ok()) {
+                    this->prepareOKCount++;
+                    for (const AcceptedSlot& slot : reply.accepted()) {
+                        auto it = this->accepted.find(slot.seq());
+                        if (it == this->accepted.end() || slot.na() > it->second.na)
+                            this->accepted[slot.seq()] = {slot.na(), slot.vaid(), peer};
+                    }
                 }
             }
+
+            if (this->prepareOKCount >= this->majorityPeerCount) {
+                this->done = true;
+                return Outcome::kMajority;
+            }
+            if (this->allResopnse >= this->peerCount) {
+                this->done = true;
+                return Outcome::kFailed;
+            }
+            return Outcome::kPending;
         }
     };
 
     struct SharedAcceptState {
-        int highestNObserved = -1, acceptOKCount = 0, allAcceptResponse = 0;
+        int highestNObserved = -1, acceptOKCount = 0, allAcceptResponse = 0, highestPromised = -1;
+        int peerCount, majorityPeerCount;
         std::mutex mu;
         bool done = false;
 
-        // Mark the accept phase as done so that no more updates are allowed
-        void doneAccept() {
-            std::lock_guard<std::mutex> lock(this->mu);
-            this->done = true;
-        }
+        SharedAcceptState(int peers) : peerCount(peers), majorityPeerCount(peers / 2 + 1) {}
 
         // Update the accept phase with a reply
-        void update(const AcceptReply &reply, bool status = true) {
+        // Returns kMajority or kFailed exactly once, when the phase is settled
+        Outcome update(const AcceptReply &reply, bool status = true) {
             std::lock_guard<std::mutex> lock(this->mu);
             if (this->done)
-                return;
+                return Outcome::kPending;
 
             this->allAcceptResponse++;
-            if (status && reply.ok()) {
-                this->acceptOKCount++;
-                if (reply.n() > this->highestNObserved) {
-                    this->highestNObserved = reply.n();
+            if (status) {
+                this->highestPromised = std::max(this->highestPromised, reply.promised());
+                if (reply.ok()) {
+                    this->acceptOKCount++;
+                    if (reply.n() > this->highestNObserved) {
+                        this->highestNObserved = reply.n();
+                    }
                 }
             }
+
+            if (this->acceptOKCount >= this->majorityPeerCount) {
+                this->done = true;
+                return Outcome::kMajority;
+            }
+            if (this->allAcceptResponse >= this->peerCount) {
+                this->done = true;
+                return Outcome::kFailed;
+            }
+            return Outcome::kPending;
+        }
+    };
+
+    // An RPC to a peer or a timer in flight, completed by a completion queue thread
+    struct AsyncTask {
+        virtual ~AsyncTask() = default;
+        virtual void Complete(bool ok) = 0;
+    };
+
+    template <typename Reply>
+    struct AsyncCall : AsyncTask {
+        grpc::ClientContext context;
+        grpc::Status status;
+        Reply reply;
+        std::unique_ptr<grpc::ClientAsyncResponseReader<Reply>> reader;
+        std::function<void(const grpc::Status&, const Reply&)> callback;
+
+        void Complete(bool /*ok*/) override {
+            callback(status, reply);
+        }
+    };
+
+    struct AsyncTimer : AsyncTask {
+        grpc::Alarm alarm;
+        std::function<void()> callback;
+
+        // A timer cancelled by the shutdown completes with ok == false
+        void Complete(bool ok) override {
+            if (ok)
+                callback();
         }
     };
 
+    template <typename Args, typename Reply>
+    using AsyncMethod = std::unique_ptr<grpc::ClientAsyncResponseReader<Reply>> (Paxos::Stub::*)(grpc::ClientContext*, const Args&, grpc::CompletionQueue*);
+
     std::mutex mu_;
+    std::condition_variable decidedCv_;  // signals waiters of Wait() when a seq number is decided
     std::vector<std::shared_ptr<Paxos::Stub>> peers_;
     int me_;  // index into peers_[]
 
-    std::unordered_map<int, Instance> instances_;    // map from seq number to paxos instance
-    std::unordered_map<int, Instance> acceptorIns_;  // intermediate phase for acceptor
+    // Declared before the instances, whose values erase their ids when released
+    std::mutex valuesMu_;                            // lock for values_, taken alone or under mu_
+    std::unordered_map<uint64_t, std::weak_ptr<const Op>> values_;  // values held by instances or proposals here, by id
+
+    InstanceWindow instances_;                       // paxos instances from Min() on, as proposer, acceptor and learner
     int highestSeqSeen_;                             // Highest seq number scene
     std::unordered_map<int, int> peerDone_;          // peers' done
-    int doneFreed_;                                  // freed highest done
+
+    int promised_ = -1;                              // highest proposal number promised, for all slots
+    int leader_ = -1;                                // peer believed to be the leader, or -1
+    int ballot_ = -1;                                // proposal number this peer leads with
+    bool electing_ = false;                          // whether this peer is running a Prepare phase
+    std::chrono::steady_clock::time_point lastLeaderContact_;  // last time the leader was heard from
+    std::chrono::steady_clock::time_point leaseExpiry_;        // time the lease of this peer as the leader ends
+    int highestDecidedSeq_ = -1;                     // highest seq number known decided
+    int electionSeq_ = -1;                           // highest seq number reported when this peer won its election
+    std::deque<std::pair<std::chrono::steady_clock::time_point, int>> leaderProgress_;  // highest slot the leader knew decided, by heartbeat
+    SnapshotSource snapshotSource_;                  // streams the state of the application to lagging peers
+    int nextSnapshotPeer_ = 0;                       // peer to fetch the next snapshot from while there is no leader
+    std::atomic<uint64_t> nextValueId_;              // id of the next value proposed by this peer
+
+    std::mutex cqMu_;                                // lock for stop_ and issuing async tasks
+    std::vector<std::unique_ptr<grpc::CompletionQueue>> cqs_;  // completion queues of peer RPCs and timers
+    std::vector<std::thread> cqThreads_;             // one thread polling each completion queue
+    size_t nextCq_ = 0;                              // completion queue of the next async task
+    bool stop_ = false;                              // whether no more async tasks may be issued
 
     /* Internal Functions */
 
-    void propose(int seq, const Op& v) {
-        bool isFirst = true;
-        int penaltySleep = 10;
+    // Start proposing the value with id at slot seq in the background, unless the
+    // slot is forgotten or already decided
+    void start(int seq, uint64_t id, Value v) {
+        std::unique_lock<std::mutex> lock(mu_);
 
-        while (true) {
-            // Clear extra memory
-            collectGarbage();
+        // Ignore if the seq number < Min()
+        if (seq < instances_.Base()) {
+            std::cout << "Ignore seq " << seq << " < Min()" << std::endl;
+            return;
+        }
 
-            // Sleep if not the first time call to let other peers propose
-            if (!isFirst) {
-                penaltySleep *= 1.5;
-                penaltySleep = std::min(penaltySleep, 50);
+        // Update highestSeqSeen_
+        if (seq > highestSeqSeen_)
+            highestSeqSeen_ = seq;
 
-                // Random backoff to avoid issues during concurrent puts
-                int randomSleep = rand() % penaltySleep + penaltySleep;
-                ABSL_LOG(INFO) << absl::StrFormat("Forced to sleep %dms (penalty: %d), seq %d, proposor %d", 
-                    randomSleep, penaltySleep, seq, me_);
-                std::this_thread::sleep_for(std::chrono::milliseconds(penaltySleep));
-            }
+        // Check if seq is already decided
+        if (decided(seq))
+            return;
 
-            isFirst = false;
+        v = internValue(id, v);
 
-            // Lock while not decided
-            std::unique_lock<std::mutex> lock(mu_);
-            if (instances_[seq].Decided)
+        // Non-blocking
+        // Return immediate and propose in the background
+        lock.unlock();
+        propose(seq, id, v, 0);
+    }
+
+    // Drive the slot seq until it is decided: as the leader propose v directly,
+    // otherwise forward v to a live leader or take over the leadership.
+    // Never blocks, every retry is scheduled on a timer.
+    void propose(int seq, uint64_t id, const Value& v, int attempt) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (seq < instances_.Base() || decided(seq))
+            return;
+
+        if (leader_ == me_) {
+            // A leader proposes at most one value per slot
+            int n = ballot_;
+            Instance& ins = instances_.At(seq);
+            if (ins.ProposedN == n)
                 return;
+            ins.ProposedN = n;
+            lock.unlock();
 
-            /* Prepare Phase */
-            auto it = acceptorIns_.find(seq);
-            int highestSeen = it == acceptorIns_.end() ? -1 : it->second.HighestSeen;
+            acceptAndDecide(seq, n, id, v, true, [this, seq, id, v, attempt](bool ok) {
+                if (!ok)
+                    retryLater(seq, id, v, attempt);
+            });
+            return;
+        }
 
-            int myDone = peerDone_[me_];
-            int peerCount = peers_.size(), majorityPeerCount = peers_.size() / 2 + 1;
+        int leader = leader_;
+        bool leaderAlive = leader >= 0 && std::chrono::steady_clock::now() - lastLeaderContact_ < std::chrono::milliseconds(LEADER_TIMEOUT_MS);
+        bool electing = electing_;
+        lock.unlock();
 
-            lock.unlock();
+        if (leaderAlive) {
+            // Check back after a while in case the leader fails before deciding
+            // The leader has the value already after the first forward, unless it changed
+            forward(leader, seq, id, v, attempt == 0, [this, seq, id, v, attempt](bool ok) {
+                if (!ok) {
+                    retryLater(seq, id, v, attempt);
+                    return;
+                }
+                runAfter(LEADER_TIMEOUT_MS, [this, seq, id, v, attempt]() {
+                    propose(seq, id, v, attempt + 1);
+                });
+            });
+            return;
+        }
 
-            // generate a unique proposal number based on the highest seen proposal number
-            int n = generateUniqueN(highestSeen);
+        if (electing) {
+            retryLater(seq, id, v, attempt);
+            return;
+        }
 
-            ABSL_LOG(INFO) << absl::StrFormat("Phase 1 Prepare: seq %d, n %d, proposor %d", seq, n, me_);
+        // No live leader, take over so that the next round can skip Prepare
+        becomeLeader([this, seq, id, v, attempt](bool ok) {
+            if (ok)
+                propose(seq, id, v, attempt + 1);
+            else
+                retryLater(seq, id, v, attempt);
+        });
+    }
 
-            auto sharedPrepState = std::make_shared<SharedPrepareState>(v);
-            PrepareArgs prepareArgs;
-            PrepareReply prepareReply;
-            prepareArgs.set_seq(seq);
-            prepareArgs.set_n(n);
-            prepareArgs.set_sender(me_);
-            prepareArgs.set_done(myDone);
+    // Propose again after a random backoff, to let other peers propose
+    void retryLater(int seq, uint64_t id, const Value& v, int attempt) {
+        int penaltySleep = 10;
+        for (int i = 0; i < attempt && penaltySleep < 50; i++)
+            penaltySleep *= 1.5;
+        penaltySleep = std::min(penaltySleep, 50);
+
+        // Random backoff to avoid issues during concurrent puts
+        int randomSleep = rand() % penaltySleep + penaltySleep;
+        ABSL_LOG(INFO) << absl::StrFormat("Forced to sleep %dms (penalty: %d), seq %d, proposor %d",
+            randomSleep, penaltySleep, seq, me_);
+
+        runAfter(randomSleep, [this, seq, id, v, attempt]() {
+            propose(seq, id, v, attempt + 1);
+        });
+    }
 
-            // Call myself
-            Prepare(nullptr, &prepareArgs, &prepareReply);
+    // Run the Prepare phase for every slot >= Min() with a new proposal number, and
+    // lead them on success. Values accepted by any acceptor are proposed again.
+    // done is called with the result once a majority answers or all peers have.
+    void becomeLeader(std::function<void(bool)> done) {
+        std::unique_lock<std::mutex> lock(mu_);
+        electing_ = true;
+        int fromSeq = getMinSeqNum();
+        int n = generateUniqueN(std::max(promised_, ballot_));
+        int myDone = peerDone_[me_];
+        int peerCount = peers_.size();
+        lock.unlock();
 
-            sharedPrepState->update(prepareReply);
+        ABSL_LOG(INFO) << absl::StrFormat("Phase 1 Prepare: from seq %d, n %d, proposor %d", fromSeq, n, me_);
 
-            // Call other peers
-            for (int i = 0; i < peerCount; i++) {
-                if (i == me_)
-                    continue;
+        auto sharedPrepState = std::make_shared<SharedPrepareState>(peerCount);
+        PrepareArgs prepareArgs;
+        PrepareReply prepareReply;
+        prepareArgs.set_seq(fromSeq);
+        prepareArgs.set_n(n);
+        prepareArgs.set_sender(me_);
+        prepareArgs.set_done(myDone);
 
-                // Non-blocking call
-                std::thread([this, i, sharedPrepState, prepareArgs]() {
-                    grpc::ClientContext context;
-                    PrepareReply reply;
-                    grpc::Status status = peers_[i]->Prepare(&context, prepareArgs, &reply);
+        auto handle = [this, sharedPrepState, fromSeq, n, done](const PrepareReply& reply, int peer, bool status) {
+            Outcome outcome = sharedPrepState->update(reply, peer, status);
+            if (outcome == Outcome::kPending)
+                return;
+
+            ABSL_LOG(INFO) << absl::StrFormat("Phase 1 Prepare Done with OKCount %d, proposor %d, n %d",
+                sharedPrepState->prepareOKCount, me_, n);
+            bool won = outcome == Outcome::kMajority && finishElection(fromSeq, n, sharedPrepState->accepted);
+            if (!won) {
+                std::lock_guard<std::mutex> lock(mu_);
+                electing_ = false;
+            }
+            done(won);
+        };
+
+        // Call myself
+        Prepare(nullptr, &prepareArgs, &prepareReply);
 
-                    sharedPrepState->update(reply, status.ok());
+        handle(prepareReply, me_, true);
 
+        // Call other peers
+        for (int i = 0; i < peerCount; i++) {
+            if (i == me_)
+                continue;
+
+            // Non-blocking call
+            callAsync(i, &Paxos::Stub::PrepareAsyncPrepare, prepareArgs, PAXOS_RPC_TIMEOUT_MS, [this, i, handle](const grpc::Status& status, const PrepareReply& reply) {
+                if (status.ok()) {
                     std::lock_guard<std::mutex> lock(mu_);
-                    if (reply.done() > peerDone_[i])
+                    if (reply.done() > peerDone_[i]) {
                         peerDone_[i] = reply.done();
-                }).detach();
-            }
+                        forgetDone();
+                    }
+                    promised_ = std::max(promised_, reply.promised());
+                }
+                handle(reply, i, status.ok());
+            });
+        }
+    }
 
-            // Wait for all responses
-            while (sharedPrepState->prepareOKCount < majorityPeerCount && sharedPrepState->allResopnse < peerCount)
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    // Take the leadership won with proposal number n, and finish the slots other
+    // leaders may have left behind. A value not known here is fetched from the peer
+    // which reported it first.
+    bool finishElection(int fromSeq, int n, const std::map<int, ReportedValue>& accepted) {
+        std::unique_lock<std::mutex> lock(mu_);
+        electing_ = false;
+        if (promised_ > n)
+            return false;
+
+        leader_ = me_;
+        ballot_ = n;
+        lastLeaderContact_ = std::chrono::steady_clock::now();
+        leaseExpiry_ = std::chrono::steady_clock::time_point();
+        if (!accepted.empty())
+            electionSeq_ = std::max(electionSeq_, accepted.rbegin()->first);
 
-            sharedPrepState->donePrepare();
+        std::vector<std::pair<int, Value>> unfinished;
+        for (const auto& pair : accepted) {
+            if (pair.first < std::max(fromSeq, instances_.Base()) || decided(pair.first))
+                continue;
+            instances_.At(pair.first).ProposedN = n;
+            unfinished.push_back({pair.first, findValue(pair.second.id)});
+        }
+        lock.unlock();
 
-            ABSL_LOG(INFO) << absl::StrFormat("Phase 1 Prepare Done with OKCount %d, seq %d, proposor %d, n %d, v %s", 
-                sharedPrepState->prepareOKCount, seq, me_, n, sharedPrepState->nextPhaseV.requestid());
+        ABSL_LOG(INFO) << absl::StrFormat("Peer %d is the leader with n %d, %d slots to finish", me_, n, unfinished.size());
 
-            if (sharedPrepState->prepareOKCount < majorityPeerCount)
+        // The acceptors which reported a value have it, the others ask for it
+        for (const auto& slot : unfinished) {
+            int seq = slot.first;
+            const ReportedValue& reported = accepted.at(seq);
+            uint64_t id = reported.id;
+            if (slot.second) {
+                acceptAndDecide(seq, n, id, slot.second, false, [](bool /*ok*/) {});
                 continue;
-            
-            lock.lock();
-            // Make a copy of nextPhaseV so that non-returned threads won't affect v
-            Op actualV = sharedPrepState->nextPhaseV;
-            lock.unlock();
+            }
 
-            /* Accept Phase */
-            ABSL_LOG(INFO) << absl::StrFormat("Phase 2 Accept: seq %d, n %d, proposor %d, v %s", seq, n, me_, actualV.requestid());
+            auto stillLeading = [this, seq, n]() {
+                return leader_ == me_ && ballot_ == n && !decided(seq);
+            };
+            fetchValue(id, reported.peer, stillLeading, [this, seq, n, id](const Value& v) {
+                acceptAndDecide(seq, n, id, v, false, [](bool /*ok*/) {});
+            });
+        }
+        return true;
+    }
 
-            auto sharedAccState = std::make_shared<SharedAcceptState>();
-            AcceptArgs accArgs;
-            AcceptReply accReply;
-            accArgs.set_seq(seq);
-            accArgs.set_n(n);
-            accArgs.set_allocated_v(new Op(actualV));
+    // Run the Accept and Decide phases for slot seq as the leader with proposal number n.
+    // The value is sent to the acceptors along with its id if withValue is set, otherwise
+    // only to those which ask for it. Step down if a majority does not accept.
+    // done is called with the result once a majority answers or all peers have.
+    void acceptAndDecide(int seq, int n, uint64_t id, const Value& v, bool withValue, std::function<void(bool)> done) {
+        int peerCount = peers_.size();
+
+        /* Accept Phase */
+        ABSL_LOG(INFO) << absl::StrFormat("Phase 2 Accept: seq %d, n %d, proposor %d, v %s", seq, n, me_, v->requestid());
+
+        auto sharedAccState = std::make_shared<SharedAcceptState>(peerCount);
+        AcceptArgs accArgs;
+        AcceptReply accReply;
+        accArgs.set_seq(seq);
+        accArgs.set_n(n);
+        accArgs.set_vid(id);
+        accArgs.set_sender(me_);
+
+        auto handle = [this, sharedAccState, seq, n, id, done](const AcceptReply& reply, bool status) {
+            Outcome outcome = sharedAccState->update(reply, status);
+            if (outcome == Outcome::kPending)
+                return;
 
-            // Call myself
-            Accept(nullptr, &accArgs, &accReply);
+            if (outcome == Outcome::kFailed) {
+                std::lock_guard<std::mutex> lock(mu_);
+                promised_ = std::max(promised_, sharedAccState->highestPromised);
+                if (leader_ == me_ && ballot_ == n) {
+                    ABSL_LOG(INFO) << absl::StrFormat("Peer %d steps down as the leader, n %d, promised %d", me_, n, promised_);
+                    leader_ = -1;
+                }
+            } else {
+                decide(seq, id);
+            }
+            done(outcome == Outcome::kMajority);
+        };
 
-            sharedAccState->update(accReply);
+        // Call myself, which knows the value already
+        Accept(nullptr, &accArgs, &accReply);
 
-            // Call other peers
-            for (int i = 0; i < peerCount; i++) {
-                if (i == me_)
-                    continue;
+        handle(accReply, true);
 
-                // Non-blocking call
-                std::thread([this, i, sharedAccState, &accArgs]() {
-                    grpc::ClientContext context;
-                    AcceptReply reply;
-                    grpc::Status status = peers_[i]->Accept(&context, accArgs, &reply);
+        // Call other peers
+        if (withValue)
+            *accArgs.mutable_v() = *v;
+        for (int i = 0; i < peerCount; i++) {
+            if (i == me_)
+                continue;
+
+            // Non-blocking call
+            sendAccept(i, accArgs, v, handle);
+        }
+    }
 
-                    sharedAccState->update(reply, status.ok());
-                }).detach();
+    // Send an accept to a peer, and again with the value if the peer asks for it
+    template <typename Handle>
+    void sendAccept(int peer, const AcceptArgs& args, const Value& v, Handle handle) {
+        int seq = args.seq(), n = args.n();
+        uint64_t id = args.vid();
+        bool withValue = args.has_v();
+        callAsync(peer, &Paxos::Stub::PrepareAsyncAccept, args, PAXOS_RPC_TIMEOUT_MS, [this, peer, seq, n, id, v, withValue, handle](const grpc::Status& status, const AcceptReply& reply) {
+            if (status.ok() && reply.missing() && !withValue) {
+                AcceptArgs args;
+                args.set_seq(seq);
+                args.set_n(n);
+                args.set_vid(id);
+                args.set_sender(me_);
+                *args.mutable_v() = *v;
+                sendAccept(peer, args, v, handle);
+                return;
             }
+            handle(reply, status.ok());
+        });
+    }
+
+    // Mark slot seq as decided here and on every peer
+    void decide(int seq, uint64_t id) {
+        ABSL_LOG(INFO) << absl::StrFormat("Phase 3 Decide: seq %d, proposor %d, vid %d", seq, me_, id);
 
-            // Wait for all responses
-            while (sharedAccState->acceptOKCount < majorityPeerCount && sharedAccState->allAcceptResponse < peerCount)
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        /* Decide Phase */
+        DecideArgs decideArgs;
+        DecideReply decideReply;
+        decideArgs.set_seq(seq);
+        decideArgs.set_vid(id);
+        decideArgs.set_sender(me_);
 
-            sharedAccState->doneAccept();
+        // Call myself
+        Decide(nullptr, &decideArgs, &decideReply);
 
-            if (sharedAccState->acceptOKCount < majorityPeerCount)
+        for (int i = 0; i < (int)peers_.size(); i++) {
+            if (i == me_)
                 continue;
 
-            ABSL_LOG(INFO) << absl::StrFormat("Phase 3 Decide: seq %d, proposor %d, n %d, v %s", seq, me_, n, actualV.requestid());
+            sendDecide(i, decideArgs, 10, 1);
+        }
+    }
+
+    // Send a decision to a peer, retrying with a growing delay until the peer answers, is done
+    // with the slot, or DECIDE_MAX_TRIES is reached. Decide never rejects, any answer will do.
+    void sendDecide(int peer, const DecideArgs& args, int retryMs, int tries) {
+        callAsync(peer, &Paxos::Stub::PrepareAsyncDecide, args, PAXOS_RPC_TIMEOUT_MS, [this, peer, args, retryMs, tries](const grpc::Status& status, const DecideReply& /*reply*/) {
+            if (status.ok() || tries >= DECIDE_MAX_TRIES)
+                return;
+
+            runAfter(retryMs, [this, peer, args, retryMs, tries]() {
+                {
+                    std::lock_guard<std::mutex> lock(mu_);
+                    if (args.seq() < getMinSeqNum() || args.seq() <= peerDone_[peer])
+                        return;
+                }
+                sendDecide(peer, args, std::min(retryMs * 2, DECIDE_RETRY_MAX_MS), tries + 1);
+            });
+        });
+    }
+
+    // Forward a proposal to the leader, with the value if withValue is set or the leader asks for it
+    // done is called with false if the leader cannot be reached or is no longer the leader
+    void forward(int leader, int seq, uint64_t id, const Value& v, bool withValue, std::function<void(bool)> done) {
+        ForwardArgs args;
+        args.set_seq(seq);
+        args.set_vid(id);
+        if (withValue)
+            *args.mutable_v() = *v;
+
+        callAsync(leader, &Paxos::Stub::PrepareAsyncForward, args, LEADER_TIMEOUT_MS, [this, leader, seq, id, v, withValue, done](const grpc::Status& status, const ForwardReply& reply) {
+            if (status.ok() && reply.missing() && !withValue) {
+                forward(leader, seq, id, v, true, done);
+                return;
+            }
+            if (status.ok() && reply.decided()) {
+                std::lock_guard<std::mutex> lock(mu_);
+                learn(seq, reply.vid(), leader);
+            } else if (!status.ok() || !reply.ok()) {
+                // Forget the leader so that the next round looks for a new one
+                std::lock_guard<std::mutex> lock(mu_);
+                if (leader_ == leader)
+                    leader_ = status.ok() ? reply.leader() : -1;
+            }
+            done(status.ok() && reply.ok());
+        });
+    }
+
+    // Record the id of the decided value of a slot and wake up its waiters, or fetch
+    // the value first from the peer the decision came from if it is not known here
+    // Caller should hold mu_ lock
+    void learn(int seq, uint64_t id, int from) {
+        if (seq < instances_.Base())
+            return;
+
+        Instance& ins = instances_.At(seq);
+        ins.Decided = true;
+        ins.DecidedId = id;
+        if (!ins.DecidedV)
+            ins.DecidedV = ins.HighestAcV && ins.HighestAcId == id ? ins.HighestAcV : findValue(id);
+        if (seq > highestSeqSeen_)
+            highestSeqSeen_ = seq;
+        if (seq > highestDecidedSeq_)
+            highestDecidedSeq_ = seq;
+
+        if (ins.DecidedV) {
+            decidedCv_.notify_all();
+        } else if (!ins.Fetching) {
+            ins.Fetching = true;
+            auto stillMissing = [this, seq]() {
+                Instance* ins = instances_.Find(seq);
+                return ins != nullptr && !ins->DecidedV;
+            };
+            fetchValue(id, from, stillMissing, [this, seq](const Value& v) {
+                std::lock_guard<std::mutex> lock(mu_);
+                Instance* ins = instances_.Find(seq);
+                if (ins != nullptr && !ins->DecidedV) {
+                    ins->DecidedV = v;
+                    decidedCv_.notify_all();
+                }
+            });
+        }
+    }
+
+    // Fetch the value with id from peer, then from the other peers in turn until one sends
+    // it back or wanted() turns false. wanted is called with mu_ lock held. done is called
+    // with the value, which is known here from then on, without the lock.
+    void fetchValue(uint64_t id, int peer, std::function<bool()> wanted, std::function<void(const Value&)> done) {
+        if (peers_.size() < 2)
+            return;
+        if (peer == me_ || peer < 0)
+            peer = (me_ + 1) % peers_.size();
+
+        FetchValueArgs args;
+        args.set_vid(id);
+        callAsync(peer, &Paxos::Stub::PrepareAsyncFetchValue, args, PAXOS_RPC_TIMEOUT_MS, [this, id, peer, wanted, done](const grpc::Status& status, const FetchValueReply& reply) {
+            Value v;
+            if (status.ok() && reply.ok())
+                v = std::make_shared<const Op>(reply.v());
+
+            std::unique_lock<std::mutex> lock(mu_);
+            if (!wanted())
+                return;
+            if (v) {
+                v = internValue(id, v);
+                lock.unlock();
+                done(v);
+                return;
+            }
+            lock.unlock();
+
+            ABSL_LOG(INFO) << absl::StrFormat("Peer %d could not fetch value %d from peer %d", me_, id, peer);
+            runAfter(VALUE_FETCH_RETRY_MS, [this, id, peer, wanted, done]() {
+                fetchValue(id, (peer + 1) % peers_.size(), wanted, done);
+            });
+        });
+    }
+
+    // Get the value with id if an instance or a proposal here still holds it, or nullptr
+    // Caller should hold mu_ lock
+    Value findValue(uint64_t id) {
+        std::lock_guard<std::mutex> lock(valuesMu_);
+        auto it = values_.find(id);
+        return it == values_.end() ? nullptr : it->second.lock();
+    }
+
+    // Make the value with id known here, or get the copy already known. The copy returned
+    // drops the id once the last instance or proposal holding it lets it go.
+    // Caller should hold mu_ lock
+    Value internValue(uint64_t id, const Value& v) {
+        Value known = findValue(id);
+        if (known)
+            return known;
+
+        Value interned(v.get(), [this, id, v](const Op*) { forgetValue(id); });
+        std::lock_guard<std::mutex> lock(valuesMu_);
+        values_[id] = interned;
+        return interned;
+    }
+
+    // Drop the id of a value no longer held, unless it was interned again meanwhile
+    // Called when the last holder releases the value, possibly under mu_ lock
+    void forgetValue(uint64_t id) {
+        std::lock_guard<std::mutex> lock(valuesMu_);
+        auto it = values_.find(id);
+        if (it != values_.end() && it->second.expired())
+            values_.erase(it);
+    }
+
+    // Remember the highest slot the leader knows decided at this time
+    // Caller should hold mu_ lock
+    void recordLeaderProgress(int decidedSeq) {
+        leaderProgress_.push_back({std::chrono::steady_clock::now(), decidedSeq});
+        if (leaderProgress_.size() > LEADER_PROGRESS_HISTORY)
+            leaderProgress_.pop_front();
+    }
 
-            /* Decide Phase */
-            DecideArgs decideArgs;
-            DecideReply decideReply;
-            decideArgs.set_seq(seq);
-            decideArgs.set_allocated_v(new Op(actualV));
+    // Whether this peer is the leader and a majority has acknowledged it recently
+    // Caller should hold mu_ lock
+    bool holdsLease() {
+        return leader_ == me_ && std::chrono::steady_clock::now() < leaseExpiry_;
+    }
 
-            // Call myself
-            Decide(nullptr, &decideArgs, &decideReply);
+    // Whether a lease this peer granted, or holds, forbids promising to sender
+    // Caller should hold mu_ lock
+    bool leaseGranted(int sender) {
+        if (sender == me_)
+            return false;
+        if (leader_ == me_)
+            return std::chrono::steady_clock::now() < leaseExpiry_;
+        return sender != leader_ && std::chrono::steady_clock::now() - lastLeaderContact_ < std::chrono::milliseconds(LEADER_TIMEOUT_MS);
+    }
+
+    // Record that the leader has been heard from
+    // Caller should hold mu_ lock
+    void followLeader(int leader) {
+        leader_ = leader;
+        lastLeaderContact_ = std::chrono::steady_clock::now();
+    }
+
+    // As the leader, send a heartbeat to every peer, then do it again in LEADER_HEARTBEAT_MS
+    void sendHeartbeats() {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (leader_ == me_) {
+            HeartbeatArgs args;
+            args.set_n(ballot_);
+            args.set_sender(me_);
+            args.set_decided(highestDecidedSeq_);
+            recordLeaderProgress(highestDecidedSeq_);
+            for (int i = 0; i < (int)peers_.size(); i++)
+                args.add_peerdone(peerDone_[i]);
+            int n = ballot_;
+
+            // The lease counts from the time the heartbeat is sent
+            auto sent = std::chrono::steady_clock::now();
+            auto acks = std::make_shared<int>(1);
+            int majority = peers_.size() / 2 + 1;
+            if (*acks >= majority)
+                leaseExpiry_ = sent + std::chrono::milliseconds(LEADER_LEASE_MS);
+            lock.unlock();
 
-            for (int i = 0; i < peerCount; i++) {
+            for (int i = 0; i < (int)peers_.size(); i++) {
                 if (i == me_)
                     continue;
 
                 // Non-blocking call
-                std::thread([this, i, decideArgs]() {
-                    // Retry until success
-                    while (true) {
-                        grpc::ClientContext context;
-                        DecideReply reply;
-                        grpc::Status status = peers_[i]->Decide(&context, decideArgs, &reply);
+                callAsync(i, &Paxos::Stub::PrepareAsyncHeartbeat, args, LEADER_TIMEOUT_MS, [this, i, n, sent, acks, majority](const grpc::Status& status, const HeartbeatReply& reply) {
+                    if (!status.ok())
+                        return;
 
-                        if (status.ok() && reply.ok())
-                            break;
-
-                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    std::lock_guard<std::mutex> lock(mu_);
+                    if (reply.done() > peerDone_[i]) {
+                        peerDone_[i] = reply.done();
+                        forgetDone();
                     }
-                }).detach();
+                    if (reply.promised() > promised_)
+                        promised_ = reply.promised();
+                    if (!reply.ok() && leader_ == me_ && ballot_ == n)
+                        leader_ = -1;
+                    if (reply.ok() && leader_ == me_ && ballot_ == n && ++*acks == majority)
+                        leaseExpiry_ = std::max(leaseExpiry_, sent + std::chrono::milliseconds(LEADER_LEASE_MS));
+                });
             }
+        } else {
+            lock.unlock();
+        }
 
-            collectGarbage();
+        runAfter(LEADER_HEARTBEAT_MS, [this]() {
+            sendHeartbeats();
+        });
+    }
+
+    // Issue an RPC to a peer on one of the completion queues with a deadline of timeoutMs.
+    // callback runs on a completion queue thread, so it must not block.
+    template <typename Args, typename Reply, typename Callback>
+    void callAsync(int peer, AsyncMethod<Args, Reply> method, const Args& args, int timeoutMs, Callback callback) {
+        auto call = new AsyncCall<Reply>();
+        call->callback = std::move(callback);
+        call->context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(timeoutMs));
+
+        std::lock_guard<std::mutex> lock(cqMu_);
+        if (stop_) {
+            delete call;
             return;
         }
+
+        call->reader = (peers_[peer].get()->*method)(&call->context, args, nextCompletionQueue());
+        call->reader->StartCall();
+        call->reader->Finish(&call->reply, &call->status, call);
     }
 
-    // Free memory according to Done
-    // We can free memory for all instances with seq number < min Done
-    // collectGarbage() requires mu_ lock
-    void collectGarbage() {
-        std::lock_guard<std::mutex> lock(mu_);
+    // Run fn on a completion queue thread after delayMs
+    void runAfter(int delayMs, std::function<void()> fn) {
+        auto timer = new AsyncTimer();
+        timer->callback = std::move(fn);
 
-        int currMin = getMinSeqNum();
+        std::lock_guard<std::mutex> lock(cqMu_);
+        if (stop_) {
+            delete timer;
+            return;
+        }
 
-        // Free memory for all instances with seq number < min Done
-        if (currMin > doneFreed_) {
-            
-            ABSL_LOG(INFO) << absl::StrFormat("Running garbage collection for seq number < %d", currMin);
-
-            // Clean up instances_
-            for (auto it = instances_.begin(); it != instances_.end(); ) {
-                if (it->first < currMin)
-                    it = instances_.erase(it);
-                else
-                    it++;
-            }
+        timer->alarm.Set(nextCompletionQueue(), std::chrono::system_clock::now() + std::chrono::milliseconds(delayMs), timer);
+    }
 
-            // Clean up acceptorIns_
-            for (auto it = acceptorIns_.begin(); it != acceptorIns_.end(); ) {
-                if (it->first < currMin)
-                    it = acceptorIns_.erase(it);
-                else
-                    it++;
-            }
+    // Pick the completion queue of the next async task in round robin
+    // Caller should hold cqMu_ lock
+    grpc::CompletionQueue* nextCompletionQueue() {
+        grpc::CompletionQueue* cq = cqs_[nextCq_].get();
+        nextCq_ = (nextCq_ + 1) % cqs_.size();
+        return cq;
+    }
+
+    // Complete the async tasks of a completion queue until it is shut down and drained
+    void pollCompletionQueue(grpc::CompletionQueue* cq) {
+        void* tag;
+        bool ok;
+        while (cq->Next(&tag, &ok)) {
+            std::unique_ptr<AsyncTask> task(static_cast<AsyncTask*>(tag));
+            task->Complete(ok);
+        }
+    }
+
+    // Whether seq is decided and not forgotten
+    // Caller should hold mu_ lock
+    bool decided(int seq) {
+        Instance* ins = instances_.Find(seq);
+        return ins != nullptr && ins->Decided;
+    }
+
+    // Whether seq is decided, not forgotten, and its value is known here
+    // Wait until slot seq is decided with its value known here, or forgotten
+    // Caller should hold mu_ lock
+    bool waitKnown(std::unique_lock<std::mutex>& lock, int seq, int timeoutMs) {
+        auto isDecided = [this, seq]() {
+            return known(seq) || seq < instances_.Base();
+        };
+
+        if (timeoutMs < 0)
+            decidedCv_.wait(lock, isDecided);
+        else if (!decidedCv_.wait_for(lock, std::chrono::milliseconds(timeoutMs), isDecided))
+            return false;
+        return known(seq);
+    }
+
+    // Caller should hold mu_ lock
+    bool known(int seq) {
+        Instance* ins = instances_.Find(seq);
+        return ins != nullptr && ins->Decided && ins->DecidedV;
+    }
 
-            // Update doneFreed_
-            doneFreed_ = currMin;
+    // Free memory according to Done
+    // We can free memory for all instances with seq number < min Done
+    // Caller should hold mu_ lock
+    void forgetDone() {
+        int currMin = getMinSeqNum();
+        if (currMin > instances_.Base()) {
+            ABSL_LOG(INFO) << absl::StrFormat("Forgetting instances with seq number < %d", currMin);
+            instances_.ReleaseBefore(currMin);
+            decidedCv_.notify_all();
         }
     }
 
@@ -0,0 +1,577 @@
+#ifndef SSTABLE_HPP
+#define SSTABLE_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "BlockCache.hpp"
+
+#define SSTABLE_BLOCK_SIZE 4096
+#define SSTABLE_MAGIC_V1 0x5054434c4f554431ULL  // "PTCLOUD1", tables without a filter block
+#define SSTABLE_MAGIC 0x5054434c4f554432ULL     // "PTCLOUD2"
+#define SSTABLE_FOOTER_SIZE_V1 24
+#define SSTABLE_FOOTER_SIZE 40
+#define BLOOM_BITS_PER_KEY 10
+#define ENTRY_TOMBSTONE 0        // entry shadowing older values of its key
+#define ENTRY_VALUE 1            // value without a version, written before versions were kept
+#define ENTRY_VERSIONED_VALUE 2  // value followed by its version
+
+/**
+ * @brief Immutable sorted string table files used by Store.
+ * @author Lang Qin
+ *
+ * An SSTable holds a sorted run of key-value entries. Each entry is either a value
+ * or a tombstone which shadows older entries of the same key. The file layout is:
+ *
+ *   [data block 0] ... [data block N-1] [filter block] [index block] [footer]
+ *
+ * Data block: a sequence of entries, each encoded as
+ *   varint shared | varint unshared | varint valueLen | u8 type | [varint version] | key[shared:] | value
+ * where shared is the length of the prefix shared with the previous key in the same
+ * block (prefix compression). The first entry of a block always has shared = 0. The
+ * type is 0 for a tombstone, 1 for a value and 2 for a value followed by its version.
+ * Values written before versions were kept have type 1 and version 0.
+ *
+ * Index block: one entry per data block, encoded as
+ *   varint keyLen | last key of the block | varint offset | varint size
+ *
+ * Filter block: a Bloom filter over all the keys of the table, followed by one byte
+ * holding the number of probes. About 1% false positives at BLOOM_BITS_PER_KEY bits.
+ *
+ * Footer: fixed64 filter offset | fixed64 filter size | fixed64 index offset |
+ *         fixed64 index size | fixed64 magic
+ *
+ * The filter and index blocks are loaded into memory when the table is opened. A
+ * lookup of a key the table does not hold is usually rejected by the filter without
+ * touching disk; otherwise it costs a binary search in memory plus a single pread of
+ * one data block, unless the block is in the block cache.
+ *
+ * APIs:
+ * 1. SSTableBuilder(const std::string& path):
+ *     Create a new table file. Keys must be added in strictly increasing order.
+ * 2. std::shared_ptr<SSTable> SSTable::Open(const std::string& path, uint64_t number):
+ *     Open an existing table file, or return nullptr if it is corrupted.
+ * 3. bool SSTable::MayContain(const std::string& key):
+ *     Check the Bloom filter. False means the table surely does not hold the key.
+ * 4. SSTable::Lookup SSTable::Get(const std::string& key, std::string& value, uint64_t& version, BlockCache* cache):
+ *     Point lookup of a key, going through the block cache if one is given.
+ * 5. SSTable::Iterator:
+ *     Sequential scan over the table starting at a given key.
+*/
+
+/* Encoding Helpers */
+
+inline void putVarint(std::string& dst, uint64_t v) {
+    while (v >= 0x80) {
+        dst.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    dst.push_back(static_cast<char>(v));
+}
+
+inline bool getVarint(const char*& p, const char* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift <= 63 && p < end; shift += 7) {
+        uint64_t byte = static_cast<unsigned char>(*p++);
+        v |= (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+inline void putFixed64(std::string& dst, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        dst.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+}
+
+inline uint64_t decodeFixed64(const char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    return v;
+}
+
+// Write the whole buffer to fd, retrying on short writes
+inline bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Flush a file, or a folder so that the files created, renamed or removed in it stay so after a crash
+inline bool syncPath(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
+
+// Read exactly size bytes at offset from fd, retrying on short reads
+inline bool preadAll(int fd, char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = ::pread(fd, data, size, offset);
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// A stable 64-bit FNV-1a hash, since filters are persisted on disk
+inline uint64_t hashKey(const std::string& key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Filter Block */
+
+// Build a Bloom filter over the given key hashes using double hashing
+inline std::string buildFilter(const std::vector<uint64_t>& hashes) {
+    size_t bits = std::max<size_t>(64, hashes.size() * BLOOM_BITS_PER_KEY);
+    bits = (bits + 7) / 8 * 8;
+    int probes = std::max(1, std::min(30, static_cast<int>(BLOOM_BITS_PER_KEY * 0.69)));
+
+    std::string filter(bits / 8, '\0');
+    for (uint64_t h : hashes) {
+        uint64_t delta = (h >> 33) | (h << 31);
+        for (int i = 0; i < probes; i++) {
+            uint64_t bit = h % bits;
+            filter[bit / 8] |= static_cast<char>(1 << (bit % 8));
+            h += delta;
+        }
+    }
+    filter.push_back(static_cast<char>(probes));
+    return filter;
+}
+
+// Check whether a key hash may be in the filter
+inline bool filterMayContain(const std::string& filter, uint64_t h) {
+    if (filter.size() < 2)
+        return true;
+
+    size_t bits = (filter.size() - 1) * 8;
+    int probes = static_cast<unsigned char>(filter.back());
+    uint64_t delta = (h >> 33) | (h << 31);
+    for (int i = 0; i < probes; i++) {
+        uint64_t bit = h % bits;
+        if (!(filter[bit / 8] & (1 << (bit % 8))))
+            return false;
+        h += delta;
+    }
+    return true;
+}
+
+/* Data Block */
+
+// A cursor that decodes the entries of a single data block in order
+struct BlockCursor {
+    const std::string* block;
+    size_t pos = 0;
+    std::string key;
+    bool deleted = false;
+    uint64_t version = 0;
+    std::string_view value;
+
+    explicit BlockCursor(const std::string* b) : block(b) {}
+
+    // Decode the next entry, return false at the end of the block or on corruption
+    bool Next() {
+        const char* p = block->data() + pos;
+        const char* end = block->data() + block->size();
+        uint64_t shared, unshared, valueLen;
+
+        if (p >= end || !getVarint(p, end, shared) || !getVarint(p, end, unshared) || !getVarint(p, end, valueLen))
+            return false;
+        if (p >= end || shared > key.size())
+            return false;
+
+        char type = *p++;
+        deleted = type == ENTRY_TOMBSTONE;
+        version = 0;
+        if (type == ENTRY_VERSIONED_VALUE && !getVarint(p, end, version))
+            return false;
+        if (p + unshared + valueLen > end)
+            return false;
+
+        key.resize(shared);
+        key.append(p, unshared);
+        p += unshared;
+        value = std::string_view(p, valueLen);
+        p += valueLen;
+
+        pos = p - block->data();
+        return true;
+    }
+};
+
+/* Writer */
+
+class SSTableBuilder {
+public:
+    /**
+     * @brief Create a new table file at path.
+     * @throw std::runtime_error if the file cannot be created
+    */
+    SSTableBuilder(const std::string& path) : path_(path) {
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0)
+            throw std::runtime_error("Failed to create SSTable: " + path);
+    }
+
+    ~SSTableBuilder() {
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+
+    /**
+     * @brief Append an entry to the table. Keys must be added in strictly increasing order.
+     *
+     * @param key the internal key
+     * @param deleted whether the entry is a tombstone
+     * @param value the value, ignored for tombstones
+     * @param version the version of the value, ignored for tombstones
+    */
+    void Add(const std::string& key, bool deleted, std::string_view value, uint64_t version = 0) {
+        size_t shared = 0;
+        if (!block_.empty()) {
+            size_t limit = std::min(lastKey_.size(), key.size());
+            while (shared < limit && lastKey_[shared] == key[shared])
+                shared++;
+        }
+
+        if (deleted)
+            value = std::string_view();
+
+        putVarint(block_, shared);
+        putVarint(block_, key.size() - shared);
+        putVarint(block_, value.size());
+        if (deleted) {
+            block_.push_back(ENTRY_TOMBSTONE);
+        } else if (version == 0) {
+            block_.push_back(ENTRY_VALUE);
+        } else {
+            block_.push_back(ENTRY_VERSIONED_VALUE);
+            putVarint(block_, version);
+        }
+        block_.append(key, shared, std::string::npos);
+        block_.append(value.data(), value.size());
+        lastKey_ = key;
+        hashes_.push_back(hashKey(key));
+        entries_++;
+
+        if (block_.size() >= SSTABLE_BLOCK_SIZE)
+            flushBlock();
+    }
+
+    /**
+     * @brief Write the filter block, the index block and the footer, and sync the file to disk.
+     * @throw std::runtime_error if the file cannot be written
+    */
+    void Finish() {
+        flushBlock();
+
+        std::string filter = buildFilter(hashes_);
+        std::string footer;
+        putFixed64(footer, offset_);
+        putFixed64(footer, filter.size());
+        putFixed64(footer, offset_ + filter.size());
+        putFixed64(footer, index_.size());
+        putFixed64(footer, SSTABLE_MAGIC);
+
+        if (!writeAll(fd_, filter.data(), filter.size()) || !writeAll(fd_, index_.data(), index_.size()) ||
+            !writeAll(fd_, footer.data(), footer.size()) || ::fsync(fd_) != 0)
+            throw std::runtime_error("Failed to write SSTable: " + path_);
+
+        offset_ += filter.size() + index_.size() + footer.size();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    /**
+     * @brief Get the number of entries added so far.
+    */
+    size_t NumEntries() const {
+        return entries_;
+    }
+
+private:
+    std::string path_;              // path of the table file
+    int fd_;                        // file descriptor of the table file
+    std::string block_;             // data block being built
+    std::string lastKey_;           // last key added
+    std::string index_;             // encoded index block
+    std::vector<uint64_t> hashes_;  // hashes of all the keys for the filter block
+    uint64_t offset_ = 0;           // offset of the next data block
+    size_t entries_ = 0;            // number of entries added
+
+    // Write out the current data block and record it in the index
+    void flushBlock() {
+        if (block_.empty())
+            return;
+
+        if (!writeAll(fd_, block_.data(), block_.size()))
+            throw std::runtime_error("Failed to write SSTable: " + path_);
+
+        putVarint(index_, lastKey_.size());
+        index_.append(lastKey_);
+        putVarint(index_, offset_);
+        putVarint(index_, block_.size());
+
+        offset_ += block_.size();
+        block_.clear();
+    }
+};
+
+/* Reader */
+
+class SSTable {
+public:
+    enum class Lookup { kFound, kDeleted, kNotFound, kError };
+
+    ~SSTable() {
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+
+    /**
+     * @brief Open an existing table file and load its index block.
+     *
+     * @param path the path of the table file
+     * @param number the file number, higher numbers are newer
+     * @return the table, or nullptr if the file is missing or corrupted
+    */
+    static std::shared_ptr<SSTable> Open(const std::string& path, uint64_t number) {
+        std::shared_ptr<SSTable> table(new SSTable(path, number));
+        if (!table->load())
+            return nullptr;
+        return table;
+    }
+
+    /**
+     * @brief Check the Bloom filter of the table.
+     *
+     * @param key the internal key
+     * @return false if the table surely does not hold the key, true otherwise
+    */
+    bool MayContain(const std::string& key) const {
+        return filterMayContain(filter_, hashKey(key));
+    }
+
+    /**
+     * @brief Look up a key in the table.
+     *
+     * @param key the internal key
+     * @param value the value to store the result
+     * @param version the version of the value
+     * @param cache the block cache to read through, or nullptr
+     * @return kFound if the key holds a value, kDeleted if it holds a tombstone,
+     *         kNotFound if the table knows nothing about the key, kError if the block
+     *         holding the key cannot be read
+    */
+    Lookup Get(const std::string& key, std::string& value, uint64_t& version, BlockCache* cache = nullptr) const {
+        size_t i = findBlock(key);
+        if (i == index_.size())
+            return Lookup::kNotFound;
+
+        std::string block;
+        if (cache == nullptr || !cache->Get(number_, index_[i].offset, block)) {
+            if (!readBlock(i, block))
+                return Lookup::kError;
+            if (cache != nullptr)
+                cache->Put(number_, index_[i].offset, block);
+        }
+
+        BlockCursor cursor(&block);
+        while (cursor.Next()) {
+            if (cursor.key < key)
+                continue;
+            if (cursor.key > key)
+                break;
+            if (cursor.deleted)
+                return Lookup::kDeleted;
+            value.assign(cursor.value.data(), cursor.value.size());
+            version = cursor.version;
+            return Lookup::kFound;
+        }
+        return Lookup::kNotFound;
+    }
+
+    /**
+     * @brief A forward iterator over the entries of a table, loading one data block at a time.
+    */
+    class Iterator {
+    public:
+        Iterator(const SSTable* table, const std::string& start) : table_(table), cursor_(&block_) {
+            blockIdx_ = table_->findBlock(start);
+            loadBlock();
+            while (valid_ && cursor_.key < start)
+                Next();
+        }
+
+        // The cursor points into block_, so iterators must stay in place
+        Iterator(const Iterator&) = delete;
+        Iterator& operator=(const Iterator&) = delete;
+
+        bool Valid() const { return valid_; }
+        bool Failed() const { return failed_; }  // a block could not be read, so the iteration stopped early
+        const std::string& Key() const { return cursor_.key; }
+        bool Deleted() const { return cursor_.deleted; }
+        uint64_t Version() const { return cursor_.version; }
+        std::string_view Value() const { return cursor_.value; }
+
+        void Next() {
+            if (cursor_.Next())
+                return;
+            blockIdx_++;
+            loadBlock();
+        }
+
+    private:
+        const SSTable* table_;
+        size_t blockIdx_;
+        std::string block_;
+        BlockCursor cursor_;
+        bool valid_ = false;
+        bool failed_ = false;
+
+        // Load blocks starting from blockIdx_ until one yields an entry
+        void loadBlock() {
+            valid_ = false;
+            for (; blockIdx_ < table_->index_.size(); blockIdx_++) {
+                if (!table_->readBlock(blockIdx_, block_)) {
+                    failed_ = true;
+                    return;
+                }
+                cursor_ = BlockCursor(&block_);
+                if (cursor_.Next()) {
+                    valid_ = true;
+                    return;
+                }
+            }
+        }
+    };
+
+    uint64_t Number() const { return number_; }
+    uint64_t FileSize() const { return fileSize_; }
+    const std::string& Path() const { return path_; }
+
+private:
+    struct IndexEntry {
+        std::string lastKey;  // last key in the block
+        uint64_t offset;      // offset of the block in the file
+        uint64_t size;        // size of the block in bytes
+    };
+
+    std::string path_;               // path of the table file
+    uint64_t number_;                // file number
+    int fd_ = -1;                    // file descriptor, shared by all readers through pread
+    uint64_t fileSize_ = 0;          // size of the file in bytes
+    std::vector<IndexEntry> index_;  // in-memory index block
+    std::string filter_;             // in-memory filter block, empty for tables without one
+
+    SSTable(const std::string& path, uint64_t number) : path_(path), number_(number) {}
+
+    // Open the file, validate the footer and load the filter and index blocks
+    bool load() {
+        fd_ = ::open(path_.c_str(), O_RDONLY);
+        if (fd_ < 0)
+            return false;
+
+        struct stat st;
+        if (::fstat(fd_, &st) != 0 || st.st_size < SSTABLE_FOOTER_SIZE_V1)
+            return false;
+        fileSize_ = st.st_size;
+
+        char magic[8];
+        if (!preadAll(fd_, magic, 8, fileSize_ - 8))
+            return false;
+
+        // Tables written before filter blocks were added have a shorter footer
+        uint64_t footerSize;
+        if (decodeFixed64(magic) == SSTABLE_MAGIC)
+            footerSize = SSTABLE_FOOTER_SIZE;
+        else if (decodeFixed64(magic) == SSTABLE_MAGIC_V1)
+            footerSize = SSTABLE_FOOTER_SIZE_V1;
+        else
+            return false;
+
+        char footer[SSTABLE_FOOTER_SIZE];
+        if (fileSize_ < footerSize || !preadAll(fd_, footer, footerSize, fileSize_ - footerSize))
+            return false;
+
+        const char* f = footer;
+        if (footerSize == SSTABLE_FOOTER_SIZE) {
+            uint64_t filterOffset = decodeFixed64(f);
+            uint64_t filterSize = decodeFixed64(f + 8);
+            if (filterOffset + filterSize > fileSize_)
+                return false;
+
+            filter_.resize(filterSize);
+            if (!preadAll(fd_, filter_.data(), filterSize, filterOffset))
+                return false;
+            f += 16;
+        }
+
+        uint64_t indexOffset = decodeFixed64(f);
+        uint64_t indexSize = decodeFixed64(f + 8);
+        if (indexOffset + indexSize + footerSize != fileSize_)
+            return false;
+
+        std::string index(indexSize, '\0');
+        if (!preadAll(fd_, index.data(), indexSize, indexOffset))
+            return false;
+
+        const char* p = index.data();
+        const char* end = p + index.size();
+        while (p < end) {
+            IndexEntry entry;
+            uint64_t keyLen;
+            if (!getVarint(p, end, keyLen) || p + keyLen > end)
+                return false;
+            entry.lastKey.assign(p, keyLen);
+            p += keyLen;
+            if (!getVarint(p, end, entry.offset) || !getVarint(p, end, entry.size))
+                return false;
+            index_.push_back(std::move(entry));
+        }
+        return true;
+    }
+
+    // Find the first block whose last key is >= key, or index_.size() if none
+    size_t findBlock(const std::string& key) const {
+        auto it = std::lower_bound(index_.begin(), index_.end(), key, [](const IndexEntry& entry, const std::string& k) {
+            return entry.lastKey < k;
+        });
+        return it - index_.begin();
+    }
+
+    // Read the i-th data block from disk
+    bool readBlock(size_t i, std::string& block) const {
+        block.resize(index_[i].size);
+        return preadAll(fd_, block.data(), index_[i].size, index_[i].offset);
+    }
+};
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef SESSION_TABLE_HPP
+#define SESSION_TABLE_HPP
+
+#include <list>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <cstdint>
+
+#define SESSION_MAX_CLIENTS 100000      // number of client sessions kept, the least recently used are dropped
+#define SESSION_EXPIRY_SLOTS 1000000    // number of slots after which an idle client session is dropped
+#define SESSION_MAX_REPLIES 1024        // number of unacknowledged replies kept per client
+
+/**
+ * @brief An at-most-once table of client sessions, which answers retried requests
+ * with the reply they got the first time instead of applying them again.
+ * @author Lang Qin
+ *
+ * A client numbers its requests 1, 2, 3... and tells with each request the highest
+ * number up to which it has received every reply. The table keeps, per client, the
+ * replies of the requests the client has not acknowledged yet, so a client may have
+ * several requests in flight. A request numbered at most the acknowledged number is
+ * a stale retry and gets an empty failed reply. Once a session holds more than
+ * SESSION_MAX_REPLIES replies, the oldest is dropped and its number becomes a floor,
+ * at or below which a request not remembered gets an empty failed reply too, since it
+ * may have been applied.
+ *
+ * Every replica must make the same decisions, so sessions expire by slot number, not
+ * by time: a session not used for SESSION_EXPIRY_SLOTS slots is dropped, and so is the
+ * least recently used one once there are more than SESSION_MAX_CLIENTS. Sessions are
+ * kept in a list ordered by last use, so both take O(1) per dropped session.
+ *
+ * The table is not thread-safe, the caller serializes access.
+ *
+ * APIs:
+ * 1. bool Duplicate(uint64_t client, uint64_t seq, uint64_t acked, int slot, Reply& reply):
+ *     Check if a request has already been applied, and get its reply if so.
+ * 2. void Record(uint64_t client, uint64_t seq, const Reply& reply):
+ *     Remember the reply of a request just applied.
+ * 3. void Update(uint64_t client, uint64_t seq, const Reply& reply):
+ *     Replace the reply of a request still remembered.
+ * 4. void Serialize(std::string& data) / bool Parse(const std::string& data):
+ *     Save and load the table, to keep it with snapshots.
+ * 5. size_t Size():
+ *     Get the number of sessions.
+*/
+
+class SessionTable {
+public:
+    struct Reply {
+        bool success = false;
+        std::string value;
+    };
+
+    SessionTable(size_t maxClients = SESSION_MAX_CLIENTS, int expirySlots = SESSION_EXPIRY_SLOTS) :
+        maxClients_(maxClients), expirySlots_(expirySlots) {}
+
+    /**
+     * @brief Check if a request has already been applied, and get its reply if so.
+     * Opens a session for a new client, and marks the session as used at slot.
+     *
+     * @param client the client id
+     * @param seq the number of the request
+     * @param acked the highest number up to which the client has every reply
+     * @param slot the slot the request is applied at
+     * @param reply the reply of the request, if it is a duplicate
+     * @return true if the request must not be applied again, false otherwise
+    */
+    bool Duplicate(uint64_t client, uint64_t seq, uint64_t acked, int slot, Reply& reply) {
+        expire(slot);
+
+        auto it = index_.find(client);
+        if (it == index_.end()) {
+            lru_.emplace_back(client);
+            it = index_.emplace(client, std::prev(lru_.end())).first;
+            while (index_.size() > maxClients_)
+                drop(lru_.begin());
+        } else {
+            lru_.splice(lru_.end(), lru_, it->second);
+        }
+
+        Session& session = *it->second;
+        session.lastSlot = slot;
+        if (acked > session.acked) {
+            session.acked = acked;
+            session.replies.erase(session.replies.begin(), session.replies.upper_bound(acked));
+        }
+
+        auto cached = session.replies.find(seq);
+        if (cached != session.replies.end()) {
+            reply = cached->second;
+            return true;
+        }
+        if (seq <= session.acked || seq <= session.evicted) {
+            reply = Reply();
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Remember the reply of a request just applied, after Duplicate() returned false.
+     *
+     * @param client the client id
+     * @param seq the number of the request
+     * @param reply the reply of the request
+    */
+    void Record(uint64_t client, uint64_t seq, const Reply& reply) {
+        auto it = index_.find(client);
+        if (it == index_.end() || seq <= it->second->acked)
+            return;
+
+        Session& session = *it->second;
+        session.replies[seq] = reply;
+        if (session.replies.size() > SESSION_MAX_REPLIES) {
+            session.evicted = std::max(session.evicted, session.replies.begin()->first);
+            session.replies.erase(session.replies.begin());
+        }
+    }
+
+    /**
+     * @brief Replace the reply of a request, if it is still remembered.
+     *
+     * @param client the client id
+     * @param seq the number of the request
+     * @param reply the reply of the request
+    */
+    void Update(uint64_t client, uint64_t seq, const Reply& reply) {
+        auto it = index_.find(client);
+        if (it == index_.end())
+            return;
+
+        auto cached = it->second->replies.find(seq);
+        if (cached != it->second->replies.end())
+            cached->second = reply;
+    }
+
+    /**
+     * @brief Save the table into a string, least recently used session first.
+     * The floors of the sessions follow all the sessions, so that tables saved before
+     * floors existed are read as having none.
+    */
+    void Serialize(std::string& data) const {
+        data.clear();
+        putFixed64(data, lru_.size());
+        for (const Session& session : lru_) {
+            putFixed64(data, session.client);
+            putFixed64(data, session.acked);
+            putFixed64(data, static_cast<uint64_t>(static_cast<int64_t>(session.lastSlot)));
+            putFixed64(data, session.replies.size());
+            for (const auto& pair : session.replies) {
+                putFixed64(data, pair.first);
+                data.push_back(pair.second.success ? 1 : 0);
+                putFixed64(data, pair.second.value.size());
+                data.append(pair.second.value);
+            }
+        }
+        for (const Session& session : lru_)
+            putFixed64(data, session.evicted);
+    }
+
+    /**
+     * @brief Replace the table with one saved by Serialize().
+     *
+     * @return true if the data is valid, false otherwise, in which case the table is empty
+    */
+    bool Parse(const std::string& data) {
+        lru_.clear();
+        index_.clear();
+
+        size_t offset = 0;
+        uint64_t count;
+        if (!getFixed64(data, offset, count))
+            return false;
+
+        for (uint64_t i = 0; i < count; i++) {
+            Session session;
+            uint64_t lastSlot, replies;
+            if (!getFixed64(data, offset, session.client) || !getFixed64(data, offset, session.acked) ||
+                !getFixed64(data, offset, lastSlot) || !getFixed64(data, offset, replies)) {
+                return fail();
+            }
+            session.lastSlot = static_cast<int>(static_cast<int64_t>(lastSlot));
+
+            for (uint64_t j = 0; j < replies; j++) {
+                uint64_t seq, size;
+                if (!getFixed64(data, offset, seq) || offset >= data.size())
+                    return fail();
+                Reply& reply = session.replies[seq];
+                reply.success = data[offset++] != 0;
+                if (!getFixed64(data, offset, size) || size > data.size() - offset)
+                    return fail();
+                reply.value = data.substr(offset, size);
+                offset += size;
+            }
+
+            lru_.push_back(std::move(session));
+            index_[lru_.back().client] = std::prev(lru_.end());
+        }
+
+        if (offset == data.size())
+            return true;
+        for (Session& session : lru_) {
+            if (!getFixed64(data, offset, session.evicted))
+                return fail();
+        }
+        return offset == data.size() || fail();
+    }
+
+    size_t Size() const {
+        return index_.size();
+    }
+
+private:
+    struct Session {
+        uint64_t client;                    // the client id
+        uint64_t acked = 0;                 // the client has the replies of every request up to this number
+        uint64_t evicted = 0;               // highest number whose reply was dropped for lack of room
+        int lastSlot = 0;                   // the slot the session was last used at
+        std::map<uint64_t, Reply> replies;  // replies of the requests after acked, by number
+
+        explicit Session(uint64_t client = 0) : client(client) {}
+    };
+
+    size_t maxClients_;  // number of sessions kept
+    int expirySlots_;    // number of slots an idle session is kept for
+    std::list<Session> lru_;  // sessions, least recently used first
+    std::unordered_map<uint64_t, std::list<Session>::iterator> index_;  // sessions by client id
+
+    // Drop the sessions idle for more than expirySlots_ slots at slot
+    void expire(int slot) {
+        while (!lru_.empty() && lru_.front().lastSlot < slot - expirySlots_)
+            drop(lru_.begin());
+    }
+
+    void drop(std::list<Session>::iterator it) {
+        index_.erase(it->client);
+        lru_.erase(it);
+    }
+
+    bool fail() {
+        lru_.clear();
+        index_.clear();
+        return false;
+    }
+
+    static void putFixed64(std::string& dst, uint64_t v) {
+        for (int i = 0; i < 8; i++)
+            dst.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+    }
+
+    static bool getFixed64(const std::string& src, size_t& offset, uint64_t& v) {
+        if (src.size() - offset < 8)
+            return false;
+        v = 0;
+        for (int i = 0; i < 8; i++)
+            v |= static_cast<uint64_t>(static_cast<unsigned char>(src[offset + i])) << (8 * i);
+        offset += 8;
+        return true;
+    }
+};
+
+#endif
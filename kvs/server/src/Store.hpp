@@ -4,25 +4,54 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <map>
 #include <filesystem>
 #include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <array>
+#include <functional>
+
+#include "Scheduler.hpp"
+#include "SSTable.hpp"
 
 #define BY_PASS_LOCK_ID "LOCK_BYPASS"
 #define LOCK_MAX_DURATION 10
 
+#ifndef MEMTABLE_SIZE
+#define MEMTABLE_SIZE (64 * 1024 * 1024)
+#endif
+#define COMPACTION_TRIGGER 4
+#define COMPACTION_SIZE_RATIO 2
+
 /**
  * @brief A key-value store that supports PUT, GET, DELETE, and CPUT operations.
  * @author Lang Qin
- * 
- * The key-value store is backed by a LRU cache and SSTable files on disk. Operations
- * are first performed on the cache. If the key-value pair is not found in the cache,
- * the key-value pair is read from the disk. If the key-value pair is found in the disk,
- * it is stored in the cache.
- * 
- * The key-value pair is stored in the disk under the folder [sstableDirectory_]. The key
- * is of the form "row-col". Each key-value pair is stored in a new file of the form
- * "[sstableDirectory_]/row/col.dat". The value is stored in the file.
- * 
+ *
+ * The key-value store is a log-structured merge tree. Writes go to an in-memory
+ * sorted memtable. Once the memtable grows beyond MEMTABLE_SIZE bytes it is frozen
+ * and written by a background thread to an immutable SSTable file (see SSTable.hpp)
+ * under the folder [sstableDirectory_]. Deletes are recorded as tombstones.
+ *
+ * Reads consult the memtable, the frozen memtable, the LRU cache of values read
+ * from disk, and finally the SSTables from newest to oldest. Each SSTable keeps its
+ * block index and a Bloom filter in memory, so a lookup of a missing key usually
+ * never touches disk and a disk read costs one seek. Data blocks read from disk are
+ * kept in a separately sized block cache (see BlockCache.hpp).
+ *
+ * Whenever there are at least COMPACTION_TRIGGER tables, the background thread merges
+ * the newest run of tables of similar size into one, which keeps the number of files
+ * bounded. Tombstones are dropped once the oldest table takes part in a compaction.
+ *
+ * Rows and cols are combined into one internal key "row\0col", so all the cols of a
+ * row are adjacent in every sorted run.
+ *
+ * Every value carries the version given by the writer, which the server takes from the
+ * slot the write was decided at and its position in the slot, so versions grow with every
+ * write and agree across replicas. A missing cell, and a cell written before versions were
+ * kept, has version 0.
+ *
  * APIs:
  * 1. bool Put(std::string& key, std::string& value):
  *     Put a key-value pair into the key-value store.
@@ -38,126 +67,320 @@
  *     Get all rows in the kvs.
  * 7. bool GetColsInRow(const Key& key, std::vector<Key>& cols):
  *     Get all cols from a row.
+ * 8. Store::Stats GetStats():
+ *     Get the hit and miss counters of the caches and filters.
+ * 9. void Checkpoint(const std::string& dir, const std::map<std::string, std::string>& extraFiles):
+ *     Save a consistent snapshot of the key-value store into the folder [dir].
+ * 10. void RestoreCheckpoint(const std::string& dir):
+ *     Replace the content of the key-value store with a snapshot.
+ * 11. bool PutIfVersion(std::string& key, uint64_t expectedVersion, std::string& newValue):
+ *     Conditional put a key-value pair, comparing only the version of the current value.
+ * 12. bool Update(std::string& key, std::function<bool(std::string&)> edit):
+ *     Edit the value of a key-value pair in place, atomically.
+ * 13. bool Transact(std::function<bool(Txn&)> body):
+ *     Read and write key-value pairs of any rows, and lock or unlock the rows, all or none.
+ * 14. static void SyncFolder(const std::string& dir, const std::vector<std::string>& files):
+ *     Flush files and the folder holding them to disk.
 */
 
 class Store {
 public:
-    Store(const std::string& dir, size_t cacheSize) : 
+    struct Stats {
+        uint64_t cacheHits = 0;             // reads served by the value cache
+        uint64_t cacheMisses = 0;           // reads that had to go to the SSTables
+        uint64_t blockCacheHits = 0;        // data blocks served by the block cache
+        uint64_t blockCacheMisses = 0;      // data blocks read from disk
+        uint64_t filterNegatives = 0;       // table lookups skipped by a Bloom filter
+        uint64_t filterFalsePositives = 0;  // table lookups let through by a Bloom filter in vain
+    };
+
+    /**
+     * @brief The reads and writes of a transaction, see Transact().
+     * Writes and lock changes are kept aside until the transaction ends, and reads see the
+     * writes made before them.
+     */
+    class Txn {
+    public:
+        // Whether the row can be accessed by the lockId
+        bool Accessible(const std::string& row, const std::string& lockId) {
+            return !store_.isResourceLocked(row, lockId);
+        }
+
+        // Read a value and its version, as written so far by the transaction
+        bool Read(const std::string& row, const std::string& col, std::string& value, uint64_t& version) {
+            auto it = writes_.find({row, col});
+            if (it == writes_.end())
+                return store_.read(row, col, value, version);
+            if (it->second.deleted)
+                return false;
+            value = it->second.value;
+            version = it->second.version;
+            return true;
+        }
+
+        void Write(const std::string& row, const std::string& col, const std::string& value, uint64_t version) {
+            writes_[{row, col}] = {false, version, value};
+        }
+
+        void Delete(const std::string& row, const std::string& col) {
+            writes_[{row, col}] = {true, 0, ""};
+        }
+
+        // Lock the row for the lockId, as SetNX() does
+        void Lock(const std::string& row, const std::string& lockId) {
+            locks_[row] = lockId;
+        }
+
+        // Unlock the row if the lockId holds it
+        void Unlock(const std::string& row, const std::string& lockId) {
+            auto it = store_.locks_.find(row);
+            if (it != store_.locks_.end() && it->second.lockId == lockId)
+                locks_[row] = "";
+        }
+
+        // Forget the writes made so far, keeping the lock changes
+        void DropWrites() {
+            writes_.clear();
+        }
+
+    private:
+        friend class Store;
+
+        struct PendingWrite {
+            bool deleted;
+            uint64_t version;
+            std::string value;
+        };
+
+        Txn(Store& store) : store_(store) {}
+
+        Store& store_;                                                         // the store, whose lock is held
+        std::map<std::pair<std::string, std::string>, PendingWrite> writes_;   // writes by row and col
+        std::map<std::string, std::string> locks_;                             // new lock of each row, empty to unlock
+    };
+
+    Store(const std::string& dir, size_t cacheSize, size_t blockCacheSize) :
         sstableDirectory_(dir),
-        scheduler_(Scheduler<std::string, std::string, std::string>(cacheSize, [this](std::string row, std::string col, const std::string& value) {
-            this->flushToDisk(row, col, value);
-        })) {}
+        cacheSize_(cacheSize),
+        scheduler_(Scheduler<std::string, std::string, CachedValue>(cacheSize)),
+        blockCache_(blockCacheSize) {
+        std::filesystem::create_directories(sstableDirectory_);
+        loadTables();
+        importLegacyFiles();
+
+        worker_ = std::thread([this]() {
+            backgroundWork();
+        });
+    }
+
+    ~Store() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stop_ = true;
+        }
+        workCv_.notify_all();
+        worker_.join();
+
+        // Persist whatever is left in memory
+        std::lock_guard<std::mutex> lock(mu_);
+        try {
+            if (imm_ != nullptr)
+                writeTable(*imm_, nextFileNumber_++, false);
+            if (!memtable_.empty())
+                writeTable(memtable_, nextFileNumber_++, false);
+        } catch (std::runtime_error& e) {
+            // The operations are still in the log and will be replayed
+        }
+    }
 
     /**
      * @brief Put a key-value pair into the key-value store.
-     * By default, the key-value pair is stored in the LRU cache. Any key-value pair
-     * that is evicted from the cache is stored in the disk under the folder [sstableDirectory_].
-     * 
+     * The key-value pair is stored in the memtable, which is flushed to an SSTable
+     * in the background once it is full.
+     *
      * @param row the row
      * @param col the col
      * @param value the value
      * @param opId the operation id
+     * @param version the version of the value
      */
-    bool Put(const std::string& row, const std::string& col, const std::string& value, const std::string& lockId) {
+    bool Put(const std::string& row, const std::string& col, const std::string& value, const std::string& lockId, uint64_t version = 0) {
+        std::unique_lock<std::mutex> lock(mu_);
         if (isResourceLocked(row, lockId))
             return false;
 
-        try {
-            scheduler_.Put(row, col, value);
-        } catch (std::runtime_error& e) {
-            // If the value size exceeds the cache capacity, store it in the disk
-            flushToDisk(row, col, value);
-        }
+        write(lock, row, col, false, value, version);
         return true;
     }
 
     /**
      * @brief Get the value of a key-value pair from the key-value store.
-     * If the key-value pair is in the LRU cache, return the value directly.
-     * Otherwise, read the key-value pair from the disk under the folder [sstableDirectory_].
-     * If the key-value pair is found, store it in the LRU cache.
-     * 
+     * Look up the memtables first, then the LRU cache, then the SSTables from newest
+     * to oldest. A value found on disk is stored in the LRU cache.
+     *
      * @param row the row
      * @param col the col
      * @param value the value
      * @param opId the operation id
      * @return true if the key-value pair is found, false otherwise
+     * @throw std::runtime_error if an SSTable that may hold the key cannot be read
      */
     bool Get(const std::string& row, const std::string& col, std::string& value, const std::string& lockId) {
+        uint64_t version;
+        return Get(row, col, value, version, lockId);
+    }
+
+    /**
+     * @brief Get the value of a key-value pair and its version.
+     *
+     * @param row the row
+     * @param col the col
+     * @param value the value
+     * @param version the version of the value
+     * @param lockId the lock id
+     * @return true if the key-value pair is found, false otherwise
+     * @throw std::runtime_error if an SSTable that may hold the key cannot be read
+     */
+    bool Get(const std::string& row, const std::string& col, std::string& value, uint64_t& version, const std::string& lockId) {
+        std::lock_guard<std::mutex> lock(mu_);
         if (isResourceLocked(row, lockId))
             return false;
 
-        if (scheduler_.Get(row, col, value)) {
-            return true;
-        }
-
-        // Read from disk
-        if (readFromDisk(row, col, value)) {
-            scheduler_.Put(row, col, value);
-            return true;
-        }
-        return false;
+        return read(row, col, value, version);
     }
 
     /**
      * @brief Delete a key-value pair from the key-value store.
-     * If the key-value pair is in the LRU cache, delete it directly.
-     * Otherwise, delete the key-value pair from the disk under the folder [sstableDirectory_].
-     * 
+     * A tombstone is written to the memtable which shadows older values on disk.
+     *
      * @param key the key
      * @param opId the operation id
      * @return true if the key-value pair is deleted, false otherwise
      */
     bool Delete(const std::string& row, const std::string& col, const std::string& lockId) {
+        std::unique_lock<std::mutex> lock(mu_);
         if (isResourceLocked(row, lockId))
             return false;
 
-        if (scheduler_.Delete(row, col))
-            return true;
-
-        // Delete from disk
-        std::string path = sstableDirectory_ + "/" + row + "/" + col + ".dat";
-        std::filesystem::remove(path);
-
-        // Delete the row directory if it is empty
-        std::string dir = sstableDirectory_ + "/" + row;
-        if (std::filesystem::exists(dir) && std::filesystem::is_empty(dir))
-            std::filesystem::remove(dir);
-
+        write(lock, row, col, true, "", 0);
         return true;
     }
 
     /**
      * @brief Conditional put a key-value pair into the key-value store.
-     * If the key-value pair is in the LRU cache and the current value is the same as the expected value,
-     * update the value with the new value. Otherwise, do nothing.
-     * 
+     * If the current value is the same as the expected value, update the value with
+     * the new value. Otherwise, do nothing.
+     *
      * @param row the row
      * @param col the col
      * @param currValue the current value
      * @param newValue the new value
+     * @param version the version of the new value
      * @return true if the key-value pair is updated, false otherwise
      */
-    bool CPut(const std::string& row, const std::string& col, const std::string& currValue, const std::string& newValue, const std::string& lockId) {
+    bool CPut(const std::string& row, const std::string& col, const std::string& currValue, const std::string& newValue, const std::string& lockId, uint64_t version = 0) {
+        std::unique_lock<std::mutex> lock(mu_);
         if (isResourceLocked(row, lockId))
             return false;
 
         std::string value;
-        if (Get(row, col, value, lockId) && value == currValue) {
-            Put(row, col, newValue, lockId);
+        uint64_t currVersion;
+        if (read(row, col, value, currVersion) && value == currValue) {
+            write(lock, row, col, false, newValue, version);
             return true;
         }
         return false;
     }
 
+    /**
+     * @brief Conditional put a key-value pair, comparing versions instead of values.
+     * If the version of the current value is expectedVersion, update the value with the
+     * new value. A missing cell has version 0, so expectedVersion 0 creates the cell.
+     *
+     * @param row the row
+     * @param col the col
+     * @param expectedVersion the version of the current value
+     * @param newValue the new value
+     * @param version the version of the new value
+     * @return true if the key-value pair is updated, false otherwise
+     */
+    bool PutIfVersion(const std::string& row, const std::string& col, uint64_t expectedVersion, const std::string& newValue, const std::string& lockId, uint64_t version) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (isResourceLocked(row, lockId))
+            return false;
+
+        std::string value;
+        uint64_t currVersion;
+        if (!read(row, col, value, currVersion))
+            currVersion = 0;
+        if (currVersion != expectedVersion)
+            return false;
+
+        write(lock, row, col, false, newValue, version);
+        return true;
+    }
+
+    /**
+     * @brief Edit the value of an existing key-value pair in place.
+     * The value is read, edited and written back without any other operation in between.
+     *
+     * @param row the row
+     * @param col the col
+     * @param edit the edit, which returns false to leave the value as it is
+     * @param lockId the lock id
+     * @param version the version of the edited value
+     * @return true if the key-value pair exists and the edit applies, false otherwise
+     */
+    bool Update(const std::string& row, const std::string& col, const std::function<bool(std::string&)>& edit, const std::string& lockId, uint64_t version) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (isResourceLocked(row, lockId))
+            return false;
+
+        std::string value;
+        uint64_t currVersion;
+        if (!read(row, col, value, currVersion) || !edit(value))
+            return false;
+
+        write(lock, row, col, false, value, version);
+        return true;
+    }
+
+    /**
+     * @brief Run a transaction over any number of rows.
+     * The body reads and writes through the transaction. Once it returns true, its writes
+     * and lock changes are made at once, with no read or write of the store in between.
+     * @note The store is locked while the body runs, so the body must not call the store itself.
+     *
+     * @param body the transaction, which returns false to abort it and change nothing
+     * @return true if the body returns true, false otherwise
+     */
+    bool Transact(const std::function<bool(Txn&)>& body) {
+        std::unique_lock<std::mutex> lock(mu_);
+        Txn txn(*this);
+        if (!body(txn))
+            return false;
+
+        for (const auto& [key, pending] : txn.writes_)
+            insert(key.first, key.second, pending.deleted, pending.value, pending.version);
+        for (const auto& [row, lockId] : txn.locks_) {
+            if (lockId.empty())
+                locks_.erase(row);
+            else
+                locks_[row] = LockInfo(lockId);
+        }
+        freezeIfFull(lock);
+        return true;
+    }
+
     /**
      * @brief Set a lock on a row if no such lock exists.
-     * 
+     *
      * @param row the row
      * @param opId the operation id
      * @return true if the lock is acquired, false otherwise
      */
     bool SetNX(const std::string& row, const std::string& lockId) {
+        std::lock_guard<std::mutex> lock(mu_);
         if (isResourceLocked(row, lockId))
             return false;
 
@@ -167,50 +390,66 @@ public:
 
     /**
      * @brief Release the lock on a row.
-     * 
+     *
      * @param row the row
      */
     bool Del(const std::string& row) {
+        std::lock_guard<std::mutex> lock(mu_);
         locks_.erase(row);
         return true;
     }
 
     /**
      * @brief Get all rows in the key-value store.
-     * 
+     *
      * @param rows the vector to store the rows
     */
     bool GetAllRows(std::vector<std::string>& rows) {
-        scheduler_.GetAllRows(rows);
-        readAllRows(rows);
+        std::lock_guard<std::mutex> lock(mu_);
+
+        std::string lastRow;
+        bool first = true;
+        scan("", [&](const std::string& key) {
+            std::string row = key.substr(0, key.find('\0'));
+            if (first || row != lastRow) {
+                rows.push_back(row);
+                lastRow = row;
+                first = false;
+            }
+        });
         return true;
     }
 
     /**
      * @brief Get all cols in a row.
-     * 
+     *
      * @param row the row
      * @param cols the vector to store the cols
      * @param lockId the lock id
      * @return true if the row exists, false otherwise
      */
     bool GetColsInRow(const std::string& row, std::vector<std::string>& cols, const std::string& lockId) {
+        std::lock_guard<std::mutex> lock(mu_);
         if (isResourceLocked(row, lockId))
             return false;
-    
-        std::string dir = sstableDirectory_ + "/" + row;
-        bool exists = std::filesystem::exists(dir);
-        if (!scheduler_.GetColsInRow(row, cols) && !exists) {
-            return false;
-        }
 
-        if (!exists)
-            return true;
+        std::string prefix = makeKey(row, "");
+        size_t before = cols.size();
+        scan(prefix, [&](const std::string& key) {
+            cols.push_back(key.substr(prefix.size()));
+        });
+        return cols.size() > before;
+    }
 
-        for (const auto& entry : std::filesystem::directory_iterator(dir)) {
-            cols.push_back(entry.path().filename());
-        }
-        return true;
+    /**
+     * @brief Get the hit and miss counters of the caches and filters.
+    */
+    Stats GetStats() {
+        std::lock_guard<std::mutex> lock(mu_);
+        Stats stats = stats_;
+        stats.blockCacheHits = blockCache_.Hits();
+        stats.blockCacheMisses = blockCache_.Misses();
+        return stats;
     }
 
     /**
@@ -218,7 +457,93 @@ public:
      * Remove all the SSTable files under the folder [sstableDirectory_].
      */
     void Clear() {
-        std::filesystem::remove_all(sstableDirectory_);
+        std::unique_lock<std::mutex> lock(mu_);
+        reset(lock);
+    }
+
+    /**
+     * @brief Save a consistent snapshot of the key-value store into the folder [dir].
+     * The memtable is flushed first, so the snapshot is exactly the set of SSTables,
+     * which are hard linked (or copied across file systems) into a temporary folder
+     * that is synced and renamed to [dir] once complete, and the rename synced too, so
+     * the snapshot is on disk when this returns. Writes are blocked meanwhile.
+     *
+     * @param dir the folder of the snapshot, which must not exist
+     * @param extraFiles files saved along with the tables, by name, ignored by RestoreCheckpoint()
+     * @throw std::filesystem::filesystem_error or std::runtime_error if the snapshot cannot be written
+     */
+    void Checkpoint(const std::string& dir, const std::map<std::string, std::string>& extraFiles = {}) {
+        std::unique_lock<std::mutex> lock(mu_);
+
+        // Make every write so far part of an SSTable
+        flushCv_.wait(lock, [this]() { return imm_ == nullptr; });
+        if (!memtable_.empty()) {
+            freezeMemtable();
+            flushCv_.wait(lock, [this]() { return imm_ == nullptr; });
+        }
+
+        // Holding the lock keeps compactions from deleting the tables meanwhile
+        std::string tmp = dir + ".tmp";
+        std::filesystem::remove_all(tmp);
+        std::filesystem::create_directories(tmp);
+        std::vector<std::string> files;
+        for (const auto& table : tables_) {
+            files.push_back(tmp + "/" + std::filesystem::path(table->Path()).filename().string());
+            linkOrCopy(table->Path(), files.back());
+        }
+        for (const auto& file : extraFiles) {
+            files.push_back(tmp + "/" + file.first);
+            std::ofstream out(files.back(), std::ios::binary);
+            out.write(file.second.data(), file.second.size());
+            out.close();
+            if (!out)
+                throw std::runtime_error("Can't write snapshot file.");
+        }
+
+        // The log is truncated once this returns, so the snapshot must survive a crash by then
+        SyncFolder(tmp, files);
+        std::filesystem::rename(tmp, dir);
+        if (!syncPath(std::filesystem::absolute(dir).parent_path().string()))
+            throw std::runtime_error("Can't sync snapshot folder.");
+    }
+
+    /**
+     * @brief Flush files and the folder holding them to disk, e.g. a snapshot before it is renamed in place.
+     *
+     * @param dir the folder
+     * @param files the files written in the folder
+     * @throw std::runtime_error if a file or the folder cannot be synced
+     */
+    static void SyncFolder(const std::string& dir, const std::vector<std::string>& files) {
+        for (const std::string& file : files) {
+            if (!syncPath(file))
+                throw std::runtime_error("Can't sync snapshot file.");
+        }
+        if (!syncPath(dir))
+            throw std::runtime_error("Can't sync snapshot folder.");
+    }
+
+    /**
+     * @brief Replace the content of the key-value store with a snapshot taken by Checkpoint().
+     *
+     * @param dir the folder of the snapshot
+     */
+    void RestoreCheckpoint(const std::string& dir) {
+        std::unique_lock<std::mutex> lock(mu_);
+        reset(lock);
+
+        std::vector<uint64_t> numbers;
+        for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".sst")
+                numbers.push_back(std::stoull(entry.path().stem().string()));
+        }
+
+        // Renumber the tables in their original order, so that they never share a
+        // number with a table whose blocks may still be in the block cache
+        std::sort(numbers.begin(), numbers.end());
+        for (uint64_t number : numbers)
+            linkOrCopy(dir + "/" + std::to_string(number) + ".sst", tablePath(nextFileNumber_++));
+        loadTables();
     }
 
 private:
@@ -234,59 +559,428 @@ private:
         }
     };
 
-    Scheduler<std::string, std::string, std::string> scheduler_;  // LRU cache
+    struct MemEntry {
+        bool deleted;       // whether the entry is a tombstone
+        uint64_t version;   // the version of the value, 0 for tombstones
+        std::string value;  // the value, empty for tombstones
+    };
+
+    // A value read from disk, as kept by the LRU cache
+    struct CachedValue {
+        std::string value;
+        uint64_t version;
+
+        size_t capacity() const {
+            return value.capacity();
+        }
+    };
+
+    using MemTable = std::map<std::string, MemEntry>;
+
     std::string sstableDirectory_;                   // Folder to store SSTable files
+    size_t cacheSize_;                               // Capacity of the LRU cache in bytes
+    Scheduler<std::string, std::string, CachedValue> scheduler_;  // LRU cache of values read from disk
+    BlockCache blockCache_;                          // LRU cache of data blocks read from disk
+    Stats stats_;                                    // counters of the value cache and filters
 
     std::unordered_map<std::string, LockInfo> locks_;  // Lock and the client that owns it
 
-    // Read the key-value pair from disk under the folder [sstableDirectory_].
-    // Key is of the form "row-col". The value is expected to be stored in a
-    // file of the form "[sstableDirectory_]/row/col.dat".
-    bool readFromDisk(const std::string& row, const std::string& col, std::string& value) {
-        std::string file = sstableDirectory_ + "/" + row + "/" + col + ".dat";
-        std::ifstream ifs(file);
-        std::string line;
-
-        // Read the key
-        std::getline(ifs, line);
-        if (line != row + "-" + col)
-            return false;
+    std::mutex mu_;                                // lock for all the fields below
+    MemTable memtable_;                            // mutable memtable receiving writes
+    size_t memtableBytes_ = 0;                     // approximate size of memtable_
+    std::shared_ptr<const MemTable> imm_;          // frozen memtable being flushed, or nullptr
+    std::vector<std::shared_ptr<SSTable>> tables_; // SSTables ordered from newest to oldest
+    uint64_t nextFileNumber_ = 1;                  // number of the next SSTable file
+
+    std::thread worker_;                 // background flush and compaction thread
+    std::condition_variable workCv_;     // signals the background thread
+    std::condition_variable flushCv_;    // signals writers waiting for imm_ to be flushed
+    bool stop_ = false;                  // whether the background thread should exit
+
+    // Combine row and col into an internal key. Cols of a row sort together.
+    static std::string makeKey(const std::string& row, const std::string& col) {
+        std::string key;
+        key.reserve(row.size() + 1 + col.size());
+        key.append(row);
+        key.push_back('\0');
+        key.append(col);
+        return key;
+    }
 
-        // Read the value
-        std::stringstream ss;
-        ss << ifs.rdbuf();
-        value = ss.str();
-        return true;
+    // Insert a value or a tombstone into the memtable, freezing it if it is full.
+    // Caller must hold the lock
+    void write(std::unique_lock<std::mutex>& lock, const std::string& row, const std::string& col, bool deleted, const std::string& value, uint64_t version) {
+        insert(row, col, deleted, value, version);
+        freezeIfFull(lock);
+    }
+
+    // Insert a value or a tombstone into the memtable
+    // Caller must hold the lock
+    void insert(const std::string& row, const std::string& col, bool deleted, const std::string& value, uint64_t version) {
+        std::string key = makeKey(row, col);
+        auto it = memtable_.find(key);
+        if (it != memtable_.end()) {
+            memtableBytes_ -= it->second.value.size();
+            it->second = {deleted, version, value};
+        } else {
+            memtableBytes_ += key.size() + sizeof(MemEntry);
+            memtable_.emplace(key, MemEntry{deleted, version, value});
+        }
+        memtableBytes_ += value.size();
+        scheduler_.Delete(row, col);
+    }
+
+    // Freeze the memtable if it is full. The lock is released while the previous frozen
+    // memtable is flushed, so callers must not be in the middle of an atomic change.
+    // Caller must hold the lock
+    void freezeIfFull(std::unique_lock<std::mutex>& lock) {
+        if (memtableBytes_ < MEMTABLE_SIZE)
+            return;
+
+        // Wait for the previous frozen memtable to reach disk before freezing this one
+        flushCv_.wait(lock, [this]() { return imm_ == nullptr; });
+        freezeMemtable();
+    }
+
+    // Hand the memtable over to the background thread for flushing
+    // Caller must hold the lock and make sure imm_ is nullptr
+    void freezeMemtable() {
+        imm_ = std::make_shared<const MemTable>(std::move(memtable_));
+        memtable_ = MemTable();
+        memtableBytes_ = 0;
+        workCv_.notify_one();
     }
-    
-    // Flush the key-value pair to disk under the folder [sstableDirectory_].
-    // Key is of the form "row-col". Each key-value pair is store in a new
-    // file of the form "[sstableDirectory_]/row/col.dat". The value is stored
-    // in the file.
-    void flushToDisk(std::string row, std::string col, const std::string& value) {
-        std::string dir = sstableDirectory_ + "/" + row;
-        std::string file = dir + "/" + col + ".dat";
 
-        // Create the directory if it does not exist
-        if (!std::filesystem::exists(dir))
-            std::filesystem::create_directories(dir);
+    // Drop all the data in memory and on disk. File numbers keep increasing so
+    // that stale blocks in the block cache are never mistaken for new ones.
+    // Caller must hold the lock
+    void reset(std::unique_lock<std::mutex>& lock) {
+        flushCv_.wait(lock, [this]() { return imm_ == nullptr; });
 
-        std::ofstream ofs(file);
-        if (!ofs.is_open())
-            throw std::runtime_error("Failed to open file: " + file);
+        memtable_.clear();
+        memtableBytes_ = 0;
+        tables_.clear();
+        scheduler_ = Scheduler<std::string, std::string, CachedValue>(cacheSize_);
 
-        ofs << row << "-" << col << std::endl;
-        ofs << value;
+        std::filesystem::remove_all(sstableDirectory_);
+        std::filesystem::create_directories(sstableDirectory_);
     }
 
-    // Read all the rows in the SSTable files under the folder [sstableDirectory_].
-    void readAllRows(std::vector<std::string>& rows) {
-        if (!std::filesystem::exists(sstableDirectory_))
+    // Hard link a file, or copy it if the link crosses file systems
+    static void linkOrCopy(const std::string& from, const std::string& to) {
+        std::error_code ec;
+        std::filesystem::create_hard_link(from, to, ec);
+        if (ec)
+            std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing);
+    }
+
+    // The memtables from newest to oldest, the frozen one may be nullptr
+    std::array<const MemTable*, 2> memtables() {
+        return {&memtable_, imm_.get()};
+    }
+
+    // Look up a key in memory and then on disk. Throws std::runtime_error if a table
+    // cannot be read, as the key may be in it and older tables would answer wrongly.
+    // Caller must hold the lock
+    bool read(const std::string& row, const std::string& col, std::string& value, uint64_t& version) {
+        std::string key = makeKey(row, col);
+
+        for (const MemTable* table : memtables()) {
+            if (table == nullptr)
+                continue;
+            auto it = table->find(key);
+            if (it != table->end()) {
+                if (it->second.deleted)
+                    return false;
+                value = it->second.value;
+                version = it->second.version;
+                return true;
+            }
+        }
+
+        CachedValue cached;
+        if (scheduler_.Get(row, col, cached)) {
+            stats_.cacheHits++;
+            value = std::move(cached.value);
+            version = cached.version;
+            return true;
+        }
+        stats_.cacheMisses++;
+
+        for (const auto& table : tables_) {
+            if (!table->MayContain(key)) {
+                stats_.filterNegatives++;
+                continue;
+            }
+
+            SSTable::Lookup result = table->Get(key, value, version, &blockCache_);
+            if (result == SSTable::Lookup::kError)
+                throw std::runtime_error("Failed to read SSTable: " + table->Path());
+            if (result == SSTable::Lookup::kNotFound)
+                stats_.filterFalsePositives++;
+            if (result == SSTable::Lookup::kDeleted)
+                return false;
+            if (result == SSTable::Lookup::kFound) {
+                try {
+                    scheduler_.Put(row, col, {value, version});
+                } catch (std::runtime_error& e) {
+                    // The value is larger than the cache, serve it without caching
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Visit every live key starting with prefix in sorted order. The newest
+    // entry of a key decides whether it is live. Throws like read().
+    // Caller must hold the lock
+    void scan(const std::string& prefix, const std::function<void(const std::string&)>& visit) {
+        std::map<std::string, bool> live;
+        auto collect = [&](const std::string& key, bool deleted) {
+            if (key.compare(0, prefix.size(), prefix) != 0)
+                return false;
+            live.emplace(key, !deleted);
+            return true;
+        };
+
+        for (const MemTable* table : memtables()) {
+            if (table == nullptr)
+                continue;
+            for (auto it = table->lower_bound(prefix); it != table->end() && collect(it->first, it->second.deleted); it++);
+        }
+
+        for (const auto& table : tables_) {
+            SSTable::Iterator it(table.get(), prefix);
+            for (; it.Valid() && collect(it.Key(), it.Deleted()); it.Next());
+            if (it.Failed())
+                throw std::runtime_error("Failed to read SSTable: " + table->Path());
+        }
+
+        for (const auto& entry : live) {
+            if (entry.second)
+                visit(entry.first);
+        }
+    }
+
+    // Flush frozen memtables and compact SSTables until asked to stop
+    void backgroundWork() {
+        std::unique_lock<std::mutex> lock(mu_);
+        while (true) {
+            workCv_.wait(lock, [this]() {
+                return stop_ || imm_ != nullptr || tables_.size() >= COMPACTION_TRIGGER;
+            });
+            if (stop_)
+                return;
+
+            try {
+                if (imm_ != nullptr) {
+                    std::shared_ptr<const MemTable> imm = imm_;
+                    uint64_t number = nextFileNumber_++;
+
+                    lock.unlock();
+                    std::shared_ptr<SSTable> table = writeTable(*imm, number, false);
+                    lock.lock();
+
+                    if (table != nullptr)
+                        tables_.insert(tables_.begin(), table);
+                    imm_ = nullptr;
+                    flushCv_.notify_all();
+                } else {
+                    compact(lock);
+                }
+            } catch (std::runtime_error& e) {
+                // Keep the data in memory and retry later. The error may come from
+                // disk I/O done without the lock, e.g. when the store was cleared meanwhile
+                if (lock.owns_lock())
+                    lock.unlock();
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                lock.lock();
+            }
+        }
+    }
+
+    // Merge the newest run of similarly sized SSTables into one table.
+    // Caller must hold the lock, which is released while merging.
+    void compact(std::unique_lock<std::mutex>& lock) {
+        // Pick the newest tables while the next older table is not much larger
+        // than everything picked so far
+        size_t count = 2;
+        uint64_t total = tables_[0]->FileSize() + tables_[1]->FileSize();
+        while (count < tables_.size() && tables_[count]->FileSize() <= COMPACTION_SIZE_RATIO * total) {
+            total += tables_[count]->FileSize();
+            count++;
+        }
+
+        std::vector<std::shared_ptr<SSTable>> inputs(tables_.begin(), tables_.begin() + count);
+        bool dropTombstones = count == tables_.size();
+        uint64_t number = nextFileNumber_++;
+
+        lock.unlock();
+        std::shared_ptr<SSTable> output = mergeTables(inputs, number, dropTombstones);
+        if (output != nullptr && !syncPath(sstableDirectory_))
+            throw std::runtime_error("Can't sync SSTable folder.");
+        lock.lock();
+
+        // The tables may have been cleared in the meantime
+        if (tables_.size() < count || !std::equal(inputs.begin(), inputs.end(), tables_.begin())) {
+            if (output != nullptr)
+                std::filesystem::remove(output->Path());
             return;
+        }
 
+        tables_.erase(tables_.begin(), tables_.begin() + count);
+        if (output != nullptr)
+            tables_.insert(tables_.begin(), output);
+
+        // Oldest first, so that a crash in between never leaves a value without the newer
+        // tombstone which deleted it, as the output may have dropped the tombstone
+        for (auto it = inputs.rbegin(); it != inputs.rend(); it++)
+            std::filesystem::remove((*it)->Path());
+    }
+
+    // Merge the given tables (newest first) into a new table. Returns nullptr
+    // if every entry was dropped.
+    std::shared_ptr<SSTable> mergeTables(const std::vector<std::shared_ptr<SSTable>>& inputs, uint64_t number, bool dropTombstones) {
+        std::vector<std::unique_ptr<SSTable::Iterator>> its;
+        for (const auto& table : inputs)
+            its.emplace_back(new SSTable::Iterator(table.get(), ""));
+
+        std::string tmp = tablePath(number) + ".tmp";
+        SSTableBuilder builder(tmp);
+
+        while (true) {
+            // Find the smallest key. On ties the newest table wins.
+            int winner = -1;
+            for (size_t i = 0; i < its.size(); i++) {
+                if (its[i]->Valid() && (winner < 0 || its[i]->Key() < its[winner]->Key()))
+                    winner = static_cast<int>(i);
+            }
+            if (winner < 0)
+                break;
+
+            std::string key = its[winner]->Key();
+            if (!(dropTombstones && its[winner]->Deleted()))
+                builder.Add(key, its[winner]->Deleted(), its[winner]->Value(), its[winner]->Version());
+
+            for (auto& it : its) {
+                if (it->Valid() && it->Key() == key)
+                    it->Next();
+            }
+        }
+
+        // A merge missing the rest of a table would lose its keys
+        for (size_t i = 0; i < its.size(); i++) {
+            if (its[i]->Failed()) {
+                std::filesystem::remove(tmp);
+                throw std::runtime_error("Failed to read SSTable: " + inputs[i]->Path());
+            }
+        }
+
+        return finishTable(builder, tmp, number);
+    }
+
+    // Write a memtable to a new SSTable file
+    std::shared_ptr<SSTable> writeTable(const MemTable& memtable, uint64_t number, bool dropTombstones) {
+        std::string tmp = tablePath(number) + ".tmp";
+        SSTableBuilder builder(tmp);
+
+        for (const auto& entry : memtable) {
+            if (!(dropTombstones && entry.second.deleted))
+                builder.Add(entry.first, entry.second.deleted, entry.second.value, entry.second.version);
+        }
+
+        return finishTable(builder, tmp, number);
+    }
+
+    // Seal a table file and atomically move it in place
+    std::shared_ptr<SSTable> finishTable(SSTableBuilder& builder, const std::string& tmp, uint64_t number) {
+        if (builder.NumEntries() == 0) {
+            std::filesystem::remove(tmp);
+            return nullptr;
+        }
+
+        builder.Finish();
+        std::filesystem::rename(tmp, tablePath(number));
+
+        std::shared_ptr<SSTable> table = SSTable::Open(tablePath(number), number);
+        if (table == nullptr)
+            throw std::runtime_error("Failed to open SSTable: " + tablePath(number));
+        return table;
+    }
+
+    // Path of the SSTable file with the given number
+    std::string tablePath(uint64_t number) {
+        return sstableDirectory_ + "/" + std::to_string(number) + ".sst";
+    }
+
+    // Open the SSTable files left by a previous run and drop unfinished ones
+    void loadTables() {
+        for (const auto& entry : std::filesystem::directory_iterator(sstableDirectory_)) {
+            if (!entry.is_regular_file())
+                continue;
+
+            std::string filename = entry.path().filename().string();
+            if (entry.path().extension() == ".tmp") {
+                std::filesystem::remove(entry.path());
+                continue;
+            }
+            if (entry.path().extension() != ".sst")
+                continue;
+
+            uint64_t number = std::stoull(entry.path().stem().string());
+            std::shared_ptr<SSTable> table = SSTable::Open(entry.path().string(), number);
+            if (table != nullptr)
+                tables_.push_back(table);
+
+            nextFileNumber_ = std::max(nextFileNumber_, number + 1);
+        }
+
+        std::sort(tables_.begin(), tables_.end(), [](const auto& a, const auto& b) {
+            return a->Number() > b->Number();
+        });
+    }
+
+    // Import cells stored by the previous one-file-per-cell layout
+    // "[sstableDirectory_]/row/col.dat" and remove the old files.
+    void importLegacyFiles() {
+        std::vector<std::filesystem::path> rowDirs;
         for (const auto& entry : std::filesystem::directory_iterator(sstableDirectory_)) {
-            rows.push_back(entry.path().filename());
+            if (entry.is_directory())
+                rowDirs.push_back(entry.path());
+        }
+        if (rowDirs.empty())
+            return;
+
+        MemTable legacy;
+        for (const auto& dir : rowDirs) {
+            std::string row = dir.filename().string();
+            for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+                if (entry.path().extension() != ".dat")
+                    continue;
+
+                std::string col = entry.path().stem().string();
+                std::ifstream ifs(entry.path());
+                std::string line;
+
+                // The first line holds the key, the rest is the value
+                std::getline(ifs, line);
+                if (line != row + "-" + col)
+                    continue;
+
+                std::stringstream ss;
+                ss << ifs.rdbuf();
+                legacy[makeKey(row, col)] = {false, 0, ss.str()};
+            }
         }
+
+        uint64_t number = nextFileNumber_++;
+        std::shared_ptr<SSTable> table = writeTable(legacy, number, true);
+        if (table != nullptr)
+            tables_.insert(tables_.begin(), table);
+
+        for (const auto& dir : rowDirs)
+            std::filesystem::remove_all(dir);
     }
 
     // Check if is the resource can be accessed by the lockId
@@ -1,7 +1,7 @@
 #include "KVSServer.hpp"
 
-void RunServer(const int me, const std::vector<std::string> peersIP) {
-    if (me < 0 || me >= peersIP.size()) {
+void RunServer(const int me, const std::vector<std::string> peersIP, Logger::Durability durability) {
+    if (me < 0 || me >= (int)peersIP.size()) {
         std::cerr << "Error: Index out of bounds." << std::endl;
         return;
     }
@@ -23,8 +23,8 @@ void RunServer(const int me, const std::vector<std::string> peersIP) {
     }
 
     // Initialize services
-    auto storePtr = std::make_shared<Store>(address + "_sstables", CACHE_SIZE);
-    auto loggerPtr = std::make_shared<Logger>("../../server_logs/" + address + "_logs");
+    auto storePtr = std::make_shared<Store>(address + "_sstables", CACHE_SIZE, BLOCK_CACHE_SIZE);
+    auto loggerPtr = std::make_shared<Logger>("../../server_logs/" + address + "_logs", durability);
     auto paxosServicePtr = std::make_shared<PaxosImpl>(peersIP, me);
     KVSServer kvsService(me, paxosServicePtr, storePtr, loggerPtr);
 
@@ -45,20 +45,30 @@ void RunServer(const int me, const std::vector<std::string> peersIP) {
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " index ip1 [ip2 ...]" << std::endl;
+    // Parse log durability mode
+    Logger::Durability durability = Logger::Durability::PERIODIC;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        if (opt != 'd' || !Logger::ParseDurability(optarg, durability)) {
+            std::cerr << "Usage: " << argv[0] << " [-d none|periodic|commit] index ip1 [ip2 ...]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        std::cerr << "Usage: " << argv[0] << " [-d none|periodic|commit] index ip1 [ip2 ...]" << std::endl;
         return 1;
     }
 
     // Parse index
-    int index = std::stoi(argv[1]);
+    int index = std::stoi(argv[optind]);
 
     // Parse IPs
     std::vector<std::string> ips;
-    for (int i = 2; i < argc; ++i) {
+    for (int i = optind + 1; i < argc; ++i) {
         ips.push_back(std::string(argv[i]));
     }
 
-    RunServer(index, ips);
+    RunServer(index, ips, durability);
     return 0;
 }
\ No newline at end of file
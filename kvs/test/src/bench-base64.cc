@@ -0,0 +1,59 @@
+#include <string>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cassert> // For basic assertions
+
+#include "base64.hpp"
+
+#define BENCH_SIZE (8 << 20)  // bytes encoded per round, about the size of a mail attachment
+#define BENCH_ROUNDS 20       // rounds timed per codec
+
+const char *isaName(base64::cpu_isa isa) {
+    switch (isa) {
+    case base64::cpu_isa::avx2:
+        return "avx2";
+    case base64::cpu_isa::sse41:
+        return "sse4.1";
+    default:
+        return "scalar";
+    }
+}
+
+// Time a codec over the rounds, and return its throughput in GB/s of input
+template <class Codec>
+double throughput(size_t size, Codec codec) {
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+        codec();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return (double)size * BENCH_ROUNDS / elapsed.count() / 1e9;
+}
+
+int main() {
+    std::mt19937 rng(42);
+    std::string bytes(BENCH_SIZE, '\0');
+    for (char &byte : bytes)
+        byte = (char)(rng() & 0xff);
+    std::string text = base64::to_base64(bytes, base64::cpu_isa::scalar);
+
+    std::printf("%-8s %12s %12s\n", "isa", "encode GB/s", "decode GB/s");
+    double scalarEncode = 0, scalarDecode = 0;
+    for (base64::cpu_isa isa : {base64::cpu_isa::scalar, base64::cpu_isa::sse41, base64::cpu_isa::avx2}) {
+        if (isa > base64::best_isa())
+            continue;
+
+        std::string encoded, decoded;
+        double encode = throughput(bytes.size(), [&]() { encoded = base64::to_base64(bytes, isa); });
+        double decode = throughput(text.size(), [&]() { decoded = base64::from_base64(text, isa); });
+        assert(encoded == text && decoded == bytes);
+
+        if (isa == base64::cpu_isa::scalar) {
+            scalarEncode = encode;
+            scalarDecode = decode;
+        }
+        std::printf("%-8s %12.2f %12.2f   (%.1fx, %.1fx)\n", isaName(isa), encode, decode,
+                    encode / scalarEncode, decode / scalarDecode);
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include <string>
+#include <vector>
+#include <random>
+#include <stdexcept>
+#include <cassert> // For basic assertions
+#include <iostream> // For std::cout
+
+#include "base64.hpp"
+
+std::string randomBytes(std::mt19937 &rng, size_t size) {
+    std::string bytes(size, '\0');
+    for (char &byte : bytes)
+        byte = (char)(rng() & 0xff);
+    return bytes;
+}
+
+bool throws(const std::string &text, base64::cpu_isa isa) {
+    try {
+        base64::from_base64(text, isa);
+    } catch (const std::runtime_error &e) {
+        return true;
+    }
+    return false;
+}
+
+void testKnownValues() {
+    std::cout << "Test Known Values: Starting..." << std::endl;
+
+    assert(base64::to_base64("") == "");
+    assert(base64::to_base64("f") == "Zg==");
+    assert(base64::to_base64("fo") == "Zm8=");
+    assert(base64::to_base64("foo") == "Zm9v");
+    assert(base64::to_base64("foobar") == "Zm9vYmFy");
+    assert(base64::from_base64("Zm9vYg==") == "foob");
+    assert(base64::from_base64("Zm9vYmE=") == "fooba");
+
+    std::cout << "Test Known Values: Passed" << std::endl;
+}
+
+void testMatchesScalar() {
+    std::cout << "Test Matches Scalar: Starting..." << std::endl;
+
+    // Cover every tail length around the 12, 16, 24 and 32 byte blocks
+    std::mt19937 rng(42);
+    for (base64::cpu_isa isa : {base64::cpu_isa::sse41, base64::cpu_isa::avx2}) {
+        if (isa > base64::best_isa())
+            continue;
+        for (size_t size = 0; size < 300; size++) {
+            std::string bytes = randomBytes(rng, size);
+            std::string text = base64::to_base64(bytes, base64::cpu_isa::scalar);
+            assert(base64::to_base64(bytes, isa) == text);
+            assert(base64::from_base64(text, isa) == bytes);
+        }
+    }
+
+    std::cout << "Test Matches Scalar: Passed" << std::endl;
+}
+
+void testInvalidCharacters() {
+    std::cout << "Test Invalid Characters: Starting..." << std::endl;
+
+    // Every position of a bad character is rejected, whichever block it lands in
+    std::mt19937 rng(7);
+    std::string text = base64::to_base64(randomBytes(rng, 120));
+    for (base64::cpu_isa isa : {base64::cpu_isa::scalar, base64::cpu_isa::sse41, base64::cpu_isa::avx2}) {
+        if (isa > base64::best_isa())
+            continue;
+        for (size_t i = 0; i < text.size(); i++) {
+            for (char bad : {'\0', ' ', '-', '@', '[', '`', '{', '=', (char)0x80, (char)0xff}) {
+                // Padding is only valid at the end
+                if (bad == '=' && i == text.size() - 1)
+                    continue;
+                std::string corrupted = text;
+                corrupted[i] = bad;
+                assert(throws(corrupted, isa));
+            }
+        }
+    }
+
+    std::cout << "Test Invalid Characters: Passed" << std::endl;
+}
+
+int main() {
+    testKnownValues();
+    testMatchesScalar();
+    testInvalidCharacters();
+    std::cout << "All tests passed!" << std::endl;
+    return 0;
+}
@@ -3,6 +3,68 @@
 #include <fstream>
 #include <sstream>
 
+// Put a value the way older clients did, straight to the server without marking the cluster
+void legacyPut(const std::string& ip, const std::string& row, const std::string& col, const std::string& value) {
+    std::unique_ptr<KVS::Stub> stub = KVS::NewStub(grpc::CreateChannel(ip, grpc::InsecureChannelCredentials()));
+    grpc::ClientContext context;
+    PutArgs args;
+    PutReply reply;
+    args.set_row(row);
+    args.set_col(col);
+    args.set_newvalue(value);
+    args.set_requestid("legacy-" + row + "-" + col);
+    args.set_lockid("-");
+    assert(stub->PutValue(&context, args, &reply).ok() && reply.success());
+}
+
+void testLegacyValues(KVSClient client) {
+    std::cout << "Testing conversion of legacy values..." << std::endl;
+    std::string value;
+    size_t converted;
+
+    // Values as older clients stored them
+    std::string binary("bin\0ary\xff", 8);
+    legacyPut("127.0.0.1:50051", "legacyRow", "col1", base64::to_base64("value1"));
+    legacyPut("127.0.0.1:50051", "legacyRow", "col2", base64::to_base64(binary));
+    legacyPut("127.0.0.1:50051", "legacyRow", "col3", "not base64!");
+
+    // Raw values written by this version before the conversion, which are also valid base64
+    client.Put("legacyRow", "col4", "test");
+    client.Put("legacyRow", "col5", "abcd");
+
+    assert(client.ConvertLegacyValues(converted));
+    assert(converted == 2);
+    assert(client.Get("legacyRow", "col1", value));
+    assert(value == "value1");
+    assert(client.Get("legacyRow", "col2", value));
+    assert(value == binary);
+    assert(client.Get("legacyRow", "col3", value));
+    assert(value == "not base64!");
+    assert(client.Get("legacyRow", "col4", value));
+    assert(value == "test");
+    assert(client.Get("legacyRow", "col5", value));
+    assert(value == "abcd");
+
+    // The cluster is converted only once
+    client.Put("legacyRow", "col1", base64::to_base64("value1"));
+    assert(client.ConvertLegacyValues(converted));
+    assert(converted == 0);
+    assert(client.Get("legacyRow", "col1", value));
+    assert(value == base64::to_base64("value1"));
+
+    std::vector<std::string> rows;
+    assert(client.GetAllRows(rows));
+    assert(rows.size() == 1);
+
+    client.Delete("legacyRow", "col1");
+    client.Delete("legacyRow", "col2");
+    client.Delete("legacyRow", "col3");
+    client.Delete("legacyRow", "col4");
+    client.Delete("legacyRow", "col5");
+
+    std::cout << "Conversion of legacy values test passed!" << std::endl;
+}
+
 void testSimple(KVSClient client) {
     std::cout << "Testing simple put and get..." << std::endl;
     std::string value;
@@ -93,6 +155,204 @@ void testGetAll(KVSClient client) {
     std::cout << "Get All Rows test passed!" << std::endl;
 }
 
+void testAsync(KVSClient client) {
+    std::cout << "Testing async put and get..." << std::endl;
+
+    std::vector<std::future<bool>> puts;
+    for (int i = 0; i < 20; i++)
+        puts.push_back(client.PutAsync("asyncRow", "col" + std::to_string(i), "value" + std::to_string(i)));
+    for (std::future<bool> &put : puts)
+        assert(put.get());
+
+    std::vector<std::string> values(20);
+    std::vector<std::future<bool>> gets;
+    for (int i = 0; i < 20; i++)
+        gets.push_back(client.GetAsync("asyncRow", "col" + std::to_string(i), values[i]));
+    for (int i = 0; i < 20; i++) {
+        assert(gets[i].get());
+        assert(values[i] == "value" + std::to_string(i));
+    }
+
+    std::string value;
+    assert(client.CPutAsync("asyncRow", "col0", "value0", "value00").get());
+    assert(!client.CPutAsync("asyncRow", "col0", "value0", "value01").get());
+    assert(client.DeleteAsync("asyncRow", "col0").get());
+    assert(!client.GetAsync("asyncRow", "col0", value).get());
+
+    std::cout << "Async put and get test passed!" << std::endl;
+}
+
+void testVersions(KVSClient client) {
+    std::cout << "Testing versioned puts..." << std::endl;
+    std::string value;
+    uint64_t version, newVersion;
+
+    // A missing pair has version 0
+    assert(client.PutIfVersion("versionRow", "col1", 0, "value1"));
+    assert(!client.PutIfVersion("versionRow", "col1", 0, "value2"));
+    assert(client.Get("versionRow", "col1", value, version));
+    assert(value == "value1" && version > 0);
+
+    // Versions grow with every write, and a stale version is refused
+    assert(client.PutIfVersion("versionRow", "col1", version, "value2"));
+    assert(!client.PutIfVersion("versionRow", "col1", version, "value3"));
+    assert(client.Get("versionRow", "col1", value, newVersion));
+    assert(value == "value2" && newVersion > version);
+
+    assert(client.PutIfVersionAsync("versionRow", "col1", newVersion, "value3").get());
+    assert(client.GetAsync("versionRow", "col1", value, version).get());
+    assert(value == "value3" && version > newVersion);
+
+    client.Delete("versionRow", "col1");
+
+    std::cout << "Versioned puts test passed!" << std::endl;
+}
+
+void testLines(KVSClient client) {
+    std::cout << "Testing line operations..." << std::endl;
+    std::string value;
+
+    // Lines are only edited in existing cells
+    assert(!client.AppendLine("lineRow", "index", "a.txt 1"));
+    client.Put("lineRow", "index", "");
+
+    assert(client.AppendLine("lineRow", "index", "a.txt 1", "a.txt"));
+    assert(client.AppendLine("lineRow", "index", "ab.txt 2", "ab.txt"));
+    assert(!client.AppendLine("lineRow", "index", "a.txt 3", "a.txt"));
+    assert(client.Get("lineRow", "index", value));
+    assert(value == "a.txt 1\nab.txt 2\n");
+
+    // Lines are found by their first field, not by a prefix of it
+    assert(client.ReplaceLine("lineRow", "index", "ab.txt", "b.txt 2"));
+    assert(!client.RemoveLine("lineRow", "index", "a"));
+    assert(client.RemoveLine("lineRow", "index", "a.txt"));
+    assert(client.Get("lineRow", "index", value));
+    assert(value == "b.txt 2\n");
+
+    // Lines with spaces in them are matched whole
+    assert(client.AppendLine("lineRow", "index", "b.txt", "b.txt\n"));
+    assert(!client.AppendLine("lineRow", "index", "b.txt", "b.txt\n"));
+    assert(client.RemoveLine("lineRow", "index", "b.txt\n"));
+    assert(client.Get("lineRow", "index", value));
+    assert(value == "b.txt 2\n");
+
+    // Concurrent appends are all kept
+    std::vector<std::future<bool>> appends;
+    for (int i = 0; i < 20; i++)
+        appends.push_back(std::async(std::launch::async, [&client, i]() {
+            return client.AppendLine("lineRow", "index", "file" + std::to_string(i) + " " + std::to_string(i));
+        }));
+    for (std::future<bool> &append : appends)
+        assert(append.get());
+    assert(client.Get("lineRow", "index", value));
+    assert(std::count(value.begin(), value.end(), '\n') == 21);
+
+    client.Delete("lineRow", "index");
+
+    std::cout << "Line operations test passed!" << std::endl;
+}
+
+void testTransactions(KVSClient client) {
+    std::cout << "Testing transactions..." << std::endl;
+    std::string value;
+    std::vector<std::string> values;
+    uint64_t version;
+
+    client.Put("txnRow1", "col1", "value1");
+    client.Put("txnRow1", "index", "");
+    assert(client.Get("txnRow1", "col1", value, version));
+
+    // Move a cell to another row, with its index line
+    Transaction move;
+    move.Check("txnRow1", "col1", version)
+        .Get("txnRow1", "col1")
+        .Delete("txnRow1", "col1")
+        .PutIfVersion("txnRow2", "col1", 0, "value1")
+        .AppendLine("txnRow1", "index", "col1 moved", "col1");
+    assert(client.Commit(move, values));
+    assert(values.size() == 1 && values[0] == "value1");
+    assert(!client.Get("txnRow1", "col1", value));
+    assert(client.Get("txnRow2", "col1", value) && value == "value1");
+    assert(client.Get("txnRow1", "index", value) && value == "col1 moved\n");
+
+    // A failing operation leaves every cell as it is
+    Transaction failing;
+    failing.Put("txnRow1", "col2", "value2")
+        .CPut("txnRow2", "col1", "wrong", "value3");
+    bool partial = true;
+    assert(!client.Commit(failing, values, &partial) && !partial);
+    assert(!client.Get("txnRow1", "col2", value));
+    assert(client.Get("txnRow2", "col1", value) && value == "value1");
+
+    // The operations see the writes before them
+    Transaction chained;
+    chained.Put("txnRow1", "col2", "value2")
+        .CPut("txnRow1", "col2", "value2", "value3")
+        .Get("txnRow1", "col2");
+    assert(client.Commit(chained, values));
+    assert(values.size() == 1 && values[0] == "value3");
+
+    // Locked rows are only written with their key
+    std::string key;
+    assert(client.SetNX("txnRow2", key));
+    Transaction locked;
+    locked.Put("txnRow2", "col1", "value4");
+    assert(!client.Commit(locked, values));
+    Transaction unlocked;
+    unlocked.Put("txnRow2", "col1", "value4", key);
+    assert(client.Commit(unlocked, values));
+    assert(client.Del("txnRow2", key));
+
+    client.Delete("txnRow1", "col2");
+    client.Delete("txnRow1", "index");
+    client.Delete("txnRow2", "col1");
+
+    std::cout << "Transactions test passed!" << std::endl;
+}
+
+void testConcurrent(KVSClient client) {
+    std::cout << "Testing concurrent calls..." << std::endl;
+
+    // Threads share one client, as the handler threads of the servers do
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&client, t]() {
+            std::string row = "threadRow" + std::to_string(t);
+            for (int i = 0; i < 20; i++) {
+                std::string value;
+                assert(client.Put(row, "col" + std::to_string(i), "value" + std::to_string(i)));
+                assert(client.Get(row, "col" + std::to_string(i), value));
+                assert(value == "value" + std::to_string(i));
+            }
+
+            std::string key, tmp;
+            assert(client.SetNX(row, key));
+            assert(!client.SetNX(row, tmp));
+            assert(client.Del(row, key));
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+
+    // Only one of the threads racing for a lock gets it
+    std::atomic<int> acquired(0);
+    std::vector<std::string> keys(8);
+    threads.clear();
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&client, &acquired, &keys, t]() {
+            if (client.SetNX("sharedRow", keys[t]))
+                acquired++;
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    assert(acquired == 1);
+    for (const std::string &key : keys)
+        client.Del("sharedRow", key);
+
+    std::cout << "Concurrent calls test passed!" << std::endl;
+}
+
 void testBigFile(KVSClient client) {
     std::cout << "Testing big file..." << std::endl;
 
@@ -115,9 +375,15 @@ void testBigFile(KVSClient client) {
 void test() {
     std::vector<std::vector<std::string>> clusters = {{"127.0.0.1:50051"}};
     KVSClient client1({"127.0.0.1:50051"}), client2(clusters);
+    testLegacyValues(client1);
     testSimple(client1);
     testLock(client1, client2);
     testGetAll(client1);
+    testAsync(client1);
+    testVersions(client1);
+    testLines(client1);
+    testTransactions(client1);
+    testConcurrent(client1);
     testBigFile(client1);
 }
 
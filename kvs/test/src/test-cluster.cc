@@ -0,0 +1,547 @@
+#include <string>
+#include <cassert> // For basic assertions
+#include <iostream> // For std::cout
+#include <atomic>
+#include <set>
+#include <sstream>
+
+// Snapshots and state transfers happen after a few hundred slots instead of thousands
+#define SNAPSHOT_INTERVAL 200
+#define STATE_TRANSFER_MIN_LAG 100
+
+#include "KVSServer.hpp"
+
+#define TEST_DIR "test_cluster_data"
+#define NUM_REPLICAS 3
+#define RPC_DEADLINE_MS 5000   // deadline of every request of the tests
+#define RPC_MAX_TRIES 20       // tries of a write, on the replicas in turn, before the test fails
+#define CATCH_UP_TIMEOUT_MS 30000  // how long a restarted replica may take to catch up
+
+/**
+ * Runs a cluster of NUM_REPLICAS replicas in this process, each with its own Paxos peer,
+ * store and log, and talks to them over gRPC the way clients do.
+ */
+
+std::vector<std::string> peers = {"127.0.0.1:50061", "127.0.0.1:50062", "127.0.0.1:50063"};
+
+// A replica of the cluster, running in this process while it is up
+struct Replica {
+    std::shared_ptr<PaxosImpl> paxos;
+    std::unique_ptr<KVSServer> kvs;
+    std::unique_ptr<grpc::Server> server;
+    std::atomic<bool> up{false};
+};
+
+Replica replicas[NUM_REPLICAS];
+std::unique_ptr<KVS::Stub> stubs[NUM_REPLICAS];  // kept across restarts of the replicas
+
+std::string replicaDir(int i) {
+    return std::string(TEST_DIR) + "/" + std::to_string(i);
+}
+
+void startReplica(int i) {
+    Replica& replica = replicas[i];
+    auto store = std::make_shared<Store>(replicaDir(i) + "/sstables", 1024 * 1024, 1024 * 1024);
+    auto logger = std::make_shared<Logger>(replicaDir(i) + "/logs", Logger::Durability::NONE);
+    replica.paxos = std::make_shared<PaxosImpl>(peers, i);
+    replica.kvs = std::make_unique<KVSServer>(i, replica.paxos, store, logger);
+
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(peers[i], grpc::InsecureServerCredentials());
+    builder.RegisterService(replica.paxos.get());
+    builder.RegisterService(replica.kvs.get());
+    replica.server = builder.BuildAndStart();
+    assert(replica.server != nullptr);
+    replica.up = true;
+}
+
+// Stop a replica, cancelling the requests it is serving, and lose its disk if wipe is set
+void stopReplica(int i, bool wipe = false) {
+    Replica& replica = replicas[i];
+    replica.up = false;
+    replica.server->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(1));
+    replica.server.reset();
+    replica.kvs.reset();
+    replica.paxos.reset();
+    if (wipe)
+        std::filesystem::remove_all(replicaDir(i));
+}
+
+void startCluster() {
+    std::filesystem::remove_all(TEST_DIR);
+    for (int i = 0; i < NUM_REPLICAS; i++)
+        startReplica(i);
+}
+
+void stopCluster() {
+    for (int i = 0; i < NUM_REPLICAS; i++) {
+        if (replicas[i].up)
+            stopReplica(i);
+    }
+    std::filesystem::remove_all(TEST_DIR);
+}
+
+// The replica which holds the leadership, or -1
+int findLeader() {
+    for (int i = 0; i < NUM_REPLICAS; i++) {
+        if (replicas[i].up && replicas[i].paxos->Leader() == i)
+            return i;
+    }
+    return -1;
+}
+
+// A client numbering its writes as KVSClient does, so that a retry is applied at most once
+struct Client {
+    uint64_t id;
+    uint64_t seq = 0;
+
+    explicit Client(uint64_t id) : id(id) {}
+};
+
+// Send a write to one replica, without retrying
+bool sendPut(int i, const PutArgs& args) {
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(RPC_DEADLINE_MS));
+    PutReply reply;
+    return stubs[i]->PutValue(&context, args, &reply).ok() && reply.success();
+}
+
+// Send a write of the client to the replicas which are up in turn, starting with first, until one applies it
+bool write(Client& client, PutArgs args, int first = 0) {
+    args.set_clientid(client.id);
+    args.set_clientseq(++client.seq);
+    args.set_clientacked(client.seq - 1);
+    args.set_requestid("client-" + std::to_string(client.id) + "-" + std::to_string(client.seq));
+    args.set_lockid("-");
+
+    for (int t = 0; t < RPC_MAX_TRIES; t++) {
+        int i = (first + t) % NUM_REPLICAS;
+        if (replicas[i].up && sendPut(i, args))
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+bool put(Client& client, const std::string& row, const std::string& col, const std::string& value, int first = 0) {
+    PutArgs args;
+    args.set_row(row);
+    args.set_col(col);
+    args.set_newvalue(value);
+    args.set_option(PUT_ARGS_PUT);
+    return write(client, args, first);
+}
+
+bool appendLine(Client& client, const std::string& row, const std::string& col, const std::string& line, int first = 0) {
+    PutArgs args;
+    args.set_row(row);
+    args.set_col(col);
+    args.set_newvalue(line);
+    args.set_option(PUT_ARGS_APPEND_LINE);
+    return write(client, args, first);
+}
+
+bool get(int i, const std::string& row, const std::string& col, std::string& value, uint64_t& version, ReadConsistency consistency = LINEARIZABLE) {
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(RPC_DEADLINE_MS));
+    GetArgs args;
+    GetReply reply;
+    args.set_row(row);
+    args.set_col(col);
+    args.set_lockid("-");
+    args.set_consistency(consistency);
+    if (!stubs[i]->GetValue(&context, args, &reply).ok() || !reply.success())
+        return false;
+    value = reply.value();
+    version = reply.version();
+    return true;
+}
+
+// Send one phase of a transaction to one replica, without retrying
+bool sendTxn(int i, const std::string& txnId, TxnPhase phase, const Op& op) {
+    static int requests = 0;
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(RPC_DEADLINE_MS));
+    TxnArgs args;
+    TxnReply reply;
+    *args.add_ops() = op;
+    args.set_txnid(txnId);
+    args.set_phase(phase);
+    args.set_requestid(txnId + "-" + std::to_string(requests++));
+    return stubs[i]->Txn(&context, args, &reply).ok() && reply.success();
+}
+
+// Wait until a replica has applied the value of a cell, without asking the leader
+bool waitForValue(int i, const std::string& row, const std::string& col, const std::string& expected) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(CATCH_UP_TIMEOUT_MS);
+    std::string value;
+    uint64_t version;
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (get(i, row, col, value, version, ANY_REPLICA) && value == expected)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return false;
+}
+
+// The lines expected in a cell after appending "prefix0" to "prefix<count - 1>" in order
+std::string expectedLines(const std::string& prefix, int count) {
+    std::string lines;
+    for (int j = 0; j < count; j++)
+        lines += prefix + std::to_string(j) + "\n";
+    return lines;
+}
+
+void testFailover() {
+    std::cout << "Test Failover: Starting..." << std::endl;
+    startCluster();
+
+    const int threads = 8, ops = 30;
+    std::vector<Client> clients;
+    for (int t = 0; t < threads; t++) {
+        clients.emplace_back(100 + t);
+        assert(put(clients[t], "failover" + std::to_string(t), "log", ""));
+    }
+    int leader = findLeader();
+    assert(leader >= 0);
+
+    // Each client appends lines one after another, retrying on another replica if one fails
+    std::vector<std::thread> workers;
+    std::atomic<int> appended{0};
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            for (int j = 0; j < ops; j++) {
+                assert(appendLine(clients[t], "failover" + std::to_string(t), "log", "line" + std::to_string(j), t + j));
+                appended++;
+            }
+        });
+    }
+
+    // The leader fails while proposals are in flight
+    while (appended < threads * ops / 3)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    stopReplica(leader);
+    for (auto& worker : workers)
+        worker.join();
+    assert(findLeader() != leader);
+
+    // Every line is applied once, in order, and the survivors agree
+    for (int t = 0; t < threads; t++) {
+        std::string values[NUM_REPLICAS];
+        uint64_t versions[NUM_REPLICAS];
+        for (int i = 0; i < NUM_REPLICAS; i++) {
+            if (i == leader)
+                continue;
+            assert(get(i, "failover" + std::to_string(t), "log", values[i], versions[i]));
+            assert(values[i] == expectedLines("line", ops));
+        }
+        int a = (leader + 1) % NUM_REPLICAS, b = (leader + 2) % NUM_REPLICAS;
+        assert(versions[a] == versions[b]);
+    }
+
+    // The old leader catches up once it is back
+    startReplica(leader);
+    for (int t = 0; t < threads; t++)
+        assert(waitForValue(leader, "failover" + std::to_string(t), "log", expectedLines("line", ops)));
+
+    stopCluster();
+    std::cout << "Test Failover: Passed" << std::endl;
+}
+
+void testStateTransfer() {
+    std::cout << "Test State Transfer: Starting..." << std::endl;
+    startCluster();
+    Client client(200);
+
+    for (int j = 0; j < 50; j++)
+        assert(put(client, "transfer", "col" + std::to_string(j), "value" + std::to_string(j)));
+
+    // Let the heartbeats spread how far every replica got, so that the slots are forgotten
+    std::this_thread::sleep_for(std::chrono::milliseconds(5 * LEADER_HEARTBEAT_MS));
+    stopReplica(2, true);
+
+    // Enough slots for the others to take snapshots and drop their logs
+    for (int j = 50; j < 3 * SNAPSHOT_INTERVAL; j++)
+        assert(put(client, "transfer", "col" + std::to_string(j), "value" + std::to_string(j)));
+    assert(replicas[0].paxos->MinKnownSeq() > 0);
+
+    // The replica lost its disk and the slots it missed are forgotten, it can only install the state of a peer
+    startReplica(2);
+    int last = 3 * SNAPSHOT_INTERVAL - 1;
+    assert(waitForValue(2, "transfer", "col" + std::to_string(last), "value" + std::to_string(last)));
+    for (int j = 0; j <= last; j += 7) {
+        std::string value, expected;
+        uint64_t version, expectedVersion;
+        assert(get(2, "transfer", "col" + std::to_string(j), value, version, ANY_REPLICA));
+        assert(get(0, "transfer", "col" + std::to_string(j), expected, expectedVersion, ANY_REPLICA));
+        assert(value == expected && version == expectedVersion);
+    }
+
+    // It takes part in new slots from there
+    assert(put(client, "transfer", "after", "value", 2));
+    assert(waitForValue(2, "transfer", "after", "value"));
+
+    stopCluster();
+    std::cout << "Test State Transfer: Passed" << std::endl;
+}
+
+void testCatchUpWithoutTransfer() {
+    std::cout << "Test Catch Up Without Transfer: Starting..." << std::endl;
+    startCluster();
+    Client client(250);
+    assert(put(client, "catchup", "col", "value"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5 * LEADER_HEARTBEAT_MS));
+    stopReplica(2);
+
+    // The peers keep the slots the replica missed, as it has not applied them, but cannot send their state
+    int count = 2 * STATE_TRANSFER_MIN_LAG;
+    for (int j = 0; j < count; j++)
+        assert(put(client, "catchup", "col" + std::to_string(j), "value" + std::to_string(j)));
+    for (int i = 0; i < 2; i++)
+        replicas[i].paxos->SetSnapshotSource(nullptr);
+
+    // Once its state transfers keep failing, the replica learns the slots through Paxos
+    startReplica(2);
+    int last = count - 1;
+    assert(waitForValue(2, "catchup", "col" + std::to_string(last), "value" + std::to_string(last)));
+
+    stopCluster();
+    std::cout << "Test Catch Up Without Transfer: Passed" << std::endl;
+}
+
+void testBatching() {
+    std::cout << "Test Batching: Starting..." << std::endl;
+    startCluster();
+
+    Client creator(300);
+    assert(put(creator, "batch", "log", ""));
+    int firstSlot = replicas[0].paxos->MaxKnownSeq();
+
+    // Many clients append to one cell at once, and every request is sent twice at the same
+    // time, as a client retrying too early does. The copies may land in the same batch.
+    const int threads = 32, ops = 10;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([t]() {
+            Client client(400 + t);
+            for (int j = 0; j < ops; j++) {
+                PutArgs args;
+                args.set_row("batch");
+                args.set_col("log");
+                args.set_newvalue("client" + std::to_string(t) + "-" + std::to_string(j));
+                args.set_option(PUT_ARGS_APPEND_LINE);
+                args.set_clientid(client.id);
+                args.set_clientseq(++client.seq);
+                args.set_clientacked(client.seq - 1);
+                args.set_requestid("client-" + std::to_string(client.id) + "-" + std::to_string(client.seq));
+                args.set_lockid("-");
+
+                bool copy = false;
+                std::thread retry([&]() {
+                    copy = sendPut(0, args);
+                });
+                assert(sendPut(0, args));
+                retry.join();
+                assert(copy);
+            }
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+
+    // Operations share slots
+    assert(replicas[0].paxos->MaxKnownSeq() - firstSlot < threads * ops);
+
+    // Every line is there exactly once, on every replica
+    std::string value;
+    uint64_t version;
+    assert(get(0, "batch", "log", value, version));
+    std::multiset<std::string> lines;
+    std::istringstream in(value);
+    for (std::string line; std::getline(in, line);)
+        lines.insert(line);
+    assert(lines.size() == threads * ops);
+    for (int t = 0; t < threads; t++) {
+        for (int j = 0; j < ops; j++)
+            assert(lines.count("client" + std::to_string(t) + "-" + std::to_string(j)) == 1);
+    }
+    for (int i = 1; i < NUM_REPLICAS; i++) {
+        std::string other;
+        uint64_t otherVersion;
+        assert(get(i, "batch", "log", other, otherVersion));
+        assert(other == value && otherVersion == version);
+    }
+
+    stopCluster();
+    std::cout << "Test Batching: Passed" << std::endl;
+}
+
+void testLeaseReads() {
+    std::cout << "Test Lease Reads: Starting..." << std::endl;
+    startCluster();
+    Client client(500);
+
+    // A read before any write gets a leader elected, and is answered
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(RPC_DEADLINE_MS));
+    GetArgs args;
+    GetReply reply;
+    args.set_row("lease");
+    args.set_col("col");
+    args.set_lockid("-");
+    args.set_consistency(LINEARIZABLE);
+    assert(stubs[1]->GetValue(&context, args, &reply).ok() && !reply.success());
+
+    std::string value;
+    uint64_t version;
+    assert(put(client, "lease", "col", "value1"));
+    for (int i = 0; i < NUM_REPLICAS; i++)
+        assert(get(i, "lease", "col", value, version) && value == "value1");
+
+    // A new leader takes over and a write completes under it
+    int leader = findLeader();
+    assert(leader >= 0);
+    stopReplica(leader);
+    assert(put(client, "lease", "col", "value2", leader + 1));
+    int newLeader = findLeader();
+    assert(newLeader >= 0 && newLeader != leader);
+
+    // Reads on the new leader, its follower, and the old leader once it is back, all see the write
+    for (int i = 0; i < NUM_REPLICAS; i++) {
+        if (i != leader)
+            assert(get(i, "lease", "col", value, version) && value == "value2");
+    }
+    startReplica(leader);
+    assert(get(leader, "lease", "col", value, version) && value == "value2");
+
+    // And so do reads after yet another write
+    assert(put(client, "lease", "col", "value3", leader));
+    for (int i = 0; i < NUM_REPLICAS; i++)
+        assert(get(i, "lease", "col", value, version) && value == "value3");
+
+    stopCluster();
+    std::cout << "Test Lease Reads: Passed" << std::endl;
+}
+
+void testBatchVersions() {
+    std::cout << "Test Batch Versions: Starting..." << std::endl;
+    startCluster();
+    Client client(600);
+    assert(put(client, "versions", "col", "value0"));
+
+    // Two writes to one cell and a write to another between them, decided in one slot
+    Op batch;
+    batch.set_type(BATCH);
+    batch.set_requestid("versions-batch");
+    std::vector<std::pair<std::string, std::string>> writes = {{"col", "value1"}, {"other", "value"}, {"col", "value2"}};
+    for (size_t j = 0; j < writes.size(); j++) {
+        Op* op = batch.add_ops();
+        op->set_type(PUT);
+        op->set_row("versions");
+        op->set_col(writes[j].first);
+        op->set_newvalue(writes[j].second);
+        op->set_requestid("versions-" + std::to_string(j));
+        op->set_lockid("-");
+    }
+    replicas[0].paxos->Start(replicas[0].paxos->MaxKnownSeq() + 1, batch);
+    assert(waitForValue(0, "versions", "col", "value2"));
+
+    // Every write has its own version, in the order of the batch
+    std::string value;
+    uint64_t version, otherVersion;
+    assert(get(0, "versions", "col", value, version) && value == "value2");
+    assert(get(0, "versions", "other", value, otherVersion));
+    assert(otherVersion < version);
+
+    // A version older than the last write of the batch does not overwrite it
+    PutArgs args;
+    args.set_row("versions");
+    args.set_col("col");
+    args.set_newvalue("value3");
+    args.set_option(PUT_ARGS_IF_VERSION);
+    args.set_version(otherVersion);
+    args.set_requestid("versions-stale");
+    args.set_lockid("-");
+    assert(!sendPut(0, args));
+    assert(get(0, "versions", "col", value, version) && value == "value2");
+    args.set_version(version);
+    args.set_requestid("versions-current");
+    assert(sendPut(0, args));
+
+    // The replicas agree on the versions, also once the log is replayed
+    assert(get(0, "versions", "col", value, version) && value == "value3");
+    stopReplica(0);
+    startReplica(0);
+    for (int i = 0; i < NUM_REPLICAS; i++) {
+        uint64_t replicaVersion;
+        assert(waitForValue(i, "versions", "col", "value3"));
+        assert(get(i, "versions", "col", value, replicaVersion, ANY_REPLICA) && replicaVersion == version);
+        assert(get(i, "versions", "other", value, replicaVersion, ANY_REPLICA) && replicaVersion == otherVersion);
+    }
+
+    stopCluster();
+    std::cout << "Test Batch Versions: Passed" << std::endl;
+}
+
+void testTxnCommit() {
+    std::cout << "Test Txn Commit: Starting..." << std::endl;
+    startCluster();
+    Client client(700);
+    assert(put(client, "txn", "col", "value0"));
+
+    Op op;
+    op.set_type(CPUT);
+    op.set_row("txn");
+    op.set_col("col");
+    op.set_currvalue("value0");
+    op.set_newvalue("value1");
+    op.set_lockid("-");
+
+    // A prepared transaction locks its rows, and commits its writes
+    assert(sendTxn(0, "txn-1", TXN_PREPARE, op));
+    PutArgs args;
+    args.set_row("txn");
+    args.set_col("col");
+    args.set_newvalue("value2");
+    args.set_option(PUT_ARGS_PUT);
+    args.set_requestid("txn-locked");
+    args.set_lockid("-");
+    assert(!sendPut(0, args));
+    assert(sendTxn(0, "txn-1", TXN_COMMIT, op));
+    std::string value;
+    uint64_t version;
+    assert(get(0, "txn", "col", value, version) && value == "value1");
+
+    // A row changed while it was locked, as once the lock has expired, makes the commit fail
+    // rather than overwrite the change, and the row is unlocked all the same
+    op.set_currvalue("value1");
+    op.set_newvalue("value3");
+    assert(sendTxn(0, "txn-2", TXN_PREPARE, op));
+    args.set_requestid("txn-bypass");
+    args.set_lockid(BY_PASS_LOCK_ID);
+    assert(sendPut(0, args));
+    assert(!sendTxn(0, "txn-2", TXN_COMMIT, op));
+    assert(get(0, "txn", "col", value, version) && value == "value2");
+    args.set_newvalue("value4");
+    args.set_requestid("txn-unlocked");
+    args.set_lockid("-");
+    assert(sendPut(0, args));
+
+    stopCluster();
+    std::cout << "Test Txn Commit: Passed" << std::endl;
+}
+
+int main() {
+    for (int i = 0; i < NUM_REPLICAS; i++)
+        stubs[i] = KVS::NewStub(grpc::CreateChannel(peers[i], grpc::InsecureChannelCredentials()));
+
+    testFailover();
+    testStateTransfer();
+    testCatchUpWithoutTransfer();
+    testBatching();
+    testLeaseReads();
+    testBatchVersions();
+    testTxnCommit();
+
+    return 0;
+}
@@ -84,7 +84,7 @@ void test() {
         if (!client.GetAllRows(tmp))
             perror("Failed to get row: " + std::to_string(i));
 
-        if (tmp.size() != 100 - i - 1)
+        if ((int)tmp.size() != 100 - i - 1)
             perror("Expected " + std::to_string(100 - i - 1) + " rows, got " + std::to_string(tmp.size()));
     }
 
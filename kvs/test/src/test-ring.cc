@@ -0,0 +1,90 @@
+#include <string>
+#include <vector>
+#include <cassert> // For basic assertions
+#include <iostream> // For std::cout
+#include <cstdio>
+
+#include "HashRing.hpp"
+
+void testBalance() {
+    std::cout << "Test Balance: Starting..." << std::endl;
+
+    HashRing ring(4);
+    std::vector<int> rows(4, 0);
+    for (int i = 0; i < 40000; i++)
+        rows[ring.Locate("row" + std::to_string(i))]++;
+
+    // Every cluster gets its share of the rows, give or take a third
+    for (int count : rows)
+        assert(count > 10000 * 2 / 3 && count < 10000 * 4 / 3);
+
+    // A row always goes to the same cluster
+    assert(ring.Locate("row1") == HashRing(4).Locate("row1"));
+
+    std::cout << "Test Balance: Passed" << std::endl;
+}
+
+void testAddCluster() {
+    std::cout << "Test Add Cluster: Starting..." << std::endl;
+
+    HashRing before(3), after(4);
+    int moved = 0;
+    for (int i = 0; i < 40000; i++) {
+        std::string row = "row" + std::to_string(i);
+        size_t from = before.Locate(row), to = after.Locate(row);
+
+        // Rows only move to the new cluster
+        assert(from == to || to == 3);
+        moved += from != to;
+    }
+
+    // About a quarter of the rows move, not three quarters as with hashing modulo the number of clusters
+    assert(moved > 40000 / 6 && moved < 40000 / 3);
+
+    std::cout << "Test Add Cluster: Passed" << std::endl;
+}
+
+void testSingleCluster() {
+    std::cout << "Test Single Cluster: Starting..." << std::endl;
+
+    HashRing empty, single(1);
+    assert(empty.Size() == 0 && single.Size() == 1);
+    assert(empty.Locate("row") == 0);
+    assert(single.Locate("row") == 0);
+
+    std::cout << "Test Single Cluster: Passed" << std::endl;
+}
+
+void testLegacyPlacement() {
+    std::cout << "Test Legacy Placement: Starting..." << std::endl;
+
+    // Rows go where older clients put them, by the hex MD5 digest of the row, its halves xored, modulo the clusters
+    HashRing legacy(2, RING_MODULO);
+    int first = 0;
+    for (int i = 0; i < 1000; i++) {
+        std::string row = "row" + std::to_string(i);
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        EVP_Digest(row.data(), row.size(), digest, nullptr, EVP_md5(), nullptr);
+        char hex[33];
+        for (int j = 0; j < 16; j++)
+            snprintf(hex + 2 * j, 3, "%02x", digest[j]);
+        std::string hash(hex, 32);
+        unsigned long long combined = std::stoull(hash.substr(0, 16), nullptr, 16) ^ std::stoull(hash.substr(16, 16), nullptr, 16);
+
+        assert(legacy.Locate(row) == combined % 2);
+        first += legacy.Locate(row) == 0;
+    }
+    assert(first > 400 && first < 600);
+    assert(legacy.Size() == 2 && HashRing(1, RING_MODULO).Locate("row") == 0);
+
+    std::cout << "Test Legacy Placement: Passed" << std::endl;
+}
+
+int main() {
+    testBalance();
+    testAddCluster();
+    testSingleCluster();
+    testLegacyPlacement();
+
+    return 0;
+}
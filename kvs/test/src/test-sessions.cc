@@ -0,0 +1,130 @@
+#include <string>
+#include <cassert> // For basic assertions
+#include <iostream> // For std::cout
+
+#include "SessionTable.hpp"
+
+void testRetriedRequests() {
+    std::cout << "Test Retried Requests: Starting..." << std::endl;
+
+    SessionTable sessions;
+    SessionTable::Reply reply;
+
+    assert(!sessions.Duplicate(7, 1, 0, 10, reply));
+    sessions.Record(7, 1, {true, ""});
+
+    // A retry gets the first reply, even if the request is decided again later
+    assert(sessions.Duplicate(7, 1, 0, 11, reply) && reply.success);
+
+    // Several requests may be in flight
+    assert(!sessions.Duplicate(7, 3, 0, 12, reply));
+    sessions.Record(7, 3, {false, ""});
+    assert(!sessions.Duplicate(7, 2, 0, 13, reply));
+    sessions.Record(7, 2, {true, ""});
+    assert(sessions.Duplicate(7, 3, 0, 14, reply) && !reply.success);
+
+    // Acknowledged replies are dropped, and a stale retry is refused
+    assert(!sessions.Duplicate(7, 4, 3, 15, reply));
+    assert(sessions.Duplicate(7, 2, 3, 16, reply) && !reply.success);
+
+    // Sessions of different clients are independent
+    assert(!sessions.Duplicate(8, 1, 0, 17, reply));
+    assert(sessions.Size() == 2);
+
+    std::cout << "Test Retried Requests: Passed" << std::endl;
+}
+
+void testExpiry() {
+    std::cout << "Test Expiry: Starting..." << std::endl;
+
+    SessionTable sessions(2, 100);
+    SessionTable::Reply reply;
+
+    for (uint64_t client = 1; client <= 3; client++) {
+        assert(!sessions.Duplicate(client, 1, 0, client, reply));
+        sessions.Record(client, 1, {true, ""});
+    }
+
+    // The least recently used session is dropped beyond the capacity
+    assert(sessions.Size() == 2);
+    assert(sessions.Duplicate(3, 1, 0, 4, reply));
+    assert(sessions.Duplicate(2, 1, 0, 5, reply));
+
+    // Sessions idle for too many slots are dropped
+    assert(!sessions.Duplicate(4, 1, 0, 105, reply));
+    assert(sessions.Size() == 2);
+    assert(!sessions.Duplicate(3, 1, 0, 106, reply));
+
+    std::cout << "Test Expiry: Passed" << std::endl;
+}
+
+void testEvictedReplies() {
+    std::cout << "Test Evicted Replies: Starting..." << std::endl;
+
+    SessionTable sessions;
+    SessionTable::Reply reply;
+
+    // The client never acknowledges, so the oldest replies are dropped beyond the limit
+    uint64_t last = SESSION_MAX_REPLIES + 10;
+    for (uint64_t seq = 2; seq <= last; seq++) {
+        assert(!sessions.Duplicate(9, seq, 0, seq, reply));
+        sessions.Record(9, seq, {true, ""});
+    }
+
+    // A retry of a dropped request is refused instead of being applied again, and so is a
+    // request older than it, which may have been applied
+    assert(sessions.Duplicate(9, 2, 0, last + 1, reply) && !reply.success);
+    assert(sessions.Duplicate(9, 1, 0, last + 2, reply) && !reply.success);
+    assert(sessions.Duplicate(9, last, 0, last + 3, reply) && reply.success);
+    assert(!sessions.Duplicate(9, last + 1, 0, last + 4, reply));
+
+    // The floor is kept with the table
+    std::string data;
+    sessions.Serialize(data);
+    SessionTable loaded;
+    assert(loaded.Parse(data));
+    assert(loaded.Duplicate(9, 10, 0, last + 5, reply) && !reply.success);
+    assert(loaded.Duplicate(9, 11, 0, last + 6, reply) && reply.success);
+
+    // A table saved before floors existed has none
+    assert(loaded.Parse(data.substr(0, data.size() - 8)));
+    assert(!loaded.Duplicate(9, 10, 0, last + 7, reply));
+
+    std::cout << "Test Evicted Replies: Passed" << std::endl;
+}
+
+void testSerialization() {
+    std::cout << "Test Serialization: Starting..." << std::endl;
+
+    SessionTable sessions;
+    SessionTable::Reply reply;
+    assert(!sessions.Duplicate(1, 5, 4, 10, reply));
+    sessions.Record(1, 5, {true, "value"});
+    assert(!sessions.Duplicate(2, 1, 0, 11, reply));
+    sessions.Record(2, 1, {false, ""});
+
+    std::string data;
+    sessions.Serialize(data);
+
+    SessionTable loaded;
+    assert(loaded.Parse(data));
+    assert(loaded.Size() == 2);
+    assert(loaded.Duplicate(1, 5, 4, 12, reply) && reply.success && reply.value == "value");
+    assert(loaded.Duplicate(1, 3, 4, 12, reply) && !reply.success);
+    assert(loaded.Duplicate(2, 1, 0, 13, reply) && !reply.success);
+
+    // A truncated table is refused
+    assert(!loaded.Parse(data.substr(0, data.size() - 1)));
+    assert(loaded.Size() == 0);
+
+    std::cout << "Test Serialization: Passed" << std::endl;
+}
+
+int main() {
+    testRetriedRequests();
+    testExpiry();
+    testEvictedReplies();
+    testSerialization();
+
+    return 0;
+}
@@ -0,0 +1,319 @@
+#include <string>
+#include <cassert> // For basic assertions
+#include <iostream> // For std::cout
+
+// Use a tiny memtable so that tests exercise flushes and compactions
+#define MEMTABLE_SIZE 4096
+
+#include "Store.hpp"
+
+#define TEST_DIR "test_store_sstables"
+
+void testBasicOperations() {
+    std::cout << "Test Basic Operations: Starting..." << std::endl;
+    std::filesystem::remove_all(TEST_DIR);
+
+    Store store(TEST_DIR, 1024 * 1024, 1024 * 1024);
+    std::string value;
+
+    assert(store.Put("row1", "col1", "value1", "-"));
+    assert(store.Get("row1", "col1", value, "-") && value == "value1");
+
+    assert(store.CPut("row1", "col1", "value1", "value2", "-"));
+    assert(!store.CPut("row1", "col1", "value1", "value3", "-"));
+    assert(store.Get("row1", "col1", value, "-") && value == "value2");
+
+    assert(store.Delete("row1", "col1", "-"));
+    assert(!store.Get("row1", "col1", value, "-"));
+
+    std::cout << "Test Basic Operations: Passed" << std::endl;
+}
+
+void testFlushAndCompaction() {
+    std::cout << "Test Flush And Compaction: Starting..." << std::endl;
+    std::filesystem::remove_all(TEST_DIR);
+
+    {
+        Store store(TEST_DIR, 1024, 1024 * 1024);
+        for (int i = 0; i < 2000; i++)
+            store.Put("row" + std::to_string(i % 10), "col" + std::to_string(i), std::string(100, 'a' + i % 26), "-");
+        for (int i = 0; i < 2000; i += 2)
+            store.Delete("row" + std::to_string(i % 10), "col" + std::to_string(i), "-");
+
+        std::string value;
+        assert(store.Get("row1", "col1", value, "-") && value == std::string(100, 'b'));
+        assert(!store.Get("row2", "col2", value, "-"));
+
+        std::vector<std::string> cols;
+        assert(store.GetColsInRow("row1", cols, "-"));
+        assert(cols.size() == 200);
+        cols.clear();
+        assert(!store.GetColsInRow("row2", cols, "-"));
+    }
+
+    // Compaction keeps the number of files bounded
+    auto files = std::distance(std::filesystem::directory_iterator(TEST_DIR), std::filesystem::directory_iterator());
+    assert(files <= 2 * COMPACTION_TRIGGER);
+
+    // Data survives a restart
+    Store store(TEST_DIR, 1024, 1024 * 1024);
+    std::string value;
+    assert(store.Get("row9", "col1999", value, "-") && value == std::string(100, 'a' + 1999 % 26));
+    assert(!store.Get("row8", "col1998", value, "-"));
+
+    std::vector<std::string> rows;
+    store.GetAllRows(rows);
+    assert(rows.size() == 5);
+
+    std::cout << "Test Flush And Compaction: Passed" << std::endl;
+}
+
+void testLegacyImport() {
+    std::cout << "Test Legacy Import: Starting..." << std::endl;
+    std::filesystem::remove_all(TEST_DIR);
+
+    std::filesystem::create_directories(std::string(TEST_DIR) + "/row1");
+    std::ofstream ofs(std::string(TEST_DIR) + "/row1/col1.dat");
+    ofs << "row1-col1" << std::endl << "legacy\nvalue";
+    ofs.close();
+
+    Store store(TEST_DIR, 1024, 1024 * 1024);
+    std::string value;
+    assert(store.Get("row1", "col1", value, "-") && value == "legacy\nvalue");
+    assert(!std::filesystem::exists(std::string(TEST_DIR) + "/row1"));
+
+    std::cout << "Test Legacy Import: Passed" << std::endl;
+}
+
+void testFiltersAndBlockCache() {
+    std::cout << "Test Filters And Block Cache: Starting..." << std::endl;
+    std::filesystem::remove_all(TEST_DIR);
+
+    Store store(TEST_DIR, 1024, 1024 * 1024);
+    for (int i = 0; i < 1000; i++)
+        store.Put("row", "col" + std::to_string(i), std::string(100, 'a'), "-");
+
+    // Misses on keys that were never written are answered by the filters
+    std::string value;
+    for (int i = 0; i < 1000; i++)
+        assert(!store.Get("missing", "col" + std::to_string(i), value, "-"));
+
+    Store::Stats stats = store.GetStats();
+    assert(stats.filterNegatives > 0);
+    assert(stats.filterFalsePositives < stats.filterNegatives / 10);
+
+    // Repeated reads of the same block hit the block cache
+    for (int i = 0; i < 10; i++)
+        assert(store.Get("row", "col1", value, "-"));
+    stats = store.GetStats();
+    assert(stats.blockCacheHits > 0 || stats.cacheHits > 0);
+
+    std::cout << "Test Filters And Block Cache: Passed" << std::endl;
+}
+
+void testCheckpoint() {
+    std::cout << "Test Checkpoint: Starting..." << std::endl;
+    std::filesystem::remove_all(TEST_DIR);
+    std::filesystem::remove_all(TEST_DIR "_snapshot");
+
+    Store store(TEST_DIR, 1024, 1024 * 1024);
+    for (int i = 0; i < 200; i++)
+        store.Put("row", "col" + std::to_string(i), std::string(100, 'a'), "-");
+    store.Put("row", "unflushed", "b", "-");
+    store.Checkpoint(TEST_DIR "_snapshot");
+
+    // Writes after the checkpoint are not part of it
+    store.Put("row", "later", "c", "-");
+    store.Delete("row", "col0", "-");
+
+    store.RestoreCheckpoint(TEST_DIR "_snapshot");
+    std::string value;
+    assert(store.Get("row", "unflushed", value, "-") && value == "b");
+    assert(store.Get("row", "col0", value, "-") && value == std::string(100, 'a'));
+    assert(!store.Get("row", "later", value, "-"));
+
+    // The snapshot can be restored again after more writes and compactions
+    for (int i = 0; i < 200; i++)
+        store.Put("row", "col" + std::to_string(i), "d", "-");
+    store.RestoreCheckpoint(TEST_DIR "_snapshot");
+    assert(store.Get("row", "col199", value, "-") && value == std::string(100, 'a'));
+
+    std::filesystem::remove_all(TEST_DIR "_snapshot");
+    std::cout << "Test Checkpoint: Passed" << std::endl;
+}
+
+void testVersions() {
+    std::cout << "Test Versions: Starting..." << std::endl;
+    std::filesystem::remove_all(TEST_DIR);
+
+    {
+        Store store(TEST_DIR, 1024 * 1024, 1024 * 1024);
+        std::string value;
+        uint64_t version;
+
+        // A missing cell has version 0
+        assert(!store.PutIfVersion("row1", "col1", 5, "value1", "-", 10));
+        assert(store.PutIfVersion("row1", "col1", 0, "value1", "-", 10));
+        assert(store.Get("row1", "col1", value, version, "-") && value == "value1" && version == 10);
+
+        // Only the version is compared
+        assert(!store.PutIfVersion("row1", "col1", 9, "value2", "-", 11));
+        assert(store.PutIfVersion("row1", "col1", 10, "value2", "-", 11));
+        assert(store.Get("row1", "col1", value, version, "-") && value == "value2" && version == 11);
+
+        store.SetNX("row1", "lock");
+        assert(!store.PutIfVersion("row1", "col1", 11, "value3", "-", 12));
+        store.Del("row1");
+
+        // Unversioned values read as version 0
+        assert(store.Put("row2", "col1", "value", "-"));
+        assert(store.Get("row2", "col1", value, version, "-") && version == 0);
+
+        // Enough writes to flush and compact several tables
+        for (int i = 0; i < 2000; i++)
+            assert(store.Put("row3", "col" + std::to_string(i), std::string(100, 'a'), "-", 100 + i));
+    }
+
+    // Versions are kept on disk, and in the value cache
+    Store store(TEST_DIR, 1024 * 1024, 1024 * 1024);
+    std::string value;
+    uint64_t version;
+    for (int round = 0; round < 2; round++) {
+        assert(store.Get("row1", "col1", value, version, "-") && value == "value2" && version == 11);
+        assert(store.Get("row2", "col1", value, version, "-") && version == 0);
+        assert(store.Get("row3", "col1999", value, version, "-") && version == 2099);
+    }
+    assert(store.PutIfVersion("row3", "col0", 100, "b", "-", 3000));
+
+    std::cout << "Test Versions: Passed" << std::endl;
+}
+
+void testUpdate() {
+    std::cout << "Test Update: Starting..." << std::endl;
+    std::filesystem::remove_all(TEST_DIR);
+
+    Store store(TEST_DIR, 1024 * 1024, 1024 * 1024);
+    std::string value;
+    uint64_t version;
+    auto append = [](std::string& value) { value += "b"; return true; };
+
+    // Only existing, unlocked cells are edited
+    assert(!store.Update("row1", "col1", append, "-", 1));
+    assert(store.Put("row1", "col1", "a", "-"));
+    assert(store.Update("row1", "col1", append, "-", 2));
+    assert(store.Get("row1", "col1", value, version, "-") && value == "ab" && version == 2);
+
+    store.SetNX("row1", "lock");
+    assert(!store.Update("row1", "col1", append, "-", 3));
+    assert(store.Update("row1", "col1", append, "lock", 3));
+    store.Del("row1");
+
+    // An edit refusing to apply leaves the cell as it is
+    assert(!store.Update("row1", "col1", [](std::string& value) { value = "c"; return false; }, "-", 4));
+    assert(store.Get("row1", "col1", value, version, "-") && value == "abb" && version == 3);
+
+    store.Delete("row1", "col1", "-");
+    assert(!store.Update("row1", "col1", append, "-", 5));
+
+    std::cout << "Test Update: Passed" << std::endl;
+}
+
+void testTransact() {
+    std::cout << "Test Transact: Starting..." << std::endl;
+    std::filesystem::remove_all(TEST_DIR);
+
+    Store store(TEST_DIR, 1024 * 1024, 1024 * 1024);
+    std::string value;
+    uint64_t version;
+    assert(store.Put("row1", "col1", "a", "-", 1));
+
+    // Reads see the writes before them, and nothing is written until the end
+    assert(store.Transact([&](Store::Txn& txn) {
+        txn.Write("row1", "col1", "b", 2);
+        txn.Delete("row2", "col1");
+        assert(txn.Read("row1", "col1", value, version) && value == "b" && version == 2);
+        return true;
+    }));
+    assert(store.Get("row1", "col1", value, version, "-") && value == "b" && version == 2);
+
+    // An aborted transaction changes nothing
+    assert(!store.Transact([&](Store::Txn& txn) {
+        txn.Write("row1", "col1", "c", 3);
+        txn.Lock("row1", "txn");
+        return false;
+    }));
+    assert(store.Get("row1", "col1", value, version, "-") && value == "b");
+
+    // Locks are taken and released with the writes
+    assert(store.Transact([&](Store::Txn& txn) {
+        txn.Write("row1", "col2", "c", 3);
+        txn.DropWrites();
+        txn.Lock("row1", "txn");
+        return true;
+    }));
+    assert(!store.Get("row1", "col2", value, version, "txn"));
+    assert(!store.Put("row1", "col1", "d", "-"));
+    assert(store.Transact([&](Store::Txn& txn) {
+        if (!txn.Accessible("row1", "txn"))
+            return false;
+        txn.Write("row1", "col1", "d", 4);
+        txn.Unlock("row1", "other");
+        txn.Unlock("row1", "txn");
+        return true;
+    }));
+    assert(store.Get("row1", "col1", value, version, "-") && value == "d" && version == 4);
+
+    std::cout << "Test Transact: Passed" << std::endl;
+}
+
+void testReadError() {
+    std::cout << "Test Read Error: Starting..." << std::endl;
+    std::filesystem::remove_all(TEST_DIR);
+
+    // An older table holds the first value and a newer one the second
+    {
+        Store store(TEST_DIR, 1024 * 1024, 1024 * 1024);
+        assert(store.Put("row1", "col1", "old", "-"));
+    }
+    {
+        Store store(TEST_DIR, 1024 * 1024, 1024 * 1024);
+        assert(store.Put("row1", "col1", "new", "-"));
+    }
+
+    Store store(TEST_DIR, 1024 * 1024, 1024 * 1024);
+    std::filesystem::path newest;
+    for (const auto& entry : std::filesystem::directory_iterator(TEST_DIR)) {
+        if (newest.empty() || std::stoull(entry.path().stem().string()) > std::stoull(newest.stem().string()))
+            newest = entry.path();
+    }
+
+    // The data block of the newer table is gone, its index is already loaded
+    std::filesystem::resize_file(newest, 0);
+
+    // The read fails rather than answering from the older table
+    std::string value;
+    bool threw = false;
+    try {
+        store.Get("row1", "col1", value, "-");
+    } catch (std::runtime_error& e) {
+        threw = true;
+    }
+    assert(threw);
+
+    std::cout << "Test Read Error: Passed" << std::endl;
+}
+
+int main() {
+    testBasicOperations();
+    testFlushAndCompaction();
+    testLegacyImport();
+    testFiltersAndBlockCache();
+    testCheckpoint();
+    testVersions();
+    testUpdate();
+    testTransact();
+    testReadError();
+
+    std::filesystem::remove_all(TEST_DIR);
+    return 0;
+}
@@ -55,19 +55,24 @@ void testSimple()
 void initKVS()
 {
   const bool localKVS = false;
+  std::vector<std::string> controllers;
   std::vector<std::vector<std::string>> clusters;
 
   if (localKVS)
   {
+    controllers = {"127.0.0.1:40050"};
     clusters = {
       {"127.0.0.1:50051", "127.0.0.1:50052", "127.0.0.1:50053"}};
   } else {
+    controllers = {"34.171.122.180:40050", "34.70.254.14:40050"};
     clusters = {
           {"34.171.122.180:50051", "34.171.122.180:50052", "34.171.122.180:50053"},
           {"34.70.254.14:50051", "34.70.254.14:50052", "34.70.254.14:50053"}};
   }
 
+  // Route rows by the ring the controllers publish once clusters are added
   kvsClient = KVSClient(clusters);
+  kvsClient.FollowRing(controllers);
 }
 
 int main(int argc, char *argv[])
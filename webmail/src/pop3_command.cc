@@ -28,15 +28,17 @@
 
 extern KVSClient kvsClient;
 
+// STAT and LIST may be a second behind, so that they spread over all replicas
+const ReadOptions listingReadOptions = {BOUNDED_STALENESS, 0, 1000};
 
-void getMboxContent(std::string& mboxContent, const std::string& user, const std::string& mutexId)
+void getMboxContent(std::string& mboxContent, const std::string& user, const std::string& mutexId, const ReadOptions& options = ReadOptions())
 {
   std::string rowKey = user + ".mbox";
   // std::cout << "rowKey: " << rowKey << std::endl;
   // std::cout << "mutexId: " << mutexId << std::endl;
   mboxContent = "";
   std::vector<std::string> colKeys;
-  if (!kvsClient.GetColsInRow(rowKey, colKeys, mutexId))
+  if (!kvsClient.GetColsInRow(rowKey, colKeys, mutexId, "", options))
   {
     std::cerr << "GetColsInRow failed" << std::endl;
     return;
@@ -46,7 +48,7 @@ void getMboxContent(std::string& mboxContent, const std::string& user, const std
   {
     // std::cout << "colKey: " << colKey << std::endl;
     std::string value;
-    if (!kvsClient.Get(rowKey, colKey, value, mutexId))
+    if (!kvsClient.Get(rowKey, colKey, value, mutexId, options))
     {
       std::cerr << "Get failed" << std::endl;
       return;
@@ -201,7 +203,7 @@ void processStatCommand(int sock, char* user, std::set<unsigned int> &deletedMes
   }
 
   std::string mboxContent;
-  getMboxContent(mboxContent, std::string(user), mutexId);
+  getMboxContent(mboxContent, std::string(user), mutexId, listingReadOptions);
 
   // Split the mbox content into messages
   std::vector<std::string> messages = splitMessages(mboxContent, false);
@@ -240,7 +242,7 @@ void processListCommand(int sock, char* user,  char *argument, std::set<unsigned
   }
 
   std::string mboxContent;
-  getMboxContent(mboxContent, std::string(user), mutexId);
+  getMboxContent(mboxContent, std::string(user), mutexId, listingReadOptions);
 
   // Split the mbox content into messages
   std::vector<std::string> messages = splitMessages(mboxContent, false);